@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#include "blob_store.h"
+
+#include "file.h"
+#include "log.h"
+#include "sha256.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct blob_store {
+    char* dir;
+};
+
+static int blob_store_mkdir(const char* path) {
+    int ret = mkdir(path, 0755);
+    if (ret < 0 && errno != EEXIST) {
+        log_errno("mkdir");
+        return ret;
+    }
+    return 0;
+}
+
+static const char* const blob_store_tmp_prefix = ".blob.";
+
+/* Temporary files are left behind if the server is killed while writing a
+ * blob. Nothing's written to the store yet, so they're all stale. */
+static int blob_store_remove_tmp_files(const char* dir) {
+    char path[PATH_MAX];
+    size_t numof_removed = 0;
+    int ret = 0;
+
+    DIR* handle = opendir(dir);
+    if (!handle) {
+        log_errno("opendir");
+        return -1;
+    }
+
+    while (1) {
+        errno = 0;
+        const struct dirent* entry = readdir(handle);
+        if (!entry) {
+            if (errno) {
+                log_errno("readdir");
+                ret = -1;
+            }
+            break;
+        }
+
+        if (strncmp(entry->d_name, blob_store_tmp_prefix, strlen(blob_store_tmp_prefix)))
+            continue;
+
+        ret = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (ret < 0 || (size_t)ret >= sizeof(path)) {
+            log_err("Blob path is too long\n");
+            ret = -1;
+            break;
+        }
+        ret = unlink(path);
+        if (ret < 0) {
+            log_errno("unlink");
+            break;
+        }
+        ++numof_removed;
+    }
+
+    log_errno_if(closedir(handle), "closedir");
+
+    if (numof_removed)
+        log("Removed %zu stale temporary files from the blob store\n", numof_removed);
+    return ret;
+}
+
+int blob_store_create(struct blob_store** _store, const char* dir) {
+    int ret = 0;
+
+    struct blob_store* store = malloc(sizeof(struct blob_store));
+    if (!store) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    store->dir = strdup(dir);
+    if (!store->dir) {
+        log_errno("strdup");
+        ret = -1;
+        goto free;
+    }
+
+    ret = blob_store_mkdir(store->dir);
+    if (ret < 0)
+        goto free_dir;
+    ret = blob_store_remove_tmp_files(store->dir);
+    if (ret < 0)
+        goto free_dir;
+
+    log("Storing blobs in %s\n", store->dir);
+
+    *_store = store;
+    return ret;
+
+free_dir:
+    free(store->dir);
+
+free:
+    free(store);
+
+    return ret;
+}
+
+void blob_store_destroy(struct blob_store* store) {
+    free(store->dir);
+    free(store);
+}
+
+/* Blobs are spread over subdirectories named after the first two digits of
+ * their hashes, so that none of the directories get too large. */
+struct blob_store_paths {
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+};
+
+static int blob_store_format_path(char* dst, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vsnprintf(dst, PATH_MAX, fmt, args);
+    va_end(args);
+
+    if (ret < 0) {
+        log_errno("vsnprintf");
+        return ret;
+    }
+    if (ret >= PATH_MAX) {
+        log_err("Blob path is too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int blob_store_format_paths(
+    const struct blob_store* store,
+    const char* hash,
+    struct blob_store_paths* paths
+) {
+    int ret = 0;
+
+    ret = blob_store_format_path(paths->dir, "%s/%.2s", store->dir, hash);
+    if (ret < 0)
+        return ret;
+    ret = blob_store_format_path(paths->path, "%s/%s", paths->dir, hash);
+    if (ret < 0)
+        return ret;
+
+    return ret;
+}
+
+/* The new name of a file is only durable once the directory is synced. */
+static int blob_store_sync_dir(const char* path) {
+    int ret = 0;
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_errno("open");
+        return fd;
+    }
+
+    ret = fsync(fd);
+    if (ret < 0)
+        log_errno("fsync");
+
+    file_close(fd);
+    return ret;
+}
+
+/* The hash isn't known until the whole blob is written, so it goes to a
+ * temporary file in the root directory first, and is renamed afterwards. */
+struct blob_store_writer {
+    const struct blob_store* store;
+    struct sha256 sha256;
+    size_t size;
+
+    int fd;
+    char tmp_path[PATH_MAX];
+};
+
+int blob_store_writer_create(const struct blob_store* store, struct blob_store_writer** _writer) {
+    int ret = 0;
+
+    struct blob_store_writer* writer = malloc(sizeof(struct blob_store_writer));
+    if (!writer) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    writer->store = store;
+    sha256_init(&writer->sha256);
+    writer->size = 0;
+
+    ret = blob_store_format_path(
+        writer->tmp_path, "%s/%sXXXXXX", store->dir, blob_store_tmp_prefix
+    );
+    if (ret < 0)
+        goto free;
+
+    ret = mkstemp(writer->tmp_path);
+    if (ret < 0) {
+        log_errno("mkstemp");
+        goto free;
+    }
+    writer->fd = ret;
+
+    /* mkstemp creates files that only the owner can read. */
+    ret = fchmod(writer->fd, 0644);
+    if (ret < 0) {
+        log_errno("fchmod");
+        goto unlink;
+    }
+
+    *_writer = writer;
+    return ret;
+
+unlink:
+    file_close(writer->fd);
+    log_errno_if(unlink(writer->tmp_path), "unlink");
+
+free:
+    free(writer);
+
+    return ret;
+}
+
+void blob_store_writer_abort(struct blob_store_writer* writer) {
+    file_close(writer->fd);
+    log_errno_if(unlink(writer->tmp_path), "unlink");
+    free(writer);
+}
+
+int blob_store_writer_write(struct blob_store_writer* writer, const void* data, size_t size) {
+    int ret = 0;
+
+    ret = file_write(writer->fd, data, size);
+    if (ret < 0)
+        return ret;
+
+    sha256_update(&writer->sha256, data, size);
+    writer->size += size;
+    return ret;
+}
+
+static int blob_store_writer_rename(
+    struct blob_store_writer* writer,
+    const struct blob_store_paths* paths
+) {
+    int ret = 0;
+
+    ret = fsync(writer->fd);
+    if (ret < 0) {
+        log_errno("fsync");
+        return ret;
+    }
+    ret = blob_store_mkdir(paths->dir);
+    if (ret < 0)
+        return ret;
+    ret = rename(writer->tmp_path, paths->path);
+    if (ret < 0) {
+        log_errno("rename");
+        return ret;
+    }
+
+    return blob_store_sync_dir(paths->dir);
+}
+
+int blob_store_writer_commit(struct blob_store_writer* writer, char* hash) {
+    struct blob_store_paths paths;
+    int ret = 0;
+
+    sha256_final(&writer->sha256, hash);
+
+    ret = blob_store_format_paths(writer->store, hash, &paths);
+    if (ret < 0)
+        goto abort;
+
+    if (file_exists(paths.path)) {
+        log_debug("Blob %s already exists\n", hash);
+        goto abort;
+    }
+
+    ret = blob_store_writer_rename(writer, &paths);
+    if (ret < 0)
+        goto abort;
+
+    log_debug("Stored blob %s (%zu bytes)\n", hash, writer->size);
+
+    file_close(writer->fd);
+    free(writer);
+    return ret;
+
+abort:
+    blob_store_writer_abort(writer);
+
+    return ret;
+}
+
+int blob_store_read(
+    const struct blob_store* store,
+    const char* hash,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+) {
+    struct blob_store_paths paths;
+    int ret = 0;
+
+    ret = blob_store_format_paths(store, hash, &paths);
+    if (ret < 0)
+        return ret;
+
+    int fd = open(paths.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_errno("open");
+        return fd;
+    }
+
+    ret = file_pread(fd, buf, size, offset, read);
+    file_close(fd);
+    return ret;
+}
+
+int blob_store_delete(const struct blob_store* store, const char* hash, size_t* size) {
+    struct blob_store_paths paths;
+    struct stat st;
+    int ret = 0;
+
+    ret = blob_store_format_paths(store, hash, &paths);
+    if (ret < 0)
+        return ret;
+
+    /* The blob might have never made it to the disk. */
+    ret = stat(paths.path, &st);
+    if (ret < 0) {
+        if (errno != ENOENT) {
+            log_errno("stat");
+            return ret;
+        }
+        *size = 0;
+        return 0;
+    }
+
+    ret = unlink(paths.path);
+    if (ret < 0) {
+        log_errno("unlink");
+        return ret;
+    }
+
+    log_debug("Deleted blob %s (%zu bytes)\n", hash, (size_t)st.st_size);
+    *size = (size_t)st.st_size;
+    return ret;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#ifndef __BLOB_STORE_H__
+#define __BLOB_STORE_H__
+
+/* A content-addressed store: every blob is a file named after the SHA-256 of
+ * its contents, so identical blobs are only stored once. Keeping track of
+ * which blobs are still in use is up to the user. */
+
+#include "sha256.h"
+
+#include <stddef.h>
+
+/* The hex-encoded hash, including the terminating null character. */
+#define BLOB_HASH_SIZE SHA256_HEX_SIZE
+
+struct blob_store;
+
+int blob_store_create(struct blob_store**, const char* dir);
+void blob_store_destroy(struct blob_store*);
+
+/* Blobs are written incrementally, and hashed on the fly. */
+struct blob_store_writer;
+
+int blob_store_writer_create(const struct blob_store*, struct blob_store_writer**);
+int blob_store_writer_write(struct blob_store_writer*, const void* data, size_t size);
+/* Destroys the writer either way. If the blob already exists, the new copy is
+ * discarded. Once this returns, the blob is on disk, so it's safe to commit a
+ * reference to it. */
+int blob_store_writer_commit(struct blob_store_writer*, char* hash);
+/* Discards whatever's been written. */
+void blob_store_writer_abort(struct blob_store_writer*);
+
+/* Reads at most `size` bytes of the blob, starting at `offset`. Fewer bytes
+ * are read only at the end of the blob. */
+int blob_store_read(
+    const struct blob_store*,
+    const char* hash,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+);
+
+/* Deletes the blob, and sets its size. It's up to the user to make sure no one
+ * writes the same blob in the meantime. */
+int blob_store_delete(const struct blob_store*, const char* hash, size_t* size);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#include "buf_pool.h"
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The largest class fits a full chunk of run output along with the JSON
+ * around it. */
+static const size_t buf_pool_class_sizes[] = {
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+    256 * 1024,
+};
+
+#define BUF_POOL_NUMOF_CLASSES (sizeof(buf_pool_class_sizes) / sizeof(buf_pool_class_sizes[0]))
+
+/* For blocks that are too large to be pooled. */
+#define BUF_POOL_NO_CLASS BUF_POOL_NUMOF_CLASSES
+
+/* The maximum number of free blocks a thread keeps around per size class. */
+#define BUF_POOL_MAX_FREE 8
+
+/* Every block is prefixed with a header, which is padded to keep the data
+ * suitably aligned. */
+union buf_pool_hdr {
+    struct {
+        size_t class;
+        union buf_pool_hdr* next;
+    };
+    max_align_t align;
+};
+
+struct buf_pool_class {
+    union buf_pool_hdr* free;
+    size_t numof_free;
+};
+
+struct buf_pool {
+    struct buf_pool_class classes[BUF_POOL_NUMOF_CLASSES];
+    /* The thread's pool has been registered to be destroyed on thread exit. */
+    int registered;
+};
+
+static _Thread_local struct buf_pool buf_pool;
+
+static pthread_once_t buf_pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buf_pool_key;
+static int buf_pool_key_created = 0;
+
+static _Atomic uint64_t buf_pool_hits = 0;
+static _Atomic uint64_t buf_pool_misses = 0;
+
+static void buf_pool_destroy(void* _pool) {
+    struct buf_pool* pool = (struct buf_pool*)_pool;
+
+    for (size_t i = 0; i < BUF_POOL_NUMOF_CLASSES; ++i) {
+        struct buf_pool_class* class = &pool->classes[i];
+
+        union buf_pool_hdr* hdr = class->free;
+        while (hdr) {
+            union buf_pool_hdr* next = hdr->next;
+            free(hdr);
+            hdr = next;
+        }
+
+        class->free = NULL;
+        class->numof_free = 0;
+    }
+}
+
+static void buf_pool_create_key(void) {
+    int ret = pthread_key_create(&buf_pool_key, buf_pool_destroy);
+    if (ret) {
+        pthread_errno(ret, "pthread_key_create");
+        return;
+    }
+    buf_pool_key_created = 1;
+}
+
+/* Make sure the free blocks are released when the thread exits. Returns 0 if
+ * the blocks can't be pooled on this thread. */
+static int buf_pool_register(void) {
+    if (buf_pool.registered)
+        return 1;
+
+    pthread_errno_if(pthread_once(&buf_pool_key_once, buf_pool_create_key), "pthread_once");
+    if (!buf_pool_key_created)
+        return 0;
+
+    int ret = pthread_setspecific(buf_pool_key, &buf_pool);
+    if (ret) {
+        pthread_errno(ret, "pthread_setspecific");
+        return 0;
+    }
+
+    buf_pool.registered = 1;
+    return 1;
+}
+
+static size_t buf_pool_find_class(size_t size) {
+    for (size_t i = 0; i < BUF_POOL_NUMOF_CLASSES; ++i)
+        if (size <= buf_pool_class_sizes[i])
+            return i;
+    return BUF_POOL_NO_CLASS;
+}
+
+void* buf_pool_alloc(size_t size) {
+    size_t class_idx = buf_pool_find_class(size);
+
+    if (class_idx != BUF_POOL_NO_CLASS) {
+        struct buf_pool_class* class = &buf_pool.classes[class_idx];
+        union buf_pool_hdr* hdr = class->free;
+
+        if (hdr) {
+            class->free = hdr->next;
+            --class->numof_free;
+
+            atomic_fetch_add_explicit(&buf_pool_hits, 1, memory_order_relaxed);
+            return hdr + 1;
+        }
+
+        size = buf_pool_class_sizes[class_idx];
+    }
+
+    atomic_fetch_add_explicit(&buf_pool_misses, 1, memory_order_relaxed);
+
+    if (size > SIZE_MAX - sizeof(union buf_pool_hdr)) {
+        log_err("Buffer is too large: %zu\n", size);
+        return NULL;
+    }
+
+    union buf_pool_hdr* hdr = malloc(sizeof(union buf_pool_hdr) + size);
+    if (!hdr) {
+        log_errno("malloc");
+        return NULL;
+    }
+    hdr->class = class_idx;
+
+    return hdr + 1;
+}
+
+void buf_pool_free(void* data) {
+    if (!data)
+        return;
+
+    union buf_pool_hdr* hdr = (union buf_pool_hdr*)data - 1;
+
+    if (hdr->class == BUF_POOL_NO_CLASS)
+        goto free;
+
+    struct buf_pool_class* class = &buf_pool.classes[hdr->class];
+    if (class->numof_free >= BUF_POOL_MAX_FREE)
+        goto free;
+    if (!buf_pool_register())
+        goto free;
+
+    hdr->next = class->free;
+    class->free = hdr;
+    ++class->numof_free;
+    return;
+
+free:
+    free(hdr);
+}
+
+void buf_pool_get_stats(struct buf_pool_stats* stats) {
+    stats->hits = atomic_load_explicit(&buf_pool_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&buf_pool_misses, memory_order_relaxed);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#ifndef __BUF_POOL_H__
+#define __BUF_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A per-thread pool of memory blocks, grouped into a few size classes. It's
+ * meant for short-lived buffers that are allocated all the time, like incoming
+ * messages. Blocks larger than the largest size class are simply malloc'ed.
+ *
+ * A block can be freed on any thread, it's put into that thread's pool. */
+
+void* buf_pool_alloc(size_t size);
+void buf_pool_free(void*);
+
+struct buf_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* The numbers are collected from all threads. */
+void buf_pool_get_stats(struct buf_pool_stats*);
+
+#endif
@@ -33,17 +33,22 @@ static const char *ci_env[] = {
 };
 /* clang-format on */
 
-static int ci_run_script(const char* script, struct process_output* result) {
+static int ci_run_script(
+    const char* script,
+    process_output_handler output_handler,
+    void* arg,
+    int* ec
+) {
     const char* args[] = {script, NULL};
-    return process_execute_and_capture(args, ci_env, result);
+    return process_execute_and_stream(args, ci_env, output_handler, arg, ec);
 }
 
-int ci_run(struct process_output* result) {
+int ci_run(process_output_handler output_handler, void* arg, int* ec) {
     for (const char** script = ci_scripts; *script; ++script) {
         if (!file_exists(*script))
             continue;
         log("Going to run: %s\n", *script);
-        return ci_run_script(*script, result);
+        return ci_run_script(*script, output_handler, arg, ec);
     }
 
     log("Couldn't find any CI scripts to run\n");
@@ -74,7 +79,13 @@ cleanup_repo:
     return ret;
 }
 
-int ci_run_git_repo(const char* url, const char* rev, struct process_output* output) {
+int ci_run_git_repo(
+    const char* url,
+    const char* rev,
+    process_output_handler output_handler,
+    void* arg,
+    int* ec
+) {
     char* oldpwd = NULL;
     git_repository* repo = NULL;
     int ret = 0;
@@ -87,7 +98,7 @@ int ci_run_git_repo(const char* url, const char* rev, struct process_output* out
     if (ret < 0)
         goto free_repo;
 
-    ret = ci_run(output);
+    ret = ci_run(output_handler, arg, ec);
     if (ret < 0)
         goto oldpwd;
 
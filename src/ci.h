@@ -10,7 +10,8 @@
 
 #include "process.h"
 
-int ci_run(struct process_output*);
+/* The output of the CI script is passed to the handler as it's produced. */
+int ci_run(process_output_handler, void* arg, int* ec);
 
 /*
  * This is a high-level function. It's basically equivalent to the following
@@ -25,6 +26,12 @@ int ci_run(struct process_output*);
  *     rm -rf "$dir"
  *
  */
-int ci_run_git_repo(const char* url, const char* rev, struct process_output*);
+int ci_run_git_repo(
+    const char* url,
+    const char* rev,
+    process_output_handler,
+    void* arg,
+    int* ec
+);
 
 #endif
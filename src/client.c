@@ -15,7 +15,10 @@
 #include "net.h"
 #include "protocol.h"
 #include "run_queue.h"
+#include "string.h"
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -40,14 +43,96 @@ void client_destroy(struct client* client) {
     free(client);
 }
 
-static int make_request(struct jsonrpc_request** request, int argc, const char** argv) {
-    if (argc < 1) {
-        exit_with_usage_err("no action specified");
+/* If the argument is KEY=VALUE, returns the VALUE. */
+static const char* get_arg_value(const char* arg, const char* key) {
+    size_t len = strlen(key);
+    if (strncmp(arg, key, len) || arg[len] != '=')
+        return NULL;
+    return arg + len + 1;
+}
+
+static int parse_get_runs_arg(struct run_filter* filter, const char* arg) {
+    const char* value = NULL;
+    int ret = 0;
+
+    if ((value = get_arg_value(arg, "limit"))) {
+        int limit = 0;
+        ret = string_to_int(value, &limit);
+        if (ret < 0)
+            return ret;
+        if (limit < 0) {
+            log_err("Invalid limit: %d\n", limit);
+            return -1;
+        }
+        filter->limit = (size_t)limit;
+        return ret;
+    }
+    if ((value = get_arg_value(arg, "before_id"))) {
+        filter->fields |= RUN_FILTER_BEFORE_ID;
+        return string_to_int(value, &filter->before_id);
+    }
+    if ((value = get_arg_value(arg, "after_id"))) {
+        filter->fields |= RUN_FILTER_AFTER_ID;
+        return string_to_int(value, &filter->after_id);
+    }
+    if ((value = get_arg_value(arg, "repo_url"))) {
+        filter->fields |= RUN_FILTER_REPO_URL;
+        filter->repo_url = value;
+        return ret;
+    }
+    if ((value = get_arg_value(arg, "status"))) {
+        filter->fields |= RUN_FILTER_STATUS;
+        return run_status_from_string(value, &filter->status);
+    }
+    if ((value = get_arg_value(arg, "exit_code"))) {
+        filter->fields |= RUN_FILTER_EXIT_CODE;
+        return string_to_int(value, &filter->exit_code);
+    }
+    if ((value = get_arg_value(arg, "created_after"))) {
+        filter->fields |= RUN_FILTER_CREATED_AFTER;
+        return string_to_int64(value, &filter->created_after);
+    }
+    if ((value = get_arg_value(arg, "created_before"))) {
+        filter->fields |= RUN_FILTER_CREATED_BEFORE;
+        return string_to_int64(value, &filter->created_before);
+    }
+
+    log_err("Invalid %s argument: %s\n", CMD_GET_RUNS, arg);
+    return -1;
+}
+
+static int parse_size_arg(const char* value, size_t* result) {
+    int64_t size = 0;
+    int ret = 0;
+
+    ret = string_to_int64(value, &size);
+    if (ret < 0)
+        return ret;
+    if (size < 0) {
+        log_err("Invalid size: %s\n", value);
         return -1;
     }
 
+    *result = (size_t)size;
+    return ret;
+}
+
+static int parse_get_run_output_arg(size_t* offset, size_t* size, const char* arg) {
+    const char* value = NULL;
+
+    if ((value = get_arg_value(arg, "offset")))
+        return parse_size_arg(value, offset);
+    if ((value = get_arg_value(arg, "size")))
+        return parse_size_arg(value, size);
+
+    log_err("Invalid %s argument: %s\n", CMD_GET_RUN_OUTPUT, arg);
+    return -1;
+}
+
+/* Returns the number of arguments used to make the request. */
+static int make_request(struct jsonrpc_request** request, int argc, const char** argv) {
     if (!strcmp(argv[0], CMD_QUEUE_RUN)) {
-        if (argc != 3)
+        if (argc < 3)
             return -1;
 
         struct run* run = NULL;
@@ -57,44 +142,159 @@ static int make_request(struct jsonrpc_request** request, int argc, const char**
 
         ret = request_create_queue_run(request, run);
         run_destroy(run);
-        return ret;
+        if (ret < 0)
+            return ret;
+        return 3;
     } else if (!strcmp(argv[0], CMD_GET_RUNS)) {
-        if (argc != 1)
+        struct run_filter filter;
+        run_filter_init(&filter);
+
+        /* The filter arguments that follow all look like KEY=VALUE. */
+        int numof_args = 1;
+        for (; numof_args < argc && strchr(argv[numof_args], '='); ++numof_args) {
+            int ret = parse_get_runs_arg(&filter, argv[numof_args]);
+            if (ret < 0)
+                return ret;
+        }
+
+        int ret = request_create_get_runs(request, &filter);
+        if (ret < 0)
+            return ret;
+        return numof_args;
+    } else if (!strcmp(argv[0], CMD_GET_RUN_OUTPUT)) {
+        if (argc < 2)
             return -1;
-        return request_create_get_runs(request);
+
+        int run_id = 0;
+        int ret = string_to_int(argv[1], &run_id);
+        if (ret < 0)
+            return ret;
+
+        size_t offset = 0;
+        size_t size = 0;
+
+        int numof_args = 2;
+        for (; numof_args < argc && strchr(argv[numof_args], '='); ++numof_args) {
+            ret = parse_get_run_output_arg(&offset, &size, argv[numof_args]);
+            if (ret < 0)
+                return ret;
+        }
+
+        ret = request_create_get_run_output(request, run_id, offset, size);
+        if (ret < 0)
+            return ret;
+        return numof_args;
+    } else if (!strcmp(argv[0], CMD_GET_STATS)) {
+        int ret = request_create_get_stats(request);
+        if (ret < 0)
+            return ret;
+        return 1;
     }
 
     return -1;
 }
 
-int client_main(
-    UNUSED const struct client* client,
-    const struct settings* settings,
+static void destroy_requests(struct jsonrpc_request** requests, size_t numof_requests) {
+    for (size_t i = 0; i < numof_requests; ++i)
+        if (requests[i])
+            jsonrpc_request_destroy(requests[i]);
+    free(requests);
+}
+
+static int make_requests(
+    struct jsonrpc_request*** _requests,
+    size_t* _numof_requests,
     int argc,
     const char** argv
 ) {
+    size_t numof_requests = 0;
     int ret = 0;
 
-    struct jsonrpc_request* request = NULL;
-    ret = make_request(&request, argc, argv);
-    if (ret < 0) {
-        exit_with_usage_err("invalid request");
-        return ret;
+    if (argc < 1) {
+        exit_with_usage_err("no action specified");
+        return -1;
     }
 
-    ret = net_connect(settings->host, settings->port);
-    if (ret < 0)
-        goto free_request;
-    int fd = ret;
+    /* Every action takes at least one argument. */
+    struct jsonrpc_request** requests = calloc(argc, sizeof(struct jsonrpc_request*));
+    if (!requests) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    while (argc > 0) {
+        ret = make_request(&requests[numof_requests], argc, argv);
+        if (ret < 0)
+            goto destroy_requests;
+
+        ++numof_requests;
+        argc -= ret;
+        argv += ret;
+    }
+
+    *_requests = requests;
+    *_numof_requests = numof_requests;
+    return 0;
 
-    ret = jsonrpc_request_send(request, fd);
+destroy_requests:
+    destroy_requests(requests, numof_requests);
+
+    return ret;
+}
+
+/* Replaces the requests with a single batch request. */
+static int make_batch(struct jsonrpc_request** requests, size_t* numof_requests) {
+    int ret = 0;
+
+    struct jsonrpc_request* batch = NULL;
+    ret = jsonrpc_request_batch_create(&batch);
     if (ret < 0)
-        goto close;
+        return ret;
+
+    for (size_t i = 0; i < *numof_requests; ++i) {
+        ret = jsonrpc_request_batch_append(batch, requests[i]);
+        if (ret < 0)
+            goto destroy_batch;
+        requests[i] = NULL;
+    }
+
+    /* There is at least one action, so there is room for the batch. */
+    requests[0] = batch;
+    *numof_requests = 1;
+    return ret;
+
+destroy_batch:
+    jsonrpc_request_destroy(batch);
+
+    return ret;
+}
+
+/* The run output is printed as is, not as part of the response. */
+static int response_is_raw(const struct jsonrpc_request* request) {
+    if (jsonrpc_request_is_batch(request))
+        return 0;
+    return !strcmp(jsonrpc_request_get_method(request), CMD_GET_RUN_OUTPUT);
+}
+
+static int recv_response(int fd, int raw) {
+    int ret = 0;
 
     struct jsonrpc_response* response = NULL;
     ret = jsonrpc_response_recv(&response, fd);
     if (ret < 0)
-        goto close;
+        return ret;
+
+    if (raw && !jsonrpc_response_is_error(response)) {
+        const void* attachment = NULL;
+        uint32_t attachment_size = 0;
+        jsonrpc_response_get_attachment(response, &attachment, &attachment_size);
+
+        if (fwrite(attachment, 1, attachment_size, stdout) != attachment_size) {
+            log_errno("fwrite");
+            ret = -1;
+        }
+        goto destroy_response;
+    }
 
     const char* response_str = jsonrpc_response_to_string(response);
     if (response_str) {
@@ -104,16 +304,65 @@ int client_main(
     } else {
         log_err("no response\n");
     }
-    goto free_response;
 
-free_response:
+destroy_response:
     jsonrpc_response_destroy(response);
 
+    return ret;
+}
+
+int client_main(
+    UNUSED const struct client* client,
+    const struct settings* settings,
+    int argc,
+    const char** argv
+) {
+    int ret = 0;
+
+    jsonrpc_set_default_encoding(settings->encoding);
+
+    struct jsonrpc_request** requests = NULL;
+    size_t numof_requests = 0;
+    ret = make_requests(&requests, &numof_requests, argc, argv);
+    if (ret < 0) {
+        exit_with_usage_err("invalid request");
+        return ret;
+    }
+
+    if (settings->batch) {
+        ret = make_batch(requests, &numof_requests);
+        if (ret < 0)
+            goto destroy_requests;
+    }
+
+    ret = net_connect(settings->host, settings->port);
+    if (ret < 0)
+        goto destroy_requests;
+    int fd = ret;
+
+    /* All the actions share the same connection. Send all the requests at
+     * once, the server responds to them in order. */
+    for (size_t i = 0; i < numof_requests; ++i) {
+        ret = jsonrpc_request_send(requests[i], fd);
+        if (ret < 0)
+            goto close;
+    }
+
+    int result = 0;
+
+    for (size_t i = 0; i < numof_requests; ++i) {
+        ret = recv_response(fd, response_is_raw(requests[i]));
+        if (ret < 0)
+            result = ret;
+    }
+
+    ret = result;
+
 close:
     net_close(fd);
 
-free_request:
-    jsonrpc_request_destroy(request);
+destroy_requests:
+    destroy_requests(requests, numof_requests);
 
     return ret;
 }
@@ -8,9 +8,14 @@
 #ifndef __CLIENT_H__
 #define __CLIENT_H__
 
+#include "json_rpc.h"
+
 struct settings {
     const char* host;
     const char* port;
+    enum jsonrpc_encoding encoding;
+    /* Send all the actions as a single JSON-RPC batch. */
+    int batch;
 };
 
 struct client;
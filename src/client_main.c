@@ -8,6 +8,7 @@
 #include "client.h"
 #include "cmd_line.h"
 #include "const.h"
+#include "json_rpc.h"
 #include "log.h"
 
 #include <getopt.h>
@@ -17,15 +18,32 @@ static struct settings default_settings(void) {
     struct settings settings = {
         .host = default_host,
         .port = default_port,
+        .encoding = JSONRPC_ENCODING_JSON,
+        .batch = 0,
     };
     return settings;
 }
 
 const char* get_usage_string(void) {
-    return "[-h|--help] [-V|--version] [-v|--verbose] [-H|--host HOST] [-p|--port PORT] ACTION [ARG...]\n\
+    return "[-h|--help] [-V|--version] [-v|--verbose] [-H|--host HOST] [-p|--port PORT] [-e|--encoding json|msgpack] [-b|--batch] ACTION [ARG...] [ACTION [ARG...]]...\n\
 \n\
 available actions:\n\
-\t" CMD_QUEUE_RUN " URL REV - schedule a CI run of repository at URL, revision REV";
+\t" CMD_QUEUE_RUN " URL REV - schedule a CI run of repository at URL, revision REV\n\
+\t" CMD_GET_RUNS " [KEY=VALUE]... - list the runs, newest first; KEY is one of limit, before_id, after_id,\n\
+\t\trepo_url, status, exit_code, created_after, created_before (Unix time)\n\
+\t" CMD_GET_RUN_OUTPUT " ID [offset=N] [size=N] - print the output of run ID, at most 1 MiB at a time\n\
+\t" CMD_GET_STATS " - show server statistics\n\
+\n\
+multiple actions are sent over the same connection, --batch makes them a single request";
+}
+
+static enum jsonrpc_encoding parse_encoding(const char* src) {
+    enum jsonrpc_encoding result = JSONRPC_ENCODING_JSON;
+
+    if (jsonrpc_encoding_from_string(src, &result) < 0)
+        exit_with_usage_err("encoding must be either json or msgpack");
+
+    return result;
 }
 
 static int parse_settings(struct settings* settings, int argc, char* argv[]) {
@@ -40,11 +58,13 @@ static int parse_settings(struct settings* settings, int argc, char* argv[]) {
 	    {"verbose", no_argument, 0, 'v'},
 	    {"host", required_argument, 0, 'H'},
 	    {"port", required_argument, 0, 'p'},
+	    {"encoding", required_argument, 0, 'e'},
+	    {"batch", no_argument, 0, 'b'},
 	    {0, 0, 0, 0},
 	};
     /* clang-format on */
 
-    while ((opt = getopt_long(argc, argv, "hVvH:p:", long_options, &longind)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hVvH:p:e:b", long_options, &longind)) != -1) {
         switch (opt) {
             case 'h':
                 exit_with_usage(0);
@@ -61,6 +81,12 @@ static int parse_settings(struct settings* settings, int argc, char* argv[]) {
             case 'p':
                 settings->port = optarg;
                 break;
+            case 'e':
+                settings->encoding = parse_encoding(optarg);
+                break;
+            case 'b':
+                settings->batch = 1;
+                break;
             default:
                 exit_with_usage(1);
                 break;
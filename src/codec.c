@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#include "codec.h"
+
+#include "log.h"
+
+#include <zlib.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#define zlib_errno(ret, fn) log_err("%s: %s\n", fn, zError(ret))
+
+static const char* const codec_names[] = {
+    [CODEC_NONE] = "none",
+    [CODEC_ZLIB] = "zlib",
+};
+
+static const size_t numof_codec_names = sizeof(codec_names) / sizeof(codec_names[0]);
+
+const char* codec_to_string(enum codec codec) {
+    if (codec < CODEC_NONE || (size_t)codec >= numof_codec_names)
+        return "unknown";
+    return codec_names[codec];
+}
+
+int codec_from_string(const char* name, enum codec* codec) {
+    for (size_t i = CODEC_NONE; i < numof_codec_names; ++i) {
+        if (strcmp(name, codec_names[i]))
+            continue;
+        *codec = (enum codec)i;
+        return 0;
+    }
+
+    log_err("Unknown codec: %s\n", name);
+    return -1;
+}
+
+static int codec_compress_none(const void* src, size_t src_size, void* dst, size_t* dst_size) {
+    if (src_size > *dst_size)
+        return 1;
+
+    memcpy(dst, src, src_size);
+    *dst_size = src_size;
+    return 0;
+}
+
+static int codec_compress_zlib(const void* src, size_t src_size, void* dst, size_t* dst_size) {
+    uLongf nb = *dst_size;
+
+    int ret = compress2(dst, &nb, src, src_size, Z_DEFAULT_COMPRESSION);
+    if (ret == Z_BUF_ERROR)
+        return 1;
+    if (ret != Z_OK) {
+        zlib_errno(ret, "compress2");
+        return -1;
+    }
+
+    *dst_size = nb;
+    return 0;
+}
+
+int codec_compress(
+    enum codec codec,
+    const void* src,
+    size_t src_size,
+    void* dst,
+    size_t* dst_size
+) {
+    switch (codec) {
+        case CODEC_NONE:
+            return codec_compress_none(src, src_size, dst, dst_size);
+        case CODEC_ZLIB:
+            return codec_compress_zlib(src, src_size, dst, dst_size);
+    }
+
+    log_err("Unsupported codec: %d\n", codec);
+    return -1;
+}
+
+static int codec_decompress_none(const void* src, size_t src_size, void* dst, size_t dst_size) {
+    if (src_size != dst_size) {
+        log_err("Expected %zu bytes of data, got %zu\n", dst_size, src_size);
+        return -1;
+    }
+
+    memcpy(dst, src, src_size);
+    return 0;
+}
+
+static int codec_decompress_zlib(const void* src, size_t src_size, void* dst, size_t dst_size) {
+    uLongf nb = dst_size;
+
+    int ret = uncompress(dst, &nb, src, src_size);
+    if (ret != Z_OK) {
+        zlib_errno(ret, "uncompress");
+        return -1;
+    }
+
+    if (nb != dst_size) {
+        log_err("Expected %zu bytes of uncompressed data, got %zu\n", dst_size, (size_t)nb);
+        return -1;
+    }
+
+    return 0;
+}
+
+int codec_decompress(
+    enum codec codec,
+    const void* src,
+    size_t src_size,
+    void* dst,
+    size_t dst_size
+) {
+    switch (codec) {
+        case CODEC_NONE:
+            return codec_decompress_none(src, src_size, dst, dst_size);
+        case CODEC_ZLIB:
+            return codec_decompress_zlib(src, src_size, dst, dst_size);
+    }
+
+    log_err("Unsupported codec: %d\n", codec);
+    return -1;
+}
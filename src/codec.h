@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stddef.h>
+
+/* These match the IDs in the cimple_codecs table. */
+enum codec {
+    CODEC_NONE = 1,
+    CODEC_ZLIB = 2,
+};
+
+const char* codec_to_string(enum codec);
+int codec_from_string(const char*, enum codec*);
+
+/* On input, dst_size is the capacity of the destination buffer. On output,
+ * it's the size of the compressed data. Returns 1 if the compressed data
+ * doesn't fit into the buffer. */
+int codec_compress(enum codec, const void* src, size_t src_size, void* dst, size_t* dst_size);
+/* dst_size must be the exact size of the uncompressed data. */
+int codec_decompress(enum codec, const void* src, size_t src_size, void* dst, size_t dst_size);
+
+#endif
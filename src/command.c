@@ -11,15 +11,35 @@
 #include "event_loop.h"
 #include "json_rpc.h"
 #include "log.h"
+#include "net.h"
+#include "string.h"
 
 #include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+struct cmd_counters {
+    _Atomic uint64_t numof_calls;
+    _Atomic uint64_t numof_errors;
+    _Atomic uint64_t latency[CMD_LATENCY_NUMOF_BUCKETS];
+};
 
 struct cmd_dispatcher {
     struct cmd_desc* cmds;
     size_t numof_cmds;
     void* ctx;
+    cmd_close_handler close_handler;
+
+    /* Commands are looked up using an open addressing hash table. The entries are indices
+     * into the command array plus one, 0 means an empty slot. */
+    size_t* table;
+    size_t table_size;
+
+    /* One per command. */
+    struct cmd_counters* counters;
 };
 
 static int copy_cmd(struct cmd_desc* dest, const struct cmd_desc* src) {
@@ -29,6 +49,7 @@ static int copy_cmd(struct cmd_desc* dest, const struct cmd_desc* src) {
         return -1;
     }
     dest->handler = src->handler;
+    dest->batch_handler = src->batch_handler;
     return 0;
 }
 
@@ -60,6 +81,30 @@ static void free_cmds(struct cmd_desc* cmds, size_t numof_cmds) {
         free_cmd(&cmds[i]);
 }
 
+static int cmd_table_create(struct cmd_dispatcher* dispatcher) {
+    /* Keep the load factor at 50% at most, the size is a power of 2. */
+    size_t table_size = 1;
+    while (table_size < dispatcher->numof_cmds * 2)
+        table_size *= 2;
+
+    size_t* table = calloc(table_size, sizeof(size_t));
+    if (!table) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < dispatcher->numof_cmds; ++i) {
+        size_t slot = string_hash(dispatcher->cmds[i].name) & (table_size - 1);
+        while (table[slot])
+            slot = (slot + 1) & (table_size - 1);
+        table[slot] = i + 1;
+    }
+
+    dispatcher->table = table;
+    dispatcher->table_size = table_size;
+    return 0;
+}
+
 int cmd_dispatcher_create(
     struct cmd_dispatcher** _dispatcher,
     struct cmd_desc* cmds,
@@ -75,6 +120,7 @@ int cmd_dispatcher_create(
     }
 
     dispatcher->ctx = ctx;
+    dispatcher->close_handler = NULL;
 
     dispatcher->cmds = malloc(sizeof(struct cmd_desc) * numof_cmds);
     if (!dispatcher->cmds) {
@@ -87,9 +133,25 @@ int cmd_dispatcher_create(
     if (ret < 0)
         goto free_cmds;
 
+    ret = cmd_table_create(dispatcher);
+    if (ret < 0)
+        goto destroy_cmds;
+
+    dispatcher->counters = calloc(numof_cmds, sizeof(struct cmd_counters));
+    if (!dispatcher->counters) {
+        log_errno("calloc");
+        goto free_table;
+    }
+
     *_dispatcher = dispatcher;
     return 0;
 
+free_table:
+    free(dispatcher->table);
+
+destroy_cmds:
+    free_cmds(dispatcher->cmds, numof_cmds);
+
 free_cmds:
     free(dispatcher->cmds);
 
@@ -100,11 +162,87 @@ free:
 }
 
 void cmd_dispatcher_destroy(struct cmd_dispatcher* dispatcher) {
+    free(dispatcher->counters);
+    free(dispatcher->table);
     free_cmds(dispatcher->cmds, dispatcher->numof_cmds);
     free(dispatcher->cmds);
     free(dispatcher);
 }
 
+void cmd_dispatcher_set_close_handler(
+    struct cmd_dispatcher* dispatcher,
+    cmd_close_handler close_handler
+) {
+    dispatcher->close_handler = close_handler;
+}
+
+static const struct cmd_desc* cmd_dispatcher_find(
+    const struct cmd_dispatcher* dispatcher,
+    const char* actual_cmd
+) {
+    const size_t mask = dispatcher->table_size - 1;
+
+    for (size_t slot = string_hash(actual_cmd) & mask; dispatcher->table[slot];
+         slot = (slot + 1) & mask) {
+        const struct cmd_desc* cmd = &dispatcher->cmds[dispatcher->table[slot] - 1];
+
+        if (!strcmp(cmd->name, actual_cmd))
+            return cmd;
+    }
+
+    log_err("Received an unknown command: %s\n", actual_cmd);
+    return NULL;
+}
+
+static uint64_t cmd_now_us(void) {
+    struct timespec now;
+    log_errno_if(clock_gettime(CLOCK_MONOTONIC, &now), "clock_gettime");
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static size_t cmd_latency_bucket(uint64_t elapsed_us) {
+    size_t bucket = 0;
+    while (elapsed_us && bucket < CMD_LATENCY_NUMOF_BUCKETS - 1) {
+        elapsed_us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+/* A batch handler's time is split evenly between the requests. */
+static void cmd_dispatcher_record(
+    const struct cmd_dispatcher* dispatcher,
+    const struct cmd_desc* cmd,
+    size_t numof_calls,
+    int ret,
+    uint64_t started_at
+) {
+    struct cmd_counters* counters = &dispatcher->counters[cmd - dispatcher->cmds];
+    const uint64_t elapsed_us = (cmd_now_us() - started_at) / numof_calls;
+
+    atomic_fetch_add_explicit(&counters->numof_calls, numof_calls, memory_order_relaxed);
+    if (ret < 0)
+        atomic_fetch_add_explicit(&counters->numof_errors, numof_calls, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+        &counters->latency[cmd_latency_bucket(elapsed_us)],
+        numof_calls,
+        memory_order_relaxed
+    );
+}
+
+static int cmd_dispatcher_call(
+    const struct cmd_dispatcher* dispatcher,
+    const struct cmd_desc* cmd,
+    const struct jsonrpc_request* request,
+    struct jsonrpc_response** result,
+    void* arg
+) {
+    const uint64_t started_at = cmd_now_us();
+    int ret = cmd->handler(request, result, arg);
+    cmd_dispatcher_record(dispatcher, cmd, 1, ret, started_at);
+    return ret;
+}
+
 static int cmd_dispatcher_handle_internal(
     const struct cmd_dispatcher* dispatcher,
     const struct jsonrpc_request* request,
@@ -112,18 +250,29 @@ static int cmd_dispatcher_handle_internal(
     void* arg
 ) {
     const char* actual_cmd = jsonrpc_request_get_method(request);
+    const struct cmd_desc* cmd = cmd_dispatcher_find(dispatcher, actual_cmd);
+    if (!cmd)
+        return -1;
 
-    for (size_t i = 0; i < dispatcher->numof_cmds; ++i) {
-        struct cmd_desc* cmd = &dispatcher->cmds[i];
+    return cmd_dispatcher_call(dispatcher, cmd, request, result, arg);
+}
 
-        if (strcmp(cmd->name, actual_cmd))
-            continue;
+size_t cmd_dispatcher_get_numof_cmds(const struct cmd_dispatcher* dispatcher) {
+    return dispatcher->numof_cmds;
+}
 
-        return cmd->handler(request, result, arg);
+void cmd_dispatcher_get_stats(const struct cmd_dispatcher* dispatcher, struct cmd_stats* stats) {
+    for (size_t i = 0; i < dispatcher->numof_cmds; ++i) {
+        const struct cmd_counters* counters = &dispatcher->counters[i];
+
+        stats[i].name = dispatcher->cmds[i].name;
+        stats[i].numof_calls = atomic_load_explicit(&counters->numof_calls, memory_order_relaxed);
+        stats[i].numof_errors =
+            atomic_load_explicit(&counters->numof_errors, memory_order_relaxed);
+        for (size_t j = 0; j < CMD_LATENCY_NUMOF_BUCKETS; ++j)
+            stats[i].latency[j] =
+                atomic_load_explicit(&counters->latency[j], memory_order_relaxed);
     }
-
-    log_err("Received an unknown command: %s\n", actual_cmd);
-    return -1;
 }
 
 int cmd_dispatcher_handle(
@@ -143,73 +292,332 @@ static struct cmd_conn_ctx* make_conn_ctx(int fd, void* arg) {
 
     ctx->fd = fd;
     ctx->arg = arg;
+    ctx->close_conn = 0;
+    ctx->idle_conn = 0;
 
     return ctx;
 }
 
-static int cmd_dispatcher_handle_conn_internal(int conn_fd, struct cmd_dispatcher* dispatcher) {
+/* Decide which response should be sent back (if any), based on the handler's result. Takes
+ * ownership of the handler's response. */
+static int cmd_dispatcher_make_response(
+    struct jsonrpc_request* request,
+    int handler_ret,
+    struct jsonrpc_response* response,
+    struct jsonrpc_response** result
+) {
+    *result = NULL;
+
+    if (jsonrpc_request_is_notification(request))
+        goto destroy_response;
+
+    if (response && (handler_ret >= 0 || jsonrpc_response_is_error(response))) {
+        *result = response;
+        return 0;
+    }
+
+    if (handler_ret < 0)
+        return jsonrpc_error_create(result, request, -1, "An error occured");
+    return jsonrpc_response_create(result, request, NULL);
+
+destroy_response:
+    if (response)
+        jsonrpc_response_destroy(response);
+
+    return 0;
+}
+
+/* Requests [begin, end) are handled at once by the batch handler, if there's one. Returns the
+ * number of requests handled. */
+static size_t cmd_dispatcher_handle_batch_part(
+    const struct cmd_dispatcher* dispatcher,
+    struct jsonrpc_request** requests,
+    size_t begin,
+    size_t end,
+    struct jsonrpc_response** responses,
+    struct cmd_conn_ctx* ctx,
+    int* ret
+) {
+    const char* actual_cmd = jsonrpc_request_get_method(requests[begin]);
+    const struct cmd_desc* cmd = cmd_dispatcher_find(dispatcher, actual_cmd);
+    if (!cmd) {
+        *ret = -1;
+        return 1;
+    }
+
+    if (!cmd->batch_handler) {
+        *ret = cmd_dispatcher_call(dispatcher, cmd, requests[begin], &responses[begin], ctx);
+        return 1;
+    }
+
+    size_t numof_requests = 1;
+    while (begin + numof_requests < end &&
+           !strcmp(actual_cmd, jsonrpc_request_get_method(requests[begin + numof_requests])))
+        ++numof_requests;
+
+    const uint64_t started_at = cmd_now_us();
+    *ret = cmd->batch_handler(
+        (const struct jsonrpc_request* const*)&requests[begin],
+        numof_requests,
+        &responses[begin],
+        ctx
+    );
+    cmd_dispatcher_record(dispatcher, cmd, numof_requests, *ret, started_at);
+    return numof_requests;
+}
+
+static void cmd_dispatcher_destroy_batch(
+    struct jsonrpc_request** requests,
+    struct jsonrpc_response** responses,
+    size_t numof_requests
+) {
+    for (size_t i = 0; i < numof_requests; ++i) {
+        if (requests[i])
+            jsonrpc_request_destroy(requests[i]);
+        if (responses[i])
+            jsonrpc_response_destroy(responses[i]);
+    }
+    free(requests);
+    free(responses);
+}
+
+/* Requests in a batch are executed in order, even if some of them fail. The responses are
+ * collected into a single batch response. */
+
+/* Attachments can't be sent in a batch, so the responses that have them are
+ * replaced with errors. */
+static int cmd_dispatcher_check_batch_response(
+    struct jsonrpc_request* request,
+    struct jsonrpc_response** response
+) {
+    const void* attachment = NULL;
+    uint32_t attachment_size = 0;
+
+    jsonrpc_response_get_attachment(*response, &attachment, &attachment_size);
+    if (!attachment_size)
+        return 0;
+
+    jsonrpc_response_destroy(*response);
+    *response = NULL;
+    return jsonrpc_error_create(response, request, -1, "Can't be batched");
+}
+
+static int cmd_dispatcher_handle_batch(
+    struct cmd_dispatcher* dispatcher,
+    struct jsonrpc_request* batch,
+    struct jsonrpc_response** _result,
+    struct cmd_conn_ctx* ctx
+) {
+    int ret = 0;
+
+    const size_t numof_requests = jsonrpc_request_batch_get_size(batch);
+
+    struct jsonrpc_request** requests = calloc(numof_requests, sizeof(struct jsonrpc_request*));
+    if (!requests) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    struct jsonrpc_response** responses = calloc(numof_requests, sizeof(struct jsonrpc_response*));
+    if (!responses) {
+        log_errno("calloc");
+        free(requests);
+        return -1;
+    }
+
+    for (size_t i = 0; i < numof_requests; ++i) {
+        ret = jsonrpc_request_batch_get(batch, i, &requests[i]);
+        if (ret < 0)
+            goto destroy_batch;
+    }
+
+    struct jsonrpc_response* batch_response = NULL;
+    ret = jsonrpc_response_batch_create(&batch_response, batch);
+    if (ret < 0)
+        goto destroy_batch;
+
+    size_t i = 0;
+    while (i < numof_requests) {
+        int handler_ret = 0;
+        size_t numof_handled = cmd_dispatcher_handle_batch_part(
+            dispatcher,
+            requests,
+            i,
+            numof_requests,
+            responses,
+            ctx,
+            &handler_ret
+        );
+
+        for (size_t end = i + numof_handled; i < end; ++i) {
+            struct jsonrpc_response* response = responses[i];
+            responses[i] = NULL;
+
+            ret = cmd_dispatcher_make_response(requests[i], handler_ret, response, &response);
+            if (ret < 0)
+                goto destroy_batch_response;
+            if (!response)
+                continue;
+            ret = cmd_dispatcher_check_batch_response(requests[i], &response);
+            if (ret < 0)
+                goto destroy_batch_response;
+
+            ret = jsonrpc_response_batch_append(batch_response, response);
+            if (ret < 0) {
+                jsonrpc_response_destroy(response);
+                goto destroy_batch_response;
+            }
+        }
+    }
+
+    /* Nothing is sent back if the batch consists of notifications only. */
+    if (jsonrpc_response_batch_is_empty(batch_response))
+        jsonrpc_response_destroy(batch_response);
+    else
+        *_result = batch_response;
+
+    ret = 0;
+    goto destroy_batch;
+
+destroy_batch_response:
+    jsonrpc_response_destroy(batch_response);
+
+destroy_batch:
+    cmd_dispatcher_destroy_batch(requests, responses, numof_requests);
+
+    return ret;
+}
+
+/* Execute the command and decide which response should be sent back (if any). If the command
+ * fails, the error is sent back, and the connection can still be used for other requests, so
+ * only the errors that prevent that are returned. */
+static int cmd_dispatcher_handle_request(
+    struct cmd_dispatcher* dispatcher,
+    int conn_fd,
+    struct jsonrpc_request* request,
+    struct jsonrpc_response** result,
+    int* close_conn,
+    int* idle_conn
+) {
     int ret = 0;
 
     struct cmd_conn_ctx* new_ctx = make_conn_ctx(conn_fd, dispatcher->ctx);
     if (!new_ctx)
         return -1;
 
+    if (jsonrpc_request_is_batch(request)) {
+        ret = cmd_dispatcher_handle_batch(dispatcher, request, result, new_ctx);
+        *close_conn = new_ctx->close_conn;
+        *idle_conn = new_ctx->idle_conn;
+        goto free_ctx;
+    }
+
+    struct jsonrpc_response* response = NULL;
+    ret = cmd_dispatcher_handle_internal(dispatcher, request, &response, new_ctx);
+    *close_conn = new_ctx->close_conn;
+    *idle_conn = new_ctx->idle_conn;
+
+    ret = cmd_dispatcher_make_response(request, ret, response, result);
+
+free_ctx:
+    free(new_ctx);
+
+    return ret;
+}
+
+static int cmd_dispatcher_handle_one(
+    int conn_fd,
+    struct cmd_dispatcher* dispatcher,
+    int* close_conn,
+    int* idle_conn
+) {
+    int ret = 0;
+
     struct jsonrpc_request* request = NULL;
     ret = jsonrpc_request_recv(&request, conn_fd);
     if (ret < 0)
-        goto free_ctx;
+        return ret;
 
-    const int requires_response = !jsonrpc_request_is_notification(request);
+    struct jsonrpc_response* response = NULL;
+    ret = cmd_dispatcher_handle_request(
+        dispatcher, conn_fd, request, &response, close_conn, idle_conn
+    );
 
-    struct jsonrpc_response* default_response = NULL;
-    if (requires_response) {
-        ret = jsonrpc_response_create(&default_response, request, NULL);
-        if (ret < 0)
-            goto free_request;
+    if (response) {
+        ret = jsonrpc_response_send(response, conn_fd) < 0 ? -1 : ret;
+        jsonrpc_response_destroy(response);
     }
 
-    struct jsonrpc_response* default_error = NULL;
-    if (requires_response) {
-        ret = jsonrpc_error_create(&default_error, request, -1, "An error occured");
+    jsonrpc_request_destroy(request);
+
+    return ret;
+}
+
+static int cmd_dispatcher_handle_conn_internal(int conn_fd, struct cmd_dispatcher* dispatcher) {
+    int ret = 0;
+
+    /* Keep handling requests (the client might send a few at once) until the client closes the
+     * connection. */
+    while (1) {
+        ret = net_recv_eof(conn_fd);
         if (ret < 0)
-            goto free_default_response;
-    }
+            return ret;
+        if (ret)
+            return 0;
 
-    struct jsonrpc_response* response = NULL;
-    ret = cmd_dispatcher_handle_internal(dispatcher, request, &response, new_ctx);
+        int close_conn = 0, idle_conn = 0;
 
-    if (requires_response) {
-        struct jsonrpc_response* actual_response = response;
-        if (!actual_response) {
-            actual_response = ret < 0 ? default_error : default_response;
-        }
-        if (ret < 0 && !jsonrpc_response_is_error(actual_response)) {
-            actual_response = default_error;
-        }
-        ret = jsonrpc_response_send(actual_response, conn_fd) < 0 ? -1 : ret;
+        ret = cmd_dispatcher_handle_one(conn_fd, dispatcher, &close_conn, &idle_conn);
+        if (ret < 0)
+            return ret;
+        if (close_conn)
+            return ret;
+        /* Don't tie up the thread waiting for the next request. */
+        if (idle_conn)
+            return 1;
     }
+}
 
-    if (response)
-        jsonrpc_response_destroy(response);
+int cmd_dispatcher_handle_conn(int conn_fd, void* _dispatcher) {
+    return cmd_dispatcher_handle_conn_internal(conn_fd, (struct cmd_dispatcher*)_dispatcher);
+}
 
-    if (default_error)
-        jsonrpc_response_destroy(default_error);
+int cmd_dispatcher_handle_msg(
+    int conn_fd,
+    const struct buf* msg,
+    struct buf** reply,
+    void* _dispatcher
+) {
+    struct cmd_dispatcher* dispatcher = (struct cmd_dispatcher*)_dispatcher;
+    int ret = 0;
 
-free_default_response:
-    if (default_response)
-        jsonrpc_response_destroy(default_response);
+    struct jsonrpc_request* request = NULL;
+    ret = jsonrpc_request_parse(&request, msg);
+    if (ret < 0)
+        return ret;
 
-free_request:
-    jsonrpc_request_destroy(request);
+    struct jsonrpc_response* response = NULL;
+    int close_conn = 0, idle_conn = 0;
+    ret = cmd_dispatcher_handle_request(
+        dispatcher, conn_fd, request, &response, &close_conn, &idle_conn
+    );
 
-free_ctx:
-    free(new_ctx);
+    if (response) {
+        ret = jsonrpc_response_to_buf(response, reply) < 0 ? -1 : ret;
+        jsonrpc_response_destroy(response);
+    }
 
-    return ret;
+    jsonrpc_request_destroy(request);
+
+    if (ret < 0)
+        return ret;
+    return close_conn;
 }
 
-int cmd_dispatcher_handle_conn(int conn_fd, void* _dispatcher) {
-    return cmd_dispatcher_handle_conn_internal(conn_fd, (struct cmd_dispatcher*)_dispatcher);
+void cmd_dispatcher_handle_close(int conn_fd, void* _dispatcher) {
+    struct cmd_dispatcher* dispatcher = (struct cmd_dispatcher*)_dispatcher;
+    if (dispatcher->close_handler)
+        dispatcher->close_handler(conn_fd, dispatcher->ctx);
 }
 
 int cmd_dispatcher_handle_event(
@@ -223,5 +631,8 @@ int cmd_dispatcher_handle_event(
         return -1;
     }
 
-    return cmd_dispatcher_handle_conn_internal(fd, (struct cmd_dispatcher*)_dispatcher);
+    int close_conn = 0, idle_conn = 0;
+    return cmd_dispatcher_handle_one(
+        fd, (struct cmd_dispatcher*)_dispatcher, &close_conn, &idle_conn
+    );
 }
@@ -8,10 +8,12 @@
 #ifndef __COMMAND_H__
 #define __COMMAND_H__
 
+#include "buf.h"
 #include "event_loop.h"
 #include "json_rpc.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef int (*cmd_handler)(
     const struct jsonrpc_request* request,
@@ -19,9 +21,20 @@ typedef int (*cmd_handler)(
     void* ctx
 );
 
+/* Consecutive requests for the same command in a JSON-RPC batch are passed to this handler
+ * all at once, if the command has one. A response can be set for each request. */
+typedef int (*cmd_batch_handler)(
+    const struct jsonrpc_request* const* requests,
+    size_t numof_requests,
+    struct jsonrpc_response** responses,
+    void* ctx
+);
+
 struct cmd_desc {
     char* name;
     cmd_handler handler;
+    /* Optional. */
+    cmd_batch_handler batch_handler;
 };
 
 struct cmd_dispatcher;
@@ -29,6 +42,27 @@ struct cmd_dispatcher;
 int cmd_dispatcher_create(struct cmd_dispatcher**, struct cmd_desc*, size_t numof_defs, void* ctx);
 void cmd_dispatcher_destroy(struct cmd_dispatcher*);
 
+/* Latency bucket i counts calls that took less than 2^i microseconds (the last bucket counts
+ * everything else). */
+#define CMD_LATENCY_NUMOF_BUCKETS 24
+
+struct cmd_stats {
+    const char* name;
+    uint64_t numof_calls;
+    uint64_t numof_errors;
+    uint64_t latency[CMD_LATENCY_NUMOF_BUCKETS];
+};
+
+size_t cmd_dispatcher_get_numof_cmds(const struct cmd_dispatcher*);
+/* Fills in an array of cmd_dispatcher_get_numof_cmds() elements. The names are owned by the
+ * dispatcher. */
+void cmd_dispatcher_get_stats(const struct cmd_dispatcher*, struct cmd_stats*);
+
+/* Called right before a connection is closed, with the dispatcher's context as the argument. */
+typedef void (*cmd_close_handler)(int conn_fd, void* ctx);
+
+void cmd_dispatcher_set_close_handler(struct cmd_dispatcher*, cmd_close_handler);
+
 int cmd_dispatcher_handle(
     const struct cmd_dispatcher*,
     const struct jsonrpc_request* command,
@@ -38,12 +72,27 @@ int cmd_dispatcher_handle(
 struct cmd_conn_ctx {
     int fd;
     void* arg;
+    /* A command handler can set this to stop reading requests from the connection (e.g. if it's
+     * been handed over to another thread). */
+    int close_conn;
+    /* A command handler can set this if the connection stays open, but is going to be idle most
+     * of the time (e.g. if it belongs to a worker waiting for runs). */
+    int idle_conn;
 };
 
-/* This is supposed to be used as an argument to tcp_server_accept. */
+/* This is supposed to be used as an argument to tcp_server_accept. Requests are read from the
+ * connection until it's closed by the peer. Returns 1 if the connection has become idle, and
+ * should be handed over to the event loop. */
 int cmd_dispatcher_handle_conn(int conn_fd, void* dispatcher);
 
-/* This is supposed to be used as an argument to event_loop_add. */
+/* Same, but for a single message (from an idle connection, or received by a non-blocking TCP
+ * server). Returns 1 if the connection should be closed. */
+int cmd_dispatcher_handle_msg(int conn_fd, const struct buf* msg, struct buf** reply, void*);
+
+/* This is supposed to be used as an argument to tcp_server_create. */
+void cmd_dispatcher_handle_close(int conn_fd, void* dispatcher);
+
+/* This is supposed to be used as an argument to event_loop_add. Only a single request is read. */
 int cmd_dispatcher_handle_event(struct event_loop*, int fd, short revents, void* arg);
 
 #endif
@@ -15,10 +15,14 @@ extern const char* default_host;
 extern const char* default_port;
 extern const char* default_sqlite_path;
 
-#define CMD_QUEUE_RUN    "queue-run"
-#define CMD_NEW_WORKER   "new-worker"
-#define CMD_START_RUN    "start-run"
-#define CMD_FINISHED_RUN "finished-run"
-#define CMD_GET_RUNS     "get-runs"
+#define CMD_QUEUE_RUN      "queue-run"
+#define CMD_NEW_WORKER     "new-worker"
+#define CMD_START_RUN      "start-run"
+#define CMD_RUN_OUTPUT     "run-output"
+#define CMD_FINISHED_RUN   "finished-run"
+#define CMD_GET_RUNS       "get-runs"
+#define CMD_GET_RUN_OUTPUT "get-run-output"
+#define CMD_GET_STATS      "get-stats"
+#define CMD_HEARTBEAT      "heartbeat"
 
 #endif
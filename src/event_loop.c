@@ -7,15 +7,104 @@
 
 #include "event_loop.h"
 
+#include "compiler.h"
+#include "file.h"
 #include "log.h"
 #include "string.h"
 
+#include <errno.h>
 #include <poll.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
-SIMPLEQ_HEAD(event_fd_queue, event_fd);
+/*
+ * The event loop is backed by epoll(7). Descriptors are registered in the
+ * kernel once, when they're added to the loop, and each registration carries a
+ * pointer to its struct event_fd. This way, every iteration only has to look
+ * at the descriptors that are actually ready, not the entire set.
+ *
+ * The API still speaks poll(2) event flags, which are converted to their epoll
+ * counterparts and back.
+ *
+ * Timers are timerfd(2) descriptors, which are added to the loop like any other
+ * descriptor. This way, epoll_wait() can still block indefinitely.
+ */
+
+/* The maximum number of ready descriptors processed in one iteration. */
+#define EVENT_LOOP_MAX_EVENTS 64
+
+LIST_HEAD(event_fd_list, event_fd);
+
+struct event_timer {
+    int fd;
+    event_timer_handler handler;
+    void* arg;
+};
+
+static int event_timer_create(
+    struct event_timer** _timer,
+    unsigned ms,
+    int periodic,
+    event_timer_handler handler,
+    void* arg
+) {
+    int ret = 0;
+
+    struct event_timer* timer = malloc(sizeof(struct event_timer));
+    if (!timer) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    ret = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ret < 0) {
+        log_errno("timerfd_create");
+        goto free;
+    }
+    timer->fd = ret;
+
+    timer->handler = handler;
+    timer->arg = arg;
+
+    struct itimerspec spec;
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+    /* A zero it_value would disarm the timer. */
+    if (!ms)
+        spec.it_value.tv_nsec = 1;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 0;
+    if (periodic)
+        spec.it_interval = spec.it_value;
+
+    ret = timerfd_settime(timer->fd, 0, &spec, NULL);
+    if (ret < 0) {
+        log_errno("timerfd_settime");
+        goto close;
+    }
+
+    *_timer = timer;
+    return ret;
+
+close:
+    file_close(timer->fd);
+
+free:
+    free(timer);
+
+    return ret;
+}
+
+static void event_timer_destroy(struct event_timer* timer) {
+    file_close(timer->fd);
+    free(timer);
+}
 
 struct event_fd {
     int fd;
@@ -23,8 +112,11 @@ struct event_fd {
     event_handler handler;
     void* arg;
     int once;
+    int removed;
+    /* The descriptor is a timer owned by the loop; arg points to it. */
+    int timer;
 
-    SIMPLEQ_ENTRY(event_fd) entries;
+    LIST_ENTRY(event_fd) entries;
 };
 
 static struct event_fd* event_fd_create(int fd, short events, event_handler handler, void* arg) {
@@ -39,31 +131,41 @@ static struct event_fd* event_fd_create(int fd, short events, event_handler hand
     res->handler = handler;
     res->arg = arg;
     res->once = 0;
+    res->removed = 0;
+    res->timer = 0;
 
     return res;
 }
 
 static void event_fd_destroy(struct event_fd* entry) {
+    if (entry->timer)
+        event_timer_destroy((struct event_timer*)entry->arg);
     free(entry);
 }
 
-static void event_fd_queue_create(struct event_fd_queue* queue) {
-    SIMPLEQ_INIT(queue);
+static void event_fd_list_create(struct event_fd_list* list) {
+    LIST_INIT(list);
 }
 
-static void event_fd_queue_destroy(struct event_fd_queue* queue) {
-    struct event_fd* entry1 = SIMPLEQ_FIRST(queue);
+static void event_fd_list_destroy(struct event_fd_list* list) {
+    struct event_fd* entry1 = LIST_FIRST(list);
     while (entry1) {
-        struct event_fd* entry2 = SIMPLEQ_NEXT(entry1, entries);
+        struct event_fd* entry2 = LIST_NEXT(entry1, entries);
         event_fd_destroy(entry1);
         entry1 = entry2;
     }
-    SIMPLEQ_INIT(queue);
+    LIST_INIT(list);
 }
 
 struct event_loop {
-    nfds_t nfds;
-    struct event_fd_queue entries;
+    int epoll_fd;
+
+    size_t nfds;
+    /* Registered entries, indexed by their descriptors. */
+    struct event_fd** entries;
+    size_t entries_size;
+    /* Entries removed while dispatching events are freed once it's done. */
+    struct event_fd_list removed;
 };
 
 int event_loop_create(struct event_loop** _loop) {
@@ -74,38 +176,182 @@ int event_loop_create(struct event_loop** _loop) {
         log_errno("calloc");
         return -1;
     }
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0) {
+        log_errno("epoll_create1");
+        goto free;
+    }
+    loop->epoll_fd = ret;
+
+    loop->nfds = 0;
+    loop->entries = NULL;
+    loop->entries_size = 0;
+    event_fd_list_create(&loop->removed);
+
     *_loop = loop;
+    return 0;
 
-    event_fd_queue_create(&loop->entries);
+free:
+    free(loop);
 
     return ret;
 }
 
 void event_loop_destroy(struct event_loop* loop) {
-    event_fd_queue_destroy(&loop->entries);
+    event_fd_list_destroy(&loop->removed);
+    for (size_t i = 0; i < loop->entries_size; ++i)
+        if (loop->entries[i])
+            event_fd_destroy(loop->entries[i]);
+    free(loop->entries);
+    file_close(loop->epoll_fd);
     free(loop);
 }
 
-static void event_loop_add_internal(struct event_loop* loop, struct event_fd* entry) {
+static uint32_t events_to_epoll(short events) {
+    uint32_t result = 0;
+
+    if (events & POLLIN)
+        result |= EPOLLIN;
+    if (events & POLLPRI)
+        result |= EPOLLPRI;
+    if (events & POLLOUT)
+        result |= EPOLLOUT;
+    if (events & POLLRDHUP)
+        result |= EPOLLRDHUP;
+
+    return result;
+}
+
+static short events_from_epoll(uint32_t events) {
+    short result = 0;
+
+    if (events & EPOLLIN)
+        result |= POLLIN;
+    if (events & EPOLLPRI)
+        result |= POLLPRI;
+    if (events & EPOLLOUT)
+        result |= POLLOUT;
+    if (events & EPOLLRDHUP)
+        result |= POLLRDHUP;
+    if (events & EPOLLERR)
+        result |= POLLERR;
+    if (events & EPOLLHUP)
+        result |= POLLHUP;
+
+    return result;
+}
+
+static struct epoll_event event_fd_to_epoll(struct event_fd* entry) {
+    struct epoll_event event;
+    event.events = events_to_epoll(entry->events);
+    if (entry->once)
+        event.events |= EPOLLONESHOT;
+    event.data.ptr = entry;
+    return event;
+}
+
+static struct event_fd* event_loop_find(const struct event_loop* loop, int fd) {
+    if (fd < 0 || (size_t)fd >= loop->entries_size)
+        return NULL;
+    return loop->entries[fd];
+}
+
+static int event_loop_reserve(struct event_loop* loop, int fd) {
+    if ((size_t)fd < loop->entries_size)
+        return 0;
+
+    size_t new_size = loop->entries_size ? loop->entries_size : 64;
+    while (new_size <= (size_t)fd)
+        new_size *= 2;
+
+    struct event_fd** new_entries = realloc(loop->entries, new_size * sizeof(struct event_fd*));
+    if (!new_entries) {
+        log_errno("realloc");
+        return -1;
+    }
+    for (size_t i = loop->entries_size; i < new_size; ++i)
+        new_entries[i] = NULL;
+
+    loop->entries = new_entries;
+    loop->entries_size = new_size;
+    return 0;
+}
+
+static void event_loop_retire_entry(struct event_loop* loop, struct event_fd* entry) {
+    loop->entries[entry->fd] = NULL;
+    --loop->nfds;
+
+    /* There might be pending events for this entry; it's freed once they're
+     * dispatched (i.e. skipped). */
+    entry->removed = 1;
+    LIST_INSERT_HEAD(&loop->removed, entry, entries);
+}
+
+static int event_loop_add_internal(struct event_loop* loop, struct event_fd* entry) {
+    int ret = 0;
+
     log_debug("Adding descriptor %d to event loop\n", entry->fd);
 
-    nfds_t nfds = loop->nfds + 1;
-    SIMPLEQ_INSERT_TAIL(&loop->entries, entry, entries);
-    loop->nfds = nfds;
+    ret = event_loop_reserve(loop, entry->fd);
+    if (ret < 0)
+        return ret;
+
+    struct epoll_event event = event_fd_to_epoll(entry);
+
+    ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, entry->fd, &event);
+    if (ret < 0) {
+        log_errno("epoll_ctl");
+        return ret;
+    }
+
+    /* If there's an entry for this descriptor already, the descriptor must've
+     * been closed without removing it from the loop first (otherwise, the
+     * kernel wouldn't have let us add it again). */
+    struct event_fd* stale = event_loop_find(loop, entry->fd);
+    if (stale)
+        event_loop_retire_entry(loop, stale);
+
+    loop->entries[entry->fd] = entry;
+    ++loop->nfds;
+    return ret;
 }
 
-int event_loop_add(
+static int event_loop_add_entry(
     struct event_loop* loop,
     int fd,
     short events,
     event_handler handler,
-    void* arg
+    void* arg,
+    int once
 ) {
+    int ret = 0;
+
     struct event_fd* entry = event_fd_create(fd, events, handler, arg);
     if (!entry)
         return -1;
-    event_loop_add_internal(loop, entry);
-    return 0;
+    entry->once = once;
+
+    ret = event_loop_add_internal(loop, entry);
+    if (ret < 0)
+        goto destroy_entry;
+
+    return ret;
+
+destroy_entry:
+    event_fd_destroy(entry);
+
+    return ret;
+}
+
+int event_loop_add(
+    struct event_loop* loop,
+    int fd,
+    short events,
+    event_handler handler,
+    void* arg
+) {
+    return event_loop_add_entry(loop, fd, events, handler, arg, 0);
 }
 
 int event_loop_add_once(
@@ -115,20 +361,137 @@ int event_loop_add_once(
     event_handler handler,
     void* arg
 ) {
-    struct event_fd* entry = event_fd_create(fd, events, handler, arg);
-    if (!entry)
+    return event_loop_add_entry(loop, fd, events, handler, arg, 1);
+}
+
+int event_loop_modify(struct event_loop* loop, int fd, short events) {
+    int ret = 0;
+
+    struct event_fd* entry = event_loop_find(loop, fd);
+    if (!entry) {
+        log_err("Descriptor %d is not in the event loop\n", fd);
         return -1;
-    entry->once = 1;
-    event_loop_add_internal(loop, entry);
-    return 0;
+    }
+
+    if (entry->events == events)
+        return ret;
+    entry->events = events;
+
+    struct epoll_event event = event_fd_to_epoll(entry);
+
+    ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, entry->fd, &event);
+    if (ret < 0) {
+        log_errno("epoll_ctl");
+        return ret;
+    }
+
+    return ret;
 }
 
-static void event_loop_remove(struct event_loop* loop, struct event_fd* entry) {
+static void event_loop_remove_entry(struct event_loop* loop, struct event_fd* entry) {
     log_debug("Removing descriptor %d from event loop\n", entry->fd);
 
-    SIMPLEQ_REMOVE(&loop->entries, entry, event_fd, entries);
+    /* The descriptor might've been closed already, in which case the kernel
+     * has removed it from the epoll set for us. */
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL) < 0 && errno != EBADF &&
+        errno != ENOENT)
+        log_errno("epoll_ctl");
+
+    event_loop_retire_entry(loop, entry);
+}
+
+int event_loop_remove(struct event_loop* loop, int fd) {
+    struct event_fd* entry = event_loop_find(loop, fd);
+    if (!entry) {
+        log_err("Descriptor %d is not in the event loop\n", fd);
+        return -1;
+    }
+
+    event_loop_remove_entry(loop, entry);
+    return 0;
+}
+
+static int event_timer_dispatch(struct event_loop* loop, int fd, UNUSED short revents, void* _timer) {
+    struct event_timer* timer = (struct event_timer*)_timer;
+
+    /* Reset the expiration counter, otherwise the descriptor stays ready. */
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        log_errno("read");
+        return -1;
+    }
+
+    return timer->handler(loop, fd, timer->arg);
+}
+
+static int event_loop_add_timer_internal(
+    struct event_loop* loop,
+    unsigned ms,
+    int periodic,
+    event_timer_handler handler,
+    void* arg
+) {
+    int ret = 0;
+
+    struct event_timer* timer = NULL;
+    ret = event_timer_create(&timer, ms, periodic, handler, arg);
+    if (ret < 0)
+        return ret;
+
+    struct event_fd* entry = event_fd_create(timer->fd, POLLIN, event_timer_dispatch, timer);
+    if (!entry) {
+        ret = -1;
+        goto destroy_timer;
+    }
+    entry->once = !periodic;
+
+    ret = event_loop_add_internal(loop, entry);
+    if (ret < 0)
+        goto destroy_entry;
+
+    /* The entry owns the timer from now on. */
+    entry->timer = 1;
+    return timer->fd;
+
+destroy_entry:
     event_fd_destroy(entry);
-    --loop->nfds;
+
+destroy_timer:
+    event_timer_destroy(timer);
+
+    return ret;
+}
+
+int event_loop_add_timer(
+    struct event_loop* loop,
+    unsigned ms,
+    event_timer_handler handler,
+    void* arg
+) {
+    return event_loop_add_timer_internal(loop, ms, 0, handler, arg);
+}
+
+int event_loop_add_periodic_timer(
+    struct event_loop* loop,
+    unsigned ms,
+    event_timer_handler handler,
+    void* arg
+) {
+    return event_loop_add_timer_internal(loop, ms, 1, handler, arg);
+}
+
+int event_loop_remove_timer(struct event_loop* loop, int timer) {
+    struct event_fd* entry = event_loop_find(loop, timer);
+    if (!entry || !entry->timer) {
+        log_err("Timer %d is not in the event loop\n", timer);
+        return -1;
+    }
+
+    /* The descriptor is closed when the entry is freed. */
+    event_loop_remove_entry(loop, entry);
+    return 0;
 }
 
 static char* append_event(char* buf, size_t sz, char* ptr, const char* event) {
@@ -163,69 +526,45 @@ static char* events_to_string(short events) {
     return buf;
 }
 
-static struct pollfd* make_pollfds(const struct event_loop* loop) {
-    struct pollfd* fds = calloc(loop->nfds, sizeof(struct pollfd));
-    if (!fds) {
-        log_errno("calloc");
-        return NULL;
-    }
-
-    struct event_fd* entry = SIMPLEQ_FIRST(&loop->entries);
-    for (nfds_t i = 0; i < loop->nfds; ++i, entry = SIMPLEQ_NEXT(entry, entries)) {
-        fds[i].fd = entry->fd;
-        fds[i].events = entry->events;
-    }
-
-    log_debug("Descriptors:\n");
-    for (nfds_t i = 0; i < loop->nfds; ++i) {
-        char* events = events_to_string(fds[i].events);
-        log_debug("    %d (%s)\n", fds[i].fd, events ? events : "");
-        free(events);
-    }
-
-    return fds;
-}
-
 int event_loop_run(struct event_loop* loop) {
-    /* Cache the number of event descriptors so that event handlers can
-     * append new ones. */
-    const nfds_t nfds = loop->nfds;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int ret = 0;
 
-    struct pollfd* fds = make_pollfds(loop);
-    if (!fds)
-        return -1;
+    log_debug("Waiting on %zu descriptor(s)\n", loop->nfds);
 
-    int ret = poll(fds, nfds, -1);
+    ret = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
     if (ret < 0) {
-        log_errno("poll");
+        log_errno("epoll_wait");
         return ret;
     }
+    const int numof_events = ret;
     ret = 0;
 
-    struct event_fd* entry = SIMPLEQ_FIRST(&loop->entries);
-    for (nfds_t i = 0; i < nfds; ++i) {
-        struct event_fd* next = SIMPLEQ_NEXT(entry, entries);
+    for (int i = 0; i < numof_events; ++i) {
+        struct event_fd* entry = (struct event_fd*)events[i].data.ptr;
 
-        if (!fds[i].revents)
-            goto next;
+        /* The entry could've been removed by a previous handler. */
+        if (entry->removed)
+            continue;
 
-        char* events = events_to_string(fds[i].revents);
-        log_debug("Descriptor %d is ready: %s\n", fds[i].fd, events ? events : "");
-        free(events);
+        const short revents = events_from_epoll(events[i].events);
 
-        /* Execute all handlers but notice if any of them fail. */
-        const int handler_ret = entry->handler(loop, fds[i].fd, fds[i].revents, entry->arg);
-        if (handler_ret < 0)
-            ret = handler_ret;
+        char* revents_str = events_to_string(revents);
+        log_debug("Descriptor %d is ready: %s\n", entry->fd, revents_str ? revents_str : "");
+        free(revents_str);
 
+        /* One-shot descriptors are disarmed by the kernel at this point.
+         * Remove them before running the handler, which might close the
+         * descriptor. */
         if (entry->once)
-            event_loop_remove(loop, entry);
+            event_loop_remove_entry(loop, entry);
 
-    next:
-        entry = next;
-        continue;
+        /* Execute all handlers but notice if any of them fail. */
+        const int handler_ret = entry->handler(loop, entry->fd, revents, entry->arg);
+        if (handler_ret < 0)
+            ret = handler_ret;
     }
 
-    free(fds);
+    event_fd_list_destroy(&loop->removed);
     return ret;
 }
@@ -20,4 +20,20 @@ typedef int (*event_handler)(struct event_loop*, int fd, short revents, void* ar
 int event_loop_add(struct event_loop*, int fd, short events, event_handler, void* arg);
 int event_loop_add_once(struct event_loop*, int fd, short events, event_handler, void* arg);
 
+/* Change the events a descriptor is watched for. */
+int event_loop_modify(struct event_loop*, int fd, short events);
+/* This is safe to call from an event handler, even for other descriptors. Don't forget to remove
+ * a descriptor before closing it. */
+int event_loop_remove(struct event_loop*, int fd);
+
+/* Timers are backed by timerfd descriptors owned by the event loop. */
+typedef int (*event_timer_handler)(struct event_loop*, int timer, void* arg);
+
+/* These return the timer ID, which can be used to cancel the timer. One-shot timers are removed
+ * automatically after they fire. */
+int event_loop_add_timer(struct event_loop*, unsigned ms, event_timer_handler, void* arg);
+int event_loop_add_periodic_timer(struct event_loop*, unsigned ms, event_timer_handler, void* arg);
+
+int event_loop_remove_timer(struct event_loop*, int timer);
+
 #endif
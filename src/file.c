@@ -10,6 +10,7 @@
 #include "compiler.h"
 #include "log.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
 #include <stdio.h>
@@ -122,8 +123,22 @@ int file_exists(const char* path) {
     return !ret && S_ISREG(stat.st_mode);
 }
 
+/* Pipes hold 64 KiB by default; reading less than that at a time only means
+ * more read(2) calls for large outputs. */
+#define FILE_READ_MIN_SIZE (64 * 1024)
+
+static size_t file_read_initial_size(int fd) {
+    struct stat stat;
+
+    /* Regular files can usually be read in one go, plus one call to detect EOF. */
+    if (!fstat(fd, &stat) && S_ISREG(stat.st_mode) && stat.st_size >= FILE_READ_MIN_SIZE)
+        return (size_t)stat.st_size + 1;
+
+    return FILE_READ_MIN_SIZE;
+}
+
 int file_read(int fd, unsigned char** _contents, size_t* _size) {
-    size_t alloc_size = 256;
+    size_t alloc_size = file_read_initial_size(fd);
     unsigned char* contents = NULL;
     size_t size = 0;
 
@@ -157,3 +172,44 @@ int file_read(int fd, unsigned char** _contents, size_t* _size) {
         }
     }
 }
+
+int file_write(int fd, const void* data, size_t size) {
+    const unsigned char* it = (const unsigned char*)data;
+
+    while (size) {
+        ssize_t written = write(fd, it, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            log_errno("write");
+            return -1;
+        }
+
+        it += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+int file_pread(int fd, void* buf, size_t size, size_t offset, size_t* _read) {
+    unsigned char* it = (unsigned char*)buf;
+    size_t read = 0;
+
+    while (read < size) {
+        ssize_t read_size = pread(fd, it + read, size - read, (off_t)(offset + read));
+        if (read_size < 0) {
+            if (errno == EINTR)
+                continue;
+            log_errno("pread");
+            return -1;
+        }
+        if (!read_size)
+            break;
+
+        read += read_size;
+    }
+
+    *_read = read;
+    return 0;
+}
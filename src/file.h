@@ -24,5 +24,8 @@ void file_close(int fd);
 
 int file_exists(const char* path);
 int file_read(int fd, unsigned char** output, size_t* size);
+int file_write(int fd, const void* data, size_t size);
+/* Reads until the buffer is full or the end of the file is reached. */
+int file_pread(int fd, void* buf, size_t size, size_t offset, size_t* read);
 
 #endif
@@ -15,6 +15,7 @@
 #include <json-c/json_tokener.h>
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +29,10 @@ void libjson_free(struct json_object* obj) {
     json_object_put(obj);
 }
 
+struct json_object* libjson_ref(struct json_object* obj) {
+    return json_object_get(obj);
+}
+
 static const char* libjson_to_string_internal(struct json_object* obj, int flags) {
     const char* result = json_object_to_json_string_ext(obj, flags);
     if (!result) {
@@ -75,6 +80,34 @@ int libjson_clone(const struct json_object* obj, const char* key, struct json_ob
     return ret;
 }
 
+int libjson_to_buf(struct json_object* obj, struct buf** buf) {
+    const char* str = libjson_to_string(obj);
+    if (!str)
+        return -1;
+
+    /* The string is owned by the JSON object, make a copy that outlives it. */
+    char* copy = strdup(str);
+    if (!copy) {
+        log_errno("strdup");
+        return -1;
+    }
+
+    int ret = buf_create_from_string(buf, copy);
+    if (ret < 0)
+        goto free_copy;
+
+    return ret;
+
+free_copy:
+    free(copy);
+
+    return ret;
+}
+
+struct json_object* libjson_from_buf(const struct buf* buf) {
+    return libjson_from_string((const char*)buf_get_data(buf));
+}
+
 int libjson_send(struct json_object* obj, int fd) {
     int ret = 0;
 
@@ -101,13 +134,12 @@ struct json_object* libjson_recv(int fd) {
     if (ret < 0)
         return NULL;
 
-    result = libjson_from_string((const char*)buf_get_data(buf));
+    result = libjson_from_buf(buf);
     if (!result)
         goto destroy_buf;
 
 destroy_buf:
-    free((void*)buf_get_data(buf));
-    buf_destroy(buf);
+    net_free_buf(buf);
 
     return result;
 }
@@ -286,3 +318,34 @@ int libjson_append(struct json_object* arr, struct json_object* elem) {
     }
     return ret;
 }
+
+int libjson_append_int(struct json_object* arr, int64_t _elem) {
+    struct json_object* elem = json_object_new_int64(_elem);
+    if (!elem) {
+        libjson_errno("json_object_new_int");
+        return -1;
+    }
+
+    int ret = libjson_append(arr, elem);
+    if (ret < 0)
+        goto free_elem;
+
+    return ret;
+
+free_elem:
+    json_object_put(elem);
+
+    return ret;
+}
+
+int libjson_is_array(const struct json_object* obj) {
+    return json_object_is_type(obj, json_type_array);
+}
+
+size_t libjson_array_size(const struct json_object* arr) {
+    return json_object_array_length(arr);
+}
+
+struct json_object* libjson_array_get(const struct json_object* arr, size_t idx) {
+    return json_object_array_get_idx(arr, idx);
+}
@@ -8,11 +8,16 @@
 #ifndef __JSON_H__
 #define __JSON_H__
 
+#include "buf.h"
+
 #include <json-c/json_object.h>
 
+#include <stddef.h>
 #include <stdint.h>
 
 void libjson_free(struct json_object*);
+/* Adds a reference to the object, libjson_free() drops one. */
+struct json_object* libjson_ref(struct json_object*);
 
 const char* libjson_to_string(struct json_object*);
 const char* libjson_to_string_pretty(struct json_object*);
@@ -20,6 +25,10 @@ struct json_object* libjson_from_string(const char*);
 
 int libjson_clone(const struct json_object*, const char* key, struct json_object** value);
 
+/* The data of the resulting buffer is allocated dynamically, don't forget to free it. */
+int libjson_to_buf(struct json_object*, struct buf**);
+struct json_object* libjson_from_buf(const struct buf*);
+
 int libjson_send(struct json_object*, int fd);
 struct json_object* libjson_recv(int fd);
 
@@ -41,5 +50,11 @@ int libjson_set_string_const_key(struct json_object*, const char*, const char* v
 int libjson_set_int_const_key(struct json_object*, const char*, int64_t value);
 
 int libjson_append(struct json_object* arr, struct json_object* elem);
+int libjson_append_int(struct json_object* arr, int64_t elem);
+
+int libjson_is_array(const struct json_object*);
+size_t libjson_array_size(const struct json_object* arr);
+/* The element is owned by the array. */
+struct json_object* libjson_array_get(const struct json_object* arr, size_t idx);
 
 #endif
@@ -7,8 +7,11 @@
 
 #include "json_rpc.h"
 
+#include "buf.h"
 #include "json.h"
 #include "log.h"
+#include "msgpack.h"
+#include "net.h"
 
 #include <json-c/json_object.h>
 
@@ -17,14 +20,220 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* A request may carry a binary attachment. It's sent in the same message,
+ * right after the NUL-terminated JSON text (or the MessagePack object). */
 struct jsonrpc_request {
     struct json_object* impl;
+    enum jsonrpc_encoding encoding;
+
+    const void* attachment;
+    uint32_t attachment_size;
+
+    /* The received message, if owned by the request. */
+    struct buf* msg;
 };
 
+/* Responses may carry an attachment the same way requests do. */
 struct jsonrpc_response {
     struct json_object* impl;
+    enum jsonrpc_encoding encoding;
+
+    const void* attachment;
+    uint32_t attachment_size;
+
+    /* The attachment, if owned by the response. */
+    void* attachment_data;
+    /* The received message, if owned by the response. */
+    struct buf* msg;
 };
 
+static const char* const jsonrpc_encoding_names[] = {
+    [JSONRPC_ENCODING_JSON] = "json",
+    [JSONRPC_ENCODING_MSGPACK] = "msgpack",
+};
+
+static const size_t jsonrpc_numof_encodings =
+    sizeof(jsonrpc_encoding_names) / sizeof(jsonrpc_encoding_names[0]);
+
+const char* jsonrpc_encoding_to_string(enum jsonrpc_encoding encoding) {
+    if ((size_t)encoding >= jsonrpc_numof_encodings)
+        return "unknown";
+    return jsonrpc_encoding_names[encoding];
+}
+
+int jsonrpc_encoding_from_string(const char* name, enum jsonrpc_encoding* encoding) {
+    for (size_t i = 0; i < jsonrpc_numof_encodings; ++i) {
+        if (strcmp(name, jsonrpc_encoding_names[i]))
+            continue;
+        *encoding = (enum jsonrpc_encoding)i;
+        return 0;
+    }
+
+    log_err("JSON-RPC: unknown encoding: %s\n", name);
+    return -1;
+}
+
+static enum jsonrpc_encoding jsonrpc_default_encoding = JSONRPC_ENCODING_JSON;
+
+void jsonrpc_set_default_encoding(enum jsonrpc_encoding encoding) {
+    jsonrpc_default_encoding = encoding;
+}
+
+/* In case of JSON text, the data of the resulting buffer is owned by the JSON
+ * object. Either way, use jsonrpc_encoded_destroy() to free the buffer. */
+static int jsonrpc_encode(
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding,
+    struct buf** buf
+) {
+    if (encoding == JSONRPC_ENCODING_MSGPACK)
+        return msgpack_encode(impl, buf);
+
+    const char* str = libjson_to_string(impl);
+    if (!str)
+        return -1;
+    return buf_create_from_string(buf, str);
+}
+
+static void jsonrpc_encoded_destroy(struct buf* buf, enum jsonrpc_encoding encoding) {
+    if (encoding == JSONRPC_ENCODING_MSGPACK)
+        free((void*)buf_get_data(buf));
+    buf_destroy(buf);
+}
+
+/* The data of the resulting buffer is allocated dynamically, don't forget to free it. */
+static int jsonrpc_encode_to_buf(
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding,
+    struct buf** buf
+) {
+    if (encoding == JSONRPC_ENCODING_MSGPACK)
+        return msgpack_encode(impl, buf);
+    return libjson_to_buf(impl, buf);
+}
+
+static int jsonrpc_send(
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding,
+    const void* attachment,
+    uint32_t attachment_size,
+    int fd
+) {
+    struct buf* msg = NULL;
+    struct buf* attachment_buf = NULL;
+    int ret = 0;
+
+    ret = jsonrpc_encode(impl, encoding, &msg);
+    if (ret < 0)
+        return ret;
+
+    if (!attachment_size) {
+        ret = net_send_buf(fd, msg);
+        goto destroy_msg;
+    }
+
+    ret = buf_create(&attachment_buf, attachment, attachment_size);
+    if (ret < 0)
+        goto destroy_msg;
+
+    const struct buf* bufs[] = {msg, attachment_buf};
+    ret = net_send_bufs(fd, bufs, sizeof(bufs) / sizeof(bufs[0]));
+
+    buf_destroy(attachment_buf);
+
+destroy_msg:
+    jsonrpc_encoded_destroy(msg, encoding);
+
+    return ret;
+}
+
+/* The attachment goes right after the message, in the same buffer. */
+static int jsonrpc_to_buf(
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding,
+    const void* attachment,
+    uint32_t attachment_size,
+    struct buf** buf
+) {
+    int ret = 0;
+
+    ret = jsonrpc_encode_to_buf(impl, encoding, buf);
+    if (ret < 0)
+        return ret;
+    if (!attachment_size)
+        return ret;
+
+    void* encoded = (void*)buf_get_data(*buf);
+    uint32_t encoded_size = buf_get_size(*buf);
+
+    if (encoded_size > UINT32_MAX - attachment_size) {
+        log_err("JSON-RPC: message is too large\n");
+        ret = -1;
+        goto free_encoded;
+    }
+
+    uint32_t size = encoded_size + attachment_size;
+    unsigned char* data = malloc(size);
+    if (!data) {
+        log_errno("malloc");
+        ret = -1;
+        goto free_encoded;
+    }
+    memcpy(data, encoded, encoded_size);
+    memcpy(data + encoded_size, attachment, attachment_size);
+
+    struct buf* result = NULL;
+    ret = buf_create(&result, data, size);
+    if (ret < 0)
+        goto free_data;
+
+    free(encoded);
+    buf_destroy(*buf);
+    *buf = result;
+    return ret;
+
+free_data:
+    free(data);
+
+free_encoded:
+    free(encoded);
+    buf_destroy(*buf);
+
+    return ret;
+}
+
+/* The encoding is detected automatically. Whatever follows the encoded object
+ * in the message is the attachment, its offset is returned in `size`. */
+static int jsonrpc_decode(
+    const struct buf* msg,
+    struct json_object** impl,
+    enum jsonrpc_encoding* encoding,
+    uint32_t* size
+) {
+    const char* data = (const char*)buf_get_data(msg);
+    uint32_t msg_size = buf_get_size(msg);
+
+    if (msgpack_detect(data, msg_size)) {
+        *encoding = JSONRPC_ENCODING_MSGPACK;
+        return msgpack_decode(data, msg_size, impl, size);
+    }
+
+    *encoding = JSONRPC_ENCODING_JSON;
+
+    const char* json_end = memchr(data, '\0', msg_size);
+    if (!json_end) {
+        log_err("JSON-RPC: message is not NUL-terminated\n");
+        return -1;
+    }
+
+    *impl = libjson_from_buf(msg);
+    if (!*impl)
+        return -1;
+
+    *size = json_end - data + 1;
+    return 0;
+}
+
 static const char* const jsonrpc_key_version = "jsonrpc";
 static const char* const jsonrpc_key_id = "id";
 static const char* const jsonrpc_key_method = "method";
@@ -193,6 +402,11 @@ static int jsonrpc_request_create_internal(
         goto exit;
     }
 
+    request->encoding = jsonrpc_default_encoding;
+    request->attachment = NULL;
+    request->attachment_size = 0;
+    request->msg = NULL;
+
     ret = libjson_new_object(&request->impl);
     if (ret < 0)
         goto free;
@@ -239,6 +453,9 @@ int jsonrpc_request_create(
 
 void jsonrpc_request_destroy(struct jsonrpc_request* request) {
     libjson_free(request->impl);
+    if (request->msg) {
+        net_free_buf(request->msg);
+    }
     free(request);
 }
 
@@ -254,7 +471,7 @@ int jsonrpc_request_is_notification(const struct jsonrpc_request* request) {
     return !libjson_has(request->impl, jsonrpc_key_id);
 }
 
-static int jsonrpc_request_from_json(struct jsonrpc_request** _request, struct json_object* impl) {
+static int jsonrpc_request_check(struct json_object* impl) {
     int ret = 0;
 
     ret = jsonrpc_check_version(impl);
@@ -270,32 +487,201 @@ static int jsonrpc_request_from_json(struct jsonrpc_request** _request, struct j
     if (ret < 0)
         return ret;
 
+    return ret;
+}
+
+static int jsonrpc_check_batch(struct json_object* impl, int (*check)(struct json_object*)) {
+    int ret = 0;
+
+    size_t numof_elems = libjson_array_size(impl);
+    if (!numof_elems) {
+        log_err("JSON-RPC: batch is empty\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < numof_elems; ++i) {
+        ret = check(libjson_array_get(impl, i));
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret;
+}
+
+/* Takes ownership of the JSON object. */
+static int jsonrpc_request_wrap(
+    struct jsonrpc_request** _request,
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding
+) {
     struct jsonrpc_request* request = malloc(sizeof(struct jsonrpc_request));
     if (!request) {
         log_errno("malloc");
         return -1;
     }
     request->impl = impl;
+    request->encoding = encoding;
+    request->attachment = NULL;
+    request->attachment_size = 0;
+    request->msg = NULL;
 
     *_request = request;
+    return 0;
+}
+
+static int jsonrpc_request_from_json(
+    struct jsonrpc_request** request,
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding
+) {
+    int ret = 0;
+
+    if (libjson_is_array(impl))
+        ret = jsonrpc_check_batch(impl, jsonrpc_request_check);
+    else
+        ret = jsonrpc_request_check(impl);
+    if (ret < 0)
+        return ret;
+
+    return jsonrpc_request_wrap(request, impl, encoding);
+}
+
+int jsonrpc_request_batch_create(struct jsonrpc_request** request) {
+    struct json_object* impl = NULL;
+    int ret = 0;
+
+    ret = libjson_new_array(&impl);
+    if (ret < 0)
+        return ret;
+
+    ret = jsonrpc_request_wrap(request, impl, jsonrpc_default_encoding);
+    if (ret < 0)
+        goto free_impl;
+
+    return ret;
+
+free_impl:
+    libjson_free(impl);
+
+    return ret;
+}
+
+int jsonrpc_request_is_batch(const struct jsonrpc_request* request) {
+    return libjson_is_array(request->impl);
+}
+
+int jsonrpc_request_batch_append(struct jsonrpc_request* batch, struct jsonrpc_request* request) {
+    int ret = 0;
+
+    if (request->attachment_size) {
+        log_err("JSON-RPC: requests with attachments can't be batched\n");
+        return -1;
+    }
+
+    ret = libjson_append(batch->impl, libjson_ref(request->impl));
+    if (ret < 0) {
+        libjson_free(request->impl);
+        return ret;
+    }
+
+    jsonrpc_request_destroy(request);
+    return ret;
+}
+
+size_t jsonrpc_request_batch_get_size(const struct jsonrpc_request* batch) {
+    return libjson_array_size(batch->impl);
+}
+
+int jsonrpc_request_batch_get(
+    const struct jsonrpc_request* batch,
+    size_t idx,
+    struct jsonrpc_request** request
+) {
+    struct json_object* impl = libjson_ref(libjson_array_get(batch->impl, idx));
+
+    int ret = jsonrpc_request_wrap(request, impl, batch->encoding);
+    if (ret < 0)
+        goto free_impl;
+
+    return ret;
+
+free_impl:
+    libjson_free(impl);
+
     return ret;
 }
 
 int jsonrpc_request_send(const struct jsonrpc_request* request, int fd) {
-    return libjson_send(request->impl, fd);
+    return jsonrpc_send(
+        request->impl, request->encoding, request->attachment, request->attachment_size, fd
+    );
+}
+
+int jsonrpc_request_to_buf(const struct jsonrpc_request* request, struct buf** buf) {
+    return jsonrpc_to_buf(
+        request->impl, request->encoding, request->attachment, request->attachment_size, buf
+    );
 }
 
 int jsonrpc_request_recv(struct jsonrpc_request** request, int fd) {
-    struct json_object* impl = libjson_recv(fd);
-    if (!impl) {
+    int ret = 0;
+
+    struct buf* msg = NULL;
+    ret = net_recv_buf(fd, &msg);
+    if (ret < 0) {
         log_err("JSON-RPC: failed to receive request\n");
-        return -1;
+        return ret;
     }
 
-    int ret = jsonrpc_request_from_json(request, impl);
+    ret = jsonrpc_request_parse(request, msg);
+    if (ret < 0)
+        goto free_msg;
+
+    /* The attachment points into the message, keep it around. */
+    (*request)->msg = msg;
+
+    return ret;
+
+free_msg:
+    net_free_buf(msg);
+
+    return ret;
+}
+
+int jsonrpc_request_parse(struct jsonrpc_request** request, const struct buf* buf) {
+    const char* data = (const char*)buf_get_data(buf);
+    uint32_t size = buf_get_size(buf);
+
+    struct json_object* impl = NULL;
+    enum jsonrpc_encoding encoding = JSONRPC_ENCODING_JSON;
+    uint32_t impl_size = 0;
+
+    int ret = jsonrpc_decode(buf, &impl, &encoding, &impl_size);
+    if (ret < 0) {
+        log_err("JSON-RPC: failed to parse request\n");
+        return ret;
+    }
+
+    ret = jsonrpc_request_from_json(request, impl, encoding);
     if (ret < 0)
         goto free_impl;
 
+    /* Whatever follows the request itself is the attachment. */
+    if (impl_size < size) {
+        if (jsonrpc_request_is_batch(*request)) {
+            log_err("JSON-RPC: batches can't have attachments\n");
+            ret = -1;
+            goto destroy_request;
+        }
+        (*request)->attachment = data + impl_size;
+        (*request)->attachment_size = size - impl_size;
+    }
+
+    return ret;
+
+destroy_request:
+    jsonrpc_request_destroy(*request);
+
     return ret;
 
 free_impl:
@@ -304,6 +690,35 @@ free_impl:
     return ret;
 }
 
+void jsonrpc_request_set_attachment(
+    struct jsonrpc_request* request,
+    const void* data,
+    uint32_t size
+) {
+    request->attachment = data;
+    request->attachment_size = size;
+}
+
+void jsonrpc_request_get_attachment(
+    const struct jsonrpc_request* request,
+    const void** data,
+    uint32_t* size
+) {
+    *data = request->attachment;
+    *size = request->attachment_size;
+}
+
+enum jsonrpc_encoding jsonrpc_request_get_encoding(const struct jsonrpc_request* request) {
+    return request->encoding;
+}
+
+void jsonrpc_request_set_encoding(
+    struct jsonrpc_request* request,
+    enum jsonrpc_encoding encoding
+) {
+    request->encoding = encoding;
+}
+
 const char* jsonrpc_request_get_method(const struct jsonrpc_request* request) {
     const char* method = NULL;
     int ret = libjson_get_string(request->impl, jsonrpc_key_method, &method);
@@ -340,6 +755,16 @@ static struct json_object* jsonrpc_request_create_params(struct jsonrpc_request*
     return params;
 }
 
+int jsonrpc_request_has_param(const struct jsonrpc_request* request, const char* name) {
+    struct json_object* params = NULL;
+
+    if (!libjson_has(request->impl, jsonrpc_key_params))
+        return 0;
+    if (libjson_get(request->impl, jsonrpc_key_params, &params) < 0)
+        return 0;
+    return libjson_has(params, name);
+}
+
 int jsonrpc_request_get_param_string(
     const struct jsonrpc_request* request,
     const char* name,
@@ -405,6 +830,12 @@ int jsonrpc_response_create_internal(
         goto exit;
     }
 
+    response->encoding = request->encoding;
+    response->attachment = NULL;
+    response->attachment_size = 0;
+    response->attachment_data = NULL;
+    response->msg = NULL;
+
     ret = libjson_new_object(&response->impl);
     if (ret < 0)
         goto free;
@@ -455,6 +886,10 @@ int jsonrpc_response_create(
 
 void jsonrpc_response_destroy(struct jsonrpc_response* response) {
     libjson_free(response->impl);
+    free(response->attachment_data);
+    if (response->msg) {
+        net_free_buf(response->msg);
+    }
     free(response);
 }
 
@@ -491,13 +926,17 @@ free:
 }
 
 int jsonrpc_response_is_error(const struct jsonrpc_response* response) {
-    return libjson_has(response->impl, jsonrpc_key_error);
+    if (!libjson_is_array(response->impl))
+        return libjson_has(response->impl, jsonrpc_key_error);
+
+    /* A batch is considered an error if any of the requests has failed. */
+    for (size_t i = 0; i < libjson_array_size(response->impl); ++i)
+        if (libjson_has(libjson_array_get(response->impl, i), jsonrpc_key_error))
+            return 1;
+    return 0;
 }
 
-static int jsonrpc_response_from_json(
-    struct jsonrpc_response** _response,
-    struct json_object* impl
-) {
+static int jsonrpc_response_check(struct json_object* impl) {
     int ret = 0;
 
     ret = jsonrpc_check_version(impl);
@@ -510,29 +949,60 @@ static int jsonrpc_response_from_json(
     if (ret < 0)
         return ret;
 
+    return ret;
+}
+
+/* Takes ownership of the JSON object. */
+static int jsonrpc_response_wrap(
+    struct jsonrpc_response** _response,
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding
+) {
     struct jsonrpc_response* response = malloc(sizeof(struct jsonrpc_response));
     if (!response) {
         log_errno("malloc");
         return -1;
     }
     response->impl = impl;
+    response->encoding = encoding;
+    response->attachment = NULL;
+    response->attachment_size = 0;
+    response->attachment_data = NULL;
+    response->msg = NULL;
 
     *_response = response;
-    return ret;
+    return 0;
 }
 
-int jsonrpc_response_send(const struct jsonrpc_response* response, int fd) {
-    return libjson_send(response->impl, fd);
+static int jsonrpc_response_from_json(
+    struct jsonrpc_response** response,
+    struct json_object* impl,
+    enum jsonrpc_encoding encoding
+) {
+    int ret = 0;
+
+    if (libjson_is_array(impl))
+        ret = jsonrpc_check_batch(impl, jsonrpc_response_check);
+    else
+        ret = jsonrpc_response_check(impl);
+    if (ret < 0)
+        return ret;
+
+    return jsonrpc_response_wrap(response, impl, encoding);
 }
 
-int jsonrpc_response_recv(struct jsonrpc_response** response, int fd) {
-    struct json_object* impl = libjson_recv(fd);
-    if (!impl) {
-        log_err("JSON-RPC: failed to receive response\n");
-        return -1;
-    }
+int jsonrpc_response_batch_create(
+    struct jsonrpc_response** response,
+    const struct jsonrpc_request* request
+) {
+    struct json_object* impl = NULL;
+    int ret = 0;
+
+    ret = libjson_new_array(&impl);
+    if (ret < 0)
+        return ret;
 
-    int ret = jsonrpc_response_from_json(response, impl);
+    ret = jsonrpc_response_wrap(response, impl, request->encoding);
     if (ret < 0)
         goto free_impl;
 
@@ -543,3 +1013,101 @@ free_impl:
 
     return ret;
 }
+
+int jsonrpc_response_batch_append(
+    struct jsonrpc_response* batch,
+    struct jsonrpc_response* response
+) {
+    if (response->attachment_size) {
+        log_err("JSON-RPC: responses with attachments can't be batched\n");
+        return -1;
+    }
+
+    int ret = libjson_append(batch->impl, libjson_ref(response->impl));
+    if (ret < 0) {
+        libjson_free(response->impl);
+        return ret;
+    }
+
+    jsonrpc_response_destroy(response);
+    return ret;
+}
+
+int jsonrpc_response_batch_is_empty(const struct jsonrpc_response* batch) {
+    return !libjson_array_size(batch->impl);
+}
+
+int jsonrpc_response_send(const struct jsonrpc_response* response, int fd) {
+    return jsonrpc_send(
+        response->impl, response->encoding, response->attachment, response->attachment_size, fd
+    );
+}
+
+int jsonrpc_response_to_buf(const struct jsonrpc_response* response, struct buf** buf) {
+    return jsonrpc_to_buf(
+        response->impl, response->encoding, response->attachment, response->attachment_size, buf
+    );
+}
+
+int jsonrpc_response_recv(struct jsonrpc_response** response, int fd) {
+    int ret = 0;
+
+    struct buf* msg = NULL;
+    ret = net_recv_buf(fd, &msg);
+    if (ret < 0) {
+        log_err("JSON-RPC: failed to receive response\n");
+        return ret;
+    }
+
+    struct json_object* impl = NULL;
+    enum jsonrpc_encoding encoding = JSONRPC_ENCODING_JSON;
+    uint32_t impl_size = 0;
+
+    ret = jsonrpc_decode(msg, &impl, &encoding, &impl_size);
+    if (ret < 0) {
+        log_err("JSON-RPC: failed to parse response\n");
+        goto free_msg;
+    }
+
+    ret = jsonrpc_response_from_json(response, impl, encoding);
+    if (ret < 0) {
+        libjson_free(impl);
+        goto free_msg;
+    }
+
+    /* Whatever follows the response itself is the attachment, which points
+     * into the message. */
+    if (impl_size < buf_get_size(msg)) {
+        if (libjson_is_array(impl)) {
+            log_err("JSON-RPC: batches can't have attachments\n");
+            jsonrpc_response_destroy(*response);
+            ret = -1;
+            goto free_msg;
+        }
+        (*response)->attachment = (const char*)buf_get_data(msg) + impl_size;
+        (*response)->attachment_size = buf_get_size(msg) - impl_size;
+        (*response)->msg = msg;
+        return ret;
+    }
+
+free_msg:
+    net_free_buf(msg);
+
+    return ret;
+}
+
+void jsonrpc_response_set_attachment(struct jsonrpc_response* response, void* data, uint32_t size) {
+    free(response->attachment_data);
+    response->attachment = data;
+    response->attachment_size = size;
+    response->attachment_data = data;
+}
+
+void jsonrpc_response_get_attachment(
+    const struct jsonrpc_response* response,
+    const void** data,
+    uint32_t* size
+) {
+    *data = response->attachment;
+    *size = response->attachment_size;
+}
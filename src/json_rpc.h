@@ -10,10 +10,28 @@
 
 /* This attempts to adhere to the format described in https://www.jsonrpc.org/specification. */
 
+#include "buf.h"
+
 #include <json-c/json_object.h>
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* Messages are either JSON text or MessagePack, the latter being more compact
+ * and cheaper to produce and parse. Received messages are decoded according to
+ * their first byte, and responses are encoded the same way as the requests. */
+enum jsonrpc_encoding {
+    JSONRPC_ENCODING_JSON,
+    JSONRPC_ENCODING_MSGPACK,
+};
+
+const char* jsonrpc_encoding_to_string(enum jsonrpc_encoding);
+int jsonrpc_encoding_from_string(const char*, enum jsonrpc_encoding*);
+
+/* The encoding of newly created requests. Not thread-safe, meant to be called
+ * once on startup. */
+void jsonrpc_set_default_encoding(enum jsonrpc_encoding);
+
 struct jsonrpc_request;
 
 int jsonrpc_generate_request_id(void);
@@ -33,11 +51,39 @@ int jsonrpc_notification_create(
 );
 int jsonrpc_request_is_notification(const struct jsonrpc_request*);
 
+/* A batch is a request that consists of multiple requests, which are sent in a
+ * single message. The server responds to a batch with a batch of responses to
+ * the requests in it (except notifications). */
+int jsonrpc_request_batch_create(struct jsonrpc_request**);
+int jsonrpc_request_is_batch(const struct jsonrpc_request*);
+/* The request is destroyed if it's been successfully added to the batch.
+ * Requests with attachments can't be batched. */
+int jsonrpc_request_batch_append(struct jsonrpc_request* batch, struct jsonrpc_request*);
+size_t jsonrpc_request_batch_get_size(const struct jsonrpc_request*);
+/* The resulting request must be destroyed separately from the batch. */
+int jsonrpc_request_batch_get(const struct jsonrpc_request*, size_t idx, struct jsonrpc_request**);
+
 int jsonrpc_request_send(const struct jsonrpc_request*, int fd);
 int jsonrpc_request_recv(struct jsonrpc_request**, int fd);
+/* The data of the resulting buffer is allocated dynamically, don't forget to free it. */
+int jsonrpc_request_to_buf(const struct jsonrpc_request*, struct buf**);
+/* The attachment of the parsed request, if any, points into the buffer, so
+ * the buffer must outlive the request. */
+int jsonrpc_request_parse(struct jsonrpc_request**, const struct buf*);
+
+/* Binary data sent along with the request, without any encoding. The data is
+ * not copied, so it must outlive the request. */
+void jsonrpc_request_set_attachment(struct jsonrpc_request*, const void*, uint32_t size);
+/* If there's no attachment, the size is 0. */
+void jsonrpc_request_get_attachment(const struct jsonrpc_request*, const void**, uint32_t* size);
+
+enum jsonrpc_encoding jsonrpc_request_get_encoding(const struct jsonrpc_request*);
+void jsonrpc_request_set_encoding(struct jsonrpc_request*, enum jsonrpc_encoding);
 
 const char* jsonrpc_request_get_method(const struct jsonrpc_request*);
 
+/* Returns 1 if the request has the named parameter. */
+int jsonrpc_request_has_param(const struct jsonrpc_request*, const char* name);
 int jsonrpc_request_get_param_string(const struct jsonrpc_request*, const char* name, const char**);
 int jsonrpc_request_set_param_string(struct jsonrpc_request*, const char* name, const char*);
 int jsonrpc_request_get_param_int(const struct jsonrpc_request*, const char* name, int64_t*);
@@ -62,7 +108,21 @@ int jsonrpc_error_create(
 );
 int jsonrpc_response_is_error(const struct jsonrpc_response*);
 
+/* The batch is encoded the same way as the batch request. */
+int jsonrpc_response_batch_create(struct jsonrpc_response**, const struct jsonrpc_request*);
+/* The response is destroyed if it's been successfully added to the batch. */
+int jsonrpc_response_batch_append(struct jsonrpc_response* batch, struct jsonrpc_response*);
+int jsonrpc_response_batch_is_empty(const struct jsonrpc_response*);
+
 int jsonrpc_response_send(const struct jsonrpc_response*, int fd);
 int jsonrpc_response_recv(struct jsonrpc_response**, int fd);
+/* The data of the resulting buffer is allocated dynamically, don't forget to free it. */
+int jsonrpc_response_to_buf(const struct jsonrpc_response*, struct buf**);
+
+/* Unlike with requests, the response takes ownership of the data, which must
+ * be allocated with malloc. Responses with attachments can't be batched. */
+void jsonrpc_response_set_attachment(struct jsonrpc_response*, void*, uint32_t size);
+/* If there's no attachment, the size is 0. */
+void jsonrpc_response_get_attachment(const struct jsonrpc_response*, const void**, uint32_t* size);
 
 #endif
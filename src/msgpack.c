@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#include "msgpack.h"
+
+#include "buf.h"
+#include "log.h"
+
+#include <json-c/json_object.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum msgpack_tag {
+    MSGPACK_FIXMAP = 0x80,
+    MSGPACK_FIXARRAY = 0x90,
+    MSGPACK_FIXSTR = 0xa0,
+    MSGPACK_NIL = 0xc0,
+    MSGPACK_FALSE = 0xc2,
+    MSGPACK_TRUE = 0xc3,
+    MSGPACK_UINT8 = 0xcc,
+    MSGPACK_UINT16 = 0xcd,
+    MSGPACK_UINT32 = 0xce,
+    MSGPACK_UINT64 = 0xcf,
+    MSGPACK_INT8 = 0xd0,
+    MSGPACK_INT16 = 0xd1,
+    MSGPACK_INT32 = 0xd2,
+    MSGPACK_INT64 = 0xd3,
+    MSGPACK_STR8 = 0xd9,
+    MSGPACK_STR16 = 0xda,
+    MSGPACK_STR32 = 0xdb,
+    MSGPACK_ARRAY16 = 0xdc,
+    MSGPACK_ARRAY32 = 0xdd,
+    MSGPACK_MAP16 = 0xde,
+    MSGPACK_MAP32 = 0xdf,
+    MSGPACK_NEGATIVE_FIXINT = 0xe0,
+};
+
+/* Same as json-c's default parsing depth. */
+#define MSGPACK_MAX_DEPTH 32
+
+struct msgpack_writer {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+};
+
+static int msgpack_reserve(struct msgpack_writer* writer, size_t size) {
+    if (writer->size + size <= writer->capacity)
+        return 0;
+
+    size_t capacity = writer->capacity ? writer->capacity : 256;
+    while (capacity < writer->size + size)
+        capacity *= 2;
+
+    if (capacity > UINT32_MAX) {
+        log_err("MessagePack: encoded data is too large\n");
+        return -1;
+    }
+
+    unsigned char* data = realloc(writer->data, capacity);
+    if (!data) {
+        log_errno("realloc");
+        return -1;
+    }
+
+    writer->data = data;
+    writer->capacity = capacity;
+    return 0;
+}
+
+static int msgpack_write(struct msgpack_writer* writer, const void* src, size_t size) {
+    int ret = msgpack_reserve(writer, size);
+    if (ret < 0)
+        return ret;
+
+    memcpy(writer->data + writer->size, src, size);
+    writer->size += size;
+    return ret;
+}
+
+/* Writes the tag followed by the value as a big-endian integer of `size` bytes. */
+static int msgpack_write_tag(
+    struct msgpack_writer* writer,
+    unsigned char tag,
+    uint64_t value,
+    size_t size
+) {
+    int ret = msgpack_reserve(writer, 1 + size);
+    if (ret < 0)
+        return ret;
+
+    writer->data[writer->size++] = tag;
+    for (size_t i = size; i > 0; --i)
+        writer->data[writer->size++] = (unsigned char)(value >> ((i - 1) * 8));
+    return ret;
+}
+
+static int msgpack_encode_int(struct msgpack_writer* writer, int64_t value) {
+    if (value >= 0) {
+        if (value <= 0x7f)
+            return msgpack_write_tag(writer, (unsigned char)value, 0, 0);
+        if (value <= UINT8_MAX)
+            return msgpack_write_tag(writer, MSGPACK_UINT8, value, 1);
+        if (value <= UINT16_MAX)
+            return msgpack_write_tag(writer, MSGPACK_UINT16, value, 2);
+        if (value <= UINT32_MAX)
+            return msgpack_write_tag(writer, MSGPACK_UINT32, value, 4);
+        return msgpack_write_tag(writer, MSGPACK_UINT64, value, 8);
+    }
+
+    if (value >= -32)
+        return msgpack_write_tag(writer, (unsigned char)value, 0, 0);
+    if (value >= INT8_MIN)
+        return msgpack_write_tag(writer, MSGPACK_INT8, (uint64_t)value, 1);
+    if (value >= INT16_MIN)
+        return msgpack_write_tag(writer, MSGPACK_INT16, (uint64_t)value, 2);
+    if (value >= INT32_MIN)
+        return msgpack_write_tag(writer, MSGPACK_INT32, (uint64_t)value, 4);
+    return msgpack_write_tag(writer, MSGPACK_INT64, (uint64_t)value, 8);
+}
+
+static int msgpack_encode_str(struct msgpack_writer* writer, const char* str, size_t len) {
+    int ret = 0;
+
+    if (len < 32)
+        ret = msgpack_write_tag(writer, MSGPACK_FIXSTR | len, 0, 0);
+    else if (len <= UINT8_MAX)
+        ret = msgpack_write_tag(writer, MSGPACK_STR8, len, 1);
+    else if (len <= UINT16_MAX)
+        ret = msgpack_write_tag(writer, MSGPACK_STR16, len, 2);
+    else
+        ret = msgpack_write_tag(writer, MSGPACK_STR32, len, 4);
+    if (ret < 0)
+        return ret;
+
+    return msgpack_write(writer, str, len);
+}
+
+static int msgpack_encode_container(
+    struct msgpack_writer* writer,
+    unsigned char fix_tag,
+    unsigned char tag16,
+    unsigned char tag32,
+    size_t numof_elems
+) {
+    if (numof_elems < 16)
+        return msgpack_write_tag(writer, fix_tag | numof_elems, 0, 0);
+    if (numof_elems <= UINT16_MAX)
+        return msgpack_write_tag(writer, tag16, numof_elems, 2);
+    return msgpack_write_tag(writer, tag32, numof_elems, 4);
+}
+
+static int msgpack_encode_obj(struct msgpack_writer* writer, struct json_object* obj) {
+    int ret = 0;
+
+    switch (json_object_get_type(obj)) {
+    case json_type_null:
+        return msgpack_write_tag(writer, MSGPACK_NIL, 0, 0);
+
+    case json_type_boolean:
+        return msgpack_write_tag(
+            writer, json_object_get_boolean(obj) ? MSGPACK_TRUE : MSGPACK_FALSE, 0, 0
+        );
+
+    case json_type_int:
+        return msgpack_encode_int(writer, json_object_get_int64(obj));
+
+    case json_type_string:
+        return msgpack_encode_str(
+            writer, json_object_get_string(obj), json_object_get_string_len(obj)
+        );
+
+    case json_type_array: {
+        size_t numof_elems = json_object_array_length(obj);
+
+        ret = msgpack_encode_container(
+            writer, MSGPACK_FIXARRAY, MSGPACK_ARRAY16, MSGPACK_ARRAY32, numof_elems
+        );
+        if (ret < 0)
+            return ret;
+
+        for (size_t i = 0; i < numof_elems; ++i) {
+            ret = msgpack_encode_obj(writer, json_object_array_get_idx(obj, i));
+            if (ret < 0)
+                return ret;
+        }
+        return ret;
+    }
+
+    case json_type_object: {
+        ret = msgpack_encode_container(
+            writer, MSGPACK_FIXMAP, MSGPACK_MAP16, MSGPACK_MAP32, json_object_object_length(obj)
+        );
+        if (ret < 0)
+            return ret;
+
+        json_object_object_foreach(obj, key, val)
+        {
+            ret = msgpack_encode_str(writer, key, strlen(key));
+            if (ret < 0)
+                return ret;
+            ret = msgpack_encode_obj(writer, val);
+            if (ret < 0)
+                return ret;
+        }
+        return ret;
+    }
+
+    default:
+        log_err("MessagePack: unsupported JSON type: %d\n", json_object_get_type(obj));
+        return -1;
+    }
+}
+
+int msgpack_encode(struct json_object* obj, struct buf** buf) {
+    struct msgpack_writer writer = {NULL, 0, 0};
+    int ret = 0;
+
+    ret = msgpack_encode_obj(&writer, obj);
+    if (ret < 0)
+        goto free_data;
+
+    ret = buf_create(buf, writer.data, writer.size);
+    if (ret < 0)
+        goto free_data;
+
+    return ret;
+
+free_data:
+    free(writer.data);
+
+    return ret;
+}
+
+struct msgpack_reader {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+};
+
+static int msgpack_read_uint(struct msgpack_reader* reader, size_t size, uint64_t* value) {
+    if (reader->size - reader->pos < size) {
+        log_err("MessagePack: unexpected end of data\n");
+        return -1;
+    }
+
+    *value = 0;
+    for (size_t i = 0; i < size; ++i)
+        *value = (*value << 8) | reader->data[reader->pos++];
+    return 0;
+}
+
+static int msgpack_read_int(struct msgpack_reader* reader, size_t size, int64_t* value) {
+    uint64_t tmp = 0;
+
+    int ret = msgpack_read_uint(reader, size, &tmp);
+    if (ret < 0)
+        return ret;
+
+    /* Sign-extend. */
+    if (size < 8 && (tmp >> (size * 8 - 1)))
+        tmp |= UINT64_MAX << (size * 8);
+    *value = (int64_t)tmp;
+    return ret;
+}
+
+static int msgpack_read_str(struct msgpack_reader* reader, size_t len, const char** str) {
+    if (reader->size - reader->pos < len) {
+        log_err("MessagePack: unexpected end of data\n");
+        return -1;
+    }
+
+    *str = (const char*)reader->data + reader->pos;
+    reader->pos += len;
+    return 0;
+}
+
+static int msgpack_decode_obj(struct msgpack_reader*, unsigned depth, struct json_object**);
+
+static int msgpack_decode_array(
+    struct msgpack_reader* reader,
+    unsigned depth,
+    size_t numof_elems,
+    struct json_object** _obj
+) {
+    int ret = 0;
+
+    /* Each element takes at least a byte, don't let a bogus size cause a huge allocation. */
+    if (numof_elems > reader->size - reader->pos) {
+        log_err("MessagePack: unexpected end of data\n");
+        return -1;
+    }
+
+    struct json_object* obj = json_object_new_array_ext((int)numof_elems);
+    if (!obj) {
+        log_err("JSON: json_object_new_array_ext failed\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < numof_elems; ++i) {
+        struct json_object* elem = NULL;
+
+        ret = msgpack_decode_obj(reader, depth, &elem);
+        if (ret < 0)
+            goto free;
+
+        ret = json_object_array_add(obj, elem);
+        if (ret < 0) {
+            log_err("JSON: json_object_array_add failed\n");
+            json_object_put(elem);
+            goto free;
+        }
+    }
+
+    *_obj = obj;
+    return ret;
+
+free:
+    json_object_put(obj);
+
+    return ret;
+}
+
+static int msgpack_decode_key(struct msgpack_reader* reader, char** key) {
+    int ret = 0;
+
+    if (reader->pos >= reader->size) {
+        log_err("MessagePack: unexpected end of data\n");
+        return -1;
+    }
+
+    const unsigned char tag = reader->data[reader->pos++];
+    uint64_t len = 0;
+
+    if ((tag & 0xe0) == MSGPACK_FIXSTR) {
+        len = tag & 0x1f;
+    } else if (tag >= MSGPACK_STR8 && tag <= MSGPACK_STR32) {
+        ret = msgpack_read_uint(reader, (size_t)1 << (tag - MSGPACK_STR8), &len);
+        if (ret < 0)
+            return ret;
+    } else {
+        log_err("MessagePack: map keys must be strings\n");
+        return -1;
+    }
+
+    const char* str = NULL;
+    ret = msgpack_read_str(reader, len, &str);
+    if (ret < 0)
+        return ret;
+
+    *key = strndup(str, len);
+    if (!*key) {
+        log_errno("strndup");
+        return -1;
+    }
+    return ret;
+}
+
+static int msgpack_decode_map(
+    struct msgpack_reader* reader,
+    unsigned depth,
+    size_t numof_elems,
+    struct json_object** _obj
+) {
+    int ret = 0;
+
+    /* Each key-value pair takes at least two bytes. */
+    if (numof_elems > (reader->size - reader->pos) / 2) {
+        log_err("MessagePack: unexpected end of data\n");
+        return -1;
+    }
+
+    struct json_object* obj = json_object_new_object();
+    if (!obj) {
+        log_err("JSON: json_object_new_object failed\n");
+        return -1;
+    }
+
+    char* key = NULL;
+
+    for (size_t i = 0; i < numof_elems; ++i) {
+        ret = msgpack_decode_key(reader, &key);
+        if (ret < 0)
+            goto free;
+
+        struct json_object* val = NULL;
+
+        ret = msgpack_decode_obj(reader, depth, &val);
+        if (ret < 0)
+            goto free_key;
+
+        ret = json_object_object_add(obj, key, val);
+        if (ret < 0) {
+            log_err("JSON: json_object_object_add failed\n");
+            json_object_put(val);
+            goto free_key;
+        }
+
+        free(key);
+    }
+
+    *_obj = obj;
+    return ret;
+
+free_key:
+    free(key);
+free:
+    json_object_put(obj);
+
+    return ret;
+}
+
+static int msgpack_new_int(int64_t value, struct json_object** obj) {
+    *obj = json_object_new_int64(value);
+    if (!*obj) {
+        log_err("JSON: json_object_new_int64 failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int msgpack_decode_str(struct msgpack_reader* reader, size_t len, struct json_object** obj) {
+    const char* str = NULL;
+
+    int ret = msgpack_read_str(reader, len, &str);
+    if (ret < 0)
+        return ret;
+
+    *obj = json_object_new_string_len(str, (int)len);
+    if (!*obj) {
+        log_err("JSON: json_object_new_string_len failed\n");
+        return -1;
+    }
+    return ret;
+}
+
+static int msgpack_decode_container(
+    struct msgpack_reader* reader,
+    unsigned depth,
+    unsigned char tag,
+    struct json_object** obj
+) {
+    int ret = 0;
+
+    if (depth >= MSGPACK_MAX_DEPTH) {
+        log_err("MessagePack: maximum nesting depth exceeded\n");
+        return -1;
+    }
+
+    uint64_t numof_elems = 0;
+
+    if (tag < MSGPACK_FIXSTR) {
+        numof_elems = tag & 0x0f;
+    } else {
+        const int is_32 = tag == MSGPACK_ARRAY32 || tag == MSGPACK_MAP32;
+        ret = msgpack_read_uint(reader, is_32 ? 4 : 2, &numof_elems);
+        if (ret < 0)
+            return ret;
+    }
+
+    if ((tag & 0xf0) == MSGPACK_FIXMAP || tag == MSGPACK_MAP16 || tag == MSGPACK_MAP32)
+        return msgpack_decode_map(reader, depth + 1, numof_elems, obj);
+    return msgpack_decode_array(reader, depth + 1, numof_elems, obj);
+}
+
+static int msgpack_decode_obj(
+    struct msgpack_reader* reader,
+    unsigned depth,
+    struct json_object** obj
+) {
+    int ret = 0;
+
+    if (reader->pos >= reader->size) {
+        log_err("MessagePack: unexpected end of data\n");
+        return -1;
+    }
+
+    const unsigned char tag = reader->data[reader->pos++];
+    uint64_t len = 0;
+    int64_t value = 0;
+
+    if (tag <= 0x7f || tag >= MSGPACK_NEGATIVE_FIXINT)
+        return msgpack_new_int((int8_t)tag, obj);
+    if ((tag & 0xe0) == MSGPACK_FIXSTR)
+        return msgpack_decode_str(reader, tag & 0x1f, obj);
+    if ((tag & 0xe0) == MSGPACK_FIXMAP || (tag >= MSGPACK_ARRAY16 && tag <= MSGPACK_MAP32))
+        return msgpack_decode_container(reader, depth, tag, obj);
+
+    switch (tag) {
+    case MSGPACK_NIL:
+        /* That's how json-c represents null. */
+        *obj = NULL;
+        return 0;
+
+    case MSGPACK_FALSE:
+    case MSGPACK_TRUE:
+        *obj = json_object_new_boolean(tag == MSGPACK_TRUE);
+        if (!*obj) {
+            log_err("JSON: json_object_new_boolean failed\n");
+            return -1;
+        }
+        return 0;
+
+    case MSGPACK_UINT8:
+    case MSGPACK_UINT16:
+    case MSGPACK_UINT32:
+    case MSGPACK_UINT64:
+        ret = msgpack_read_uint(reader, (size_t)1 << (tag - MSGPACK_UINT8), &len);
+        if (ret < 0)
+            return ret;
+        if (len > INT64_MAX) {
+            log_err("MessagePack: integer is too large\n");
+            return -1;
+        }
+        return msgpack_new_int((int64_t)len, obj);
+
+    case MSGPACK_INT8:
+    case MSGPACK_INT16:
+    case MSGPACK_INT32:
+    case MSGPACK_INT64:
+        ret = msgpack_read_int(reader, (size_t)1 << (tag - MSGPACK_INT8), &value);
+        if (ret < 0)
+            return ret;
+        return msgpack_new_int(value, obj);
+
+    case MSGPACK_STR8:
+    case MSGPACK_STR16:
+    case MSGPACK_STR32:
+        ret = msgpack_read_uint(reader, (size_t)1 << (tag - MSGPACK_STR8), &len);
+        if (ret < 0)
+            return ret;
+        return msgpack_decode_str(reader, len, obj);
+
+    default:
+        log_err("MessagePack: unsupported type: 0x%02x\n", tag);
+        return -1;
+    }
+}
+
+int msgpack_decode(const void* data, uint32_t size, struct json_object** obj, uint32_t* consumed) {
+    struct msgpack_reader reader = {data, size, 0};
+
+    int ret = msgpack_decode_obj(&reader, 0, obj);
+    if (ret < 0)
+        return ret;
+
+    *consumed = (uint32_t)reader.pos;
+    return ret;
+}
+
+int msgpack_detect(const void* data, uint32_t size) {
+    if (!size)
+        return 0;
+
+    const unsigned char tag = *(const unsigned char*)data;
+    return (tag & 0xe0) == MSGPACK_FIXMAP || tag == MSGPACK_ARRAY16 || tag == MSGPACK_ARRAY32 ||
+           tag == MSGPACK_MAP16 || tag == MSGPACK_MAP32;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#ifndef __MSGPACK_H__
+#define __MSGPACK_H__
+
+/* A MessagePack (https://msgpack.org/) encoder/decoder for JSON objects. Only
+ * the types that have a JSON counterpart are supported, except for floating
+ * point numbers, which the protocol doesn't use. */
+
+#include "buf.h"
+
+#include <json-c/json_object.h>
+
+#include <stdint.h>
+
+/* The data of the resulting buffer is allocated dynamically, don't forget to free it. */
+int msgpack_encode(struct json_object*, struct buf**);
+/* Decodes a single object from the beginning of the data; the number of bytes
+ * it occupies is returned in `consumed`. */
+int msgpack_decode(const void*, uint32_t size, struct json_object**, uint32_t* consumed);
+
+/* Returns 1 if the data looks like a MessagePack map or array rather than JSON text. */
+int msgpack_detect(const void*, uint32_t size);
+
+#endif
@@ -8,25 +8,156 @@
 #include "net.h"
 
 #include "buf.h"
+#include "buf_pool.h"
 #include "file.h"
 #include "log.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <netdb.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #define gai_log_errno(ec) log_err("getaddrinfo: %s\n", gai_strerror(ec))
 
-int net_bind(const char* port) {
+#define NET_UNIX_PREFIX "unix:"
+
+/* Returns the socket path if the address is of the form unix:PATH, or NULL. */
+static const char* net_unix_path(const char* addr) {
+    static const size_t prefix_len = sizeof(NET_UNIX_PREFIX) - 1;
+
+    if (!addr || strncmp(addr, NET_UNIX_PREFIX, prefix_len))
+        return NULL;
+    return addr + prefix_len;
+}
+
+static int net_unix_addr(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (!*path || strlen(path) >= sizeof(addr->sun_path)) {
+        log_err("Invalid Unix domain socket path: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+static int net_listen(int fd) {
+    int ret = listen(fd, 4096);
+    if (ret < 0) {
+        log_errno("listen");
+        return ret;
+    }
+    return ret;
+}
+
+/* A socket file left behind by a previous instance would make bind() fail.
+ * Only remove actual sockets, and only if nobody is listening on them anymore. */
+static int net_unix_remove_stale(const struct sockaddr_un* addr) {
+    struct stat stat;
+    int ret = 0;
+
+    if (lstat(addr->sun_path, &stat) < 0 || !S_ISSOCK(stat.st_mode))
+        return 0;
+
+    const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        log_errno("socket");
+        return socket_fd;
+    }
+
+    ret = connect(socket_fd, (const struct sockaddr*)addr, sizeof(*addr));
+    if (!ret) {
+        log_err("Unix domain socket %s is in use by another process\n", addr->sun_path);
+        ret = -1;
+        goto close;
+    }
+    if (errno != ECONNREFUSED) {
+        log_errno("connect");
+        goto close;
+    }
+
+    ret = unlink(addr->sun_path);
+    if (ret < 0) {
+        log_errno("unlink");
+        goto close;
+    }
+
+close:
+    net_close(socket_fd);
+
+    return ret;
+}
+
+static int net_bind_unix(const char* path, int reuseport) {
+    static const int flags = SOCK_CLOEXEC;
+    struct sockaddr_un addr;
+    int socket_fd = -1, ret = 0;
+
+    /* Unix domain sockets don't balance connections between multiple sockets
+     * bound to the same path. */
+    if (reuseport) {
+        log_err("Unix domain socket %s can't be bound more than once\n", path);
+        return -1;
+    }
+
+    ret = net_unix_addr(&addr, path);
+    if (ret < 0)
+        return ret;
+
+    ret = net_unix_remove_stale(&addr);
+    if (ret < 0)
+        return ret;
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+    if (socket_fd < 0) {
+        log_errno("socket");
+        return socket_fd;
+    }
+
+    ret = bind(socket_fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (ret < 0) {
+        log_errno("bind");
+        log_err("Couldn't bind to Unix domain socket %s\n", path);
+        goto close;
+    }
+
+    ret = net_listen(socket_fd);
+    if (ret < 0)
+        goto unlink;
+
+    return socket_fd;
+
+unlink:
+    log_errno_if(unlink(path), "unlink");
+
+close:
+    net_close(socket_fd);
+
+    return ret;
+}
+
+static int net_bind_internal(const char* port, int reuseport) {
     static const int flags = SOCK_CLOEXEC;
     struct addrinfo *result = NULL, *it = NULL;
     struct addrinfo hints;
     int socket_fd = -1, ret = 0;
 
+    const char* path = net_unix_path(port);
+    if (path)
+        return net_bind_unix(path, reuseport);
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET6;
     hints.ai_socktype = SOCK_STREAM;
@@ -60,6 +191,12 @@ int net_bind(const char* port) {
             goto close_socket;
         }
 
+        if (reuseport &&
+            setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+            log_errno("setsockopt");
+            goto close_socket;
+        }
+
         if (bind(socket_fd, it->ai_addr, it->ai_addrlen) < 0) {
             log_errno("bind");
             goto close_socket;
@@ -78,11 +215,9 @@ int net_bind(const char* port) {
         return -1;
     }
 
-    ret = listen(socket_fd, 4096);
-    if (ret < 0) {
-        log_errno("listen");
+    ret = net_listen(socket_fd);
+    if (ret < 0)
         goto fail;
-    }
 
     return socket_fd;
 
@@ -92,8 +227,15 @@ fail:
     return ret;
 }
 
-int net_accept(int fd) {
-    static const int flags = SOCK_CLOEXEC;
+int net_bind(const char* port) {
+    return net_bind_internal(port, 0);
+}
+
+int net_bind_reuseport(const char* port) {
+    return net_bind_internal(port, 1);
+}
+
+static int net_accept_internal(int fd, int flags) {
     int ret = 0;
 
     ret = accept4(fd, NULL, NULL, flags);
@@ -105,12 +247,59 @@ int net_accept(int fd) {
     return ret;
 }
 
+int net_accept(int fd) {
+    static const int flags = SOCK_CLOEXEC;
+    return net_accept_internal(fd, flags);
+}
+
+int net_accept_nonblock(int fd) {
+    static const int flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    return net_accept_internal(fd, flags);
+}
+
+static int net_connect_unix(const char* path) {
+    static const int flags = SOCK_CLOEXEC;
+    struct sockaddr_un addr;
+    int socket_fd = -1, ret = 0;
+
+    ret = net_unix_addr(&addr, path);
+    if (ret < 0)
+        return ret;
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+    if (socket_fd < 0) {
+        log_errno("socket");
+        return socket_fd;
+    }
+
+    ret = connect(socket_fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (ret < 0) {
+        log_errno("connect");
+        log_err("Couldn't connect to Unix domain socket %s\n", path);
+        goto close;
+    }
+
+    return socket_fd;
+
+close:
+    net_close(socket_fd);
+
+    return ret;
+}
+
 int net_connect(const char* host, const char* port) {
     static const int flags = SOCK_CLOEXEC;
     struct addrinfo *result = NULL, *it = NULL;
     struct addrinfo hints;
     int socket_fd = -1, ret = 0;
 
+    /* The socket path can be passed either as the host or as the port. */
+    const char* path = net_unix_path(host);
+    if (!path)
+        path = net_unix_path(port);
+    if (path)
+        return net_connect_unix(path);
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -153,31 +342,93 @@ void net_close(int fd) {
     file_close(fd);
 }
 
-static ssize_t net_send_part(int fd, const void* buf, size_t size) {
-    static const int flags = MSG_NOSIGNAL;
+void net_unbind(int fd) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) < 0) {
+        log_errno("getsockname");
+        goto close;
+    }
+
+    /* Don't leave the socket file lying around. */
+    if (addr.sun_family == AF_UNIX && addr.sun_path[0])
+        log_errno_if(unlink(addr.sun_path), "unlink");
+
+close:
+    net_close(fd);
+}
+
+void net_shutdown(int fd) {
+    if (shutdown(fd, SHUT_RDWR) < 0)
+        log_errno("shutdown");
+}
+
+/* Blocking sends are occasionally made on non-blocking sockets (e.g. a
+ * notification for a worker connected to a non-blocking server). Wait until
+ * the socket is writable in that case. */
+static int net_wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
 
-    ssize_t ret = send(fd, buf, size, flags);
+    int ret = poll(&pfd, 1, -1);
     if (ret < 0) {
-        log_errno("send");
-        return -1;
+        log_errno("poll");
+        return ret;
     }
 
-    return ret;
+    return 0;
 }
 
-int net_send(int fd, const void* buf, size_t size) {
-    size_t sent_total = 0;
+static ssize_t net_send_part(int fd, struct iovec* iov, size_t iovcnt) {
+    static const int flags = MSG_NOSIGNAL;
+
+    struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = iovcnt};
+
+    while (1) {
+        ssize_t ret = sendmsg(fd, &hdr, flags);
+        if (ret >= 0)
+            return ret;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_errno("sendmsg");
+            return -1;
+        }
 
-    while (sent_total < size) {
-        ssize_t sent_now = net_send_part(fd, (const char*)buf + sent_total, size - sent_total);
+        if (net_wait_writable(fd) < 0)
+            return -1;
+    }
+}
+
+/* Sends everything in a single sendmsg(2) call if possible. The iovec array is
+ * modified to skip what's been sent after partial sends. */
+static int net_sendv(int fd, struct iovec* iov, size_t iovcnt) {
+    while (iovcnt) {
+        ssize_t sent_now = net_send_part(fd, iov, iovcnt);
         if (sent_now < 0)
             return -1;
-        sent_total += sent_now;
+
+        size_t sent = (size_t)sent_now;
+
+        while (iovcnt && sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt) {
+            iov->iov_base = (unsigned char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
     }
 
     return 0;
 }
 
+int net_send(int fd, const void* buf, size_t size) {
+    struct iovec iov = {.iov_base = (void*)buf, .iov_len = size};
+    return net_sendv(fd, &iov, 1);
+}
+
 int net_recv(int fd, void* buf, size_t size) {
     ssize_t read_total = 0;
 
@@ -202,19 +453,86 @@ int net_recv(int fd, void* buf, size_t size) {
     return 0;
 }
 
+int net_recv_eof(int fd) {
+    char c = 0;
+
+    ssize_t ret = recv(fd, &c, sizeof(c), MSG_PEEK);
+    if (ret < 0) {
+        log_errno("recv");
+        return -1;
+    }
+
+    return !ret;
+}
+
 int net_send_buf(int fd, const struct buf* buf) {
-    int ret = 0;
+    return net_send_bufs(fd, &buf, 1);
+}
 
-    uint32_t size = htonl(buf_get_size(buf));
-    ret = net_send(fd, &size, sizeof(size));
-    if (ret < 0)
-        return ret;
+/* The size and a few buffers, e.g. a JSON-RPC request and its attachment. */
+#define NET_SEND_MAX_IOVCNT 4
 
-    ret = net_send(fd, buf_get_data(buf), buf_get_size(buf));
-    if (ret < 0)
-        return ret;
+int net_send_bufs(int fd, const struct buf* const* bufs, size_t numof_bufs) {
+    struct iovec iov[NET_SEND_MAX_IOVCNT];
 
-    return ret;
+    if (numof_bufs >= NET_SEND_MAX_IOVCNT) {
+        log_err("Too many buffers to send: %zu\n", numof_bufs);
+        return -1;
+    }
+
+    uint32_t total_size = 0;
+    for (size_t i = 0; i < numof_bufs; ++i) {
+        uint32_t size = buf_get_size(bufs[i]);
+        if (size > UINT32_MAX - total_size) {
+            log_err("Message is too large to be sent\n");
+            return -1;
+        }
+        total_size += size;
+
+        iov[i + 1].iov_base = (void*)buf_get_data(bufs[i]);
+        iov[i + 1].iov_len = size;
+    }
+
+    /* Send the size along with the data, so that they don't end up in separate packets. */
+    uint32_t size = htonl(total_size);
+    iov[0].iov_base = &size;
+    iov[0].iov_len = sizeof(size);
+
+    return net_sendv(fd, iov, numof_bufs + 1);
+}
+
+static uint32_t net_max_msg_size = NET_DEFAULT_MAX_MSG_SIZE;
+
+static _Atomic uint64_t net_rejected_msgs = 0;
+
+void net_set_max_msg_size(uint32_t size) {
+    net_max_msg_size = size;
+}
+
+int net_check_msg_size(uint32_t size) {
+    if (size <= net_max_msg_size)
+        return 0;
+
+    atomic_fetch_add_explicit(&net_rejected_msgs, 1, memory_order_relaxed);
+    log_err(
+        "Message is too large: %" PRIu32 " bytes (the limit is %" PRIu32 ")\n",
+        size,
+        net_max_msg_size
+    );
+    return -1;
+}
+
+void* net_alloc_msg(uint32_t size) {
+    /* Make room for a terminating NUL, see net.h. */
+    unsigned char* data = buf_pool_alloc((size_t)size + 1);
+    if (!data)
+        return NULL;
+    data[size] = '\0';
+    return data;
+}
+
+void net_free_msg(void* data) {
+    buf_pool_free(data);
 }
 
 int net_recv_buf(int fd, struct buf** buf) {
@@ -228,11 +546,13 @@ int net_recv_buf(int fd, struct buf** buf) {
     }
     size = ntohl(size);
 
-    void* data = malloc(size);
-    if (!data) {
-        log_errno("malloc");
+    ret = net_check_msg_size(size);
+    if (ret < 0)
+        goto fail;
+
+    void* data = net_alloc_msg(size);
+    if (!data)
         goto fail;
-    }
 
     ret = net_recv(fd, data, size);
     if (ret < 0) {
@@ -247,8 +567,22 @@ int net_recv_buf(int fd, struct buf** buf) {
     return ret;
 
 free_data:
-    free(data);
+    net_free_msg(data);
 
 fail:
     return -1;
 }
+
+void net_free_buf(struct buf* buf) {
+    net_free_msg((void*)buf_get_data(buf));
+    buf_destroy(buf);
+}
+
+void net_get_stats(struct net_stats* stats) {
+    struct buf_pool_stats pool_stats;
+    buf_pool_get_stats(&pool_stats);
+
+    stats->pool_hits = pool_stats.hits;
+    stats->pool_misses = pool_stats.misses;
+    stats->rejected_msgs = atomic_load_explicit(&net_rejected_msgs, memory_order_relaxed);
+}
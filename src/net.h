@@ -11,16 +11,58 @@
 #include "buf.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+/* Addresses of the form unix:PATH refer to Unix domain sockets. They can be
+ * passed instead of the port to net_bind(), and as either the host or the port
+ * to net_connect(). */
 int net_bind(const char* port);
+/* Multiple sockets can be bound to the same port this way. */
+int net_bind_reuseport(const char* port);
 int net_accept(int fd);
+int net_accept_nonblock(int fd);
 int net_connect(const char* host, const char* port);
 void net_close(int fd);
+/* Closes a listening socket returned by net_bind(), removing its socket file
+ * in case of a Unix domain socket. */
+void net_unbind(int fd);
+/* Make pending and future reads from the connection return EOF. */
+void net_shutdown(int fd);
 
 int net_send(int fd, const void*, size_t);
 int net_recv(int fd, void*, size_t);
+/* Blocks until there's something to read. Returns 1 if the peer has closed the connection. */
+int net_recv_eof(int fd);
 
+/* Messages are prefixed with their size, and sent in a single sendmsg(2) call
+ * if possible. */
 int net_send_buf(int fd, const struct buf*);
+/* Sends the buffers as a single message, the same as if they were concatenated. */
+int net_send_bufs(int fd, const struct buf* const*, size_t numof_bufs);
+/* The received data is always followed by a NUL byte (not included in the
+ * buffer size), so that it can be safely treated as a string. Messages larger
+ * than the maximum size are rejected without being read. */
 int net_recv_buf(int fd, struct buf**);
+/* Frees a buffer returned by net_recv_buf(). */
+void net_free_buf(struct buf*);
+
+#define NET_DEFAULT_MAX_MSG_SIZE (64 * 1024 * 1024)
+
+/* Not thread-safe, meant to be called once on startup. */
+void net_set_max_msg_size(uint32_t);
+/* Returns -1 (and logs an error) if a message of this size must be rejected. */
+int net_check_msg_size(uint32_t);
+
+/* Incoming messages are read into buffers from a per-thread pool. */
+void* net_alloc_msg(uint32_t size);
+void net_free_msg(void*);
+
+struct net_stats {
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+    uint64_t rejected_msgs;
+};
+
+void net_get_stats(struct net_stats*);
 
 #endif
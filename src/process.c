@@ -10,8 +10,10 @@
 #include "file.h"
 #include "log.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -70,6 +72,13 @@ int process_execute(const char* args[], const char* envp[], int* ec) {
     return wait_for_child(child_pid, ec);
 }
 
+/* This is the default /proc/sys/fs/pipe-max-size value. */
+#define PROCESS_PIPE_SIZE (1024 * 1024)
+
+/* The output is handed over in chunks of at most this size, so that memory
+ * usage doesn't depend on how much output there is. */
+#define PROCESS_OUTPUT_CHUNK_SIZE (64 * 1024)
+
 static int redirect_and_exec_child(int pipe_fds[2], const char* args[], const char* envp[]) {
     int ret = 0;
 
@@ -90,10 +99,43 @@ static int redirect_and_exec_child(int pipe_fds[2], const char* args[], const ch
     return exec_child(args, envp);
 }
 
-int process_execute_and_capture(
+static int process_stream_output(int fd, process_output_handler handler, void* arg) {
+    int ret = 0;
+
+    unsigned char* chunk = malloc(PROCESS_OUTPUT_CHUNK_SIZE);
+    if (!chunk) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    while (1) {
+        ssize_t nb = read(fd, chunk, PROCESS_OUTPUT_CHUNK_SIZE);
+        if (nb < 0) {
+            log_errno("read");
+            ret = -1;
+            goto free_chunk;
+        }
+
+        if (!nb)
+            break;
+
+        ret = handler(chunk, (size_t)nb, arg);
+        if (ret < 0)
+            goto free_chunk;
+    }
+
+free_chunk:
+    free(chunk);
+
+    return ret;
+}
+
+int process_execute_and_stream(
     const char* args[],
     const char* envp[],
-    struct process_output* result
+    process_output_handler handler,
+    void* arg,
+    int* ec
 ) {
     static const int flags = O_CLOEXEC;
     int pipe_fds[2];
@@ -105,6 +147,13 @@ int process_execute_and_capture(
         return -1;
     }
 
+    /* A larger pipe means fewer context switches and fewer read(2) calls when
+     * the child produces a lot of output. It's merely an optimization, so
+     * failing to resize the pipe (e.g. because of the pipe-max-size limit) is
+     * not an error. */
+    if (fcntl(pipe_fds[0], F_SETPIPE_SZ, PROCESS_PIPE_SIZE) < 0)
+        log_debug("Couldn't resize the output pipe: %s\n", strerror(errno));
+
     pid_t child_pid = fork();
     if (child_pid < 0) {
         log_errno("fork");
@@ -116,48 +165,18 @@ int process_execute_and_capture(
 
     file_close(pipe_fds[1]);
 
-    ret = file_read(pipe_fds[0], &result->data, &result->data_size);
-    if (ret < 0)
-        goto close_pipe;
-
-    ret = wait_for_child(child_pid, &result->ec);
-    if (ret < 0)
-        goto free_data;
+    ret = process_stream_output(pipe_fds[0], handler, arg);
 
-    goto close_pipe;
+    /* If we've stopped reading early, the child gets SIGPIPE instead of
+     * blocking on a full pipe forever. */
+    file_close(pipe_fds[0]);
 
-free_data:
-    free(result->data);
+    int wait_ret = wait_for_child(child_pid, ec);
+    return ret < 0 ? ret : wait_ret;
 
 close_pipe:
     file_close(pipe_fds[0]);
-    /* No errno checking here, we might've already closed the write end. */
-    close(pipe_fds[1]);
-
-    return ret;
-}
-
-int process_output_create(struct process_output** _output) {
-    struct process_output* output = calloc(1, sizeof(struct process_output));
-    if (!output) {
-        log_errno("calloc");
-        return -1;
-    }
-
-    output->ec = 0;
-    output->data = NULL;
-    output->data_size = 0;
-
-    *_output = output;
-    return 0;
-}
-
-void process_output_destroy(struct process_output* output) {
-    free(output->data);
-    free(output);
-}
+    file_close(pipe_fds[1]);
 
-void process_output_dump(const struct process_output* output) {
-    log("Process exit code: %d\n", output->ec);
-    log("Process output: %zu bytes\n", output->data_size);
+    return -1;
 }
@@ -10,28 +10,22 @@
 
 #include <stddef.h>
 
-struct process_output {
-    int ec;
-    unsigned char* data;
-    size_t data_size;
-};
-
 /* The exit code is only valid if the functions returns a non-negative number. */
 int process_execute(const char* args[], const char* envp[], int* ec);
 
-/* Similarly, the contents of the process_output structure is only valid if the function returns a
- * non-negative number.
- *
- * In that case, you'll need to free the output. */
-int process_execute_and_capture(
+/* Called for every chunk of the process output (both stdout and stderr) as
+ * soon as it's available. The data is only valid during the call. */
+typedef int (*process_output_handler)(const void* data, size_t size, void* arg);
+
+/* Similarly, the exit code is only valid if the function returns a
+ * non-negative number. If the handler fails, the output is no longer read and
+ * the function fails after the process exits. */
+int process_execute_and_stream(
     const char* args[],
     const char* envp[],
-    struct process_output* result
+    process_output_handler,
+    void* arg,
+    int* ec
 );
 
-int process_output_create(struct process_output**);
-void process_output_destroy(struct process_output*);
-
-void process_output_dump(const struct process_output*);
-
 #endif
@@ -7,14 +7,19 @@
 
 #include "protocol.h"
 
-#include "base64.h"
+#include "codec.h"
+#include "command.h"
 #include "compiler.h"
 #include "const.h"
 #include "json.h"
 #include "json_rpc.h"
-#include "process.h"
+#include "log.h"
+#include "net.h"
 #include "run_queue.h"
+#include "storage.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -110,37 +115,42 @@ int request_parse_start_run(const struct jsonrpc_request* request, struct run**
     return run_created(run, (int)id, url, rev);
 }
 
-static const char* const finished_key_run_id = "run_id";
-static const char* const finished_key_ec = "exit_code";
-static const char* const finished_key_data = "output";
+static const char* const output_key_run_id = "run_id";
+static const char* const output_key_offset = "offset";
+static const char* const output_key_size = "size";
+static const char* const output_key_codec = "codec";
 
-int request_create_finished_run(
+int request_create_run_output(
     struct jsonrpc_request** request,
     int run_id,
-    const struct process_output* output
+    const struct run_output_chunk* chunk
 ) {
     int ret = 0;
 
-    ret = jsonrpc_notification_create(request, CMD_FINISHED_RUN, NULL);
+    if (chunk->data_size > UINT32_MAX) {
+        log_err("Output chunk is too large: %zu bytes\n", chunk->data_size);
+        return -1;
+    }
+
+    ret = jsonrpc_notification_create(request, CMD_RUN_OUTPUT, NULL);
     if (ret < 0)
         return ret;
-    ret = jsonrpc_request_set_param_int(*request, finished_key_run_id, run_id);
+    ret = jsonrpc_request_set_param_int(*request, output_key_run_id, run_id);
     if (ret < 0)
         goto free_request;
-    ret = jsonrpc_request_set_param_int(*request, finished_key_ec, output->ec);
+    ret = jsonrpc_request_set_param_int(*request, output_key_offset, chunk->offset);
     if (ret < 0)
         goto free_request;
-
-    char* b64data = NULL;
-    ret = base64_encode(output->data, output->data_size, &b64data);
+    ret = jsonrpc_request_set_param_int(*request, output_key_size, chunk->size);
     if (ret < 0)
         goto free_request;
-
-    ret = jsonrpc_request_set_param_string(*request, finished_key_data, b64data);
-    free(b64data);
+    ret = jsonrpc_request_set_param_string(*request, output_key_codec, codec_to_string(chunk->codec));
     if (ret < 0)
         goto free_request;
 
+    /* The output is sent as is, without base64-encoding it into the JSON. */
+    jsonrpc_request_set_attachment(*request, chunk->data, (uint32_t)chunk->data_size);
+
     return ret;
 
 free_request:
@@ -149,76 +159,683 @@ free_request:
     return ret;
 }
 
-int request_parse_finished_run(
+int request_parse_run_output(
     const struct jsonrpc_request* request,
     int* _run_id,
-    struct process_output** _output
+    struct run_output_chunk* chunk
 ) {
     int ret = 0;
 
-    struct process_output* output = NULL;
-    ret = process_output_create(&output);
+    int64_t run_id = 0;
+    ret = jsonrpc_request_get_param_int(request, output_key_run_id, &run_id);
+    if (ret < 0)
+        return ret;
+
+    int64_t offset = 0;
+    ret = jsonrpc_request_get_param_int(request, output_key_offset, &offset);
+    if (ret < 0)
+        return ret;
+    if (offset < 0) {
+        log_err("Invalid output offset: %" PRId64 "\n", offset);
+        return -1;
+    }
+
+    int64_t size = 0;
+    ret = jsonrpc_request_get_param_int(request, output_key_size, &size);
+    if (ret < 0)
+        return ret;
+    if (size < 0) {
+        log_err("Invalid output size: %" PRId64 "\n", size);
+        return -1;
+    }
+
+    const char* codec_name = NULL;
+    ret = jsonrpc_request_get_param_string(request, output_key_codec, &codec_name);
+    if (ret < 0)
+        return ret;
+    enum codec codec = CODEC_NONE;
+    ret = codec_from_string(codec_name, &codec);
     if (ret < 0)
         return ret;
 
+    const void* data = NULL;
+    uint32_t data_size = 0;
+    jsonrpc_request_get_attachment(request, &data, &data_size);
+
+    if (codec == CODEC_NONE && size != data_size) {
+        log_err(
+            "Expected %" PRId64 " bytes of process output, got %" PRIu32 "\n",
+            size,
+            data_size
+        );
+        return -1;
+    }
+
+    *_run_id = (int)run_id;
+    chunk->offset = (size_t)offset;
+    chunk->size = (size_t)size;
+    chunk->codec = codec;
+    chunk->data = data;
+    chunk->data_size = data_size;
+    return ret;
+}
+
+static const char* const finished_key_run_id = "run_id";
+static const char* const finished_key_ec = "exit_code";
+
+int request_create_finished_run(struct jsonrpc_request** request, int run_id, int ec) {
+    int ret = 0;
+
+    ret = jsonrpc_notification_create(request, CMD_FINISHED_RUN, NULL);
+    if (ret < 0)
+        return ret;
+    ret = jsonrpc_request_set_param_int(*request, finished_key_run_id, run_id);
+    if (ret < 0)
+        goto free_request;
+    ret = jsonrpc_request_set_param_int(*request, finished_key_ec, ec);
+    if (ret < 0)
+        goto free_request;
+
+    return ret;
+
+free_request:
+    jsonrpc_request_destroy(*request);
+
+    return ret;
+}
+
+int request_parse_finished_run(const struct jsonrpc_request* request, int* _run_id, int* _ec) {
+    int ret = 0;
+
     int64_t run_id = 0;
     ret = jsonrpc_request_get_param_int(request, finished_key_run_id, &run_id);
     if (ret < 0)
-        goto free_output;
+        return ret;
 
     int64_t ec = -1;
     ret = jsonrpc_request_get_param_int(request, finished_key_ec, &ec);
     if (ret < 0)
-        goto free_output;
-    output->ec = (int)ec;
+        return ret;
+
+    *_run_id = (int)run_id;
+    *_ec = (int)ec;
+    return ret;
+}
+
+int request_create_heartbeat(struct jsonrpc_request** request) {
+    return jsonrpc_notification_create(request, CMD_HEARTBEAT, NULL);
+}
+
+int request_parse_heartbeat(UNUSED const struct jsonrpc_request* request) {
+    return 0;
+}
+
+static const char* const get_runs_key_limit = "limit";
+static const char* const get_runs_key_before_id = "before_id";
+static const char* const get_runs_key_after_id = "after_id";
+static const char* const get_runs_key_repo_url = "repo_url";
+static const char* const get_runs_key_status = "status";
+static const char* const get_runs_key_exit_code = "exit_code";
+static const char* const get_runs_key_created_after = "created_after";
+static const char* const get_runs_key_created_before = "created_before";
+
+static const char* const get_runs_key_runs = "runs";
+static const char* const get_runs_key_next_before_id = "next_before_id";
+static const char* const get_runs_key_next_after_id = "next_after_id";
+
+static int get_runs_set_param_int(
+    struct jsonrpc_request* request,
+    const struct run_filter* filter,
+    unsigned int field,
+    const char* key,
+    int64_t value
+) {
+    if (!(filter->fields & field))
+        return 0;
+    return jsonrpc_request_set_param_int(request, key, value);
+}
+
+int request_create_get_runs(struct jsonrpc_request** request, const struct run_filter* filter) {
+    int ret = 0;
 
-    const char* b64data = NULL;
-    ret = jsonrpc_request_get_param_string(request, finished_key_data, &b64data);
+    ret = jsonrpc_request_create(request, jsonrpc_generate_request_id(), CMD_GET_RUNS, NULL);
     if (ret < 0)
-        goto free_output;
+        return ret;
 
-    ret = base64_decode(b64data, &output->data, &output->data_size);
+    if (filter->limit) {
+        ret = jsonrpc_request_set_param_int(*request, get_runs_key_limit, (int64_t)filter->limit);
+        if (ret < 0)
+            goto free_request;
+    }
+    ret = get_runs_set_param_int(
+        *request, filter, RUN_FILTER_BEFORE_ID, get_runs_key_before_id, filter->before_id
+    );
     if (ret < 0)
-        goto free_output;
+        goto free_request;
+    ret = get_runs_set_param_int(
+        *request, filter, RUN_FILTER_AFTER_ID, get_runs_key_after_id, filter->after_id
+    );
+    if (ret < 0)
+        goto free_request;
+    if (filter->fields & RUN_FILTER_REPO_URL) {
+        ret = jsonrpc_request_set_param_string(*request, get_runs_key_repo_url, filter->repo_url);
+        if (ret < 0)
+            goto free_request;
+    }
+    if (filter->fields & RUN_FILTER_STATUS) {
+        ret = jsonrpc_request_set_param_string(
+            *request, get_runs_key_status, run_status_to_string(filter->status)
+        );
+        if (ret < 0)
+            goto free_request;
+    }
+    ret = get_runs_set_param_int(
+        *request, filter, RUN_FILTER_EXIT_CODE, get_runs_key_exit_code, filter->exit_code
+    );
+    if (ret < 0)
+        goto free_request;
+    ret = get_runs_set_param_int(
+        *request,
+        filter,
+        RUN_FILTER_CREATED_AFTER,
+        get_runs_key_created_after,
+        filter->created_after
+    );
+    if (ret < 0)
+        goto free_request;
+    ret = get_runs_set_param_int(
+        *request,
+        filter,
+        RUN_FILTER_CREATED_BEFORE,
+        get_runs_key_created_before,
+        filter->created_before
+    );
+    if (ret < 0)
+        goto free_request;
 
-    *_run_id = (int)run_id;
-    *_output = output;
     return ret;
 
-free_output:
-    process_output_destroy(output);
+free_request:
+    jsonrpc_request_destroy(*request);
 
     return ret;
 }
 
-int request_create_get_runs(struct jsonrpc_request** request) {
-    return jsonrpc_request_create(request, jsonrpc_generate_request_id(), CMD_GET_RUNS, NULL);
+/* Returns 1 if the parameter is present. */
+static int get_runs_get_param_int(
+    const struct jsonrpc_request* request,
+    struct run_filter* filter,
+    unsigned int field,
+    const char* key,
+    int64_t* value
+) {
+    int ret = 0;
+
+    if (!jsonrpc_request_has_param(request, key))
+        return 0;
+    ret = jsonrpc_request_get_param_int(request, key, value);
+    if (ret < 0)
+        return ret;
+
+    filter->fields |= field;
+    return 1;
+}
+
+/* Same, but for the fields that are ints. */
+static int get_runs_get_param_int32(
+    const struct jsonrpc_request* request,
+    struct run_filter* filter,
+    unsigned int field,
+    const char* key,
+    int* value
+) {
+    int64_t result = 0;
+    int ret = 0;
+
+    ret = get_runs_get_param_int(request, filter, field, key, &result);
+    if (ret <= 0)
+        return ret;
+    if (result < INT_MIN || result > INT_MAX) {
+        log_err("Invalid %s: %" PRId64 "\n", key, result);
+        return -1;
+    }
+
+    *value = (int)result;
+    return ret;
 }
 
-int request_parse_get_runs(UNUSED const struct jsonrpc_request* request) {
+int request_parse_get_runs(const struct jsonrpc_request* request, struct run_filter* filter) {
+    int64_t value = 0;
+    const char* str = NULL;
+    int ret = 0;
+
+    run_filter_init(filter);
+
+    if (jsonrpc_request_has_param(request, get_runs_key_limit)) {
+        ret = jsonrpc_request_get_param_int(request, get_runs_key_limit, &value);
+        if (ret < 0)
+            return ret;
+        if (value < 0) {
+            log_err("Invalid limit: %" PRId64 "\n", value);
+            return -1;
+        }
+        filter->limit = (size_t)value;
+    }
+
+    ret = get_runs_get_param_int32(
+        request, filter, RUN_FILTER_BEFORE_ID, get_runs_key_before_id, &filter->before_id
+    );
+    if (ret < 0)
+        return ret;
+    ret = get_runs_get_param_int32(
+        request, filter, RUN_FILTER_AFTER_ID, get_runs_key_after_id, &filter->after_id
+    );
+    if (ret < 0)
+        return ret;
+
+    if (jsonrpc_request_has_param(request, get_runs_key_repo_url)) {
+        ret = jsonrpc_request_get_param_string(request, get_runs_key_repo_url, &str);
+        if (ret < 0)
+            return ret;
+        filter->fields |= RUN_FILTER_REPO_URL;
+        filter->repo_url = str;
+    }
+    if (jsonrpc_request_has_param(request, get_runs_key_status)) {
+        ret = jsonrpc_request_get_param_string(request, get_runs_key_status, &str);
+        if (ret < 0)
+            return ret;
+        ret = run_status_from_string(str, &filter->status);
+        if (ret < 0)
+            return ret;
+        filter->fields |= RUN_FILTER_STATUS;
+    }
+
+    ret = get_runs_get_param_int32(
+        request, filter, RUN_FILTER_EXIT_CODE, get_runs_key_exit_code, &filter->exit_code
+    );
+    if (ret < 0)
+        return ret;
+    ret = get_runs_get_param_int(
+        request, filter, RUN_FILTER_CREATED_AFTER, get_runs_key_created_after, &value
+    );
+    if (ret < 0)
+        return ret;
+    if (ret)
+        filter->created_after = value;
+    ret = get_runs_get_param_int(
+        request, filter, RUN_FILTER_CREATED_BEFORE, get_runs_key_created_before, &value
+    );
+    if (ret < 0)
+        return ret;
+    if (ret)
+        filter->created_before = value;
+
     return 0;
 }
 
 int response_create_get_runs(
     struct jsonrpc_response** response,
     const struct jsonrpc_request* request,
-    const struct run_queue* runs
+    const struct run_filter* filter,
+    const struct run_queue* runs,
+    int next_id
 ) {
+    struct json_object* result = NULL;
     struct json_object* runs_json = NULL;
     int ret = 0;
 
+    ret = libjson_new_object(&result);
+    if (ret < 0)
+        return ret;
+
     ret = run_queue_to_json(runs, &runs_json);
+    if (ret < 0)
+        goto free_result;
+    ret = libjson_set_const_key(result, get_runs_key_runs, runs_json);
+    if (ret < 0)
+        goto free_runs;
+
+    if (next_id) {
+        const char* key = run_filter_is_ascending(filter) ? get_runs_key_next_after_id
+                                                          : get_runs_key_next_before_id;
+        ret = libjson_set_int_const_key(result, key, next_id);
+        if (ret < 0)
+            goto free_result;
+    }
+
+    ret = jsonrpc_response_create(response, request, result);
+    if (ret < 0)
+        goto free_result;
+
+    return ret;
+
+free_runs:
+    libjson_free(runs_json);
+
+free_result:
+    libjson_free(result);
+
+    return ret;
+}
+
+static const char* const get_run_output_key_run_id = "run_id";
+static const char* const get_run_output_key_offset = "offset";
+static const char* const get_run_output_key_size = "size";
+
+int request_create_get_run_output(
+    struct jsonrpc_request** request,
+    int run_id,
+    size_t offset,
+    size_t size
+) {
+    int ret = 0;
+
+    ret = jsonrpc_request_create(request, jsonrpc_generate_request_id(), CMD_GET_RUN_OUTPUT, NULL);
+    if (ret < 0)
+        return ret;
+    ret = jsonrpc_request_set_param_int(*request, get_run_output_key_run_id, run_id);
+    if (ret < 0)
+        goto free_request;
+    ret = jsonrpc_request_set_param_int(*request, get_run_output_key_offset, (int64_t)offset);
+    if (ret < 0)
+        goto free_request;
+    if (size) {
+        ret = jsonrpc_request_set_param_int(*request, get_run_output_key_size, (int64_t)size);
+        if (ret < 0)
+            goto free_request;
+    }
+
+    return ret;
+
+free_request:
+    jsonrpc_request_destroy(*request);
+
+    return ret;
+}
+
+int request_parse_get_run_output(
+    const struct jsonrpc_request* request,
+    int* _run_id,
+    size_t* _offset,
+    size_t* _size
+) {
+    int ret = 0;
+
+    int64_t run_id = 0;
+    ret = jsonrpc_request_get_param_int(request, get_run_output_key_run_id, &run_id);
+    if (ret < 0)
+        return ret;
+
+    int64_t offset = 0;
+    if (jsonrpc_request_has_param(request, get_run_output_key_offset)) {
+        ret = jsonrpc_request_get_param_int(request, get_run_output_key_offset, &offset);
+        if (ret < 0)
+            return ret;
+        if (offset < 0) {
+            log_err("Invalid output offset: %" PRId64 "\n", offset);
+            return -1;
+        }
+    }
+
+    int64_t size = GET_RUN_OUTPUT_MAX_SIZE;
+    if (jsonrpc_request_has_param(request, get_run_output_key_size)) {
+        ret = jsonrpc_request_get_param_int(request, get_run_output_key_size, &size);
+        if (ret < 0)
+            return ret;
+        if (size < 0) {
+            log_err("Invalid output size: %" PRId64 "\n", size);
+            return -1;
+        }
+        if (size > GET_RUN_OUTPUT_MAX_SIZE)
+            size = GET_RUN_OUTPUT_MAX_SIZE;
+    }
+
+    *_run_id = (int)run_id;
+    *_offset = (size_t)offset;
+    *_size = (size_t)size;
+    return ret;
+}
+
+int response_create_get_run_output(
+    struct jsonrpc_response** response,
+    const struct jsonrpc_request* request,
+    size_t offset,
+    void* data,
+    size_t size
+) {
+    struct json_object* result = NULL;
+    int ret = 0;
+
+    ret = libjson_new_object(&result);
+    if (ret < 0)
+        return ret;
+
+    ret = libjson_set_int_const_key(result, get_run_output_key_offset, (int64_t)offset);
+    if (ret < 0)
+        goto free_result;
+    ret = libjson_set_int_const_key(result, get_run_output_key_size, (int64_t)size);
+    if (ret < 0)
+        goto free_result;
+
+    ret = jsonrpc_response_create(response, request, result);
+    if (ret < 0)
+        goto free_result;
+
+    if (size)
+        jsonrpc_response_set_attachment(*response, data, (uint32_t)size);
+    else
+        free(data);
+    return ret;
+
+free_result:
+    libjson_free(result);
+
+    return ret;
+}
+
+int request_create_get_stats(struct jsonrpc_request** request) {
+    return jsonrpc_request_create(request, jsonrpc_generate_request_id(), CMD_GET_STATS, NULL);
+}
+
+int request_parse_get_stats(UNUSED const struct jsonrpc_request* request) {
+    return 0;
+}
+
+static int net_stats_to_json(const struct net_stats* stats, struct json_object** _json) {
+    struct json_object* json = NULL;
+    int ret = 0;
+
+    ret = libjson_new_object(&json);
+    if (ret < 0)
+        return ret;
+
+    ret = libjson_set_int_const_key(json, "pool_hits", (int64_t)stats->pool_hits);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "pool_misses", (int64_t)stats->pool_misses);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "rejected_msgs", (int64_t)stats->rejected_msgs);
+    if (ret < 0)
+        goto free;
+
+    *_json = json;
+    return ret;
+
+free:
+    libjson_free(json);
+
+    return ret;
+}
+
+static int storage_stats_to_json(const struct storage_stats* stats, struct json_object** _json) {
+    struct json_object* json = NULL;
+    int ret = 0;
+
+    ret = libjson_new_object(&json);
+    if (ret < 0)
+        return ret;
+
+    ret = libjson_set_int_const_key(json, "repo_cache_hits", (int64_t)stats->repo_cache_hits);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "repo_cache_misses", (int64_t)stats->repo_cache_misses);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "prune_passes", (int64_t)stats->prune_passes);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "pruned_runs", (int64_t)stats->pruned_runs);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "pruned_outputs", (int64_t)stats->pruned_outputs);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "reclaimed_bytes", (int64_t)stats->reclaimed_bytes);
+    if (ret < 0)
+        goto free;
+
+    *_json = json;
+    return ret;
+
+free:
+    libjson_free(json);
+
+    return ret;
+}
+
+static int cmd_stats_to_json(const struct cmd_stats* stats, struct json_object** _json) {
+    struct json_object* json = NULL;
+    struct json_object* latency_json = NULL;
+    int ret = 0;
+
+    ret = libjson_new_object(&json);
     if (ret < 0)
         return ret;
 
-    ret = jsonrpc_response_create(response, request, runs_json);
+    ret = libjson_set_int_const_key(json, "calls", (int64_t)stats->numof_calls);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_int_const_key(json, "errors", (int64_t)stats->numof_errors);
+    if (ret < 0)
+        goto free;
+
+    /* Element i is the number of calls that took less than 2^i microseconds (and at least
+     * 2^(i-1)), the last one counts the rest. */
+    ret = libjson_new_array(&latency_json);
+    if (ret < 0)
+        goto free;
+    ret = libjson_set_const_key(json, "latency_us_log2", latency_json);
+    if (ret < 0) {
+        libjson_free(latency_json);
+        goto free;
+    }
+
+    for (size_t i = 0; i < CMD_LATENCY_NUMOF_BUCKETS; ++i) {
+        ret = libjson_append_int(latency_json, (int64_t)stats->latency[i]);
+        if (ret < 0)
+            goto free;
+    }
+
+    *_json = json;
+    return ret;
+
+free:
+    libjson_free(json);
+
+    return ret;
+}
+
+static int cmds_stats_to_json(
+    const struct cmd_stats* stats,
+    size_t numof_cmds,
+    struct json_object** _json
+) {
+    struct json_object* json = NULL;
+    int ret = 0;
+
+    ret = libjson_new_object(&json);
+    if (ret < 0)
+        return ret;
+
+    for (size_t i = 0; i < numof_cmds; ++i) {
+        struct json_object* cmd_json = NULL;
+        ret = cmd_stats_to_json(&stats[i], &cmd_json);
+        if (ret < 0)
+            goto free;
+
+        ret = libjson_set(json, stats[i].name, cmd_json);
+        if (ret < 0) {
+            libjson_free(cmd_json);
+            goto free;
+        }
+    }
+
+    *_json = json;
+    return ret;
+
+free:
+    libjson_free(json);
+
+    return ret;
+}
+
+int response_create_get_stats(
+    struct jsonrpc_response** response,
+    const struct jsonrpc_request* request,
+    const struct net_stats* net_stats,
+    const struct cmd_stats* cmd_stats,
+    size_t numof_cmds,
+    const struct storage_stats* storage_stats
+) {
+    struct json_object* stats_json = NULL;
+    struct json_object* net_json = NULL;
+    struct json_object* cmds_json = NULL;
+    struct json_object* storage_json = NULL;
+    int ret = 0;
+
+    ret = libjson_new_object(&stats_json);
+    if (ret < 0)
+        return ret;
+
+    ret = net_stats_to_json(net_stats, &net_json);
+    if (ret < 0)
+        goto free_json;
+
+    ret = libjson_set_const_key(stats_json, "net", net_json);
+    if (ret < 0) {
+        libjson_free(net_json);
+        goto free_json;
+    }
+
+    ret = cmds_stats_to_json(cmd_stats, numof_cmds, &cmds_json);
+    if (ret < 0)
+        goto free_json;
+
+    ret = libjson_set_const_key(stats_json, "commands", cmds_json);
+    if (ret < 0) {
+        libjson_free(cmds_json);
+        goto free_json;
+    }
+
+    ret = storage_stats_to_json(storage_stats, &storage_json);
+    if (ret < 0)
+        goto free_json;
+
+    ret = libjson_set_const_key(stats_json, "storage", storage_json);
+    if (ret < 0) {
+        libjson_free(storage_json);
+        goto free_json;
+    }
+
+    ret = jsonrpc_response_create(response, request, stats_json);
     if (ret < 0)
         goto free_json;
 
     return ret;
 
 free_json:
-    libjson_free(runs_json);
+    libjson_free(stats_json);
 
     return ret;
 }
@@ -8,9 +8,11 @@
 #ifndef __PROTOCOL_H__
 #define __PROTOCOL_H__
 
+#include "command.h"
 #include "json_rpc.h"
-#include "process.h"
+#include "net.h"
 #include "run_queue.h"
+#include "storage.h"
 
 int request_create_queue_run(struct jsonrpc_request**, const struct run*);
 int request_parse_queue_run(const struct jsonrpc_request*, struct run**);
@@ -21,16 +23,75 @@ int request_parse_new_worker(const struct jsonrpc_request*);
 int request_create_start_run(struct jsonrpc_request**, const struct run*);
 int request_parse_start_run(const struct jsonrpc_request*, struct run**);
 
-int request_create_finished_run(struct jsonrpc_request**, int run_id, const struct process_output*);
-int request_parse_finished_run(const struct jsonrpc_request*, int* run_id, struct process_output**);
+/* The output chunk is sent as a binary attachment. When parsing, the chunk
+ * data points into the request, don't free it. */
+int request_create_run_output(
+    struct jsonrpc_request**,
+    int run_id,
+    const struct run_output_chunk*
+);
+int request_parse_run_output(const struct jsonrpc_request*, int* run_id, struct run_output_chunk*);
+
+int request_create_finished_run(struct jsonrpc_request**, int run_id, int ec);
+int request_parse_finished_run(const struct jsonrpc_request*, int* run_id, int* ec);
+
+int request_create_heartbeat(struct jsonrpc_request**);
+int request_parse_heartbeat(const struct jsonrpc_request*);
 
-int request_create_get_runs(struct jsonrpc_request**);
-int request_parse_get_runs(const struct jsonrpc_request*);
+int request_create_get_runs(struct jsonrpc_request**, const struct run_filter*);
+/* The repository URL points into the request, don't free it. */
+int request_parse_get_runs(const struct jsonrpc_request*, struct run_filter*);
 
+/* If there are more runs past the page, next_id is the cursor to the next
+ * page (either next_before_id or next_after_id, depending on the direction);
+ * otherwise, it's 0. */
 int response_create_get_runs(
     struct jsonrpc_response**,
     const struct jsonrpc_request*,
-    const struct run_queue*
+    const struct run_filter*,
+    const struct run_queue*,
+    int next_id
+);
+
+/* At most this much output is sent in a single response. */
+#define GET_RUN_OUTPUT_MAX_SIZE (1024 * 1024)
+
+/* If the size is 0, it defaults to GET_RUN_OUTPUT_MAX_SIZE. */
+int request_create_get_run_output(
+    struct jsonrpc_request**,
+    int run_id,
+    size_t offset,
+    size_t size
+);
+/* The size is capped at GET_RUN_OUTPUT_MAX_SIZE. */
+int request_parse_get_run_output(
+    const struct jsonrpc_request*,
+    int* run_id,
+    size_t* offset,
+    size_t* size
+);
+
+/* The output is sent as a binary attachment; the response takes ownership of
+ * the data. If fewer bytes than requested are sent, the end of the output has
+ * been reached. */
+int response_create_get_run_output(
+    struct jsonrpc_response**,
+    const struct jsonrpc_request*,
+    size_t offset,
+    void* data,
+    size_t size
+);
+
+int request_create_get_stats(struct jsonrpc_request**);
+int request_parse_get_stats(const struct jsonrpc_request*);
+
+int response_create_get_stats(
+    struct jsonrpc_response**,
+    const struct jsonrpc_request*,
+    const struct net_stats*,
+    const struct cmd_stats*,
+    size_t numof_cmds,
+    const struct storage_stats*
 );
 
 #endif
@@ -16,6 +16,30 @@
 #include <string.h>
 #include <sys/queue.h>
 
+const char* run_status_to_string(enum run_status status) {
+    switch (status) {
+        case RUN_STATUS_CREATED:
+            return "created";
+        case RUN_STATUS_FINISHED:
+            return "finished";
+    }
+    return "unknown";
+}
+
+int run_status_from_string(const char* src, enum run_status* status) {
+    if (!strcmp(src, "created")) {
+        *status = RUN_STATUS_CREATED;
+        return 0;
+    }
+    if (!strcmp(src, "finished")) {
+        *status = RUN_STATUS_FINISHED;
+        return 0;
+    }
+
+    log_err("Invalid run status: %s\n", src);
+    return -1;
+}
+
 struct run {
     int id;
     char* repo_url;
@@ -192,3 +216,11 @@ struct run* run_queue_remove_first(struct run_queue* queue) {
     SIMPLEQ_REMOVE_HEAD(queue, entries);
     return entry;
 }
+
+void run_filter_init(struct run_filter* filter) {
+    memset(filter, 0, sizeof(*filter));
+}
+
+int run_filter_is_ascending(const struct run_filter* filter) {
+    return (filter->fields & RUN_FILTER_AFTER_ID) && !(filter->fields & RUN_FILTER_BEFORE_ID);
+}
@@ -8,8 +8,12 @@
 #ifndef __RUN_QUEUE_H__
 #define __RUN_QUEUE_H__
 
+#include "codec.h"
+
 #include <json-c/json_object.h>
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/queue.h>
 
 enum run_status {
@@ -17,8 +21,23 @@ enum run_status {
     RUN_STATUS_FINISHED = 2,
 };
 
+const char* run_status_to_string(enum run_status);
+int run_status_from_string(const char*, enum run_status*);
+
 struct run;
 
+/* A piece of the run's output, as it was produced by the CI script. */
+struct run_output_chunk {
+    /* The position of the chunk in the uncompressed output. */
+    size_t offset;
+    size_t size;
+
+    /* The chunk data as it's sent and stored, i.e. possibly compressed. */
+    enum codec codec;
+    const void* data;
+    size_t data_size;
+};
+
 int run_new(
     struct run**,
     int id,
@@ -54,4 +73,43 @@ void run_queue_add_last(struct run_queue*, struct run*);
 
 struct run* run_queue_remove_first(struct run_queue*);
 
+/* Runs are listed a page at a time, newest first. Only the fields that are
+ * set restrict the selection. */
+enum run_filter_field {
+    RUN_FILTER_BEFORE_ID = 1 << 0,
+    RUN_FILTER_AFTER_ID = 1 << 1,
+    RUN_FILTER_REPO_URL = 1 << 2,
+    RUN_FILTER_STATUS = 1 << 3,
+    RUN_FILTER_EXIT_CODE = 1 << 4,
+    RUN_FILTER_CREATED_AFTER = 1 << 5,
+    RUN_FILTER_CREATED_BEFORE = 1 << 6,
+};
+
+#define RUN_FILTER_NUMOF_FIELDS 7
+
+struct run_filter {
+    /* A combination of run_filter_field values. */
+    unsigned int fields;
+    /* 0 means no limit. */
+    size_t limit;
+
+    /* The keyset cursor: the IDs of the runs adjacent to the page. */
+    int before_id;
+    int after_id;
+
+    const char* repo_url;
+    enum run_status status;
+    int exit_code;
+    /* Unix time. */
+    int64_t created_after;
+    int64_t created_before;
+};
+
+void run_filter_init(struct run_filter*);
+
+/* If only after_id is set, the page is the oldest runs after it (and the next
+ * page is newer). Otherwise, it's the newest runs before before_id (and the
+ * next page is older). */
+int run_filter_is_ascending(const struct run_filter*);
+
 #endif
@@ -7,19 +7,19 @@
 
 #include "server.h"
 
+#include "codec.h"
 #include "command.h"
 #include "compiler.h"
 #include "const.h"
 #include "event_loop.h"
-#include "file.h"
 #include "json_rpc.h"
 #include "log.h"
 #include "net.h"
-#include "process.h"
 #include "protocol.h"
 #include "run_queue.h"
 #include "signal.h"
 #include "storage.h"
+#include "storage_memory.h"
 #include "storage_sqlite.h"
 #include "tcp_server.h"
 #include "worker_queue.h"
@@ -40,6 +40,8 @@ struct server {
     int signalfd;
 
     struct worker_queue worker_queue;
+    /* Workers that have been assigned a run. */
+    struct worker_queue busy_workers;
     struct run_queue run_queue;
 
     struct storage storage;
@@ -95,6 +97,28 @@ static int server_set_stopping(
     return ret;
 }
 
+/* How often the connection statistics are logged. */
+#define SERVER_STATS_INTERVAL_MS (60 * 1000)
+
+static int server_log_stats(UNUSED struct event_loop* loop, UNUSED int timer, void* _server) {
+    struct server* server = (struct server*)_server;
+    struct tcp_server_stats stats;
+    int ret = 0;
+
+    ret = tcp_server_get_stats(server->tcp_server, &stats);
+    if (ret < 0)
+        return ret;
+
+    log_debug(
+        "Connections: %llu accepted, %llu rejected, queue depth %zu (max %zu)\n",
+        stats.numof_accepted,
+        stats.numof_rejected,
+        stats.queue_depth,
+        stats.max_queue_depth
+    );
+    return ret;
+}
+
 static int server_has_workers(const struct server* server) {
     return !worker_queue_is_empty(&server->worker_queue);
 }
@@ -114,6 +138,58 @@ static int server_enqueue_worker(struct server* server, struct worker* worker) {
     return ret;
 }
 
+/* Called once a worker has reported the result of its run. */
+static int server_release_worker(struct server* server, int conn_fd) {
+    int ret = 0;
+
+    ret = server_lock(server);
+    if (ret < 0)
+        return ret;
+
+    struct worker* worker = worker_queue_remove_conn(&server->busy_workers, conn_fd);
+    if (!worker) {
+        log_err("Connection %d doesn't belong to a busy worker\n", conn_fd);
+        ret = -1;
+        goto unlock;
+    }
+
+    worker_queue_add_last(&server->worker_queue, worker);
+    log("Worker %d is ready for a new run\n", worker_get_fd(worker));
+
+    server_notify(server);
+
+unlock:
+    server_unlock(server);
+    return ret;
+}
+
+static void server_handle_conn_closed(int conn_fd, void* _server) {
+    struct server* server = (struct server*)_server;
+
+    if (server_lock(server) < 0)
+        return;
+
+    struct worker* worker = worker_queue_remove_conn(&server->worker_queue, conn_fd);
+    if (worker) {
+        log("Worker %d has disconnected\n", worker_get_fd(worker));
+        goto destroy_worker;
+    }
+
+    worker = worker_queue_remove_conn(&server->busy_workers, conn_fd);
+    if (worker) {
+        log_err("Worker %d has disconnected before finishing its run\n", worker_get_fd(worker));
+        goto destroy_worker;
+    }
+
+    goto unlock;
+
+destroy_worker:
+    worker_destroy(worker);
+
+unlock:
+    server_unlock(server);
+}
+
 static int server_has_runs(const struct server* server) {
     return !run_queue_is_empty(&server->run_queue);
 }
@@ -140,6 +216,29 @@ static int server_enqueue_run(struct server* server, struct run* run) {
     return ret;
 }
 
+static int server_enqueue_run_batch(struct server* server, struct run** runs, size_t numof_runs) {
+    int ret = 0;
+
+    ret = storage_run_create_batch(&server->storage, runs, numof_runs);
+    if (ret < 0)
+        return ret;
+
+    ret = server_lock(server);
+    if (ret < 0)
+        return ret;
+
+    for (size_t i = 0; i < numof_runs; ++i) {
+        run_queue_add_last(&server->run_queue, runs[i]);
+        log("Added a new run %d for repository %s to the queue\n",
+            run_get_id(runs[i]),
+            run_get_repo_url(runs[i]));
+    }
+
+    server_notify(server);
+    server_unlock(server);
+    return ret;
+}
+
 static int server_ready_for_action(const struct server* server) {
     return server->stopping || (server_has_runs(server) && server_has_workers(server));
 }
@@ -166,32 +265,45 @@ static void server_assign_run(struct server* server) {
     log("Removed worker %d from the queue\n", worker_get_fd(worker));
 
     struct jsonrpc_request* start_request = NULL;
+    struct buf* start_msg = NULL;
     int ret = 0;
 
     ret = request_create_start_run(&start_request, run);
     if (ret < 0)
         goto exit;
 
-    ret = jsonrpc_request_send(start_request, worker_get_fd(worker));
+    jsonrpc_request_set_encoding(start_request, worker_get_encoding(worker));
+
+    ret = jsonrpc_request_to_buf(start_request, &start_msg);
     jsonrpc_request_destroy(start_request);
     if (ret < 0)
         goto exit;
 
+    /* This doesn't block: the request is queued, and it's the event loop that
+     * owns the connection that sends it (after the lock is released). It's
+     * queued under the lock though, so that the connection can't be closed
+     * (and the descriptor reused) in the meantime; see
+     * server_handle_conn_closed. */
+    ret = tcp_server_send(server->tcp_server, worker_get_fd(worker), start_msg);
+    if (ret < 0)
+        goto exit;
+
 exit:
     if (ret < 0) {
         log("Failed to assign run for repository %s to worker %d, requeueing\n",
             run_get_repo_url(run),
             worker_get_fd(worker));
         run_queue_add_first(&server->run_queue, run);
+        worker_destroy(worker);
     } else {
         log("Assigned run %d for repository %s to worker %d\n",
             run_get_id(run),
             run_get_repo_url(run),
             worker_get_fd(worker));
         run_destroy(run);
+        /* The worker is back in the queue once it reports the result. */
+        worker_queue_add_last(&server->busy_workers, worker);
     }
-
-    worker_destroy(worker);
 }
 
 static void* server_main_thread(void* _server) {
@@ -221,7 +333,7 @@ exit:
 }
 
 static int server_handle_cmd_new_worker(
-    UNUSED const struct jsonrpc_request* request,
+    const struct jsonrpc_request* request,
     UNUSED struct jsonrpc_response** response,
     void* _ctx
 ) {
@@ -229,29 +341,25 @@ static int server_handle_cmd_new_worker(
     struct server* server = (struct server*)ctx->arg;
     int ret = 0;
 
-    ret = file_dup(ctx->fd);
-    if (ret < 0)
-        return ret;
-
-    const int fd = ret;
+    /* The worker keeps the connection open for as long as it runs. It's idle
+     * in between runs, so it shouldn't occupy a handler thread; runs are
+     * assigned from the main thread using tcp_server_send. */
     struct worker* worker = NULL;
 
-    ret = worker_create(&worker, fd);
+    ret = worker_create(&worker, ctx->fd, jsonrpc_request_get_encoding(request));
     if (ret < 0)
-        goto close;
+        return ret;
 
     ret = server_enqueue_worker(server, worker);
     if (ret < 0)
         goto destroy_worker;
 
+    ctx->idle_conn = 1;
     return ret;
 
 destroy_worker:
     worker_destroy(worker);
 
-close:
-    net_close(fd);
-
     return ret;
 }
 
@@ -290,6 +398,86 @@ destroy_run:
     return ret;
 }
 
+/* The runs from a batch are inserted in a single transaction. */
+static int server_handle_cmd_queue_run_batch(
+    const struct jsonrpc_request* const* requests,
+    size_t numof_requests,
+    struct jsonrpc_response** responses,
+    void* _ctx
+) {
+    struct cmd_conn_ctx* ctx = (struct cmd_conn_ctx*)_ctx;
+    struct server* server = (struct server*)ctx->arg;
+    size_t numof_runs = 0;
+    int ret = 0;
+
+    struct run** runs = calloc(numof_requests, sizeof(struct run*));
+    if (!runs) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    for (numof_runs = 0; numof_runs < numof_requests; ++numof_runs) {
+        ret = request_parse_queue_run(requests[numof_runs], &runs[numof_runs]);
+        if (ret < 0)
+            goto destroy_runs;
+    }
+
+    ret = server_enqueue_run_batch(server, runs, numof_runs);
+    if (ret < 0)
+        goto destroy_runs;
+
+    /* The runs are owned by the queue now. */
+    free(runs);
+
+    for (size_t i = 0; i < numof_requests; ++i) {
+        ret = jsonrpc_response_create(&responses[i], requests[i], NULL);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret;
+
+destroy_runs:
+    for (size_t i = 0; i < numof_runs; ++i)
+        run_destroy(runs[i]);
+    free(runs);
+
+    return ret;
+}
+
+static int server_handle_cmd_run_output(
+    const struct jsonrpc_request* request,
+    UNUSED struct jsonrpc_response** response,
+    void* _ctx
+) {
+    struct cmd_conn_ctx* ctx = (struct cmd_conn_ctx*)_ctx;
+    struct server* server = (struct server*)ctx->arg;
+    int ret = 0;
+
+    int run_id = 0;
+    struct run_output_chunk chunk;
+
+    ret = request_parse_run_output(request, &run_id, &chunk);
+    if (ret < 0)
+        return ret;
+
+    ret = storage_run_output_append(&server->storage, run_id, &chunk);
+    if (ret < 0) {
+        log_err("Failed to save output of run %d\n", run_id);
+        return ret;
+    }
+
+    log_debug(
+        "Saved %zu bytes of output of run %d at offset %zu (%s, %zu bytes)\n",
+        chunk.size,
+        run_id,
+        chunk.offset,
+        codec_to_string(chunk.codec),
+        chunk.data_size
+    );
+    return ret;
+}
+
 static int server_handle_cmd_finished_run(
     const struct jsonrpc_request* request,
     UNUSED struct jsonrpc_response** response,
@@ -300,23 +488,36 @@ static int server_handle_cmd_finished_run(
     int ret = 0;
 
     int run_id = 0;
-    struct process_output* output;
+    int ec = -1;
 
-    ret = request_parse_finished_run(request, &run_id, &output);
+    ret = request_parse_finished_run(request, &run_id, &ec);
     if (ret < 0)
         return ret;
 
-    ret = storage_run_finished(&server->storage, run_id, output);
+    ret = storage_run_finished(&server->storage, run_id, ec);
     if (ret < 0) {
         log_err("Failed to mark run %d as finished\n", run_id);
-        goto free_output;
+        return ret;
     }
 
     log("Marked run %d as finished\n", run_id);
 
-free_output:
-    process_output_destroy(output);
+    return server_release_worker(server, ctx->fd);
+}
+
+static int server_handle_cmd_heartbeat(
+    const struct jsonrpc_request* request,
+    UNUSED struct jsonrpc_response** response,
+    void* _ctx
+) {
+    struct cmd_conn_ctx* ctx = (struct cmd_conn_ctx*)_ctx;
+    int ret = 0;
 
+    ret = request_parse_heartbeat(request);
+    if (ret < 0)
+        return ret;
+
+    log_debug("Received a heartbeat on connection %d\n", ctx->fd);
     return ret;
 }
 
@@ -329,19 +530,22 @@ static int server_handle_cmd_get_runs(
     struct server* server = (struct server*)ctx->arg;
     int ret = 0;
 
-    ret = request_parse_get_runs(request);
+    struct run_filter filter;
+
+    ret = request_parse_get_runs(request, &filter);
     if (ret < 0)
         return ret;
 
     struct run_queue runs;
+    int next_id = 0;
 
-    ret = storage_get_runs(&server->storage, &runs);
+    ret = storage_get_runs(&server->storage, &filter, &runs, &next_id);
     if (ret < 0) {
         log_err("Failed to fetch runs\n");
         return ret;
     }
 
-    ret = response_create_get_runs(response, request, &runs);
+    ret = response_create_get_runs(response, request, &filter, &runs, next_id);
     if (ret < 0)
         goto destroy_runs;
 
@@ -351,17 +555,113 @@ destroy_runs:
     return ret;
 }
 
+static int server_handle_cmd_get_run_output(
+    const struct jsonrpc_request* request,
+    struct jsonrpc_response** response,
+    void* _ctx
+) {
+    struct cmd_conn_ctx* ctx = (struct cmd_conn_ctx*)_ctx;
+    struct server* server = (struct server*)ctx->arg;
+    int ret = 0;
+
+    int run_id = 0;
+    size_t offset = 0;
+    size_t size = 0;
+
+    ret = request_parse_get_run_output(request, &run_id, &offset, &size);
+    if (ret < 0)
+        return ret;
+
+    /* The buffer is attached to the response, which frees it. */
+    void* data = malloc(size ? size : 1);
+    if (!data) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    size_t read = 0;
+    ret = storage_run_output_read(&server->storage, run_id, offset, data, size, &read);
+    if (ret < 0) {
+        log_err("Failed to read output of run %d\n", run_id);
+        goto free;
+    }
+
+    ret = response_create_get_run_output(response, request, offset, data, read);
+    if (ret < 0)
+        goto free;
+
+    return ret;
+
+free:
+    free(data);
+
+    return ret;
+}
+
+static int server_handle_cmd_get_stats(
+    const struct jsonrpc_request* request,
+    struct jsonrpc_response** response,
+    void* _ctx
+) {
+    struct cmd_conn_ctx* ctx = (struct cmd_conn_ctx*)_ctx;
+    struct server* server = (struct server*)ctx->arg;
+    int ret = 0;
+
+    ret = request_parse_get_stats(request);
+    if (ret < 0)
+        return ret;
+
+    struct net_stats net_stats;
+    net_get_stats(&net_stats);
+
+    const size_t numof_cmds = cmd_dispatcher_get_numof_cmds(server->cmd_dispatcher);
+    struct cmd_stats* cmd_stats = calloc(numof_cmds, sizeof(struct cmd_stats));
+    if (!cmd_stats) {
+        log_errno("calloc");
+        return -1;
+    }
+    cmd_dispatcher_get_stats(server->cmd_dispatcher, cmd_stats);
+
+    struct storage_stats storage_stats;
+    storage_get_stats(&server->storage, &storage_stats);
+
+    ret = response_create_get_stats(
+        response,
+        request,
+        &net_stats,
+        cmd_stats,
+        numof_cmds,
+        &storage_stats
+    );
+    free(cmd_stats);
+    return ret;
+}
+
 static struct cmd_desc commands[] = {
-    {CMD_NEW_WORKER, server_handle_cmd_new_worker},
-    {CMD_QUEUE_RUN, server_handle_cmd_queue_run},
-    {CMD_FINISHED_RUN, server_handle_cmd_finished_run},
-    {CMD_GET_RUNS, server_handle_cmd_get_runs},
+    {CMD_NEW_WORKER, server_handle_cmd_new_worker, NULL},
+    {CMD_QUEUE_RUN, server_handle_cmd_queue_run, server_handle_cmd_queue_run_batch},
+    {CMD_RUN_OUTPUT, server_handle_cmd_run_output, NULL},
+    {CMD_FINISHED_RUN, server_handle_cmd_finished_run, NULL},
+    {CMD_GET_RUNS, server_handle_cmd_get_runs, NULL},
+    {CMD_GET_RUN_OUTPUT, server_handle_cmd_get_run_output, NULL},
+    {CMD_GET_STATS, server_handle_cmd_get_stats, NULL},
+    {CMD_HEARTBEAT, server_handle_cmd_heartbeat, NULL},
 };
 
 static const size_t numof_commands = sizeof(commands) / sizeof(commands[0]);
 
 int server_create(struct server** _server, const struct settings* settings) {
     struct storage_settings storage_settings;
+    const struct storage_sqlite_pragmas sqlite_pragmas = {
+        .synchronous = settings->sqlite_synchronous,
+        .cache_size = settings->sqlite_cache_size,
+        .mmap_size = settings->sqlite_mmap_size,
+    };
+    const struct storage_sqlite_retention sqlite_retention = {
+        .keep_runs = settings->keep_runs,
+        .keep_output_days = settings->keep_output_days,
+        .interval_s = settings->maintenance_interval_s,
+    };
     int ret = 0;
 
     struct server* server = malloc(sizeof(struct server));
@@ -384,9 +684,12 @@ int server_create(struct server** _server, const struct settings* settings) {
 
     server->stopping = 0;
 
+    net_set_max_msg_size(settings->max_msg_size);
+
     ret = cmd_dispatcher_create(&server->cmd_dispatcher, commands, numof_commands, server);
     if (ret < 0)
         goto destroy_cv;
+    cmd_dispatcher_set_close_handler(server->cmd_dispatcher, server_handle_conn_closed);
 
     ret = event_loop_create(&server->event_loop);
     if (ret < 0)
@@ -402,8 +705,18 @@ int server_create(struct server** _server, const struct settings* settings) {
         goto close_signalfd;
 
     worker_queue_create(&server->worker_queue);
-
-    ret = storage_sqlite_settings_create(&storage_settings, settings->sqlite_path);
+    worker_queue_create(&server->busy_workers);
+
+    if (settings->storage_type == STORAGE_TYPE_MEMORY)
+        ret = storage_memory_settings_create(&storage_settings);
+    else
+        ret = storage_sqlite_settings_create(
+            &storage_settings,
+            settings->sqlite_path,
+            settings->blob_dir,
+            &sqlite_pragmas,
+            &sqlite_retention
+        );
     if (ret < 0)
         goto destroy_worker_queue;
 
@@ -420,12 +733,23 @@ int server_create(struct server** _server, const struct settings* settings) {
         &server->tcp_server,
         server->event_loop,
         settings->port,
+        settings->numof_acceptors,
+        settings->numof_threads,
         cmd_dispatcher_handle_conn,
+        cmd_dispatcher_handle_msg,
+        cmd_dispatcher_handle_close,
         server->cmd_dispatcher
     );
     if (ret < 0)
         goto destroy_run_queue;
 
+    /* The timer is owned by the event loop. */
+    ret = event_loop_add_periodic_timer(
+        server->event_loop, SERVER_STATS_INTERVAL_MS, server_log_stats, server
+    );
+    if (ret < 0)
+        goto destroy_tcp_server;
+
     ret = pthread_create(&server->main_thread, NULL, server_main_thread, server);
     if (ret) {
         pthread_errno(ret, "pthread_create");
@@ -445,6 +769,7 @@ destroy_storage:
     storage_destroy(&server->storage);
 
 destroy_worker_queue:
+    worker_queue_destroy(&server->busy_workers);
     worker_queue_destroy(&server->worker_queue);
 
 close_signalfd:
@@ -475,6 +800,7 @@ void server_destroy(struct server* server) {
     tcp_server_destroy(server->tcp_server);
     storage_destroy(&server->storage);
     run_queue_destroy(&server->run_queue);
+    worker_queue_destroy(&server->busy_workers);
     worker_queue_destroy(&server->worker_queue);
     signalfd_destroy(server->signalfd);
     event_loop_destroy(server->event_loop);
@@ -8,10 +8,30 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include "storage.h"
+
+#include <stdint.h>
+
 struct settings {
     const char* port;
+    unsigned numof_acceptors;
+    unsigned numof_threads;
+    /* Larger incoming messages are rejected. */
+    uint32_t max_msg_size;
 
+    enum storage_type storage_type;
+    /* The rest only apply to the SQLite storage. */
     const char* sqlite_path;
+    /* See storage_sqlite_pragmas. */
+    const char* sqlite_synchronous;
+    int sqlite_cache_size;
+    int64_t sqlite_mmap_size;
+    /* Run outputs are stored here; NULL means next to the database. */
+    const char* blob_dir;
+    /* See storage_sqlite_retention. */
+    unsigned keep_runs;
+    unsigned keep_output_days;
+    unsigned maintenance_interval_s;
 };
 
 struct server;
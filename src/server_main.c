@@ -8,21 +8,138 @@
 #include "cmd_line.h"
 #include "const.h"
 #include "log.h"
+#include "net.h"
 #include "server.h"
+#include "storage.h"
+#include "string.h"
 
 #include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
 #include <unistd.h>
 
 static struct settings default_settings(void) {
     struct settings settings = {
         .port = default_port,
+        .numof_acceptors = 1,
+        .numof_threads = 16,
+        .max_msg_size = NET_DEFAULT_MAX_MSG_SIZE,
+        .storage_type = STORAGE_TYPE_SQLITE,
         .sqlite_path = default_sqlite_path,
+        /* NORMAL is durable enough in WAL mode, only the last transactions
+         * might be rolled back after a power loss. */
+        .sqlite_synchronous = "NORMAL",
+        /* These are SQLite's defaults. */
+        .sqlite_cache_size = -2000,
+        .sqlite_mmap_size = 0,
+        .blob_dir = NULL,
+        /* Everything is kept by default. */
+        .keep_runs = 0,
+        .keep_output_days = 0,
+        .maintenance_interval_s = 3600,
     };
     return settings;
 }
 
 const char* get_usage_string(void) {
-    return "[-h|--help] [-V|--version] [-v|--verbose] [-p|--port PORT] [-s|--sqlite PATH]";
+    return "[-h|--help] [-V|--version] [-v|--verbose] [-p|--port PORT] [-a|--acceptors NUM] [-t|--threads NUM] [-m|--max-message-size BYTES] [-T|--storage TYPE] [-s|--sqlite PATH] [-S|--sqlite-synchronous MODE] [-C|--sqlite-cache-size NUM] [-M|--sqlite-mmap-size BYTES] [-B|--blob-dir DIR] [-R|--keep-runs NUM] [-O|--keep-output-days DAYS] [-I|--maintenance-interval SECONDS]";
+}
+
+static unsigned parse_numof_acceptors(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0 || result <= 0)
+        exit_with_usage_err("number of acceptors must be a positive integer");
+
+    return (unsigned)result;
+}
+
+/* 0 means that connections are handled on the event loop thread. */
+static unsigned parse_numof_threads(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0 || result < 0)
+        exit_with_usage_err("number of threads must be a non-negative integer");
+
+    return (unsigned)result;
+}
+
+static uint32_t parse_max_msg_size(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0 || result <= 0)
+        exit_with_usage_err("maximum message size must be a positive integer");
+
+    return (uint32_t)result;
+}
+
+static enum storage_type parse_storage_type(const char* src) {
+    if (!strcasecmp(src, "sqlite"))
+        return STORAGE_TYPE_SQLITE;
+    if (!strcasecmp(src, "memory"))
+        return STORAGE_TYPE_MEMORY;
+
+    exit_with_usage_err("storage type must be either sqlite or memory");
+    return STORAGE_TYPE_SQLITE;
+}
+
+static const char* parse_sqlite_synchronous(const char* src) {
+    static const char* const modes[] = {"OFF", "NORMAL", "FULL", "EXTRA"};
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+        if (!strcasecmp(src, modes[i]))
+            return modes[i];
+
+    exit_with_usage_err("synchronous mode must be one of OFF, NORMAL, FULL or EXTRA");
+    return NULL;
+}
+
+/* Same as PRAGMA cache_size: negative values are in KiB, positive are in pages. */
+static int parse_sqlite_cache_size(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0)
+        exit_with_usage_err("cache size must be an integer");
+
+    return result;
+}
+
+static int64_t parse_sqlite_mmap_size(const char* src) {
+    int64_t result = 0;
+
+    if (string_to_int64(src, &result) < 0 || result < 0)
+        exit_with_usage_err("mmap size must be a non-negative integer");
+
+    return result;
+}
+
+/* 0 means that everything is kept. */
+static unsigned parse_keep_runs(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0 || result < 0)
+        exit_with_usage_err("number of runs to keep must be a non-negative integer");
+
+    return (unsigned)result;
+}
+
+static unsigned parse_keep_output_days(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0 || result < 0)
+        exit_with_usage_err("number of days to keep outputs for must be a non-negative integer");
+
+    return (unsigned)result;
+}
+
+static unsigned parse_maintenance_interval(const char* src) {
+    int result = 0;
+
+    if (string_to_int(src, &result) < 0 || result <= 0)
+        exit_with_usage_err("maintenance interval must be a positive integer");
+
+    return (unsigned)result;
 }
 
 static int parse_settings(struct settings* settings, int argc, char* argv[]) {
@@ -36,12 +153,25 @@ static int parse_settings(struct settings* settings, int argc, char* argv[]) {
 	    {"version", no_argument, 0, 'V'},
 	    {"verbose", no_argument, 0, 'v'},
 	    {"port", required_argument, 0, 'p'},
+	    {"acceptors", required_argument, 0, 'a'},
+	    {"threads", required_argument, 0, 't'},
+	    {"max-message-size", required_argument, 0, 'm'},
+	    {"storage", required_argument, 0, 'T'},
 	    {"sqlite", required_argument, 0, 's'},
+	    {"sqlite-synchronous", required_argument, 0, 'S'},
+	    {"sqlite-cache-size", required_argument, 0, 'C'},
+	    {"sqlite-mmap-size", required_argument, 0, 'M'},
+	    {"blob-dir", required_argument, 0, 'B'},
+	    {"keep-runs", required_argument, 0, 'R'},
+	    {"keep-output-days", required_argument, 0, 'O'},
+	    {"maintenance-interval", required_argument, 0, 'I'},
 	    {0, 0, 0, 0},
 	};
     /* clang-format on */
 
-    while ((opt = getopt_long(argc, argv, "hVvp:s:", long_options, &longind)) != -1) {
+    while ((opt = getopt_long(
+                argc, argv, "hVvp:a:t:m:T:s:S:C:M:B:R:O:I:", long_options, &longind
+            )) != -1) {
         switch (opt) {
             case 'h':
                 exit_with_usage(0);
@@ -55,9 +185,42 @@ static int parse_settings(struct settings* settings, int argc, char* argv[]) {
             case 'p':
                 settings->port = optarg;
                 break;
+            case 'a':
+                settings->numof_acceptors = parse_numof_acceptors(optarg);
+                break;
+            case 't':
+                settings->numof_threads = parse_numof_threads(optarg);
+                break;
+            case 'm':
+                settings->max_msg_size = parse_max_msg_size(optarg);
+                break;
+            case 'T':
+                settings->storage_type = parse_storage_type(optarg);
+                break;
             case 's':
                 settings->sqlite_path = optarg;
                 break;
+            case 'S':
+                settings->sqlite_synchronous = parse_sqlite_synchronous(optarg);
+                break;
+            case 'C':
+                settings->sqlite_cache_size = parse_sqlite_cache_size(optarg);
+                break;
+            case 'M':
+                settings->sqlite_mmap_size = parse_sqlite_mmap_size(optarg);
+                break;
+            case 'B':
+                settings->blob_dir = optarg;
+                break;
+            case 'R':
+                settings->keep_runs = parse_keep_runs(optarg);
+                break;
+            case 'O':
+                settings->keep_output_days = parse_keep_output_days(optarg);
+                break;
+            case 'I':
+                settings->maintenance_interval_s = parse_maintenance_interval(optarg);
+                break;
             default:
                 exit_with_usage(1);
                 break;
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+/* SHA-256 as specified in FIPS 180-4. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+/* The hex-encoded digest, including the terminating null character. */
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t size;
+    unsigned char block[64];
+};
+
+void sha256_init(struct sha256*);
+void sha256_update(struct sha256*, const void* data, size_t size);
+void sha256_final(struct sha256*, char hex[SHA256_HEX_SIZE]);
+
+#endif
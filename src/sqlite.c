@@ -13,9 +13,11 @@
 #include <sqlite3.h>
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #define sqlite_errno(var, fn)                         \
     do {                                              \
@@ -139,13 +141,19 @@ int sqlite_column_int(sqlite3_stmt* stmt, int index) {
     return sqlite3_column_int(stmt, index);
 }
 
+sqlite3_int64 sqlite_column_int64(sqlite3_stmt* stmt, int index) {
+    return sqlite3_column_int64(stmt, index);
+}
+
 int sqlite_column_text(sqlite3_stmt* stmt, int index, char** _result) {
     int ret = 0;
 
     const unsigned char* value = sqlite3_column_text(stmt, index);
     if (!value) {
+        /* NULL is also returned for NULL values, in which case the error code
+         * is left over from the last step. */
         ret = sqlite3_errcode(sqlite3_db_handle(stmt));
-        if (ret) {
+        if (ret == SQLITE_NOMEM) {
             sqlite_errno(ret, "sqlite3_column_text");
             return ret;
         }
@@ -174,8 +182,8 @@ int sqlite_column_blob(sqlite3_stmt* stmt, int index, unsigned char** _result) {
     const unsigned char* value = sqlite3_column_blob(stmt, index);
     if (!value) {
         ret = sqlite3_errcode(sqlite3_db_handle(stmt));
-        if (ret) {
-            sqlite_errno(ret, "sqlite3_column_text");
+        if (ret == SQLITE_NOMEM) {
+            sqlite_errno(ret, "sqlite3_column_blob");
             return ret;
         }
 
@@ -197,6 +205,24 @@ int sqlite_column_blob(sqlite3_stmt* stmt, int index, unsigned char** _result) {
     return 0;
 }
 
+int sqlite_column_blob_ref(sqlite3_stmt* stmt, int index, const void** data, size_t* size) {
+    int ret = 0;
+
+    /* NULL is also returned for empty blobs, in which case it's not an error. */
+    const void* value = sqlite3_column_blob(stmt, index);
+    if (!value) {
+        ret = sqlite3_errcode(sqlite3_db_handle(stmt));
+        if (ret == SQLITE_NOMEM) {
+            sqlite_errno(ret, "sqlite3_column_blob");
+            return -1;
+        }
+    }
+
+    *data = value;
+    *size = (size_t)sqlite3_column_bytes(stmt, index);
+    return 0;
+}
+
 int sqlite_bind_int(sqlite3_stmt* stmt, int index, int value) {
     int ret = 0;
 
@@ -209,6 +235,18 @@ int sqlite_bind_int(sqlite3_stmt* stmt, int index, int value) {
     return ret;
 }
 
+int sqlite_bind_int64(sqlite3_stmt* stmt, int index, sqlite3_int64 value) {
+    int ret = 0;
+
+    ret = sqlite3_bind_int64(stmt, index, value);
+    if (ret) {
+        sqlite_errno(ret, "sqlite3_bind_int64");
+        return ret;
+    }
+
+    return ret;
+}
+
 int sqlite_bind_text(sqlite3_stmt* stmt, int index, const char* value) {
     int ret = 0;
 
@@ -221,9 +259,19 @@ int sqlite_bind_text(sqlite3_stmt* stmt, int index, const char* value) {
     return ret;
 }
 
-int sqlite_bind_blob(sqlite3_stmt* stmt, int index, unsigned char* value, size_t nb) {
+int sqlite_bind_blob(sqlite3_stmt* stmt, int index, const void* value, size_t nb) {
     int ret = 0;
 
+    /* A NULL pointer would be bound as NULL instead of an empty blob. */
+    if (!nb) {
+        ret = sqlite3_bind_zeroblob64(stmt, index, 0);
+        if (ret) {
+            sqlite_errno(ret, "sqlite3_bind_zeroblob64");
+            return ret;
+        }
+        return ret;
+    }
+
     ret = sqlite3_bind_blob64(stmt, index, value, nb, SQLITE_STATIC);
     if (ret) {
         sqlite_errno(ret, "sqlite3_bind_blob64");
@@ -233,6 +281,44 @@ int sqlite_bind_blob(sqlite3_stmt* stmt, int index, unsigned char* value, size_t
     return ret;
 }
 
+int sqlite_blob_open_ro(
+    sqlite3* db,
+    const char* table,
+    const char* column,
+    sqlite3_int64 row,
+    sqlite3_blob** blob
+) {
+    int ret = 0;
+
+    ret = sqlite3_blob_open(db, "main", table, column, row, 0, blob);
+    if (ret) {
+        sqlite_errno(ret, "sqlite3_blob_open");
+        return ret;
+    }
+
+    return ret;
+}
+
+void sqlite_blob_close(sqlite3_blob* blob) {
+    sqlite_errno_if(sqlite3_blob_close(blob), "sqlite3_blob_close");
+}
+
+size_t sqlite_blob_size(sqlite3_blob* blob) {
+    return (size_t)sqlite3_blob_bytes(blob);
+}
+
+int sqlite_blob_read(sqlite3_blob* blob, void* buf, size_t size, size_t offset) {
+    int ret = 0;
+
+    ret = sqlite3_blob_read(blob, buf, (int)size, (int)offset);
+    if (ret) {
+        sqlite_errno(ret, "sqlite3_blob_read");
+        return ret;
+    }
+
+    return ret;
+}
+
 int sqlite_exec_as_transaction(sqlite3* db, const char* stmt) {
     static const char* const fmt = "BEGIN; %s COMMIT;";
     int ret = 0;
@@ -257,6 +343,44 @@ free:
     return ret;
 }
 
+int sqlite_begin(sqlite3* db) {
+    static const char* const sql = "BEGIN;";
+    return sqlite_exec(db, sql, NULL, NULL);
+}
+
+int sqlite_commit(sqlite3* db) {
+    static const char* const sql = "COMMIT;";
+    return sqlite_exec(db, sql, NULL, NULL);
+}
+
+void sqlite_rollback(sqlite3* db) {
+    static const char* const sql = "ROLLBACK;";
+    sqlite_exec(db, sql, NULL, NULL);
+}
+
+static int sqlite_exec_savepoint(sqlite3* db, const char* fmt, const char* name) {
+    char sql[128];
+    int ret = snprintf(sql, sizeof(sql), fmt, name);
+    if (ret < 0 || (size_t)ret >= sizeof(sql)) {
+        log_err("Savepoint name is too long: %s\n", name);
+        return -1;
+    }
+
+    return sqlite_exec(db, sql, NULL, NULL);
+}
+
+int sqlite_savepoint(sqlite3* db, const char* name) {
+    return sqlite_exec_savepoint(db, "SAVEPOINT %s;", name);
+}
+
+int sqlite_release(sqlite3* db, const char* name) {
+    return sqlite_exec_savepoint(db, "RELEASE %s;", name);
+}
+
+void sqlite_rollback_to(sqlite3* db, const char* name) {
+    sqlite_exec_savepoint(db, "ROLLBACK TO %s;", name);
+}
+
 int sqlite_get_user_version(sqlite3* db, unsigned int* output) {
     static const char* const sql = "PRAGMA user_version;";
 
@@ -295,3 +419,167 @@ int sqlite_set_foreign_keys(sqlite3* db) {
     static const char* const sql = "PRAGMA foreign_keys = ON;";
     return sqlite_exec(db, sql, NULL, NULL);
 }
+
+int sqlite_set_journal_mode_wal(sqlite3* db) {
+    static const char* const sql = "PRAGMA journal_mode = WAL;";
+
+    sqlite3_stmt* stmt = NULL;
+    char* mode = NULL;
+    int ret = 0;
+
+    ret = sqlite_prepare(db, sql, &stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_step(stmt);
+    if (ret < 0)
+        goto finalize;
+    if (!ret) {
+        ret = -1;
+        log_err("Failed to set journal mode\n");
+        goto finalize;
+    }
+
+    /* The new journal mode is returned; it's not changed for e.g. in-memory
+     * databases. */
+    ret = sqlite_column_text(stmt, 0, &mode);
+    if (ret < 0)
+        goto finalize;
+    if (!mode || strcmp(mode, "wal")) {
+        log_err("Failed to switch to WAL mode, journal mode is: %s\n", mode ? mode : "unknown");
+        ret = -1;
+        goto free_mode;
+    }
+
+free_mode:
+    free(mode);
+
+finalize:
+    sqlite_finalize(stmt);
+
+    return ret;
+}
+
+static int sqlite_set_pragma(sqlite3* db, const char* name, const char* value) {
+    static const char* const fmt = "PRAGMA %s = %s;";
+
+    char sql[128];
+    int ret = snprintf(sql, sizeof(sql), fmt, name, value);
+    if (ret < 0 || (size_t)ret >= sizeof(sql)) {
+        log_err("PRAGMA %s value is too long: %s\n", name, value);
+        return -1;
+    }
+
+    return sqlite_exec(db, sql, NULL, NULL);
+}
+
+int sqlite_set_synchronous(sqlite3* db, const char* mode) {
+    static const char* const modes[] = {"OFF", "NORMAL", "FULL", "EXTRA"};
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        if (strcasecmp(mode, modes[i]))
+            continue;
+        return sqlite_set_pragma(db, "synchronous", modes[i]);
+    }
+
+    log_err("Invalid synchronous mode: %s\n", mode);
+    return -1;
+}
+
+int sqlite_set_cache_size(sqlite3* db, int cache_size) {
+    char value[32];
+    snprintf(value, sizeof(value), "%d", cache_size);
+    return sqlite_set_pragma(db, "cache_size", value);
+}
+
+int sqlite_set_mmap_size(sqlite3* db, int64_t mmap_size) {
+    char value[32];
+    snprintf(value, sizeof(value), "%lld", (long long)mmap_size);
+    return sqlite_set_pragma(db, "mmap_size", value);
+}
+
+static int sqlite_get_pragma_int(sqlite3* db, const char* name, int64_t* value) {
+    static const char* const fmt = "PRAGMA %s;";
+
+    sqlite3_stmt* stmt = NULL;
+    int ret = 0;
+
+    char sql[128];
+    ret = snprintf(sql, sizeof(sql), fmt, name);
+    if (ret < 0 || (size_t)ret >= sizeof(sql)) {
+        log_err("PRAGMA name is too long: %s\n", name);
+        return -1;
+    }
+
+    ret = sqlite_prepare(db, sql, &stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_step(stmt);
+    if (ret < 0)
+        goto finalize;
+    if (!ret) {
+        ret = -1;
+        log_err("Failed to read PRAGMA %s\n", name);
+        goto finalize;
+    }
+
+    *value = sqlite_column_int64(stmt, 0);
+    ret = 0;
+
+finalize:
+    sqlite_finalize(stmt);
+
+    return ret;
+}
+
+int sqlite_set_auto_vacuum_incremental(sqlite3* db) {
+    /* See https://www.sqlite.org/pragma.html#pragma_auto_vacuum. */
+    static const int64_t incremental = 2;
+
+    int64_t mode = 0, numof_pages = 0;
+    int ret = 0;
+
+    ret = sqlite_get_pragma_int(db, "auto_vacuum", &mode);
+    if (ret < 0)
+        return ret;
+    if (mode == incremental)
+        return ret;
+
+    ret = sqlite_set_pragma(db, "auto_vacuum", "INCREMENTAL");
+    if (ret < 0)
+        return ret;
+
+    /* A new database doesn't need to be rebuilt. */
+    ret = sqlite_get_pragma_int(db, "page_count", &numof_pages);
+    if (ret < 0)
+        return ret;
+    if (!numof_pages)
+        return ret;
+
+    log("Rebuilding SQLite database to enable incremental vacuum\n");
+    return sqlite_exec(db, "VACUUM;", NULL, NULL);
+}
+
+int sqlite_incremental_vacuum(sqlite3* db, size_t max_pages, size_t* reclaimed) {
+    int64_t page_size = 0, free_before = 0, free_after = 0;
+    int ret = 0;
+
+    ret = sqlite_get_pragma_int(db, "page_size", &page_size);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_get_pragma_int(db, "freelist_count", &free_before);
+    if (ret < 0)
+        return ret;
+
+    char value[32];
+    snprintf(value, sizeof(value), "%zu", max_pages);
+    ret = sqlite_set_pragma(db, "incremental_vacuum", value);
+    if (ret < 0)
+        return ret;
+
+    ret = sqlite_get_pragma_int(db, "freelist_count", &free_after);
+    if (ret < 0)
+        return ret;
+
+    *reclaimed = (size_t)(free_before - free_after) * (size_t)page_size;
+    return ret;
+}
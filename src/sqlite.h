@@ -11,6 +11,7 @@
 #include <sqlite3.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
 int sqlite_init(void);
 void sqlite_destroy(void);
@@ -28,16 +29,58 @@ void sqlite_finalize(sqlite3_stmt*);
 int sqlite_step(sqlite3_stmt*);
 
 int sqlite_bind_int(sqlite3_stmt*, int column_index, int value);
+int sqlite_bind_int64(sqlite3_stmt*, int column_index, sqlite3_int64 value);
 int sqlite_bind_text(sqlite3_stmt*, int column_index, const char* value);
-int sqlite_bind_blob(sqlite3_stmt*, int column_index, unsigned char* value, size_t nb);
+int sqlite_bind_blob(sqlite3_stmt*, int column_index, const void* value, size_t nb);
 
 int sqlite_column_int(sqlite3_stmt*, int column_index);
+sqlite3_int64 sqlite_column_int64(sqlite3_stmt*, int column_index);
 int sqlite_column_text(sqlite3_stmt*, int column_index, char** result);
 int sqlite_column_blob(sqlite3_stmt*, int column_index, unsigned char** result);
+/* Same, but without making a copy: the data is only valid until the statement
+ * is stepped or reset. */
+int sqlite_column_blob_ref(sqlite3_stmt*, int column_index, const void** data, size_t* size);
+
+/* Incremental blob I/O: the blob is read piece by piece instead of as a whole.
+ * The handle keeps the read transaction open until it's closed. */
+int sqlite_blob_open_ro(
+    sqlite3* db,
+    const char* table,
+    const char* column,
+    sqlite3_int64 row,
+    sqlite3_blob** blob
+);
+void sqlite_blob_close(sqlite3_blob*);
+size_t sqlite_blob_size(sqlite3_blob*);
+int sqlite_blob_read(sqlite3_blob*, void* buf, size_t size, size_t offset);
 
 int sqlite_exec_as_transaction(sqlite3* db, const char* stmt);
 
+int sqlite_begin(sqlite3* db);
+int sqlite_commit(sqlite3* db);
+void sqlite_rollback(sqlite3* db);
+
+/* Savepoints can be nested in a transaction, and rolled back separately. */
+int sqlite_savepoint(sqlite3* db, const char* name);
+int sqlite_release(sqlite3* db, const char* name);
+void sqlite_rollback_to(sqlite3* db, const char* name);
+
 int sqlite_get_user_version(sqlite3* db, unsigned int* version);
 int sqlite_set_foreign_keys(sqlite3* db);
 
+/* Readers don't block the writer in WAL mode, and vice versa. */
+int sqlite_set_journal_mode_wal(sqlite3* db);
+/* The mode is one of OFF, NORMAL, FULL or EXTRA. */
+int sqlite_set_synchronous(sqlite3* db, const char* mode);
+/* Negative values are in KiB, positive are in pages. */
+int sqlite_set_cache_size(sqlite3* db, int cache_size);
+int sqlite_set_mmap_size(sqlite3* db, int64_t mmap_size);
+
+/* Free pages are only returned to the OS when asked to. Switching an existing
+ * database to this mode rebuilds it, which takes a while. */
+int sqlite_set_auto_vacuum_incremental(sqlite3* db);
+/* Returns at most max_pages free pages to the OS, and sets the number of bytes
+ * reclaimed. */
+int sqlite_incremental_vacuum(sqlite3* db, size_t max_pages, size_t* reclaimed);
+
 #endif
@@ -0,0 +1,21 @@
+CREATE TABLE cimple_run_output (
+	run_id INTEGER NOT NULL,
+	offset INTEGER NOT NULL,
+	data BLOB NOT NULL,
+	PRIMARY KEY (run_id, offset),
+	FOREIGN KEY (run_id) REFERENCES cimple_runs(id)
+		ON DELETE CASCADE ON UPDATE CASCADE
+) STRICT;
+
+DROP VIEW cimple_runs_view;
+
+-- The output is streamed by workers in chunks, which are stored in
+-- cimple_run_output. Runs finished before that have it in cimple_runs.output.
+CREATE VIEW cimple_runs_view(id, status, exit_code, output, repo_url, repo_rev)  AS
+	SELECT run.id, status.label, run.exit_code,
+		COALESCE((SELECT CAST(group_concat(chunk.data, '') AS BLOB) FROM
+			(SELECT data FROM cimple_run_output WHERE run_id = run.id ORDER BY offset) AS chunk),
+			run.output),
+		repo.url, run.repo_rev FROM cimple_runs AS run
+		INNER JOIN cimple_run_status as status ON run.status = status.id
+		INNER JOIN cimple_repos as repo ON run.repo_id = repo.id;
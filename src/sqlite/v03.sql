@@ -0,0 +1,50 @@
+CREATE TABLE cimple_codecs (
+	id INTEGER PRIMARY KEY,
+	label TEXT NOT NULL
+) STRICT;
+
+CREATE UNIQUE INDEX cimple_codecs_index_label ON cimple_codecs(label);
+
+INSERT INTO cimple_codecs(id, label) VALUES (1, 'none');
+INSERT INTO cimple_codecs(id, label) VALUES (2, 'zlib');
+
+DROP VIEW cimple_runs_view;
+
+-- Output chunks may now be compressed; the size and the offset are those of
+-- the uncompressed data.
+ALTER TABLE cimple_run_output RENAME TO cimple_run_output_old;
+
+CREATE TABLE cimple_run_output (
+	run_id INTEGER NOT NULL,
+	offset INTEGER NOT NULL,
+	size INTEGER NOT NULL,
+	codec INTEGER NOT NULL,
+	data BLOB NOT NULL,
+	PRIMARY KEY (run_id, offset),
+	FOREIGN KEY (run_id) REFERENCES cimple_runs(id)
+		ON DELETE CASCADE ON UPDATE CASCADE,
+	FOREIGN KEY (codec) REFERENCES cimple_codecs(id)
+) STRICT;
+
+INSERT INTO cimple_run_output(run_id, offset, size, codec, data)
+	SELECT run_id, offset, length(data), 1, data FROM cimple_run_output_old;
+
+DROP TABLE cimple_run_output_old;
+
+-- SQLite can't decompress the output, so it's NULL here if any of the chunks
+-- are compressed. cimple_run_output_view has the chunks along with their codecs.
+CREATE VIEW cimple_runs_view(id, status, exit_code, output, repo_url, repo_rev)  AS
+	SELECT run.id, status.label, run.exit_code,
+		CASE WHEN EXISTS (SELECT 1 FROM cimple_run_output WHERE run_id = run.id AND codec <> 1)
+			THEN NULL
+			ELSE COALESCE((SELECT CAST(group_concat(chunk.data, '') AS BLOB) FROM
+				(SELECT data FROM cimple_run_output WHERE run_id = run.id ORDER BY offset) AS chunk),
+				run.output)
+		END,
+		repo.url, run.repo_rev FROM cimple_runs AS run
+		INNER JOIN cimple_run_status as status ON run.status = status.id
+		INNER JOIN cimple_repos as repo ON run.repo_id = repo.id;
+
+CREATE VIEW cimple_run_output_view(run_id, offset, size, codec, data) AS
+	SELECT chunk.run_id, chunk.offset, chunk.size, codec.label, chunk.data FROM cimple_run_output AS chunk
+		INNER JOIN cimple_codecs AS codec ON chunk.codec = codec.id;
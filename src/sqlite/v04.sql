@@ -0,0 +1,10 @@
+-- The time a run was created, in Unix time; it's 0 for runs created before
+-- this was recorded.
+ALTER TABLE cimple_runs ADD COLUMN created_at INTEGER NOT NULL DEFAULT 0;
+
+-- Runs are listed newest first, a page at a time, optionally filtered. Every
+-- index implicitly ends with the run ID, so these also keep the runs ordered
+-- within each filtered set (as do cimple_runs_index_status and
+-- cimple_runs_index_repo_id).
+CREATE INDEX cimple_runs_index_exit_code ON cimple_runs(exit_code);
+CREATE INDEX cimple_runs_index_created_at ON cimple_runs(created_at);
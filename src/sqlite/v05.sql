@@ -0,0 +1,32 @@
+-- The outputs of finished runs are moved from cimple_runs.output and
+-- cimple_run_output to the blob store, where they are named after the SHA-256
+-- of the (uncompressed) output. Identical outputs share a single blob, which
+-- is referenced by refcount runs.
+CREATE TABLE cimple_blobs (
+	hash TEXT PRIMARY KEY,
+	refcount INTEGER NOT NULL
+) STRICT;
+
+ALTER TABLE cimple_runs ADD COLUMN output_hash TEXT;
+ALTER TABLE cimple_runs ADD COLUMN output_size INTEGER NOT NULL DEFAULT 0;
+
+-- Finished runs that still have their output in the database are moved to
+-- the blob store in the background.
+CREATE INDEX cimple_runs_index_output_hash ON cimple_runs(output_hash);
+
+DROP VIEW cimple_runs_view;
+
+-- SQLite can't read blobs, so the output is NULL here if it's in the blob
+-- store (or compressed).
+CREATE VIEW cimple_runs_view(id, status, exit_code, output, repo_url, repo_rev)  AS
+	SELECT run.id, status.label, run.exit_code,
+		CASE WHEN run.output_hash IS NOT NULL
+				OR EXISTS (SELECT 1 FROM cimple_run_output WHERE run_id = run.id AND codec <> 1)
+			THEN NULL
+			ELSE COALESCE((SELECT CAST(group_concat(chunk.data, '') AS BLOB) FROM
+				(SELECT data FROM cimple_run_output WHERE run_id = run.id ORDER BY offset) AS chunk),
+				run.output)
+		END,
+		repo.url, run.repo_rev FROM cimple_runs AS run
+		INNER JOIN cimple_run_status as status ON run.status = status.id
+		INNER JOIN cimple_repos as repo ON run.repo_id = repo.id;
@@ -0,0 +1,16 @@
+-- Old runs are deleted, and the outputs of the runs that are kept might be
+-- dropped, according to the retention policies. The outputs of such runs are
+-- empty, and they're never moved to the blob store.
+ALTER TABLE cimple_runs ADD COLUMN output_pruned INTEGER NOT NULL DEFAULT 0;
+
+-- Only the runs that still have their outputs are looked at when dropping
+-- the old ones, however many have been dropped already.
+CREATE INDEX cimple_runs_index_unpruned ON cimple_runs(status, created_at) WHERE output_pruned = 0;
+
+-- Blobs that are no longer referenced are deleted in the background.
+CREATE INDEX cimple_blobs_index_unused ON cimple_blobs(hash) WHERE refcount <= 0;
+
+-- The outputs are moved to the blob store in the background, whenever a run
+-- finishes, so only the runs that still have theirs in the database are
+-- looked at.
+CREATE INDEX cimple_runs_index_unstored ON cimple_runs(status) WHERE output_hash IS NULL AND output_pruned = 0;
@@ -8,8 +8,8 @@
 #include "storage.h"
 
 #include "log.h"
-#include "process.h"
 #include "run_queue.h"
+#include "storage_memory.h"
 #include "storage_sqlite.h"
 
 #include <stddef.h>
@@ -19,10 +19,31 @@ typedef int (*storage_create_t)(struct storage*, const struct storage_settings*)
 typedef void (*storage_destroy_t)(struct storage*);
 
 typedef int (*storage_run_create_t)(struct storage*, const char* repo_url, const char* rev);
-typedef int (*storage_run_finished_t)(struct storage*, int repo_id, const struct process_output*);
-
-typedef int (*storage_get_runs_t)(struct storage*, struct run_queue*);
-typedef storage_get_runs_t storage_get_run_queue_t;
+typedef int (*storage_run_create_batch_t)(struct storage*, struct run**, size_t);
+typedef int (*storage_run_output_append_t)(
+    struct storage*,
+    int run_id,
+    const struct run_output_chunk*
+);
+typedef int (*storage_run_finished_t)(struct storage*, int run_id, int ec);
+typedef int (*storage_run_output_read_t)(
+    struct storage*,
+    int run_id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+);
+
+typedef int (*storage_get_runs_t)(
+    struct storage*,
+    const struct run_filter*,
+    struct run_queue*,
+    int* next_id
+);
+typedef int (*storage_get_run_queue_t)(struct storage*, struct run_queue*);
+
+typedef void (*storage_get_stats_t)(struct storage*, struct storage_stats*);
 
 struct storage_api {
     storage_settings_destroy_t destroy_settings;
@@ -30,10 +51,15 @@ struct storage_api {
     storage_destroy_t destroy;
 
     storage_run_create_t run_create;
+    storage_run_create_batch_t run_create_batch;
+    storage_run_output_append_t run_output_append;
     storage_run_finished_t run_finished;
+    storage_run_output_read_t run_output_read;
 
     storage_get_runs_t get_runs;
     storage_get_run_queue_t get_run_queue;
+
+    storage_get_stats_t get_stats;
 };
 
 static const struct storage_api apis[] = {
@@ -43,10 +69,31 @@ static const struct storage_api apis[] = {
         storage_sqlite_destroy,
 
         storage_sqlite_run_create,
+        storage_sqlite_run_create_batch,
+        storage_sqlite_run_output_append,
         storage_sqlite_run_finished,
+        storage_sqlite_run_output_read,
 
         storage_sqlite_get_runs,
         storage_sqlite_get_run_queue,
+
+        storage_sqlite_get_stats,
+    },
+    {
+        storage_memory_settings_destroy,
+        storage_memory_create,
+        storage_memory_destroy,
+
+        storage_memory_run_create,
+        storage_memory_run_create_batch,
+        storage_memory_run_output_append,
+        storage_memory_run_finished,
+        storage_memory_run_output_read,
+
+        storage_memory_get_runs,
+        storage_memory_get_run_queue,
+
+        storage_memory_get_stats,
     },
 };
 
@@ -57,7 +104,7 @@ static size_t numof_apis(void) {
 static const struct storage_api* get_api(enum storage_type type) {
     if (type < 0)
         goto invalid_type;
-    if ((size_t)type > numof_apis())
+    if ((size_t)type >= numof_apis())
         goto invalid_type;
 
     return &apis[type];
@@ -100,18 +147,55 @@ int storage_run_create(struct storage* storage, const char* repo_url, const char
     return api->run_create(storage, repo_url, rev);
 }
 
-int storage_run_finished(struct storage* storage, int run_id, const struct process_output* output) {
+int storage_run_create_batch(struct storage* storage, struct run** runs, size_t numof_runs) {
+    const struct storage_api* api = get_api(storage->type);
+    if (!api)
+        return -1;
+    return api->run_create_batch(storage, runs, numof_runs);
+}
+
+int storage_run_output_append(
+    struct storage* storage,
+    int run_id,
+    const struct run_output_chunk* chunk
+) {
+    const struct storage_api* api = get_api(storage->type);
+    if (!api)
+        return -1;
+    return api->run_output_append(storage, run_id, chunk);
+}
+
+int storage_run_finished(struct storage* storage, int run_id, int ec) {
+    const struct storage_api* api = get_api(storage->type);
+    if (!api)
+        return -1;
+    return api->run_finished(storage, run_id, ec);
+}
+
+int storage_run_output_read(
+    struct storage* storage,
+    int run_id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+) {
     const struct storage_api* api = get_api(storage->type);
     if (!api)
         return -1;
-    return api->run_finished(storage, run_id, output);
+    return api->run_output_read(storage, run_id, offset, buf, size, read);
 }
 
-int storage_get_runs(struct storage* storage, struct run_queue* queue) {
+int storage_get_runs(
+    struct storage* storage,
+    const struct run_filter* filter,
+    struct run_queue* queue,
+    int* next_id
+) {
     const struct storage_api* api = get_api(storage->type);
     if (!api)
         return -1;
-    return api->get_runs(storage, queue);
+    return api->get_runs(storage, filter, queue, next_id);
 }
 
 int storage_get_run_queue(struct storage* storage, struct run_queue* queue) {
@@ -120,3 +204,10 @@ int storage_get_run_queue(struct storage* storage, struct run_queue* queue) {
         return -1;
     return api->get_run_queue(storage, queue);
 }
+
+void storage_get_stats(struct storage* storage, struct storage_stats* stats) {
+    const struct storage_api* api = get_api(storage->type);
+    if (!api)
+        return;
+    api->get_stats(storage, stats);
+}
@@ -8,12 +8,15 @@
 #ifndef __STORAGE_H__
 #define __STORAGE_H__
 
-#include "process.h"
 #include "run_queue.h"
 #include "storage_sqlite.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 enum storage_type {
     STORAGE_TYPE_SQLITE,
+    STORAGE_TYPE_MEMORY,
 };
 
 struct storage_settings {
@@ -29,6 +32,7 @@ struct storage {
     enum storage_type type;
     union {
         struct storage_sqlite* sqlite;
+        struct storage_memory* memory;
     };
 };
 
@@ -36,9 +40,43 @@ int storage_create(struct storage*, const struct storage_settings*);
 void storage_destroy(struct storage*);
 
 int storage_run_create(struct storage*, const char* repo_url, const char* rev);
-int storage_run_finished(struct storage*, int run_id, const struct process_output*);
+/* Creates the runs in a single transaction, and sets their IDs. */
+int storage_run_create_batch(struct storage*, struct run** runs, size_t numof_runs);
+/* Output chunks are appended as they arrive from the worker, and stored as is
+ * (i.e. compressed, if they are). A chunk at offset 0 discards whatever output
+ * the run had before. */
+int storage_run_output_append(struct storage*, int run_id, const struct run_output_chunk*);
+int storage_run_finished(struct storage*, int run_id, int ec);
+/* Reads at most `size` bytes of the (uncompressed) output of a run, starting
+ * at `offset`. Fewer bytes are read only at the end of the output. Only the
+ * chunks that overlap the range are read, so the whole output is never loaded
+ * into memory. */
+int storage_run_output_read(
+    struct storage*,
+    int run_id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+);
 
-int storage_get_runs(struct storage*, struct run_queue*);
+/* Returns a page of runs matching the filter, newest first. If there are more
+ * runs past the page, next_id is set to the cursor for the next page;
+ * otherwise, it's set to 0. */
+int storage_get_runs(struct storage*, const struct run_filter*, struct run_queue*, int* next_id);
 int storage_get_run_queue(struct storage*, struct run_queue*);
 
+struct storage_stats {
+    uint64_t repo_cache_hits;
+    uint64_t repo_cache_misses;
+
+    /* See storage_sqlite_retention. */
+    uint64_t prune_passes;
+    uint64_t pruned_runs;
+    uint64_t pruned_outputs;
+    uint64_t reclaimed_bytes;
+};
+
+void storage_get_stats(struct storage*, struct storage_stats*);
+
 #endif
@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#include "storage_memory.h"
+
+#include "codec.h"
+#include "compiler.h"
+#include "log.h"
+#include "run_queue.h"
+#include "storage.h"
+#include "string.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int storage_memory_settings_create(struct storage_settings* settings) {
+    settings->type = STORAGE_TYPE_MEMORY;
+    return 0;
+}
+
+void storage_memory_settings_destroy(UNUSED const struct storage_settings* settings) {}
+
+struct storage_memory_run {
+    /* The index in the repository array. */
+    size_t repo;
+    char* rev;
+    enum run_status status;
+    int exit_code;
+    /* Unix time. */
+    int64_t created_at;
+
+    /* The output is stored uncompressed. */
+    unsigned char* output;
+    size_t output_size;
+    size_t output_capacity;
+};
+
+#define STORAGE_MEMORY_REPOS_TABLE_INITIAL_SIZE 64
+
+struct storage_memory {
+    /* Queries only take the lock for reading. */
+    pthread_rwlock_t lock;
+
+    /* Run IDs start at 1 and are never reused, so a run is at index ID - 1. */
+    struct storage_memory_run* runs;
+    size_t numof_runs;
+    size_t runs_capacity;
+
+    char** repos;
+    size_t numof_repos;
+    size_t repos_capacity;
+    /* Repositories by URL. Open addressing, the size is a power of 2. The
+     * slots hold indices in the repository array plus 1, 0 means the slot is
+     * empty. */
+    size_t* repos_table;
+    size_t repos_table_size;
+};
+
+static int storage_memory_rdlock(struct storage_memory* storage) {
+    int ret = pthread_rwlock_rdlock(&storage->lock);
+    if (ret) {
+        pthread_errno(ret, "pthread_rwlock_rdlock");
+        return -1;
+    }
+    return ret;
+}
+
+static int storage_memory_wrlock(struct storage_memory* storage) {
+    int ret = pthread_rwlock_wrlock(&storage->lock);
+    if (ret) {
+        pthread_errno(ret, "pthread_rwlock_wrlock");
+        return -1;
+    }
+    return ret;
+}
+
+static void storage_memory_unlock(struct storage_memory* storage) {
+    pthread_errno_if(pthread_rwlock_unlock(&storage->lock), "pthread_rwlock_unlock");
+}
+
+/* Makes room for at least `size` elements, doubling the capacity. Returns the
+ * (possibly moved) array, or NULL if it couldn't be grown. */
+static void* storage_memory_reserve(void* data, size_t* capacity, size_t size, size_t elem_size) {
+    if (size <= *capacity)
+        return data;
+
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < size)
+        new_capacity *= 2;
+
+    void* new_data = realloc(data, new_capacity * elem_size);
+    if (!new_data) {
+        log_errno("realloc");
+        return NULL;
+    }
+
+    *capacity = new_capacity;
+    return new_data;
+}
+
+int storage_memory_create(struct storage* storage, UNUSED const struct storage_settings* settings) {
+    int ret = 0;
+
+    log("Using in-memory storage, nothing will be saved\n");
+
+    struct storage_memory* memory = calloc(1, sizeof(struct storage_memory));
+    if (!memory) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    ret = pthread_rwlock_init(&memory->lock, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_rwlock_init");
+        goto free;
+    }
+
+    memory->repos_table =
+        calloc(STORAGE_MEMORY_REPOS_TABLE_INITIAL_SIZE, sizeof(memory->repos_table[0]));
+    if (!memory->repos_table) {
+        log_errno("calloc");
+        ret = -1;
+        goto destroy_lock;
+    }
+    memory->repos_table_size = STORAGE_MEMORY_REPOS_TABLE_INITIAL_SIZE;
+
+    storage->memory = memory;
+    return ret;
+
+destroy_lock:
+    pthread_errno_if(pthread_rwlock_destroy(&memory->lock), "pthread_rwlock_destroy");
+
+free:
+    free(memory);
+
+    return ret;
+}
+
+static void storage_memory_run_destroy(struct storage_memory_run* run) {
+    free(run->output);
+    free(run->rev);
+}
+
+void storage_memory_destroy(struct storage* storage) {
+    struct storage_memory* memory = storage->memory;
+
+    for (size_t i = 0; i < memory->numof_runs; ++i)
+        storage_memory_run_destroy(&memory->runs[i]);
+    free(memory->runs);
+
+    for (size_t i = 0; i < memory->numof_repos; ++i)
+        free(memory->repos[i]);
+    free(memory->repos);
+    free(memory->repos_table);
+
+    pthread_errno_if(pthread_rwlock_destroy(&memory->lock), "pthread_rwlock_destroy");
+    free(memory);
+}
+
+static size_t* storage_memory_repos_slot(
+    size_t* table,
+    size_t table_size,
+    char* const* repos,
+    const char* url
+) {
+    const size_t mask = table_size - 1;
+
+    for (size_t slot = string_hash(url) & mask;; slot = (slot + 1) & mask)
+        if (!table[slot] || !strcmp(repos[table[slot] - 1], url))
+            return &table[slot];
+}
+
+/* Returns 0 and sets the index if the repository exists. */
+static int storage_memory_find_repo(
+    struct storage_memory* storage,
+    const char* url,
+    size_t* index
+) {
+    const size_t* slot = storage_memory_repos_slot(
+        storage->repos_table, storage->repos_table_size, storage->repos, url
+    );
+    if (!*slot)
+        return -1;
+
+    *index = *slot - 1;
+    return 0;
+}
+
+/* Keep the load factor at 50% at most. */
+static int storage_memory_grow_repos_table(struct storage_memory* storage) {
+    const size_t table_size = storage->repos_table_size * 2;
+
+    size_t* table = calloc(table_size, sizeof(table[0]));
+    if (!table) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < storage->numof_repos; ++i)
+        *storage_memory_repos_slot(table, table_size, storage->repos, storage->repos[i]) = i + 1;
+
+    free(storage->repos_table);
+    storage->repos_table = table;
+    storage->repos_table_size = table_size;
+    return 0;
+}
+
+/* Sets the index of the repository, adding it if it's new. */
+static int storage_memory_insert_repo(
+    struct storage_memory* storage,
+    const char* url,
+    size_t* index
+) {
+    int ret = 0;
+
+    if (!storage_memory_find_repo(storage, url, index))
+        return ret;
+
+    if ((storage->numof_repos + 1) * 2 > storage->repos_table_size) {
+        ret = storage_memory_grow_repos_table(storage);
+        if (ret < 0)
+            return ret;
+    }
+
+    char** repos = storage_memory_reserve(
+        storage->repos, &storage->repos_capacity, storage->numof_repos + 1, sizeof(repos[0])
+    );
+    if (!repos)
+        return -1;
+    storage->repos = repos;
+
+    char* repo = strdup(url);
+    if (!repo) {
+        log_errno("strdup");
+        return -1;
+    }
+
+    *index = storage->numof_repos++;
+    storage->repos[*index] = repo;
+    *storage_memory_repos_slot(
+        storage->repos_table, storage->repos_table_size, storage->repos, url
+    ) = *index + 1;
+    return ret;
+}
+
+/* Returns the ID of the new run. */
+static int storage_memory_insert_run(
+    struct storage_memory* storage,
+    const char* repo_url,
+    const char* rev
+) {
+    size_t repo = 0;
+    int ret = 0;
+
+    if (storage->numof_runs >= INT_MAX) {
+        log_err("Too many runs\n");
+        return -1;
+    }
+
+    ret = storage_memory_insert_repo(storage, repo_url, &repo);
+    if (ret < 0)
+        return ret;
+
+    struct storage_memory_run* runs = storage_memory_reserve(
+        storage->runs, &storage->runs_capacity, storage->numof_runs + 1, sizeof(runs[0])
+    );
+    if (!runs)
+        return -1;
+    storage->runs = runs;
+
+    struct storage_memory_run* run = &storage->runs[storage->numof_runs];
+    memset(run, 0, sizeof(*run));
+
+    run->rev = strdup(rev);
+    if (!run->rev) {
+        log_errno("strdup");
+        return -1;
+    }
+
+    run->repo = repo;
+    run->status = RUN_STATUS_CREATED;
+    run->exit_code = -1;
+    run->created_at = (int64_t)time(NULL);
+
+    return (int)++storage->numof_runs;
+}
+
+int storage_memory_run_create(struct storage* storage, const char* repo_url, const char* rev) {
+    int ret = 0;
+
+    ret = storage_memory_wrlock(storage->memory);
+    if (ret < 0)
+        return ret;
+    ret = storage_memory_insert_run(storage->memory, repo_url, rev);
+    storage_memory_unlock(storage->memory);
+
+    return ret;
+}
+
+/* Either all of the runs are created, or none are. */
+int storage_memory_run_create_batch(struct storage* storage, struct run** runs, size_t numof_runs) {
+    struct storage_memory* memory = storage->memory;
+    int ret = 0;
+
+    ret = storage_memory_wrlock(memory);
+    if (ret < 0)
+        return ret;
+
+    const size_t numof_old_runs = memory->numof_runs;
+
+    for (size_t i = 0; i < numof_runs; ++i) {
+        ret = storage_memory_insert_run(
+            memory, run_get_repo_url(runs[i]), run_get_repo_rev(runs[i])
+        );
+        if (ret < 0)
+            goto rollback;
+        run_set_id(runs[i], ret);
+    }
+
+    goto unlock;
+
+rollback:
+    while (memory->numof_runs > numof_old_runs)
+        storage_memory_run_destroy(&memory->runs[--memory->numof_runs]);
+
+unlock:
+    storage_memory_unlock(memory);
+
+    return ret;
+}
+
+static struct storage_memory_run* storage_memory_find_run(struct storage_memory* storage, int id) {
+    if (id <= 0 || (size_t)id > storage->numof_runs) {
+        log_err("Run %d doesn't exist\n", id);
+        return NULL;
+    }
+    return &storage->runs[id - 1];
+}
+
+static int storage_memory_append_output(
+    struct storage_memory_run* run,
+    const struct run_output_chunk* chunk
+) {
+    /* The run might have been started before (e.g. if the worker was
+     * restarted while it was in progress). */
+    if (!chunk->offset)
+        run->output_size = 0;
+
+    if (chunk->offset != run->output_size) {
+        log_err(
+            "Output chunk is at offset %zu, expected offset %zu\n",
+            chunk->offset,
+            run->output_size
+        );
+        return -1;
+    }
+    if (chunk->size > SIZE_MAX - run->output_size) {
+        log_err("Run output is too large\n");
+        return -1;
+    }
+
+    unsigned char* output = storage_memory_reserve(
+        run->output, &run->output_capacity, run->output_size + chunk->size, 1
+    );
+    if (!output)
+        return -1;
+    run->output = output;
+
+    int ret = codec_decompress(
+        chunk->codec, chunk->data, chunk->data_size, run->output + run->output_size, chunk->size
+    );
+    if (ret < 0)
+        return ret;
+
+    run->output_size += chunk->size;
+    return ret;
+}
+
+int storage_memory_run_output_append(
+    struct storage* storage,
+    int run_id,
+    const struct run_output_chunk* chunk
+) {
+    int ret = 0;
+
+    ret = storage_memory_wrlock(storage->memory);
+    if (ret < 0)
+        return ret;
+
+    struct storage_memory_run* run = storage_memory_find_run(storage->memory, run_id);
+    if (!run) {
+        ret = -1;
+        goto unlock;
+    }
+
+    ret = storage_memory_append_output(run, chunk);
+
+unlock:
+    storage_memory_unlock(storage->memory);
+
+    return ret;
+}
+
+int storage_memory_run_finished(struct storage* storage, int run_id, int ec) {
+    int ret = 0;
+
+    ret = storage_memory_wrlock(storage->memory);
+    if (ret < 0)
+        return ret;
+
+    struct storage_memory_run* run = storage_memory_find_run(storage->memory, run_id);
+    if (!run) {
+        ret = -1;
+        goto unlock;
+    }
+
+    run->status = RUN_STATUS_FINISHED;
+    run->exit_code = ec;
+
+unlock:
+    storage_memory_unlock(storage->memory);
+
+    return ret;
+}
+
+int storage_memory_run_output_read(
+    struct storage* storage,
+    int run_id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+) {
+    int ret = 0;
+
+    ret = storage_memory_rdlock(storage->memory);
+    if (ret < 0)
+        return ret;
+
+    const struct storage_memory_run* run = storage_memory_find_run(storage->memory, run_id);
+    if (!run) {
+        ret = -1;
+        goto unlock;
+    }
+
+    *read = 0;
+    if (offset < run->output_size) {
+        *read = run->output_size - offset;
+        if (*read > size)
+            *read = size;
+        memcpy(buf, run->output + offset, *read);
+    }
+
+unlock:
+    storage_memory_unlock(storage->memory);
+
+    return ret;
+}
+
+static int storage_memory_make_run(
+    const struct storage_memory* storage,
+    int id,
+    struct run** run
+) {
+    const struct storage_memory_run* src = &storage->runs[id - 1];
+    return run_new(run, id, storage->repos[src->repo], src->rev, src->status, src->exit_code);
+}
+
+/* The cursor (before_id and after_id) is applied by the caller. */
+static int storage_memory_run_matches(
+    const struct storage_memory_run* run,
+    const struct run_filter* filter,
+    size_t repo
+) {
+    if ((filter->fields & RUN_FILTER_REPO_URL) && run->repo != repo)
+        return 0;
+    if ((filter->fields & RUN_FILTER_STATUS) && run->status != filter->status)
+        return 0;
+    if ((filter->fields & RUN_FILTER_EXIT_CODE) && run->exit_code != filter->exit_code)
+        return 0;
+    if ((filter->fields & RUN_FILTER_CREATED_AFTER) && run->created_at <= filter->created_after)
+        return 0;
+    if ((filter->fields & RUN_FILTER_CREATED_BEFORE) && run->created_at >= filter->created_before)
+        return 0;
+    return 1;
+}
+
+static int storage_memory_runs_to_page(
+    const struct storage_memory* storage,
+    const struct run_filter* filter,
+    size_t repo,
+    struct run_queue* queue,
+    int* next_id
+) {
+    const int ascending = run_filter_is_ascending(filter);
+    size_t numof_runs = 0;
+    int last_id = 0;
+    int ret = 0;
+
+    /* The range of IDs that are inside the cursor, inclusive. The cursor can
+     * be any int, so it's compared to the existing IDs before being moved, so
+     * that it can't overflow. */
+    int first = 1;
+    int last = (int)storage->numof_runs;
+    if (filter->fields & RUN_FILTER_AFTER_ID) {
+        if (filter->after_id >= last)
+            return ret;
+        if (filter->after_id >= first)
+            first = filter->after_id + 1;
+    }
+    if (filter->fields & RUN_FILTER_BEFORE_ID) {
+        if (filter->before_id <= first)
+            return ret;
+        if (filter->before_id <= last)
+            last = filter->before_id - 1;
+    }
+
+    for (int i = 0; i <= last - first; ++i) {
+        const int id = ascending ? first + i : last - i;
+
+        if (!storage_memory_run_matches(&storage->runs[id - 1], filter, repo))
+            continue;
+
+        if (filter->limit && numof_runs == filter->limit) {
+            *next_id = last_id;
+            break;
+        }
+
+        struct run* run = NULL;
+
+        ret = storage_memory_make_run(storage, id, &run);
+        if (ret < 0)
+            goto run_queue_destroy;
+
+        last_id = id;
+        ++numof_runs;
+
+        /* The page is always returned newest first. */
+        if (ascending)
+            run_queue_add_first(queue, run);
+        else
+            run_queue_add_last(queue, run);
+    }
+
+    return ret;
+
+run_queue_destroy:
+    run_queue_destroy(queue);
+
+    return ret;
+}
+
+int storage_memory_get_runs(
+    struct storage* storage,
+    const struct run_filter* filter,
+    struct run_queue* queue,
+    int* next_id
+) {
+    size_t repo = 0;
+    int ret = 0;
+
+    run_queue_create(queue);
+    *next_id = 0;
+
+    ret = storage_memory_rdlock(storage->memory);
+    if (ret < 0)
+        return ret;
+
+    /* A repository that doesn't exist doesn't have any runs. */
+    if (filter->fields & RUN_FILTER_REPO_URL)
+        if (storage_memory_find_repo(storage->memory, filter->repo_url, &repo) < 0)
+            goto unlock;
+
+    ret = storage_memory_runs_to_page(storage->memory, filter, repo, queue, next_id);
+
+unlock:
+    storage_memory_unlock(storage->memory);
+
+    return ret;
+}
+
+int storage_memory_get_run_queue(struct storage* storage, struct run_queue* queue) {
+    struct storage_memory* memory = storage->memory;
+    int ret = 0;
+
+    run_queue_create(queue);
+
+    ret = storage_memory_rdlock(memory);
+    if (ret < 0)
+        return ret;
+
+    for (size_t i = 0; i < memory->numof_runs; ++i) {
+        if (memory->runs[i].status != RUN_STATUS_CREATED)
+            continue;
+
+        struct run* run = NULL;
+
+        ret = storage_memory_make_run(memory, (int)i + 1, &run);
+        if (ret < 0)
+            goto run_queue_destroy;
+
+        log("Adding run %d for repository %s to the queue\n",
+            run_get_id(run),
+            run_get_repo_url(run));
+        run_queue_add_last(queue, run);
+    }
+
+    goto unlock;
+
+run_queue_destroy:
+    run_queue_destroy(queue);
+
+unlock:
+    storage_memory_unlock(memory);
+
+    return ret;
+}
+
+/* There's no cache, and nothing to prune. */
+void storage_memory_get_stats(UNUSED struct storage* storage, struct storage_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2023 Egor Tensin <egor@tensin.name>
+ * This file is part of the "cimple" project.
+ * For details, see https://github.com/egor-tensin/cimple.
+ * Distributed under the MIT License.
+ */
+
+#ifndef __STORAGE_MEMORY_H__
+#define __STORAGE_MEMORY_H__
+
+/* Everything is kept in memory and lost when the server stops. This is
+ * useful for benchmarking, and for throwaway instances. */
+
+#include "run_queue.h"
+
+#include <stddef.h>
+
+struct storage_settings;
+
+struct storage;
+struct storage_memory;
+
+int storage_memory_settings_create(struct storage_settings*);
+void storage_memory_settings_destroy(const struct storage_settings*);
+
+int storage_memory_create(struct storage*, const struct storage_settings*);
+void storage_memory_destroy(struct storage*);
+
+int storage_memory_run_create(struct storage*, const char* repo_url, const char* rev);
+int storage_memory_run_create_batch(struct storage*, struct run** runs, size_t numof_runs);
+int storage_memory_run_output_append(struct storage*, int id, const struct run_output_chunk*);
+int storage_memory_run_finished(struct storage*, int id, int ec);
+int storage_memory_run_output_read(
+    struct storage*,
+    int id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+);
+
+int storage_memory_get_runs(
+    struct storage*,
+    const struct run_filter*,
+    struct run_queue* runs,
+    int* next_id
+);
+int storage_memory_get_run_queue(struct storage*, struct run_queue* runs);
+
+struct storage_stats;
+
+void storage_memory_get_stats(struct storage*, struct storage_stats*);
+
+#endif
@@ -7,25 +7,59 @@
 
 #include "storage_sqlite.h"
 
+#include "blob_store.h"
+#include "codec.h"
 #include "log.h"
-#include "process.h"
 #include "run_queue.h"
 #include "sql/sqlite_sql.h"
 #include "sqlite.h"
 #include "storage.h"
+#include "string.h"
 
 #include <sqlite3.h>
 
+#include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
+#include <time.h>
 
 struct storage_sqlite_settings {
     char* path;
+    char* blob_dir;
+    char* synchronous;
+    int cache_size;
+    int64_t mmap_size;
+    struct storage_sqlite_retention retention;
 };
 
-int storage_sqlite_settings_create(struct storage_settings* settings, const char* path) {
+/* By default, the blob store is next to the database (like its -wal and -shm
+ * files). */
+static char* storage_sqlite_default_blob_dir(const char* path) {
+    static const char* const suffix = "-blobs";
+
+    char* dir = malloc(strlen(path) + strlen(suffix) + 1);
+    if (!dir) {
+        log_errno("malloc");
+        return NULL;
+    }
+
+    strcpy(dir, path);
+    strcat(dir, suffix);
+    return dir;
+}
+
+int storage_sqlite_settings_create(
+    struct storage_settings* settings,
+    const char* path,
+    const char* blob_dir,
+    const struct storage_sqlite_pragmas* pragmas,
+    const struct storage_sqlite_retention* retention
+) {
     struct storage_sqlite_settings* sqlite = malloc(sizeof(struct storage_sqlite_settings));
     if (!sqlite) {
         log_errno("malloc");
@@ -38,10 +72,38 @@ int storage_sqlite_settings_create(struct storage_settings* settings, const char
         goto free;
     }
 
+    if (blob_dir) {
+        sqlite->blob_dir = strdup(blob_dir);
+        if (!sqlite->blob_dir) {
+            log_errno("strdup");
+            goto free_path;
+        }
+    } else {
+        sqlite->blob_dir = storage_sqlite_default_blob_dir(path);
+        if (!sqlite->blob_dir)
+            goto free_path;
+    }
+
+    sqlite->synchronous = strdup(pragmas->synchronous);
+    if (!sqlite->synchronous) {
+        log_errno("strdup");
+        goto free_blob_dir;
+    }
+
+    sqlite->cache_size = pragmas->cache_size;
+    sqlite->mmap_size = pragmas->mmap_size;
+    sqlite->retention = *retention;
+
     settings->type = STORAGE_TYPE_SQLITE;
     settings->sqlite = sqlite;
     return 0;
 
+free_blob_dir:
+    free(sqlite->blob_dir);
+
+free_path:
+    free(sqlite->path);
+
 free:
     free(sqlite);
 
@@ -49,6 +111,8 @@ free:
 }
 
 void storage_sqlite_settings_destroy(const struct storage_settings* settings) {
+    free(settings->sqlite->synchronous);
+    free(settings->sqlite->blob_dir);
     free(settings->sqlite->path);
     free(settings->sqlite);
 }
@@ -97,17 +161,335 @@ static void prepared_stmt_unlock(struct prepared_stmt* stmt) {
     pthread_errno_if(pthread_mutex_unlock(&stmt->mtx), "pthread_mutex_unlock");
 }
 
+/* A read-only connection, used by a single thread at a time. */
+struct storage_sqlite_reader {
+    sqlite3* db;
+
+    /* There's a statement for every combination of run_filter fields, each
+     * prepared when it's first needed. */
+    sqlite3_stmt* stmt_get_runs[1 << RUN_FILTER_NUMOF_FIELDS];
+    sqlite3_stmt* stmt_get_run_queue;
+    sqlite3_stmt* stmt_get_run_output;
+    sqlite3_stmt* stmt_get_run_output_hash;
+    sqlite3_stmt* stmt_get_unstored_runs;
+    sqlite3_stmt* stmt_get_repo_ids;
+    sqlite3_stmt* stmt_get_old_runs;
+    sqlite3_stmt* stmt_get_old_outputs;
+    sqlite3_stmt* stmt_get_unused_blobs;
+    sqlite3_stmt* stmt_get_blob;
+};
+
+#define STORAGE_SQLITE_NUMOF_READERS 4
+
+enum storage_sqlite_write_type {
+    STORAGE_SQLITE_WRITE_RUN_CREATE,
+    STORAGE_SQLITE_WRITE_RUN_CREATE_BATCH,
+    STORAGE_SQLITE_WRITE_RUN_OUTPUT_APPEND,
+    STORAGE_SQLITE_WRITE_RUN_FINISHED,
+    STORAGE_SQLITE_WRITE_RUN_OUTPUT_STORED,
+    STORAGE_SQLITE_WRITE_RUNS_DELETE,
+    STORAGE_SQLITE_WRITE_RUN_OUTPUTS_DROP,
+    STORAGE_SQLITE_WRITE_BLOBS_DELETE,
+    STORAGE_SQLITE_WRITE_VACUUM,
+};
+
+/* A write is submitted to the writer thread by the thread that needs it done,
+ * which then waits for the result. */
+struct storage_sqlite_write {
+    enum storage_sqlite_write_type type;
+    union {
+        struct {
+            const char* repo_url;
+            const char* rev;
+        } run_create;
+        struct {
+            struct run** runs;
+            size_t numof_runs;
+        } run_create_batch;
+        struct {
+            int run_id;
+            const struct run_output_chunk* chunk;
+        } run_output_append;
+        struct {
+            int run_id;
+            int ec;
+        } run_finished;
+        struct {
+            int run_id;
+            const char* output_hash;
+            size_t output_size;
+        } run_output_stored;
+        struct {
+            const int* ids;
+            size_t numof_ids;
+        } runs_delete;
+        struct {
+            const int* ids;
+            size_t numof_ids;
+        } run_outputs_drop;
+        struct {
+            char (*hashes)[BLOB_HASH_SIZE];
+            size_t numof_hashes;
+            /* Set for every blob that's no longer tracked. */
+            int* deleted;
+        } blobs_delete;
+        struct {
+            size_t max_pages;
+            size_t* reclaimed;
+        } vacuum;
+    };
+
+    int result;
+    int done;
+    SIMPLEQ_ENTRY(storage_sqlite_write) entries;
+};
+
+SIMPLEQ_HEAD(storage_sqlite_write_queue, storage_sqlite_write);
+
+/* Writes are committed in groups: a group is closed once it has this many
+ * writes, or this much time has passed since the first write in it. */
+#define STORAGE_SQLITE_MAX_GROUP_SIZE 256
+#define STORAGE_SQLITE_MAX_GROUP_DELAY_US 1000
+
+/* Repository IDs by URL. There're few repositories, so all of them are kept in
+ * memory, and the common case of queueing a run doesn't touch cimple_repos. */
+struct storage_sqlite_repo {
+    char* url;
+    int id;
+};
+
+struct storage_sqlite_repo_cache {
+    /* Open addressing, the size is a power of 2. */
+    struct storage_sqlite_repo* table;
+    size_t table_size;
+    size_t numof_repos;
+
+    /* Updated by the writer thread, read by whoever wants the stats. */
+    atomic_size_t hits;
+    atomic_size_t misses;
+};
+
+#define STORAGE_SQLITE_REPO_CACHE_INITIAL_SIZE 64
+
+static int storage_sqlite_repo_cache_init(struct storage_sqlite_repo_cache* cache) {
+    cache->table = calloc(STORAGE_SQLITE_REPO_CACHE_INITIAL_SIZE, sizeof(cache->table[0]));
+    if (!cache->table) {
+        log_errno("calloc");
+        return -1;
+    }
+    cache->table_size = STORAGE_SQLITE_REPO_CACHE_INITIAL_SIZE;
+    cache->numof_repos = 0;
+
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    return 0;
+}
+
+static void storage_sqlite_repo_cache_clear(struct storage_sqlite_repo_cache* cache) {
+    for (size_t i = 0; i < cache->table_size; ++i) {
+        free(cache->table[i].url);
+        cache->table[i].url = NULL;
+    }
+    cache->numof_repos = 0;
+}
+
+static void storage_sqlite_repo_cache_destroy(struct storage_sqlite_repo_cache* cache) {
+    storage_sqlite_repo_cache_clear(cache);
+    free(cache->table);
+}
+
+static struct storage_sqlite_repo* storage_sqlite_repo_cache_slot(
+    struct storage_sqlite_repo* table,
+    size_t table_size,
+    const char* url
+) {
+    const size_t mask = table_size - 1;
+
+    for (size_t slot = string_hash(url) & mask;; slot = (slot + 1) & mask)
+        if (!table[slot].url || !strcmp(table[slot].url, url))
+            return &table[slot];
+}
+
+/* Returns 0 if the repository isn't cached. */
+static int storage_sqlite_repo_cache_find(
+    struct storage_sqlite_repo_cache* cache,
+    const char* url
+) {
+    const struct storage_sqlite_repo* repo =
+        storage_sqlite_repo_cache_slot(cache->table, cache->table_size, url);
+
+    if (!repo->url) {
+        atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    return repo->id;
+}
+
+/* Keep the load factor at 50% at most. */
+static int storage_sqlite_repo_cache_grow(struct storage_sqlite_repo_cache* cache) {
+    const size_t table_size = cache->table_size * 2;
+
+    struct storage_sqlite_repo* table = calloc(table_size, sizeof(table[0]));
+    if (!table) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache->table_size; ++i) {
+        const struct storage_sqlite_repo* repo = &cache->table[i];
+        if (repo->url)
+            *storage_sqlite_repo_cache_slot(table, table_size, repo->url) = *repo;
+    }
+
+    free(cache->table);
+    cache->table = table;
+    cache->table_size = table_size;
+    return 0;
+}
+
+static int storage_sqlite_repo_cache_insert(
+    struct storage_sqlite_repo_cache* cache,
+    const char* url,
+    int id
+) {
+    int ret = 0;
+
+    if ((cache->numof_repos + 1) * 2 > cache->table_size) {
+        ret = storage_sqlite_repo_cache_grow(cache);
+        if (ret < 0)
+            return ret;
+    }
+
+    struct storage_sqlite_repo* repo =
+        storage_sqlite_repo_cache_slot(cache->table, cache->table_size, url);
+    if (repo->url) {
+        repo->id = id;
+        return ret;
+    }
+
+    repo->url = strdup(url);
+    if (!repo->url) {
+        log_errno("strdup");
+        return -1;
+    }
+    repo->id = id;
+    ++cache->numof_repos;
+    return ret;
+}
+
 struct storage_sqlite {
+    /* The only read-write connection, it's used by the writer thread
+     * exclusively. */
     sqlite3* db;
 
+    pthread_t writer;
+    pthread_mutex_t writes_mtx;
+    /* Signalled when a write is submitted. */
+    pthread_cond_t writes_cv;
+    /* Broadcast when a group of writes is done. */
+    pthread_cond_t writes_done_cv;
+    struct storage_sqlite_write_queue writes;
+    size_t numof_writes;
+    int stopping;
+
     struct prepared_stmt stmt_repo_find;
     struct prepared_stmt stmt_repo_insert;
     struct prepared_stmt stmt_run_insert;
+    struct prepared_stmt stmt_run_output_clear;
+    struct prepared_stmt stmt_run_output_append;
     struct prepared_stmt stmt_run_finished;
-    struct prepared_stmt stmt_get_runs;
-    struct prepared_stmt stmt_get_run_queue;
+    struct prepared_stmt stmt_run_output_store;
+    struct prepared_stmt stmt_blob_ref;
+    struct prepared_stmt stmt_blob_unref;
+    struct prepared_stmt stmt_blob_delete;
+    struct prepared_stmt stmt_run_delete;
+    struct prepared_stmt stmt_run_output_drop;
+
+    /* Only used by the writer thread (once the storage is created). If a
+     * write is rolled back, the repositories it's inserted are rolled back
+     * too, so the cache is cleared and filled again as the repositories are
+     * looked up. */
+    struct storage_sqlite_repo_cache repos;
+
+    /* The outputs of finished runs. */
+    struct blob_store* blobs;
+    /* Read-locked while a blob is stored and referenced, write-locked while
+     * unreferenced blobs are deleted. */
+    pthread_rwlock_t blobs_lock;
+
+    /* The maintenance thread moves the outputs of finished runs to the blob
+     * store. It first does that for the runs finished before the blob store
+     * was introduced (or while the server was down), then whenever a run
+     * finishes. It also periodically applies the retention policies, deletes
+     * unreferenced blobs and returns free pages to the OS. */
+    pthread_t maintenance;
+    pthread_mutex_t maintenance_mtx;
+    /* Signalled when a run finishes, or the storage is shutting down. */
+    pthread_cond_t maintenance_cv;
+    /* Set when a run finishes; protected by maintenance_mtx. */
+    int migration_pending;
+    atomic_int stop_maintenance;
+    struct storage_sqlite_retention retention;
+
+    atomic_size_t numof_prune_passes;
+    atomic_size_t numof_pruned_runs;
+    atomic_size_t numof_pruned_outputs;
+    atomic_size_t reclaimed_bytes;
+
+    /* Queries go through a pool of read-only connections. The database is in
+     * WAL mode, so they never block the writer (and aren't blocked by it). */
+    struct storage_sqlite_reader readers[STORAGE_SQLITE_NUMOF_READERS];
+    struct storage_sqlite_reader* free_readers[STORAGE_SQLITE_NUMOF_READERS];
+    size_t numof_free_readers;
+    pthread_mutex_t readers_mtx;
+    pthread_cond_t readers_cv;
 };
 
+/* Blocks until the write is committed (or has failed). */
+static int storage_sqlite_write(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_write* write
+) {
+    int ret = 0;
+
+    write->result = -1;
+    write->done = 0;
+
+    ret = pthread_mutex_lock(&storage->writes_mtx);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_lock");
+        return ret;
+    }
+
+    if (storage->stopping) {
+        log_err("SQLite storage is shutting down, can't write\n");
+        ret = -1;
+        goto unlock;
+    }
+
+    SIMPLEQ_INSERT_TAIL(&storage->writes, write, entries);
+    ++storage->numof_writes;
+    pthread_errno_if(pthread_cond_signal(&storage->writes_cv), "pthread_cond_signal");
+
+    while (!write->done) {
+        ret = pthread_cond_wait(&storage->writes_done_cv, &storage->writes_mtx);
+        if (ret) {
+            pthread_errno(ret, "pthread_cond_wait");
+            goto unlock;
+        }
+    }
+
+    ret = write->result;
+
+unlock:
+    pthread_errno_if(pthread_mutex_unlock(&storage->writes_mtx), "pthread_mutex_unlock");
+
+    return ret;
+}
+
+static void* storage_sqlite_writer_main(void*);
+
 static int storage_sqlite_upgrade_to(struct storage_sqlite* storage, size_t version) {
     static const char* const fmt = "%s PRAGMA user_version = %zu;";
 
@@ -174,10 +556,43 @@ static int storage_sqlite_upgrade(struct storage_sqlite* storage) {
     return storage_sqlite_upgrade_from_to(storage, current_version, newest_version);
 }
 
-static int storage_sqlite_setup(struct storage_sqlite* storage) {
+/* These are per-connection. */
+static int storage_sqlite_set_cache_pragmas(
+    sqlite3* db,
+    const struct storage_sqlite_settings* settings
+) {
+    int ret = 0;
+
+    ret = sqlite_set_cache_size(db, settings->cache_size);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_set_mmap_size(db, settings->mmap_size);
+    if (ret < 0)
+        return ret;
+
+    return ret;
+}
+
+static int storage_sqlite_setup(
+    struct storage_sqlite* storage,
+    const struct storage_sqlite_settings* settings
+) {
     int ret = 0;
 
     ret = sqlite_set_foreign_keys(storage->db);
+    if (ret < 0)
+        return ret;
+    /* New databases aren't rebuilt if this is set before anything's written. */
+    ret = sqlite_set_auto_vacuum_incremental(storage->db);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_set_journal_mode_wal(storage->db);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_set_synchronous(storage->db, settings->synchronous);
+    if (ret < 0)
+        return ret;
+    ret = storage_sqlite_set_cache_pragmas(storage->db, settings);
     if (ret < 0)
         return ret;
 
@@ -193,13 +608,24 @@ static int storage_sqlite_prepare_statements(struct storage_sqlite* storage) {
     static const char* const fmt_repo_insert =
         "INSERT INTO cimple_repos(url) VALUES (?) ON CONFLICT(url) DO NOTHING;";
     static const char* const fmt_run_insert =
-        "INSERT INTO cimple_runs(status, exit_code, output, repo_id, repo_rev) VALUES (?, -1, x'', ?, ?) RETURNING id;";
+        "INSERT INTO cimple_runs(status, exit_code, output, repo_id, repo_rev, created_at) VALUES (?, -1, x'', ?, ?, CAST(strftime('%s', 'now') AS INTEGER)) RETURNING id;";
+    static const char* const fmt_run_output_clear =
+        "DELETE FROM cimple_run_output WHERE run_id = ?;";
+    static const char* const fmt_run_output_append =
+        "INSERT INTO cimple_run_output(run_id, offset, size, codec, data) VALUES (?, ?, ?, ?, ?);";
     static const char* const fmt_run_finished =
-        "UPDATE cimple_runs SET status = ?, exit_code = ?, output = ? WHERE id = ?;";
-    static const char* const fmt_get_runs =
-        "SELECT id, status, exit_code, repo_url, repo_rev FROM cimple_runs_view ORDER BY id DESC";
-    static const char* const fmt_get_run_queue =
-        "SELECT id, status, exit_code, repo_url, repo_rev FROM cimple_runs_view WHERE status = ? ORDER BY id;";
+        "UPDATE cimple_runs SET status = ?, exit_code = ? WHERE id = ?;";
+    static const char* const fmt_run_output_store =
+        "UPDATE cimple_runs SET output_hash = ?, output_size = ?, output = x'' WHERE id = ? AND output_hash IS NULL AND output_pruned = 0 RETURNING id;";
+    static const char* const fmt_blob_ref =
+        "INSERT INTO cimple_blobs(hash, refcount) VALUES (?, 1) ON CONFLICT(hash) DO UPDATE SET refcount = refcount + 1;";
+    static const char* const fmt_blob_unref =
+        "UPDATE cimple_blobs SET refcount = refcount - 1 WHERE hash = (SELECT output_hash FROM cimple_runs WHERE id = ?);";
+    static const char* const fmt_blob_delete =
+        "DELETE FROM cimple_blobs WHERE hash = ? AND refcount <= 0 RETURNING hash;";
+    static const char* const fmt_run_delete = "DELETE FROM cimple_runs WHERE id = ? RETURNING id;";
+    static const char* const fmt_run_output_drop =
+        "UPDATE cimple_runs SET output = x'', output_hash = NULL, output_size = 0, output_pruned = 1 WHERE id = ? AND output_pruned = 0 RETURNING id;";
 
     int ret = 0;
 
@@ -212,22 +638,52 @@ static int storage_sqlite_prepare_statements(struct storage_sqlite* storage) {
     ret = prepared_stmt_init(&storage->stmt_run_insert, storage->db, fmt_run_insert);
     if (ret < 0)
         goto finalize_repo_insert;
-    ret = prepared_stmt_init(&storage->stmt_run_finished, storage->db, fmt_run_finished);
+    ret = prepared_stmt_init(&storage->stmt_run_output_clear, storage->db, fmt_run_output_clear);
     if (ret < 0)
         goto finalize_run_insert;
-    ret = prepared_stmt_init(&storage->stmt_get_runs, storage->db, fmt_get_runs);
+    ret = prepared_stmt_init(&storage->stmt_run_output_append, storage->db, fmt_run_output_append);
+    if (ret < 0)
+        goto finalize_run_output_clear;
+    ret = prepared_stmt_init(&storage->stmt_run_finished, storage->db, fmt_run_finished);
+    if (ret < 0)
+        goto finalize_run_output_append;
+    ret = prepared_stmt_init(&storage->stmt_run_output_store, storage->db, fmt_run_output_store);
     if (ret < 0)
         goto finalize_run_finished;
-    ret = prepared_stmt_init(&storage->stmt_get_run_queue, storage->db, fmt_get_run_queue);
+    ret = prepared_stmt_init(&storage->stmt_blob_ref, storage->db, fmt_blob_ref);
+    if (ret < 0)
+        goto finalize_run_output_store;
+    ret = prepared_stmt_init(&storage->stmt_blob_unref, storage->db, fmt_blob_unref);
+    if (ret < 0)
+        goto finalize_blob_ref;
+    ret = prepared_stmt_init(&storage->stmt_blob_delete, storage->db, fmt_blob_delete);
     if (ret < 0)
-        goto finalize_get_runs;
+        goto finalize_blob_unref;
+    ret = prepared_stmt_init(&storage->stmt_run_delete, storage->db, fmt_run_delete);
+    if (ret < 0)
+        goto finalize_blob_delete;
+    ret = prepared_stmt_init(&storage->stmt_run_output_drop, storage->db, fmt_run_output_drop);
+    if (ret < 0)
+        goto finalize_run_delete;
 
     return ret;
 
-finalize_get_runs:
-    prepared_stmt_destroy(&storage->stmt_get_runs);
+finalize_run_delete:
+    prepared_stmt_destroy(&storage->stmt_run_delete);
+finalize_blob_delete:
+    prepared_stmt_destroy(&storage->stmt_blob_delete);
+finalize_blob_unref:
+    prepared_stmt_destroy(&storage->stmt_blob_unref);
+finalize_blob_ref:
+    prepared_stmt_destroy(&storage->stmt_blob_ref);
+finalize_run_output_store:
+    prepared_stmt_destroy(&storage->stmt_run_output_store);
 finalize_run_finished:
     prepared_stmt_destroy(&storage->stmt_run_finished);
+finalize_run_output_append:
+    prepared_stmt_destroy(&storage->stmt_run_output_append);
+finalize_run_output_clear:
+    prepared_stmt_destroy(&storage->stmt_run_output_clear);
 finalize_run_insert:
     prepared_stmt_destroy(&storage->stmt_run_insert);
 finalize_repo_insert:
@@ -239,114 +695,472 @@ finalize_repo_find:
 }
 
 static void storage_sqlite_finalize_statements(struct storage_sqlite* storage) {
-    prepared_stmt_destroy(&storage->stmt_get_run_queue);
-    prepared_stmt_destroy(&storage->stmt_get_runs);
+    prepared_stmt_destroy(&storage->stmt_run_output_drop);
+    prepared_stmt_destroy(&storage->stmt_run_delete);
+    prepared_stmt_destroy(&storage->stmt_blob_delete);
+    prepared_stmt_destroy(&storage->stmt_blob_unref);
+    prepared_stmt_destroy(&storage->stmt_blob_ref);
+    prepared_stmt_destroy(&storage->stmt_run_output_store);
     prepared_stmt_destroy(&storage->stmt_run_finished);
+    prepared_stmt_destroy(&storage->stmt_run_output_append);
+    prepared_stmt_destroy(&storage->stmt_run_output_clear);
     prepared_stmt_destroy(&storage->stmt_run_insert);
     prepared_stmt_destroy(&storage->stmt_repo_insert);
     prepared_stmt_destroy(&storage->stmt_repo_find);
 }
 
-int storage_sqlite_create(struct storage* storage, const struct storage_settings* settings) {
-    int ret = 0;
-
-    log("Using SQLite database at %s\n", settings->sqlite->path);
+static int storage_sqlite_reader_open(
+    struct storage_sqlite_reader* reader,
+    const struct storage_sqlite_settings* settings
+) {
+    static const char* const fmt_get_run_queue =
+        "SELECT id, status, exit_code, repo_url, repo_rev FROM cimple_runs_view WHERE status = ? ORDER BY id;";
+    /* The chunks overlapping [?2, ?3), starting with the one at ?2. */
+    static const char* const fmt_get_run_output =
+        "SELECT offset, size, codec, data FROM cimple_run_output WHERE run_id = ?1 AND offset >= COALESCE((SELECT MAX(offset) FROM cimple_run_output WHERE run_id = ?1 AND offset <= ?2), 0) AND offset < ?3 ORDER BY offset;";
+    static const char* const fmt_get_run_output_hash =
+        "SELECT output_hash FROM cimple_runs WHERE id = ?;";
+    static const char* const fmt_get_unstored_runs =
+        "SELECT id FROM cimple_runs WHERE status = ? AND output_hash IS NULL AND output_pruned = 0 AND id > ? ORDER BY id LIMIT ?;";
+    static const char* const fmt_get_repo_ids =
+        "SELECT id FROM cimple_repos WHERE id > ? ORDER BY id LIMIT ?;";
+    /* Finished runs in repository ?1 that have at least ?3 newer runs. Both
+     * lookups only touch that repository's part of cimple_runs_index_repo_id. */
+    static const char* const fmt_get_old_runs =
+        "SELECT id FROM cimple_runs WHERE repo_id = ?1 AND status = ?2 AND id <= (SELECT id FROM cimple_runs WHERE repo_id = ?1 ORDER BY id DESC LIMIT 1 OFFSET ?3) ORDER BY id LIMIT ?4;";
+    /* This walks cimple_runs_index_unpruned, so the runs that have had their
+     * outputs dropped already aren't visited again. */
+    static const char* const fmt_get_old_outputs =
+        "SELECT id FROM cimple_runs WHERE status = ? AND created_at < ? AND output_pruned = 0 ORDER BY created_at LIMIT ?;";
+    static const char* const fmt_get_unused_blobs =
+        "SELECT hash FROM cimple_blobs WHERE refcount <= 0 LIMIT ?;";
+    static const char* const fmt_get_blob = "SELECT refcount FROM cimple_blobs WHERE hash = ?;";
 
-    struct storage_sqlite* sqlite = malloc(sizeof(struct storage_sqlite));
-    if (!sqlite) {
-        log_errno("malloc");
-        return -1;
-    }
+    int ret = 0;
 
-    ret = sqlite_init();
+    ret = sqlite_open_ro(settings->path, &reader->db);
     if (ret < 0)
-        goto free;
-    ret = sqlite_open_rw(settings->sqlite->path, &sqlite->db);
-    if (ret < 0)
-        goto destroy;
-    ret = storage_sqlite_setup(sqlite);
+        return ret;
+    ret = storage_sqlite_set_cache_pragmas(reader->db, settings);
     if (ret < 0)
         goto close;
-    ret = storage_sqlite_prepare_statements(sqlite);
+
+    memset(reader->stmt_get_runs, 0, sizeof(reader->stmt_get_runs));
+    ret = sqlite_prepare(reader->db, fmt_get_run_queue, &reader->stmt_get_run_queue);
     if (ret < 0)
         goto close;
+    ret = sqlite_prepare(reader->db, fmt_get_run_output, &reader->stmt_get_run_output);
+    if (ret < 0)
+        goto finalize_get_run_queue;
+    ret = sqlite_prepare(reader->db, fmt_get_run_output_hash, &reader->stmt_get_run_output_hash);
+    if (ret < 0)
+        goto finalize_get_run_output;
+    ret = sqlite_prepare(reader->db, fmt_get_unstored_runs, &reader->stmt_get_unstored_runs);
+    if (ret < 0)
+        goto finalize_get_run_output_hash;
+    ret = sqlite_prepare(reader->db, fmt_get_repo_ids, &reader->stmt_get_repo_ids);
+    if (ret < 0)
+        goto finalize_get_unstored_runs;
+    ret = sqlite_prepare(reader->db, fmt_get_old_runs, &reader->stmt_get_old_runs);
+    if (ret < 0)
+        goto finalize_get_repo_ids;
+    ret = sqlite_prepare(reader->db, fmt_get_old_outputs, &reader->stmt_get_old_outputs);
+    if (ret < 0)
+        goto finalize_get_old_runs;
+    ret = sqlite_prepare(reader->db, fmt_get_unused_blobs, &reader->stmt_get_unused_blobs);
+    if (ret < 0)
+        goto finalize_get_old_outputs;
+    ret = sqlite_prepare(reader->db, fmt_get_blob, &reader->stmt_get_blob);
+    if (ret < 0)
+        goto finalize_get_unused_blobs;
 
-    storage->sqlite = sqlite;
     return ret;
 
+finalize_get_unused_blobs:
+    sqlite_finalize(reader->stmt_get_unused_blobs);
+finalize_get_old_outputs:
+    sqlite_finalize(reader->stmt_get_old_outputs);
+finalize_get_old_runs:
+    sqlite_finalize(reader->stmt_get_old_runs);
+finalize_get_repo_ids:
+    sqlite_finalize(reader->stmt_get_repo_ids);
+finalize_get_unstored_runs:
+    sqlite_finalize(reader->stmt_get_unstored_runs);
+finalize_get_run_output_hash:
+    sqlite_finalize(reader->stmt_get_run_output_hash);
+finalize_get_run_output:
+    sqlite_finalize(reader->stmt_get_run_output);
+finalize_get_run_queue:
+    sqlite_finalize(reader->stmt_get_run_queue);
 close:
-    sqlite_close(storage->sqlite->db);
-destroy:
-    sqlite_destroy();
-free:
-    free(sqlite);
+    sqlite_close(reader->db);
 
     return ret;
 }
 
-void storage_sqlite_destroy(struct storage* storage) {
-    storage_sqlite_finalize_statements(storage->sqlite);
-    sqlite_close(storage->sqlite->db);
-    sqlite_destroy();
-    free(storage->sqlite);
+static void storage_sqlite_reader_close(struct storage_sqlite_reader* reader) {
+    sqlite_finalize(reader->stmt_get_blob);
+    sqlite_finalize(reader->stmt_get_unused_blobs);
+    sqlite_finalize(reader->stmt_get_old_outputs);
+    sqlite_finalize(reader->stmt_get_old_runs);
+    sqlite_finalize(reader->stmt_get_repo_ids);
+    sqlite_finalize(reader->stmt_get_unstored_runs);
+    sqlite_finalize(reader->stmt_get_run_output_hash);
+    sqlite_finalize(reader->stmt_get_run_output);
+    sqlite_finalize(reader->stmt_get_run_queue);
+    for (size_t i = 0; i < sizeof(reader->stmt_get_runs) / sizeof(reader->stmt_get_runs[0]); ++i)
+        if (reader->stmt_get_runs[i])
+            sqlite_finalize(reader->stmt_get_runs[i]);
+    sqlite_close(reader->db);
 }
 
-static int storage_sqlite_find_repo(struct storage_sqlite* storage, const char* url) {
-    struct prepared_stmt* stmt = &storage->stmt_repo_find;
+static void storage_sqlite_close_readers(struct storage_sqlite* storage, size_t numof_readers) {
+    for (size_t i = 0; i < numof_readers; ++i)
+        storage_sqlite_reader_close(&storage->readers[i]);
+}
+
+/* The readers must be opened after the schema is upgraded. */
+static int storage_sqlite_open_readers(
+    struct storage_sqlite* storage,
+    const struct storage_sqlite_settings* settings
+) {
     int ret = 0;
 
-    ret = prepared_stmt_lock(stmt);
-    if (ret < 0)
+    for (size_t i = 0; i < STORAGE_SQLITE_NUMOF_READERS; ++i) {
+        ret = storage_sqlite_reader_open(&storage->readers[i], settings);
+        if (ret < 0) {
+            storage_sqlite_close_readers(storage, i);
+            return ret;
+        }
+        storage->free_readers[i] = &storage->readers[i];
+    }
+    storage->numof_free_readers = STORAGE_SQLITE_NUMOF_READERS;
+
+    return ret;
+}
+
+static int storage_sqlite_reader_acquire(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_reader** reader
+) {
+    int ret = 0;
+
+    ret = pthread_mutex_lock(&storage->readers_mtx);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_lock");
         return ret;
-    ret = sqlite_bind_text(stmt->impl, 1, url);
-    if (ret < 0)
-        goto reset;
-    ret = sqlite_step(stmt->impl);
-    if (ret < 0)
-        goto reset;
+    }
 
-    if (!ret)
-        goto reset;
+    while (!storage->numof_free_readers) {
+        ret = pthread_cond_wait(&storage->readers_cv, &storage->readers_mtx);
+        if (ret) {
+            pthread_errno(ret, "pthread_cond_wait");
+            goto unlock;
+        }
+    }
 
-    ret = sqlite_column_int(stmt->impl, 0);
-    goto reset;
+    *reader = storage->free_readers[--storage->numof_free_readers];
 
-reset:
-    sqlite_reset(stmt->impl);
-    prepared_stmt_unlock(stmt);
+unlock:
+    pthread_errno_if(pthread_mutex_unlock(&storage->readers_mtx), "pthread_mutex_unlock");
 
     return ret;
 }
 
-static int storage_sqlite_insert_repo(struct storage_sqlite* storage, const char* url) {
-    struct prepared_stmt* stmt = &storage->stmt_repo_insert;
+static void storage_sqlite_reader_release(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_reader* reader
+) {
+    pthread_errno_if(pthread_mutex_lock(&storage->readers_mtx), "pthread_mutex_lock");
+    storage->free_readers[storage->numof_free_readers++] = reader;
+    pthread_errno_if(pthread_cond_signal(&storage->readers_cv), "pthread_cond_signal");
+    pthread_errno_if(pthread_mutex_unlock(&storage->readers_mtx), "pthread_mutex_unlock");
+}
+
+static int storage_sqlite_writer_start(struct storage_sqlite* storage) {
+    pthread_condattr_t attr;
     int ret = 0;
 
-    ret = prepared_stmt_lock(stmt);
-    if (ret < 0)
+    SIMPLEQ_INIT(&storage->writes);
+    storage->numof_writes = 0;
+    storage->stopping = 0;
+
+    ret = pthread_mutex_init(&storage->writes_mtx, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_init");
         return ret;
-    ret = sqlite_bind_text(stmt->impl, 1, url);
-    if (ret < 0)
-        goto reset;
-    ret = sqlite_step(stmt->impl);
-    if (ret < 0)
-        goto reset;
+    }
 
-reset:
-    sqlite_reset(stmt->impl);
-    prepared_stmt_unlock(stmt);
+    ret = pthread_condattr_init(&attr);
+    if (ret) {
+        pthread_errno(ret, "pthread_condattr_init");
+        goto destroy_mtx;
+    }
 
-    if (ret < 0)
-        return ret;
+    /* The writer waits for more writes with a timeout. */
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (ret) {
+        pthread_errno(ret, "pthread_condattr_setclock");
+        goto destroy_attr;
+    }
 
-    return storage_sqlite_find_repo(storage, url);
+    ret = pthread_cond_init(&storage->writes_cv, &attr);
+    if (ret) {
+        pthread_errno(ret, "pthread_cond_init");
+        goto destroy_attr;
+    }
+
+    ret = pthread_cond_init(&storage->writes_done_cv, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_cond_init");
+        goto destroy_cv;
+    }
+
+    ret = pthread_create(&storage->writer, NULL, storage_sqlite_writer_main, storage);
+    if (ret) {
+        pthread_errno(ret, "pthread_create");
+        goto destroy_done_cv;
+    }
+
+    pthread_errno_if(pthread_condattr_destroy(&attr), "pthread_condattr_destroy");
+    return ret;
+
+destroy_done_cv:
+    pthread_errno_if(pthread_cond_destroy(&storage->writes_done_cv), "pthread_cond_destroy");
+destroy_cv:
+    pthread_errno_if(pthread_cond_destroy(&storage->writes_cv), "pthread_cond_destroy");
+destroy_attr:
+    pthread_errno_if(pthread_condattr_destroy(&attr), "pthread_condattr_destroy");
+destroy_mtx:
+    pthread_errno_if(pthread_mutex_destroy(&storage->writes_mtx), "pthread_mutex_destroy");
+
+    return ret;
 }
 
-static int storage_sqlite_insert_run(struct storage_sqlite* storage, int repo_id, const char* rev) {
-    struct prepared_stmt* stmt = &storage->stmt_run_insert;
+/* Pending writes are committed before the writer thread exits. */
+static void storage_sqlite_writer_stop(struct storage_sqlite* storage) {
+    pthread_errno_if(pthread_mutex_lock(&storage->writes_mtx), "pthread_mutex_lock");
+    storage->stopping = 1;
+    pthread_errno_if(pthread_cond_signal(&storage->writes_cv), "pthread_cond_signal");
+    pthread_errno_if(pthread_mutex_unlock(&storage->writes_mtx), "pthread_mutex_unlock");
+
+    pthread_errno_if(pthread_join(storage->writer, NULL), "pthread_join");
+
+    pthread_errno_if(pthread_cond_destroy(&storage->writes_done_cv), "pthread_cond_destroy");
+    pthread_errno_if(pthread_cond_destroy(&storage->writes_cv), "pthread_cond_destroy");
+    pthread_errno_if(pthread_mutex_destroy(&storage->writes_mtx), "pthread_mutex_destroy");
+}
+
+static int storage_sqlite_maintenance_start(struct storage_sqlite*);
+static void storage_sqlite_maintenance_stop(struct storage_sqlite*);
+
+static int storage_sqlite_load_repos(struct storage_sqlite* storage) {
+    static const char* const fmt_get_repos = "SELECT id, url FROM cimple_repos;";
+
+    sqlite3_stmt* stmt = NULL;
     int ret = 0;
 
-    ret = prepared_stmt_lock(stmt);
+    ret = storage_sqlite_repo_cache_init(&storage->repos);
+    if (ret < 0)
+        return ret;
+
+    ret = sqlite_prepare(storage->db, fmt_get_repos, &stmt);
+    if (ret < 0)
+        goto destroy_cache;
+
+    while (1) {
+        ret = sqlite_step(stmt);
+        if (!ret)
+            break;
+        if (ret < 0)
+            goto finalize;
+
+        int id = sqlite_column_int(stmt, 0);
+        char* url = NULL;
+        ret = sqlite_column_text(stmt, 1, &url);
+        if (ret < 0)
+            goto finalize;
+
+        ret = storage_sqlite_repo_cache_insert(&storage->repos, url, id);
+        free(url);
+        if (ret < 0)
+            goto finalize;
+    }
+
+    sqlite_finalize(stmt);
+    log("Loaded %zu repositories\n", storage->repos.numof_repos);
+    return ret;
+
+finalize:
+    sqlite_finalize(stmt);
+
+destroy_cache:
+    storage_sqlite_repo_cache_destroy(&storage->repos);
+
+    return ret;
+}
+
+int storage_sqlite_create(struct storage* storage, const struct storage_settings* settings) {
+    int ret = 0;
+
+    log("Using SQLite database at %s\n", settings->sqlite->path);
+
+    struct storage_sqlite* sqlite = malloc(sizeof(struct storage_sqlite));
+    if (!sqlite) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    ret = pthread_mutex_init(&sqlite->readers_mtx, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_init");
+        goto free;
+    }
+
+    ret = pthread_cond_init(&sqlite->readers_cv, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_cond_init");
+        goto destroy_readers_mtx;
+    }
+
+    ret = pthread_rwlock_init(&sqlite->blobs_lock, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_rwlock_init");
+        goto destroy_readers_cv;
+    }
+
+    sqlite->retention = settings->sqlite->retention;
+
+    ret = sqlite_init();
+    if (ret < 0)
+        goto destroy_blobs_lock;
+    ret = sqlite_open_rw(settings->sqlite->path, &sqlite->db);
+    if (ret < 0)
+        goto destroy;
+    ret = storage_sqlite_setup(sqlite, settings->sqlite);
+    if (ret < 0)
+        goto close;
+    ret = storage_sqlite_prepare_statements(sqlite);
+    if (ret < 0)
+        goto close;
+    ret = storage_sqlite_load_repos(sqlite);
+    if (ret < 0)
+        goto finalize_statements;
+    ret = storage_sqlite_open_readers(sqlite, settings->sqlite);
+    if (ret < 0)
+        goto destroy_repos;
+    ret = blob_store_create(&sqlite->blobs, settings->sqlite->blob_dir);
+    if (ret < 0)
+        goto close_readers;
+    ret = storage_sqlite_writer_start(sqlite);
+    if (ret < 0)
+        goto destroy_blobs;
+    ret = storage_sqlite_maintenance_start(sqlite);
+    if (ret < 0)
+        goto stop_writer;
+
+    storage->sqlite = sqlite;
+    return ret;
+
+stop_writer:
+    storage_sqlite_writer_stop(sqlite);
+destroy_blobs:
+    blob_store_destroy(sqlite->blobs);
+close_readers:
+    storage_sqlite_close_readers(sqlite, STORAGE_SQLITE_NUMOF_READERS);
+destroy_repos:
+    storage_sqlite_repo_cache_destroy(&sqlite->repos);
+finalize_statements:
+    storage_sqlite_finalize_statements(sqlite);
+close:
+    sqlite_close(sqlite->db);
+destroy:
+    sqlite_destroy();
+destroy_blobs_lock:
+    pthread_errno_if(pthread_rwlock_destroy(&sqlite->blobs_lock), "pthread_rwlock_destroy");
+destroy_readers_cv:
+    pthread_errno_if(pthread_cond_destroy(&sqlite->readers_cv), "pthread_cond_destroy");
+destroy_readers_mtx:
+    pthread_errno_if(pthread_mutex_destroy(&sqlite->readers_mtx), "pthread_mutex_destroy");
+free:
+    free(sqlite);
+
+    return ret;
+}
+
+void storage_sqlite_destroy(struct storage* storage) {
+    storage_sqlite_maintenance_stop(storage->sqlite);
+    storage_sqlite_writer_stop(storage->sqlite);
+    blob_store_destroy(storage->sqlite->blobs);
+    storage_sqlite_close_readers(storage->sqlite, STORAGE_SQLITE_NUMOF_READERS);
+    storage_sqlite_repo_cache_destroy(&storage->sqlite->repos);
+    storage_sqlite_finalize_statements(storage->sqlite);
+    sqlite_close(storage->sqlite->db);
+    sqlite_destroy();
+    pthread_errno_if(
+        pthread_rwlock_destroy(&storage->sqlite->blobs_lock), "pthread_rwlock_destroy"
+    );
+    pthread_errno_if(pthread_cond_destroy(&storage->sqlite->readers_cv), "pthread_cond_destroy");
+    pthread_errno_if(pthread_mutex_destroy(&storage->sqlite->readers_mtx), "pthread_mutex_destroy");
+    free(storage->sqlite);
+}
+
+static int storage_sqlite_find_repo(struct storage_sqlite* storage, const char* url) {
+    struct prepared_stmt* stmt = &storage->stmt_repo_find;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_text(stmt->impl, 1, url);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+    if (!ret)
+        goto reset;
+
+    ret = sqlite_column_int(stmt->impl, 0);
+    goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+static int storage_sqlite_insert_repo(struct storage_sqlite* storage, const char* url) {
+    struct prepared_stmt* stmt = &storage->stmt_repo_insert;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_text(stmt->impl, 1, url);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    if (ret < 0)
+        return ret;
+
+    return storage_sqlite_find_repo(storage, url);
+}
+
+static int storage_sqlite_insert_run(struct storage_sqlite* storage, int repo_id, const char* rev) {
+    struct prepared_stmt* stmt = &storage->stmt_run_insert;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
     if (ret < 0)
         return ret;
     ret = sqlite_bind_int(stmt->impl, 1, RUN_STATUS_CREATED);
@@ -354,76 +1168,1745 @@ static int storage_sqlite_insert_run(struct storage_sqlite* storage, int repo_id
         goto reset;
     ret = sqlite_bind_int(stmt->impl, 2, repo_id);
     if (ret < 0)
-        goto reset;
-    ret = sqlite_bind_text(stmt->impl, 3, rev);
+        goto reset;
+    ret = sqlite_bind_text(stmt->impl, 3, rev);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+    if (!ret) {
+        ret = -1;
+        log_err("Failed to insert a run\n");
+        goto reset;
+    }
+
+    ret = sqlite_column_int(stmt->impl, 0);
+    goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+static int storage_sqlite_get_repo_id(struct storage_sqlite* storage, const char* url) {
+    int ret = 0;
+
+    ret = storage_sqlite_repo_cache_find(&storage->repos, url);
+    if (ret)
+        return ret;
+
+    ret = storage_sqlite_insert_repo(storage, url);
+    if (ret < 0)
+        return ret;
+    int id = ret;
+
+    ret = storage_sqlite_repo_cache_insert(&storage->repos, url, id);
+    if (ret < 0)
+        return ret;
+
+    return id;
+}
+
+static int storage_sqlite_insert_repo_run(
+    struct storage_sqlite* storage,
+    const char* repo_url,
+    const char* rev
+) {
+    int ret = 0;
+
+    ret = storage_sqlite_get_repo_id(storage, repo_url);
+    if (ret < 0)
+        return ret;
+
+    ret = storage_sqlite_insert_run(storage, ret, rev);
+    if (ret < 0)
+        return ret;
+
+    return ret;
+}
+
+int storage_sqlite_run_create(struct storage* storage, const char* repo_url, const char* rev) {
+    struct storage_sqlite_write write = {
+        .type = STORAGE_SQLITE_WRITE_RUN_CREATE,
+        .run_create = {repo_url, rev},
+    };
+    return storage_sqlite_write(storage->sqlite, &write);
+}
+
+static int storage_sqlite_insert_repo_runs(
+    struct storage_sqlite* storage,
+    struct run** runs,
+    size_t numof_runs
+) {
+    int ret = 0;
+
+    for (size_t i = 0; i < numof_runs; ++i) {
+        ret = storage_sqlite_insert_repo_run(
+            storage, run_get_repo_url(runs[i]), run_get_repo_rev(runs[i])
+        );
+        if (ret < 0)
+            return ret;
+        run_set_id(runs[i], ret);
+    }
+
+    return ret;
+}
+
+int storage_sqlite_run_create_batch(struct storage* storage, struct run** runs, size_t numof_runs) {
+    struct storage_sqlite_write write = {
+        .type = STORAGE_SQLITE_WRITE_RUN_CREATE_BATCH,
+        .run_create_batch = {runs, numof_runs},
+    };
+    return storage_sqlite_write(storage->sqlite, &write);
+}
+
+static int storage_sqlite_run_output_clear(struct storage_sqlite* storage, int run_id) {
+    struct prepared_stmt* stmt = &storage->stmt_run_output_clear;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_int(stmt->impl, 1, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+static int storage_sqlite_run_output_insert(
+    struct storage_sqlite* storage,
+    int run_id,
+    const struct run_output_chunk* chunk
+) {
+    struct prepared_stmt* stmt = &storage->stmt_run_output_append;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_int(stmt->impl, 1, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt->impl, 2, (sqlite3_int64)chunk->offset);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt->impl, 3, (sqlite3_int64)chunk->size);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int(stmt->impl, 4, chunk->codec);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_blob(stmt->impl, 5, chunk->data, chunk->data_size);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+static int storage_sqlite_run_output_write(
+    struct storage_sqlite* storage,
+    int run_id,
+    const struct run_output_chunk* chunk
+) {
+    int ret = 0;
+
+    /* The run might have been started before (e.g. if the server was restarted
+     * while it was in progress). */
+    if (!chunk->offset) {
+        ret = storage_sqlite_run_output_clear(storage, run_id);
+        if (ret < 0)
+            return ret;
+    }
+
+    return storage_sqlite_run_output_insert(storage, run_id, chunk);
+}
+
+int storage_sqlite_run_output_append(
+    struct storage* storage,
+    int run_id,
+    const struct run_output_chunk* chunk
+) {
+    struct storage_sqlite_write write = {
+        .type = STORAGE_SQLITE_WRITE_RUN_OUTPUT_APPEND,
+        .run_output_append = {run_id, chunk},
+    };
+    return storage_sqlite_write(storage->sqlite, &write);
+}
+
+static int storage_sqlite_set_run_finished(struct storage_sqlite* storage, int run_id, int ec) {
+    struct prepared_stmt* stmt = &storage->stmt_run_finished;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_int(stmt->impl, 1, RUN_STATUS_FINISHED);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int(stmt->impl, 2, ec);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int(stmt->impl, 3, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+static int storage_sqlite_ref_blob(struct storage_sqlite* storage, const char* hash) {
+    struct prepared_stmt* stmt = &storage->stmt_blob_ref;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_text(stmt->impl, 1, hash);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+/* Points the run to its output in the blob store, and drops the copy in the
+ * database. Does nothing and returns 0 if that's been done already, or if the
+ * output's been pruned. */
+static int storage_sqlite_run_output_stored(
+    struct storage_sqlite* storage,
+    int run_id,
+    const char* hash,
+    size_t size
+) {
+    struct prepared_stmt* stmt = &storage->stmt_run_output_store;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_text(stmt->impl, 1, hash);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt->impl, 2, (sqlite3_int64)size);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int(stmt->impl, 3, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    if (ret <= 0)
+        return ret;
+
+    ret = storage_sqlite_ref_blob(storage, hash);
+    if (ret < 0)
+        return ret;
+    ret = storage_sqlite_run_output_clear(storage, run_id);
+    if (ret < 0)
+        return ret;
+
+    return 1;
+}
+
+/* Binds the run ID to the statement, and returns 1 if the run's been affected
+ * (for statements that return something). */
+static int storage_sqlite_exec_run_stmt(struct prepared_stmt* stmt, int run_id) {
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_int(stmt->impl, 1, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+/* The chunks of the output are deleted along with the run. The blob with the
+ * output loses a reference; it's deleted later if that was the last one. */
+static int storage_sqlite_delete_run(struct storage_sqlite* storage, int run_id) {
+    int ret = 0;
+
+    ret = storage_sqlite_exec_run_stmt(&storage->stmt_blob_unref, run_id);
+    if (ret < 0)
+        return ret;
+
+    return storage_sqlite_exec_run_stmt(&storage->stmt_run_delete, run_id);
+}
+
+/* Returns the number of runs deleted. */
+static int storage_sqlite_delete_runs(
+    struct storage_sqlite* storage,
+    const int* ids,
+    size_t numof_ids
+) {
+    int numof_deleted = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < numof_ids; ++i) {
+        ret = storage_sqlite_delete_run(storage, ids[i]);
+        if (ret < 0)
+            return ret;
+        numof_deleted += ret;
+    }
+
+    return numof_deleted;
+}
+
+static int storage_sqlite_drop_run_output(struct storage_sqlite* storage, int run_id) {
+    int ret = 0;
+
+    ret = storage_sqlite_exec_run_stmt(&storage->stmt_blob_unref, run_id);
+    if (ret < 0)
+        return ret;
+    ret = storage_sqlite_exec_run_stmt(&storage->stmt_run_output_drop, run_id);
+    if (ret <= 0)
+        return ret;
+    ret = storage_sqlite_run_output_clear(storage, run_id);
+    if (ret < 0)
+        return ret;
+
+    return 1;
+}
+
+/* Returns the number of outputs dropped. */
+static int storage_sqlite_drop_run_outputs(
+    struct storage_sqlite* storage,
+    const int* ids,
+    size_t numof_ids
+) {
+    int numof_dropped = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < numof_ids; ++i) {
+        ret = storage_sqlite_drop_run_output(storage, ids[i]);
+        if (ret < 0)
+            return ret;
+        numof_dropped += ret;
+    }
+
+    return numof_dropped;
+}
+
+/* Stops tracking the blob, unless it's been referenced again. */
+static int storage_sqlite_delete_blob(struct storage_sqlite* storage, const char* hash) {
+    struct prepared_stmt* stmt = &storage->stmt_blob_delete;
+    int ret = 0;
+
+    ret = prepared_stmt_lock(stmt);
+    if (ret < 0)
+        return ret;
+    ret = sqlite_bind_text(stmt->impl, 1, hash);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt->impl);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt->impl);
+    prepared_stmt_unlock(stmt);
+
+    return ret;
+}
+
+/* Returns the number of blobs no longer tracked; the files are deleted by the
+ * caller, once that's committed. */
+static int storage_sqlite_delete_blobs(
+    struct storage_sqlite* storage,
+    char (*hashes)[BLOB_HASH_SIZE],
+    size_t numof_hashes,
+    int* deleted
+) {
+    int numof_deleted = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < numof_hashes; ++i) {
+        ret = storage_sqlite_delete_blob(storage, hashes[i]);
+        if (ret < 0)
+            return ret;
+        deleted[i] = ret;
+        numof_deleted += ret;
+    }
+
+    return numof_deleted;
+}
+
+/* The output of a run is never read as a whole, but piece by piece: chunk by
+ * chunk, or in pieces of this size if it's a single blob. This way, the memory
+ * needed depends on the size of the chunks, not the size of the output. */
+#define STORAGE_SQLITE_OUTPUT_PIECE_SIZE (64 * 1024)
+
+/* Called for every consecutive piece of the (uncompressed) output. */
+typedef int (*storage_sqlite_output_cb)(const void* data, size_t size, void* arg);
+
+/* Pieces that need to be decompressed (or copied) go here. */
+struct storage_sqlite_scratch {
+    unsigned char* data;
+    size_t capacity;
+};
+
+static int storage_sqlite_scratch_reserve(struct storage_sqlite_scratch* scratch, size_t size) {
+    if (size <= scratch->capacity)
+        return 0;
+
+    unsigned char* data = realloc(scratch->data, size);
+    if (!data) {
+        log_errno("realloc");
+        return -1;
+    }
+
+    scratch->data = data;
+    scratch->capacity = size;
+    return 0;
+}
+
+/* The part of the output that's read, [begin, end). */
+struct storage_sqlite_range {
+    size_t begin;
+    size_t end;
+};
+
+/* Returns the number of chunks read. */
+static int storage_sqlite_read_run_chunks(
+    struct storage_sqlite_reader* reader,
+    int run_id,
+    const struct storage_sqlite_range* range,
+    struct storage_sqlite_scratch* scratch,
+    storage_sqlite_output_cb callback,
+    void* arg
+) {
+    sqlite3_stmt* stmt = reader->stmt_get_run_output;
+    size_t pos = range->begin;
+    int numof_chunks = 0;
+    int ret = 0;
+
+    ret = sqlite_bind_int(stmt, 1, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 2, (sqlite3_int64)range->begin);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(
+        stmt, 3, range->end > INT64_MAX ? INT64_MAX : (sqlite3_int64)range->end
+    );
+    if (ret < 0)
+        goto reset;
+
+    while (1) {
+        ret = sqlite_step(stmt);
+        if (!ret)
+            break;
+        if (ret < 0)
+            goto reset;
+
+        ++numof_chunks;
+
+        size_t offset = (size_t)sqlite_column_int64(stmt, 0);
+        size_t size = (size_t)sqlite_column_int64(stmt, 1);
+        enum codec codec = (enum codec)sqlite_column_int(stmt, 2);
+
+        if (offset > pos) {
+            log_err("Output of run %d is missing data at offset %zu\n", run_id, pos);
+            ret = -1;
+            goto reset;
+        }
+        /* The range starts past the end of the output. */
+        if (offset + size <= pos)
+            continue;
+
+        const void* data = NULL;
+        size_t data_size = 0;
+        ret = sqlite_column_blob_ref(stmt, 3, &data, &data_size);
+        if (ret < 0)
+            goto reset;
+
+        if (codec != CODEC_NONE || data_size != size) {
+            ret = storage_sqlite_scratch_reserve(scratch, size);
+            if (ret < 0)
+                goto reset;
+            ret = codec_decompress(codec, data, data_size, scratch->data, size);
+            if (ret < 0)
+                goto reset;
+            data = scratch->data;
+        }
+
+        size_t skip = pos - offset;
+        size_t piece_size = size - skip;
+        if (piece_size > range->end - pos)
+            piece_size = range->end - pos;
+
+        ret = callback((const unsigned char*)data + skip, piece_size, arg);
+        if (ret < 0)
+            goto reset;
+
+        pos += piece_size;
+    }
+
+    ret = numof_chunks;
+
+reset:
+    sqlite_reset(stmt);
+
+    return ret;
+}
+
+/* The runs finished before the output was streamed have it in
+ * cimple_runs.output, which is read incrementally. */
+static int storage_sqlite_read_run_inline_output(
+    struct storage_sqlite_reader* reader,
+    int run_id,
+    const struct storage_sqlite_range* range,
+    struct storage_sqlite_scratch* scratch,
+    storage_sqlite_output_cb callback,
+    void* arg
+) {
+    sqlite3_blob* blob = NULL;
+    int ret = 0;
+
+    ret = sqlite_blob_open_ro(reader->db, "cimple_runs", "output", run_id, &blob);
+    if (ret < 0)
+        return ret;
+
+    size_t end = sqlite_blob_size(blob);
+    if (end > range->end)
+        end = range->end;
+
+    ret = storage_sqlite_scratch_reserve(scratch, STORAGE_SQLITE_OUTPUT_PIECE_SIZE);
+    if (ret < 0)
+        goto close;
+
+    for (size_t pos = range->begin; pos < end;) {
+        size_t piece_size = end - pos;
+        if (piece_size > STORAGE_SQLITE_OUTPUT_PIECE_SIZE)
+            piece_size = STORAGE_SQLITE_OUTPUT_PIECE_SIZE;
+
+        ret = sqlite_blob_read(blob, scratch->data, piece_size, pos);
+        if (ret < 0)
+            goto close;
+        ret = callback(scratch->data, piece_size, arg);
+        if (ret < 0)
+            goto close;
+
+        pos += piece_size;
+    }
+
+close:
+    sqlite_blob_close(blob);
+
+    return ret;
+}
+
+/* Reads the part of the output of a run that's still in the database,
+ * decompressing it as necessary. */
+static int storage_sqlite_read_run_output(
+    struct storage_sqlite_reader* reader,
+    int run_id,
+    const struct storage_sqlite_range* range,
+    storage_sqlite_output_cb callback,
+    void* arg
+) {
+    struct storage_sqlite_scratch scratch = {NULL, 0};
+    int ret = 0;
+
+    ret = storage_sqlite_read_run_chunks(reader, run_id, range, &scratch, callback, arg);
+    if (ret < 0)
+        goto free;
+    if (ret > 0) {
+        ret = 0;
+        goto free;
+    }
+
+    ret = storage_sqlite_read_run_inline_output(reader, run_id, range, &scratch, callback, arg);
+    if (ret < 0)
+        goto free;
+
+free:
+    free(scratch.data);
+
+    return ret;
+}
+
+struct storage_sqlite_put_ctx {
+    struct blob_store_writer* writer;
+    size_t size;
+};
+
+static int storage_sqlite_put_piece(const void* data, size_t size, void* _ctx) {
+    struct storage_sqlite_put_ctx* ctx = (struct storage_sqlite_put_ctx*)_ctx;
+    ctx->size += size;
+    return blob_store_writer_write(ctx->writer, data, size);
+}
+
+/* Puts the output of a run into the blob store. It's up to the caller to then
+ * point the run to it. */
+static int storage_sqlite_put_run_output(
+    struct storage_sqlite* storage,
+    int run_id,
+    char* hash,
+    size_t* size
+) {
+    static const struct storage_sqlite_range everything = {0, SIZE_MAX};
+
+    struct storage_sqlite_reader* reader = NULL;
+    struct storage_sqlite_put_ctx ctx = {NULL, 0};
+    int ret = 0;
+
+    ret = blob_store_writer_create(storage->blobs, &ctx.writer);
+    if (ret < 0)
+        return ret;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        goto abort;
+    ret = storage_sqlite_read_run_output(
+        reader, run_id, &everything, storage_sqlite_put_piece, &ctx
+    );
+    storage_sqlite_reader_release(storage, reader);
+    if (ret < 0)
+        goto abort;
+
+    ret = blob_store_writer_commit(ctx.writer, hash);
+    if (ret < 0)
+        return ret;
+
+    *size = ctx.size;
+    return ret;
+
+abort:
+    blob_store_writer_abort(ctx.writer);
+
+    return ret;
+}
+
+struct storage_sqlite_copy_ctx {
+    unsigned char* buf;
+    size_t size;
+};
+
+static int storage_sqlite_copy_piece(const void* data, size_t size, void* _ctx) {
+    struct storage_sqlite_copy_ctx* ctx = (struct storage_sqlite_copy_ctx*)_ctx;
+    memcpy(ctx->buf + ctx->size, data, size);
+    ctx->size += size;
+    return 0;
+}
+
+/* Returns 1 and sets the hash if the output is in the blob store. */
+static int storage_sqlite_get_run_output_hash(
+    struct storage_sqlite_reader* reader,
+    int run_id,
+    char* hash
+) {
+    sqlite3_stmt* stmt = reader->stmt_get_run_output_hash;
+    char* output_hash = NULL;
+    int ret = 0;
+
+    ret = sqlite_bind_int(stmt, 1, run_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt);
+    if (ret < 0)
+        goto reset;
+    if (!ret) {
+        log_err("Run %d doesn't exist\n", run_id);
+        ret = -1;
+        goto reset;
+    }
+
+    ret = sqlite_column_text(stmt, 0, &output_hash);
+    if (ret < 0)
+        goto reset;
+    if (!output_hash)
+        goto reset;
+
+    if (strlen(output_hash) != BLOB_HASH_SIZE - 1) {
+        log_err("Run %d has invalid output hash: %s\n", run_id, output_hash);
+        ret = -1;
+        goto free;
+    }
+
+    strcpy(hash, output_hash);
+    ret = 1;
+
+free:
+    free(output_hash);
+
+reset:
+    sqlite_reset(stmt);
+
+    return ret;
+}
+
+static int storage_sqlite_read_run_output_range(
+    struct storage_sqlite_reader* reader,
+    int run_id,
+    const struct storage_sqlite_range* range,
+    void* buf,
+    size_t* read,
+    char* hash
+) {
+    struct storage_sqlite_copy_ctx ctx = {(unsigned char*)buf, 0};
+    int ret = 0;
+
+    ret = storage_sqlite_get_run_output_hash(reader, run_id, hash);
+    if (ret)
+        return ret;
+
+    ret = storage_sqlite_read_run_output(reader, run_id, range, storage_sqlite_copy_piece, &ctx);
+    if (ret < 0)
+        return ret;
+
+    *read = ctx.size;
+    return ret;
+}
+
+int storage_sqlite_run_output_read(
+    struct storage* storage,
+    int run_id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+) {
+    struct storage_sqlite_range range = {offset, offset + size};
+    struct storage_sqlite_reader* reader = NULL;
+    char hash[BLOB_HASH_SIZE];
+    int ret = 0;
+
+    if (size > SIZE_MAX - offset) {
+        log_err("Invalid output range: %zu bytes at offset %zu\n", size, offset);
+        return -1;
+    }
+
+    ret = storage_sqlite_reader_acquire(storage->sqlite, &reader);
+    if (ret < 0)
+        return ret;
+
+    /* The output may be moved to the blob store in the meantime, so the hash
+     * and the chunks are read from the same snapshot. */
+    ret = sqlite_begin(reader->db);
+    if (ret < 0)
+        goto release;
+    ret = storage_sqlite_read_run_output_range(reader, run_id, &range, buf, read, hash);
+    if (ret < 0) {
+        sqlite_rollback(reader->db);
+        goto release;
+    }
+    ret = sqlite_commit(reader->db) < 0 ? -1 : ret;
+
+release:
+    storage_sqlite_reader_release(storage->sqlite, reader);
+
+    if (ret <= 0)
+        return ret;
+
+    /* Blobs are never modified, so they're read outside of the transaction. */
+    return blob_store_read(storage->sqlite->blobs, hash, offset, buf, size, read);
+}
+
+#define STORAGE_SQLITE_MIGRATION_BATCH_SIZE 64
+
+/* Returns the number of finished runs after the given one that still have
+ * their output in the database. */
+static int storage_sqlite_get_unstored_runs(
+    struct storage_sqlite* storage,
+    int after_id,
+    int* ids,
+    size_t max_ids
+) {
+    struct storage_sqlite_reader* reader = NULL;
+    int numof_ids = 0;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        return ret;
+
+    sqlite3_stmt* stmt = reader->stmt_get_unstored_runs;
+
+    ret = sqlite_bind_int(stmt, 1, RUN_STATUS_FINISHED);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int(stmt, 2, after_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 3, (sqlite3_int64)max_ids);
+    if (ret < 0)
+        goto reset;
+
+    while (1) {
+        ret = sqlite_step(stmt);
+        if (!ret)
+            break;
+        if (ret < 0)
+            goto reset;
+
+        ids[numof_ids++] = sqlite_column_int(stmt, 0);
+    }
+
+    ret = numof_ids;
+
+reset:
+    sqlite_reset(stmt);
+    storage_sqlite_reader_release(storage, reader);
+
+    return ret;
+}
+
+/* A blob mustn't be deleted after it's been put into the blob store, but before
+ * it's referenced. */
+static int storage_sqlite_blobs_rdlock(struct storage_sqlite* storage) {
+    int ret = pthread_rwlock_rdlock(&storage->blobs_lock);
+    if (ret) {
+        pthread_errno(ret, "pthread_rwlock_rdlock");
+        return -1;
+    }
+    return ret;
+}
+
+static int storage_sqlite_blobs_wrlock(struct storage_sqlite* storage) {
+    int ret = pthread_rwlock_wrlock(&storage->blobs_lock);
+    if (ret) {
+        pthread_errno(ret, "pthread_rwlock_wrlock");
+        return -1;
+    }
+    return ret;
+}
+
+static void storage_sqlite_blobs_unlock(struct storage_sqlite* storage) {
+    pthread_errno_if(pthread_rwlock_unlock(&storage->blobs_lock), "pthread_rwlock_unlock");
+}
+
+/* Returns 1 if the blob is tracked in the database. */
+static int storage_sqlite_blob_exists(struct storage_sqlite* storage, const char* hash) {
+    struct storage_sqlite_reader* reader = NULL;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        return ret;
+
+    sqlite3_stmt* stmt = reader->stmt_get_blob;
+
+    ret = sqlite_bind_text(stmt, 1, hash);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_step(stmt);
+    if (ret < 0)
+        goto reset;
+
+reset:
+    sqlite_reset(stmt);
+    storage_sqlite_reader_release(storage, reader);
+
+    return ret;
+}
+
+/* A blob's been put into the store, but the run doesn't reference it (the
+ * write's been rolled back, or the output's been stored or pruned in the
+ * meantime). Unless the database tracks the same blob for some other run,
+ * nothing would ever delete it. */
+static void storage_sqlite_forget_blob(struct storage_sqlite* storage, const char* hash) {
+    size_t size = 0;
+    int ret = 0;
+
+    /* Nobody's storing blobs while the lock is held, so if the blob isn't
+     * tracked now, it's not going to be. */
+    ret = storage_sqlite_blobs_wrlock(storage);
+    if (ret < 0)
+        goto fail;
+
+    ret = storage_sqlite_blob_exists(storage, hash);
+    if (ret < 0)
+        goto unlock;
+    if (!ret)
+        ret = blob_store_delete(storage->blobs, hash, &size);
+
+unlock:
+    storage_sqlite_blobs_unlock(storage);
+
+fail:
+    if (ret < 0)
+        log_err("Failed to delete unused blob %s\n", hash);
+}
+
+static int storage_sqlite_migrate_run_output(struct storage_sqlite* storage, int run_id) {
+    char hash[BLOB_HASH_SIZE];
+    size_t size = 0;
+    int ret = 0;
+
+    ret = storage_sqlite_blobs_rdlock(storage);
+    if (ret < 0)
+        return ret;
+
+    ret = storage_sqlite_put_run_output(storage, run_id, hash, &size);
+    if (ret < 0) {
+        storage_sqlite_blobs_unlock(storage);
+        return ret;
+    }
+
+    struct storage_sqlite_write write = {
+        .type = STORAGE_SQLITE_WRITE_RUN_OUTPUT_STORED,
+        .run_output_stored = {run_id, hash, size},
+    };
+    ret = storage_sqlite_write(storage, &write);
+
+    storage_sqlite_blobs_unlock(storage);
+
+    if (ret <= 0)
+        storage_sqlite_forget_blob(storage, hash);
+    return ret < 0 ? ret : 0;
+}
+
+static int storage_sqlite_is_maintenance_stopped(struct storage_sqlite* storage) {
+    return atomic_load(&storage->stop_maintenance);
+}
+
+/* The migration is picked up where it left off the next time the server
+ * starts. Returns the number of runs that have had their outputs moved. */
+static size_t storage_sqlite_migrate(struct storage_sqlite* storage) {
+    int ids[STORAGE_SQLITE_MIGRATION_BATCH_SIZE];
+    size_t numof_migrated = 0;
+    int last_id = 0;
+    int ret = 0;
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        ret = storage_sqlite_get_unstored_runs(
+            storage, last_id, ids, STORAGE_SQLITE_MIGRATION_BATCH_SIZE
+        );
+        if (ret <= 0)
+            break;
+        int numof_ids = ret;
+
+        for (int i = 0; i < numof_ids && !storage_sqlite_is_maintenance_stopped(storage); ++i) {
+            last_id = ids[i];
+
+            ret = storage_sqlite_migrate_run_output(storage, last_id);
+            if (ret < 0) {
+                log_err("Failed to move the output of run %d to the blob store\n", last_id);
+                continue;
+            }
+            ++numof_migrated;
+        }
+    }
+
+    return numof_migrated;
+}
+
+/* Retention policies are applied in batches, each committed separately, so
+ * that other writes are never held up for long. */
+#define STORAGE_SQLITE_PRUNE_BATCH_SIZE 64
+/* Free pages are returned to the OS this many at a time. */
+#define STORAGE_SQLITE_VACUUM_BATCH_SIZE 1024
+
+/* Reads the IDs (of runs or repositories) the statement selects. */
+static int storage_sqlite_read_ids(sqlite3_stmt* stmt, int* ids, size_t max_ids) {
+    int numof_ids = 0;
+    int ret = 0;
+
+    while ((size_t)numof_ids < max_ids) {
+        ret = sqlite_step(stmt);
+        if (!ret)
+            break;
+        if (ret < 0)
+            return ret;
+
+        ids[numof_ids++] = sqlite_column_int(stmt, 0);
+    }
+
+    return numof_ids;
+}
+
+/* Repositories with IDs greater than after_id are selected. */
+static int storage_sqlite_get_repo_ids(
+    struct storage_sqlite* storage,
+    int after_id,
+    int* ids,
+    size_t max_ids
+) {
+    struct storage_sqlite_reader* reader = NULL;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        return ret;
+
+    sqlite3_stmt* stmt = reader->stmt_get_repo_ids;
+
+    ret = sqlite_bind_int(stmt, 1, after_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 2, (sqlite3_int64)max_ids);
+    if (ret < 0)
+        goto reset;
+
+    ret = storage_sqlite_read_ids(stmt, ids, max_ids);
+
+reset:
+    sqlite_reset(stmt);
+    storage_sqlite_reader_release(storage, reader);
+
+    return ret;
+}
+
+static int storage_sqlite_get_old_runs(
+    struct storage_sqlite* storage,
+    int repo_id,
+    int* ids,
+    size_t max_ids
+) {
+    struct storage_sqlite_reader* reader = NULL;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        return ret;
+
+    sqlite3_stmt* stmt = reader->stmt_get_old_runs;
+
+    ret = sqlite_bind_int(stmt, 1, repo_id);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int(stmt, 2, RUN_STATUS_FINISHED);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 3, (sqlite3_int64)storage->retention.keep_runs);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 4, (sqlite3_int64)max_ids);
+    if (ret < 0)
+        goto reset;
+
+    ret = storage_sqlite_read_ids(stmt, ids, max_ids);
+
+reset:
+    sqlite_reset(stmt);
+    storage_sqlite_reader_release(storage, reader);
+
+    return ret;
+}
+
+/* Runs created before the time are selected. */
+static int storage_sqlite_get_old_outputs(
+    struct storage_sqlite* storage,
+    int64_t before,
+    int* ids,
+    size_t max_ids
+) {
+    struct storage_sqlite_reader* reader = NULL;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        return ret;
+
+    sqlite3_stmt* stmt = reader->stmt_get_old_outputs;
+
+    ret = sqlite_bind_int(stmt, 1, RUN_STATUS_FINISHED);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 2, before);
+    if (ret < 0)
+        goto reset;
+    ret = sqlite_bind_int64(stmt, 3, (sqlite3_int64)max_ids);
+    if (ret < 0)
+        goto reset;
+
+    ret = storage_sqlite_read_ids(stmt, ids, max_ids);
+
+reset:
+    sqlite_reset(stmt);
+    storage_sqlite_reader_release(storage, reader);
+
+    return ret;
+}
+
+static int storage_sqlite_get_unused_blobs(
+    struct storage_sqlite* storage,
+    char (*hashes)[BLOB_HASH_SIZE],
+    size_t max_hashes
+) {
+    struct storage_sqlite_reader* reader = NULL;
+    int numof_hashes = 0;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage, &reader);
+    if (ret < 0)
+        return ret;
+
+    sqlite3_stmt* stmt = reader->stmt_get_unused_blobs;
+
+    ret = sqlite_bind_int64(stmt, 1, (sqlite3_int64)max_hashes);
+    if (ret < 0)
+        goto reset;
+
+    while ((size_t)numof_hashes < max_hashes) {
+        ret = sqlite_step(stmt);
+        if (!ret)
+            break;
+        if (ret < 0)
+            goto reset;
+
+        char* hash = NULL;
+        ret = sqlite_column_text(stmt, 0, &hash);
+        if (ret < 0)
+            goto reset;
+
+        if (!hash || strlen(hash) != BLOB_HASH_SIZE - 1) {
+            log_err("Invalid blob hash: %s\n", hash ? hash : "NULL");
+            free(hash);
+            continue;
+        }
+
+        strcpy(hashes[numof_hashes++], hash);
+        free(hash);
+    }
+
+    ret = numof_hashes;
+
+reset:
+    sqlite_reset(stmt);
+    storage_sqlite_reader_release(storage, reader);
+
+    return ret;
+}
+
+/* What a single pass has reclaimed. */
+struct storage_sqlite_prune_pass {
+    size_t numof_runs;
+    size_t numof_outputs;
+    size_t numof_blobs;
+    size_t reclaimed_bytes;
+};
+
+static int storage_sqlite_prune_repo_runs(
+    struct storage_sqlite* storage,
+    int repo_id,
+    struct storage_sqlite_prune_pass* pass
+) {
+    int ids[STORAGE_SQLITE_PRUNE_BATCH_SIZE];
+    int ret = 0;
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        ret = storage_sqlite_get_old_runs(storage, repo_id, ids, STORAGE_SQLITE_PRUNE_BATCH_SIZE);
+        if (ret <= 0)
+            return ret;
+
+        struct storage_sqlite_write write = {
+            .type = STORAGE_SQLITE_WRITE_RUNS_DELETE,
+            .runs_delete = {ids, (size_t)ret},
+        };
+        ret = storage_sqlite_write(storage, &write);
+        if (ret <= 0)
+            return ret;
+        pass->numof_runs += (size_t)ret;
+    }
+
+    return ret;
+}
+
+/* The repositories are visited one at a time, so that every query only looks
+ * at the runs of a single repository. */
+static int storage_sqlite_prune_runs(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_prune_pass* pass
+) {
+    int repo_ids[STORAGE_SQLITE_PRUNE_BATCH_SIZE];
+    int last_repo_id = 0;
+    int ret = 0;
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        ret = storage_sqlite_get_repo_ids(
+            storage, last_repo_id, repo_ids, STORAGE_SQLITE_PRUNE_BATCH_SIZE
+        );
+        if (ret <= 0)
+            return ret;
+        const int numof_repos = ret;
+
+        for (int i = 0; i < numof_repos; ++i) {
+            last_repo_id = repo_ids[i];
+
+            ret = storage_sqlite_prune_repo_runs(storage, last_repo_id, pass);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    return ret;
+}
+
+static int storage_sqlite_prune_outputs(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_prune_pass* pass
+) {
+    int ids[STORAGE_SQLITE_PRUNE_BATCH_SIZE];
+    int ret = 0;
+
+    /* Runs created before the creation time was recorded are older still. */
+    const int64_t before =
+        (int64_t)time(NULL) - (int64_t)storage->retention.keep_output_days * 86400;
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        ret = storage_sqlite_get_old_outputs(storage, before, ids, STORAGE_SQLITE_PRUNE_BATCH_SIZE);
+        if (ret <= 0)
+            return ret;
+
+        struct storage_sqlite_write write = {
+            .type = STORAGE_SQLITE_WRITE_RUN_OUTPUTS_DROP,
+            .run_outputs_drop = {ids, (size_t)ret},
+        };
+        ret = storage_sqlite_write(storage, &write);
+        if (ret <= 0)
+            return ret;
+        pass->numof_outputs += (size_t)ret;
+    }
+
+    return ret;
+}
+
+/* The blobs are deleted while no one's storing blobs, since someone might be
+ * storing the same blob, and expect it to still be there. */
+static int storage_sqlite_delete_blobs_batch(
+    struct storage_sqlite* storage,
+    char (*hashes)[BLOB_HASH_SIZE],
+    size_t numof_hashes,
+    struct storage_sqlite_prune_pass* pass
+) {
+    int deleted[STORAGE_SQLITE_PRUNE_BATCH_SIZE];
+    int ret = 0;
+
+    ret = storage_sqlite_blobs_wrlock(storage);
+    if (ret < 0)
+        return ret;
+
+    struct storage_sqlite_write write = {
+        .type = STORAGE_SQLITE_WRITE_BLOBS_DELETE,
+        .blobs_delete = {hashes, numof_hashes, deleted},
+    };
+    ret = storage_sqlite_write(storage, &write);
+    if (ret <= 0)
+        goto unlock;
+
+    for (size_t i = 0; i < numof_hashes; ++i) {
+        if (!deleted[i])
+            continue;
+
+        size_t size = 0;
+        if (blob_store_delete(storage->blobs, hashes[i], &size) < 0) {
+            log_err("Failed to delete blob %s\n", hashes[i]);
+            continue;
+        }
+        ++pass->numof_blobs;
+        pass->reclaimed_bytes += size;
+    }
+
+unlock:
+    storage_sqlite_blobs_unlock(storage);
+
+    return ret;
+}
+
+static int storage_sqlite_delete_unused_blobs(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_prune_pass* pass
+) {
+    char hashes[STORAGE_SQLITE_PRUNE_BATCH_SIZE][BLOB_HASH_SIZE];
+    int ret = 0;
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        ret = storage_sqlite_get_unused_blobs(storage, hashes, STORAGE_SQLITE_PRUNE_BATCH_SIZE);
+        if (ret <= 0)
+            return ret;
+
+        ret = storage_sqlite_delete_blobs_batch(storage, hashes, (size_t)ret, pass);
+        if (ret <= 0)
+            return ret;
+    }
+
+    return ret;
+}
+
+static int storage_sqlite_vacuum(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_prune_pass* pass
+) {
+    int ret = 0;
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        size_t reclaimed = 0;
+
+        struct storage_sqlite_write write = {
+            .type = STORAGE_SQLITE_WRITE_VACUUM,
+            .vacuum = {STORAGE_SQLITE_VACUUM_BATCH_SIZE, &reclaimed},
+        };
+        ret = storage_sqlite_write(storage, &write);
+        if (ret < 0)
+            return ret;
+        if (!reclaimed)
+            break;
+        pass->reclaimed_bytes += reclaimed;
+    }
+
+    return ret;
+}
+
+static int storage_sqlite_prune(struct storage_sqlite* storage) {
+    struct storage_sqlite_prune_pass pass = {0, 0, 0, 0};
+    int ret = 0;
+
+    if (storage->retention.keep_runs) {
+        ret = storage_sqlite_prune_runs(storage, &pass);
+        if (ret < 0)
+            goto update_stats;
+    }
+    if (storage->retention.keep_output_days) {
+        ret = storage_sqlite_prune_outputs(storage, &pass);
+        if (ret < 0)
+            goto update_stats;
+    }
+    ret = storage_sqlite_delete_unused_blobs(storage, &pass);
+    if (ret < 0)
+        goto update_stats;
+    ret = storage_sqlite_vacuum(storage, &pass);
     if (ret < 0)
-        goto reset;
-    ret = sqlite_step(stmt->impl);
+        goto update_stats;
+
+update_stats:
+    atomic_fetch_add_explicit(&storage->numof_prune_passes, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&storage->numof_pruned_runs, pass.numof_runs, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+        &storage->numof_pruned_outputs, pass.numof_outputs, memory_order_relaxed
+    );
+    atomic_fetch_add_explicit(
+        &storage->reclaimed_bytes, pass.reclaimed_bytes, memory_order_relaxed
+    );
+
     if (ret < 0)
-        goto reset;
+        log_err("Failed to apply the retention policies\n");
+    if (pass.numof_runs || pass.numof_outputs || pass.numof_blobs || pass.reclaimed_bytes)
+        log("Deleted %zu runs, %zu outputs and %zu blobs, reclaimed %zu bytes\n",
+            pass.numof_runs,
+            pass.numof_outputs,
+            pass.numof_blobs,
+            pass.reclaimed_bytes);
+    return ret;
+}
 
-    if (!ret) {
-        ret = -1;
-        log_err("Failed to insert a run\n");
-        goto reset;
+enum storage_sqlite_maintenance_task {
+    STORAGE_SQLITE_MAINTENANCE_STOP,
+    STORAGE_SQLITE_MAINTENANCE_MIGRATE,
+    STORAGE_SQLITE_MAINTENANCE_PRUNE,
+};
+
+/* Waits until there's something to do, or until the deadline for the next
+ * retention pass. */
+static int storage_sqlite_maintenance_wait(
+    struct storage_sqlite* storage,
+    const struct timespec* deadline
+) {
+    int ret = 0;
+
+    ret = pthread_mutex_lock(&storage->maintenance_mtx);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_lock");
+        return -1;
     }
 
-    ret = sqlite_column_int(stmt->impl, 0);
-    goto reset;
+    while (!storage_sqlite_is_maintenance_stopped(storage) && !storage->migration_pending) {
+        ret = pthread_cond_timedwait(
+            &storage->maintenance_cv, &storage->maintenance_mtx, deadline
+        );
+        if (ret == ETIMEDOUT) {
+            ret = STORAGE_SQLITE_MAINTENANCE_PRUNE;
+            goto unlock;
+        }
+        if (ret) {
+            pthread_errno(ret, "pthread_cond_timedwait");
+            ret = -1;
+            goto unlock;
+        }
+    }
 
-reset:
-    sqlite_reset(stmt->impl);
-    prepared_stmt_unlock(stmt);
+    if (storage_sqlite_is_maintenance_stopped(storage)) {
+        ret = STORAGE_SQLITE_MAINTENANCE_STOP;
+        goto unlock;
+    }
+
+    storage->migration_pending = 0;
+    ret = STORAGE_SQLITE_MAINTENANCE_MIGRATE;
+
+unlock:
+    pthread_errno_if(pthread_mutex_unlock(&storage->maintenance_mtx), "pthread_mutex_unlock");
 
     return ret;
 }
 
-int storage_sqlite_run_create(struct storage* storage, const char* repo_url, const char* rev) {
+/* Wakes up the maintenance thread to move the output of a finished run to the
+ * blob store. */
+static void storage_sqlite_maintenance_notify(struct storage_sqlite* storage) {
+    pthread_errno_if(pthread_mutex_lock(&storage->maintenance_mtx), "pthread_mutex_lock");
+    storage->migration_pending = 1;
+    pthread_errno_if(pthread_cond_signal(&storage->maintenance_cv), "pthread_cond_signal");
+    pthread_errno_if(pthread_mutex_unlock(&storage->maintenance_mtx), "pthread_mutex_unlock");
+}
+
+static void* storage_sqlite_maintenance_main(void* _storage) {
+    struct storage_sqlite* storage = (struct storage_sqlite*)_storage;
+    struct timespec deadline;
+
+    const size_t numof_migrated = storage_sqlite_migrate(storage);
+    if (numof_migrated)
+        log("Moved the outputs of %zu runs to the blob store\n", numof_migrated);
+
+    while (!storage_sqlite_is_maintenance_stopped(storage)) {
+        storage_sqlite_prune(storage);
+
+        log_errno_if(clock_gettime(CLOCK_MONOTONIC, &deadline), "clock_gettime");
+        deadline.tv_sec += storage->retention.interval_s;
+
+        /* The runs that finish in the meantime don't delay the next pass. */
+        int task = STORAGE_SQLITE_MAINTENANCE_MIGRATE;
+        while (task == STORAGE_SQLITE_MAINTENANCE_MIGRATE) {
+            task = storage_sqlite_maintenance_wait(storage, &deadline);
+            if (task == STORAGE_SQLITE_MAINTENANCE_MIGRATE)
+                storage_sqlite_migrate(storage);
+        }
+        if (task != STORAGE_SQLITE_MAINTENANCE_PRUNE)
+            break;
+    }
+
+    return NULL;
+}
+
+static int storage_sqlite_maintenance_start(struct storage_sqlite* storage) {
+    pthread_condattr_t attr;
     int ret = 0;
 
-    ret = storage_sqlite_insert_repo(storage->sqlite, repo_url);
-    if (ret < 0)
+    storage->migration_pending = 0;
+    atomic_init(&storage->stop_maintenance, 0);
+    atomic_init(&storage->numof_prune_passes, 0);
+    atomic_init(&storage->numof_pruned_runs, 0);
+    atomic_init(&storage->numof_pruned_outputs, 0);
+    atomic_init(&storage->reclaimed_bytes, 0);
+
+    ret = pthread_mutex_init(&storage->maintenance_mtx, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_init");
         return ret;
+    }
 
-    ret = storage_sqlite_insert_run(storage->sqlite, ret, rev);
+    ret = pthread_condattr_init(&attr);
+    if (ret) {
+        pthread_errno(ret, "pthread_condattr_init");
+        goto destroy_mtx;
+    }
+
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (ret) {
+        pthread_errno(ret, "pthread_condattr_setclock");
+        goto destroy_attr;
+    }
+
+    ret = pthread_cond_init(&storage->maintenance_cv, &attr);
+    if (ret) {
+        pthread_errno(ret, "pthread_cond_init");
+        goto destroy_attr;
+    }
+
+    ret = pthread_create(&storage->maintenance, NULL, storage_sqlite_maintenance_main, storage);
+    if (ret) {
+        pthread_errno(ret, "pthread_create");
+        goto destroy_cv;
+    }
+
+    pthread_errno_if(pthread_condattr_destroy(&attr), "pthread_condattr_destroy");
+    return ret;
+
+destroy_cv:
+    pthread_errno_if(pthread_cond_destroy(&storage->maintenance_cv), "pthread_cond_destroy");
+destroy_attr:
+    pthread_errno_if(pthread_condattr_destroy(&attr), "pthread_condattr_destroy");
+destroy_mtx:
+    pthread_errno_if(pthread_mutex_destroy(&storage->maintenance_mtx), "pthread_mutex_destroy");
+
+    return ret;
+}
+
+/* Whatever's in progress is stopped between batches. */
+static void storage_sqlite_maintenance_stop(struct storage_sqlite* storage) {
+    pthread_errno_if(pthread_mutex_lock(&storage->maintenance_mtx), "pthread_mutex_lock");
+    atomic_store(&storage->stop_maintenance, 1);
+    pthread_errno_if(pthread_cond_signal(&storage->maintenance_cv), "pthread_cond_signal");
+    pthread_errno_if(pthread_mutex_unlock(&storage->maintenance_mtx), "pthread_mutex_unlock");
+
+    pthread_errno_if(pthread_join(storage->maintenance, NULL), "pthread_join");
+
+    pthread_errno_if(pthread_cond_destroy(&storage->maintenance_cv), "pthread_cond_destroy");
+    pthread_errno_if(pthread_mutex_destroy(&storage->maintenance_mtx), "pthread_mutex_destroy");
+}
+
+/* Reading the output back, hashing it and writing the blob takes time
+ * proportional to the output's size, so that's left to the maintenance
+ * thread. */
+int storage_sqlite_run_finished(struct storage* storage, int run_id, int ec) {
+    int ret = 0;
+
+    struct storage_sqlite_write write = {
+        .type = STORAGE_SQLITE_WRITE_RUN_FINISHED,
+        .run_finished = {run_id, ec},
+    };
+    ret = storage_sqlite_write(storage->sqlite, &write);
     if (ret < 0)
         return ret;
 
-    return ret;
+    storage_sqlite_maintenance_notify(storage->sqlite);
+    return 0;
 }
 
-int storage_sqlite_run_finished(
-    struct storage* storage,
-    int run_id,
-    const struct process_output* output
+static int storage_sqlite_apply_write(
+    struct storage_sqlite* storage,
+    const struct storage_sqlite_write* write
+) {
+    switch (write->type) {
+        case STORAGE_SQLITE_WRITE_RUN_CREATE:
+            return storage_sqlite_insert_repo_run(
+                storage, write->run_create.repo_url, write->run_create.rev
+            );
+        case STORAGE_SQLITE_WRITE_RUN_CREATE_BATCH:
+            return storage_sqlite_insert_repo_runs(
+                storage, write->run_create_batch.runs, write->run_create_batch.numof_runs
+            );
+        case STORAGE_SQLITE_WRITE_RUN_OUTPUT_APPEND:
+            return storage_sqlite_run_output_write(
+                storage, write->run_output_append.run_id, write->run_output_append.chunk
+            );
+        case STORAGE_SQLITE_WRITE_RUN_FINISHED:
+            return storage_sqlite_set_run_finished(
+                storage, write->run_finished.run_id, write->run_finished.ec
+            );
+        case STORAGE_SQLITE_WRITE_RUN_OUTPUT_STORED:
+            return storage_sqlite_run_output_stored(
+                storage,
+                write->run_output_stored.run_id,
+                write->run_output_stored.output_hash,
+                write->run_output_stored.output_size
+            );
+        case STORAGE_SQLITE_WRITE_RUNS_DELETE:
+            return storage_sqlite_delete_runs(
+                storage, write->runs_delete.ids, write->runs_delete.numof_ids
+            );
+        case STORAGE_SQLITE_WRITE_RUN_OUTPUTS_DROP:
+            return storage_sqlite_drop_run_outputs(
+                storage, write->run_outputs_drop.ids, write->run_outputs_drop.numof_ids
+            );
+        case STORAGE_SQLITE_WRITE_BLOBS_DELETE:
+            return storage_sqlite_delete_blobs(
+                storage,
+                write->blobs_delete.hashes,
+                write->blobs_delete.numof_hashes,
+                write->blobs_delete.deleted
+            );
+        case STORAGE_SQLITE_WRITE_VACUUM:
+            return sqlite_incremental_vacuum(
+                storage->db, write->vacuum.max_pages, write->vacuum.reclaimed
+            );
+    }
+
+    log_err("Unknown SQLite write type: %d\n", write->type);
+    return -1;
+}
+
+static const char* const storage_sqlite_savepoint = "cimple_write";
+
+/* Each write is atomic: if it fails, whatever it's done is rolled back, but
+ * the rest of the group is still committed. */
+static int storage_sqlite_apply_write_atomically(
+    struct storage_sqlite* storage,
+    const struct storage_sqlite_write* write
 ) {
-    struct prepared_stmt* stmt = &storage->sqlite->stmt_run_finished;
     int ret = 0;
 
-    ret = prepared_stmt_lock(stmt);
+    ret = sqlite_savepoint(storage->db, storage_sqlite_savepoint);
     if (ret < 0)
         return ret;
-    ret = sqlite_bind_int(stmt->impl, 1, RUN_STATUS_FINISHED);
-    if (ret < 0)
-        goto reset;
-    ret = sqlite_bind_int(stmt->impl, 2, output->ec);
-    if (ret < 0)
-        goto reset;
-    ret = sqlite_bind_blob(stmt->impl, 3, output->data, output->data_size);
-    if (ret < 0)
-        goto reset;
-    ret = sqlite_bind_int(stmt->impl, 4, run_id);
+
+    const int result = storage_sqlite_apply_write(storage, write);
+    if (result < 0) {
+        sqlite_rollback_to(storage->db, storage_sqlite_savepoint);
+        storage_sqlite_repo_cache_clear(&storage->repos);
+    }
+
+    ret = sqlite_release(storage->db, storage_sqlite_savepoint);
     if (ret < 0)
-        goto reset;
-    ret = sqlite_step(stmt->impl);
+        return ret;
+
+    return result;
+}
+
+static void storage_sqlite_apply_group(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_write_queue* group
+) {
+    struct storage_sqlite_write* write = NULL;
+    size_t numof_writes = 0;
+    int ret = 0;
+
+    ret = sqlite_begin(storage->db);
     if (ret < 0)
-        goto reset;
+        goto fail;
 
-reset:
-    sqlite_reset(stmt->impl);
-    prepared_stmt_unlock(stmt);
+    SIMPLEQ_FOREACH(write, group, entries)
+    {
+        write->result = storage_sqlite_apply_write_atomically(storage, write);
+        ++numof_writes;
+    }
 
-    return ret;
+    ret = sqlite_commit(storage->db);
+    if (ret < 0) {
+        sqlite_rollback(storage->db);
+        storage_sqlite_repo_cache_clear(&storage->repos);
+        goto fail;
+    }
+
+    log_debug("Committed a group of %zu SQLite writes\n", numof_writes);
+    return;
+
+fail:
+    SIMPLEQ_FOREACH(write, group, entries)
+    {
+        write->result = ret;
+    }
+}
+
+/* Returns 1 if the storage is shutting down and there're no more writes. */
+static int storage_sqlite_collect_group(
+    struct storage_sqlite* storage,
+    struct storage_sqlite_write_queue* group
+) {
+    int ret = 0;
+
+    SIMPLEQ_INIT(group);
+
+    while (!storage->stopping && SIMPLEQ_EMPTY(&storage->writes)) {
+        ret = pthread_cond_wait(&storage->writes_cv, &storage->writes_mtx);
+        if (ret) {
+            pthread_errno(ret, "pthread_cond_wait");
+            return ret;
+        }
+    }
+
+    if (SIMPLEQ_EMPTY(&storage->writes))
+        return 1;
+
+    /* Give other threads a chance to add their writes to the group. */
+    struct timespec deadline;
+    log_errno_if(clock_gettime(CLOCK_MONOTONIC, &deadline), "clock_gettime");
+    deadline.tv_nsec += STORAGE_SQLITE_MAX_GROUP_DELAY_US * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (!storage->stopping && storage->numof_writes < STORAGE_SQLITE_MAX_GROUP_SIZE) {
+        ret = pthread_cond_timedwait(&storage->writes_cv, &storage->writes_mtx, &deadline);
+        if (ret == ETIMEDOUT)
+            break;
+        if (ret) {
+            pthread_errno(ret, "pthread_cond_timedwait");
+            return ret;
+        }
+    }
+
+    for (size_t i = 0; i < STORAGE_SQLITE_MAX_GROUP_SIZE; ++i) {
+        struct storage_sqlite_write* write = SIMPLEQ_FIRST(&storage->writes);
+        if (!write)
+            break;
+        SIMPLEQ_REMOVE_HEAD(&storage->writes, entries);
+        --storage->numof_writes;
+        SIMPLEQ_INSERT_TAIL(group, write, entries);
+    }
+
+    return 0;
+}
+
+static void* storage_sqlite_writer_main(void* _storage) {
+    struct storage_sqlite* storage = (struct storage_sqlite*)_storage;
+    struct storage_sqlite_write_queue group;
+    struct storage_sqlite_write* write = NULL;
+    int ret = 0;
+
+    ret = pthread_mutex_lock(&storage->writes_mtx);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_lock");
+        return NULL;
+    }
+
+    while (1) {
+        ret = storage_sqlite_collect_group(storage, &group);
+        if (ret)
+            break;
+
+        /* Other threads can submit writes while the group is being committed. */
+        pthread_errno_if(pthread_mutex_unlock(&storage->writes_mtx), "pthread_mutex_unlock");
+        storage_sqlite_apply_group(storage, &group);
+        pthread_errno_if(pthread_mutex_lock(&storage->writes_mtx), "pthread_mutex_lock");
+
+        SIMPLEQ_FOREACH(write, &group, entries)
+        {
+            write->done = 1;
+        }
+        pthread_errno_if(
+            pthread_cond_broadcast(&storage->writes_done_cv), "pthread_cond_broadcast"
+        );
+    }
+
+    pthread_errno_if(pthread_mutex_unlock(&storage->writes_mtx), "pthread_mutex_unlock");
+    return NULL;
 }
 
 static int storage_sqlite_row_to_run(struct sqlite3_stmt* stmt, struct run** run) {
@@ -447,8 +2930,6 @@ static int storage_sqlite_row_to_run(struct sqlite3_stmt* stmt, struct run** run
     if (ret < 0)
         goto free_rev;
 
-    log("Adding run %d for repository %s to the queue\n", id, url);
-
 free_rev:
     free(rev);
 
@@ -476,6 +2957,11 @@ static int storage_sqlite_rows_to_runs(struct sqlite3_stmt* stmt, struct run_que
         if (ret < 0)
             goto run_queue_destroy;
 
+        log(
+            "Adding run %d for repository %s to the queue\n",
+            run_get_id(run),
+            run_get_repo_url(run)
+        );
         run_queue_add_last(queue, run);
     }
 
@@ -487,41 +2973,215 @@ run_queue_destroy:
     return ret;
 }
 
-int storage_sqlite_get_runs(struct storage* storage, struct run_queue* queue) {
-    struct prepared_stmt* stmt = &storage->sqlite->stmt_get_runs;
+/* The conditions are in the order of the run_filter_field bits. */
+static const char* const storage_sqlite_run_filter_conds[RUN_FILTER_NUMOF_FIELDS] = {
+    "run.id < ?",
+    "run.id > ?",
+    "repo.url = ?",
+    "run.status = ?",
+    "run.exit_code = ?",
+    "run.created_at > ?",
+    "run.created_at < ?",
+};
+
+static int storage_sqlite_prepare_get_runs(
+    sqlite3* db,
+    const struct run_filter* filter,
+    sqlite3_stmt** stmt
+) {
+    static const char* const fmt_select =
+        "SELECT run.id, run.status, run.exit_code, repo.url, run.repo_rev FROM cimple_runs AS run INNER JOIN cimple_repos AS repo ON run.repo_id = repo.id";
+
+    char query[1024];
+    char* const end = query + sizeof(query);
+    const char* sep = " WHERE ";
+
+    char* it = string_append(query, end, fmt_select);
+    for (int i = 0; i < RUN_FILTER_NUMOF_FIELDS; ++i) {
+        if (!(filter->fields & (1u << i)))
+            continue;
+        it = string_append(it, end, sep);
+        it = string_append(it, end, storage_sqlite_run_filter_conds[i]);
+        sep = " AND ";
+    }
+    if (run_filter_is_ascending(filter))
+        it = string_append(it, end, " ORDER BY run.id LIMIT ?;");
+    else
+        it = string_append(it, end, " ORDER BY run.id DESC LIMIT ?;");
+
+    if (it == end) {
+        log_err("SQL query is too long\n");
+        return -1;
+    }
+
+    return sqlite_prepare(db, query, stmt);
+}
+
+static int storage_sqlite_bind_run_filter(sqlite3_stmt* stmt, const struct run_filter* filter) {
+    int index = 0;
     int ret = 0;
 
-    ret = prepared_stmt_lock(stmt);
+    if (filter->fields & RUN_FILTER_BEFORE_ID) {
+        ret = sqlite_bind_int(stmt, ++index, filter->before_id);
+        if (ret < 0)
+            return ret;
+    }
+    if (filter->fields & RUN_FILTER_AFTER_ID) {
+        ret = sqlite_bind_int(stmt, ++index, filter->after_id);
+        if (ret < 0)
+            return ret;
+    }
+    if (filter->fields & RUN_FILTER_REPO_URL) {
+        ret = sqlite_bind_text(stmt, ++index, filter->repo_url);
+        if (ret < 0)
+            return ret;
+    }
+    if (filter->fields & RUN_FILTER_STATUS) {
+        ret = sqlite_bind_int(stmt, ++index, filter->status);
+        if (ret < 0)
+            return ret;
+    }
+    if (filter->fields & RUN_FILTER_EXIT_CODE) {
+        ret = sqlite_bind_int(stmt, ++index, filter->exit_code);
+        if (ret < 0)
+            return ret;
+    }
+    if (filter->fields & RUN_FILTER_CREATED_AFTER) {
+        ret = sqlite_bind_int64(stmt, ++index, filter->created_after);
+        if (ret < 0)
+            return ret;
+    }
+    if (filter->fields & RUN_FILTER_CREATED_BEFORE) {
+        ret = sqlite_bind_int64(stmt, ++index, filter->created_before);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* An extra row is fetched to find out if there's a next page. */
+    sqlite3_int64 limit = filter->limit ? (sqlite3_int64)filter->limit + 1 : -1;
+    return sqlite_bind_int64(stmt, ++index, limit);
+}
+
+static int storage_sqlite_rows_to_page(
+    sqlite3_stmt* stmt,
+    const struct run_filter* filter,
+    struct run_queue* queue,
+    int* next_id
+) {
+    const int ascending = run_filter_is_ascending(filter);
+    size_t numof_runs = 0;
+    int last_id = 0;
+    int ret = 0;
+
+    run_queue_create(queue);
+    *next_id = 0;
+
+    while (1) {
+        ret = sqlite_step(stmt);
+        if (!ret)
+            break;
+        if (ret < 0)
+            goto run_queue_destroy;
+
+        if (filter->limit && numof_runs == filter->limit) {
+            *next_id = last_id;
+            ret = 0;
+            break;
+        }
+
+        struct run* run = NULL;
+
+        ret = storage_sqlite_row_to_run(stmt, &run);
+        if (ret < 0)
+            goto run_queue_destroy;
+
+        last_id = run_get_id(run);
+        ++numof_runs;
+
+        /* The page is always returned newest first. */
+        if (ascending)
+            run_queue_add_first(queue, run);
+        else
+            run_queue_add_last(queue, run);
+    }
+
+    return ret;
+
+run_queue_destroy:
+    run_queue_destroy(queue);
+
+    return ret;
+}
+
+int storage_sqlite_get_runs(
+    struct storage* storage,
+    const struct run_filter* filter,
+    struct run_queue* queue,
+    int* next_id
+) {
+    struct storage_sqlite_reader* reader = NULL;
+    int ret = 0;
+
+    ret = storage_sqlite_reader_acquire(storage->sqlite, &reader);
     if (ret < 0)
         return ret;
-    ret = storage_sqlite_rows_to_runs(stmt->impl, queue);
+
+    sqlite3_stmt** stmt = &reader->stmt_get_runs[filter->fields];
+    if (!*stmt) {
+        ret = storage_sqlite_prepare_get_runs(reader->db, filter, stmt);
+        if (ret < 0)
+            goto release;
+    }
+
+    ret = storage_sqlite_bind_run_filter(*stmt, filter);
+    if (ret < 0)
+        goto reset;
+    ret = storage_sqlite_rows_to_page(*stmt, filter, queue, next_id);
     if (ret < 0)
         goto reset;
 
 reset:
-    sqlite_reset(stmt->impl);
-    prepared_stmt_unlock(stmt);
+    sqlite_reset(*stmt);
+
+release:
+    storage_sqlite_reader_release(storage->sqlite, reader);
 
     return ret;
 }
 
 int storage_sqlite_get_run_queue(struct storage* storage, struct run_queue* queue) {
-    struct prepared_stmt* stmt = &storage->sqlite->stmt_get_run_queue;
+    struct storage_sqlite_reader* reader = NULL;
     int ret = 0;
 
-    ret = prepared_stmt_lock(stmt);
+    ret = storage_sqlite_reader_acquire(storage->sqlite, &reader);
     if (ret < 0)
         return ret;
-    ret = sqlite_bind_int(stmt->impl, 1, RUN_STATUS_CREATED);
+    ret = sqlite_bind_int(reader->stmt_get_run_queue, 1, RUN_STATUS_CREATED);
     if (ret < 0)
         goto reset;
-    ret = storage_sqlite_rows_to_runs(stmt->impl, queue);
+    ret = storage_sqlite_rows_to_runs(reader->stmt_get_run_queue, queue);
     if (ret < 0)
         goto reset;
 
 reset:
-    sqlite_reset(stmt->impl);
-    prepared_stmt_unlock(stmt);
+    sqlite_reset(reader->stmt_get_run_queue);
+    storage_sqlite_reader_release(storage->sqlite, reader);
 
     return ret;
 }
+
+void storage_sqlite_get_stats(struct storage* storage, struct storage_stats* stats) {
+    struct storage_sqlite_repo_cache* repos = &storage->sqlite->repos;
+
+    stats->repo_cache_hits = atomic_load_explicit(&repos->hits, memory_order_relaxed);
+    stats->repo_cache_misses = atomic_load_explicit(&repos->misses, memory_order_relaxed);
+
+    stats->prune_passes =
+        atomic_load_explicit(&storage->sqlite->numof_prune_passes, memory_order_relaxed);
+    stats->pruned_runs =
+        atomic_load_explicit(&storage->sqlite->numof_pruned_runs, memory_order_relaxed);
+    stats->pruned_outputs =
+        atomic_load_explicit(&storage->sqlite->numof_pruned_outputs, memory_order_relaxed);
+    stats->reclaimed_bytes =
+        atomic_load_explicit(&storage->sqlite->reclaimed_bytes, memory_order_relaxed);
+}
@@ -8,25 +8,72 @@
 #ifndef __STORAGE_SQLITE_H__
 #define __STORAGE_SQLITE_H__
 
-#include "process.h"
 #include "run_queue.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct storage_settings;
 struct storage_sqlite_setttings;
 
+/* These are passed to the corresponding PRAGMAs, see https://www.sqlite.org/pragma.html. */
+struct storage_sqlite_pragmas {
+    const char* synchronous;
+    int cache_size;
+    int64_t mmap_size;
+};
+
+/* Retention policies are applied in the background, every interval_s seconds.
+ * Only finished runs are affected; 0 means the runs (or the outputs) are kept
+ * forever. */
+struct storage_sqlite_retention {
+    /* Older runs of every repository are deleted. */
+    unsigned keep_runs;
+    /* The outputs of older runs are dropped, but the runs are kept. */
+    unsigned keep_output_days;
+    unsigned interval_s;
+};
+
 struct storage;
 struct storage_sqlite;
 
-int storage_sqlite_settings_create(struct storage_settings*, const char* path);
+/* Run outputs are stored in blob_dir; if it's NULL, the directory is next to
+ * the database. */
+int storage_sqlite_settings_create(
+    struct storage_settings*,
+    const char* path,
+    const char* blob_dir,
+    const struct storage_sqlite_pragmas*,
+    const struct storage_sqlite_retention*
+);
 void storage_sqlite_settings_destroy(const struct storage_settings*);
 
 int storage_sqlite_create(struct storage*, const struct storage_settings*);
 void storage_sqlite_destroy(struct storage*);
 
 int storage_sqlite_run_create(struct storage*, const char* repo_url, const char* rev);
-int storage_sqlite_run_finished(struct storage*, int id, const struct process_output*);
+int storage_sqlite_run_create_batch(struct storage*, struct run** runs, size_t numof_runs);
+int storage_sqlite_run_output_append(struct storage*, int id, const struct run_output_chunk*);
+int storage_sqlite_run_finished(struct storage*, int id, int ec);
+int storage_sqlite_run_output_read(
+    struct storage*,
+    int id,
+    size_t offset,
+    void* buf,
+    size_t size,
+    size_t* read
+);
 
-int storage_sqlite_get_runs(struct storage*, struct run_queue* runs);
+int storage_sqlite_get_runs(
+    struct storage*,
+    const struct run_filter*,
+    struct run_queue* runs,
+    int* next_id
+);
 int storage_sqlite_get_run_queue(struct storage*, struct run_queue* runs);
 
+struct storage_stats;
+
+void storage_sqlite_get_stats(struct storage*, struct storage_stats*);
+
 #endif
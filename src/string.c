@@ -10,6 +10,9 @@
 #include "log.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -45,6 +48,41 @@ int string_to_int(const char* src, int* result) {
         return -1;
     }
 
+    if (ret < INT_MIN || ret > INT_MAX) {
+        log_err("Number is out of range: %s\n", src);
+        return -1;
+    }
+
     *result = (int)ret;
     return 0;
 }
+
+int string_to_int64(const char* src, int64_t* result) {
+    char* endptr = NULL;
+
+    errno = 0;
+    long long ret = strtoll(src, &endptr, 10);
+
+    if (errno) {
+        log_errno("strtoll");
+        return -1;
+    }
+
+    if (endptr == src || *endptr != '\0') {
+        log_err("Invalid number: %s\n", src);
+        return -1;
+    }
+
+    *result = (int64_t)ret;
+    return 0;
+}
+
+/* FNV-1a. */
+size_t string_hash(const char* src) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* it = (const unsigned char*)src; *it; ++it) {
+        hash ^= *it;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
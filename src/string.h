@@ -8,6 +8,9 @@
 #ifndef __STRING_H__
 #define __STRING_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
  * This is an implementation for stpecpy.
  * For details, see string_copying(7).
@@ -24,5 +27,9 @@
 char* string_append(char* dst, char* end, const char* src);
 
 int string_to_int(const char* src, int* result);
+int string_to_int64(const char* src, int64_t* result);
+
+/* A non-cryptographic hash, for hash tables. */
+size_t string_hash(const char* src);
 
 #endif
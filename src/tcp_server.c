@@ -9,144 +9,999 @@
 
 #include "compiler.h"
 #include "event_loop.h"
-#include "file.h"
 #include "log.h"
 #include "net.h"
 #include "signal.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/eventfd.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /*
- * This is a simple threaded TCP server implementation. Each client is handled
- * in a separate thread.
+ * This is a simple pre-threaded TCP server implementation.
  *
- * It used to be much simpler; basically, we have two types of client
- * connections: those made by cimple-worker and cimple-client respectively.
- * cimple-server would keep track of cimple-worker threads/connections, and
- * clean them up when assigning tasks/on shutdown.
+ * It used to spawn a new thread for each client connection. That thread would
+ * make an eventfd descriptor and write to it when it was about to finish; the
+ * descriptor was added to the event loop, so that the thread could be cleaned
+ * up from the main event loop thread. It worked, but thread creation, signal
+ * mask juggling and eventfd setup for every single connection added up quickly
+ * when a lot of short-lived connections (like those made by cimple-client)
+ * arrived at once.
  *
- * What about cimple-client connections though? I struggled to come up with a
- * scheme that would allow cimple-server to clean them up gracefully. When
- * would it do the cleanup even? I didn't want to do it on shutdown, since
- * there would be potentially a lot of them.
+ * Now a fixed number of handler threads is created beforehand. The TCP server
+ * adds the listening socket to the event loop, as before. Accepted connections
+ * are put into a bounded queue, and the handler threads take them from there.
+ * If the queue is full, the connection is rejected (i.e. closed right away).
  *
- * One solution is to make client threads detached. This is a common advise;
- * I really don't understand the merit of this approach though. Client threads
- * actively work on shared data, take locks, etc. Data corruption is very
- * likely after the main thread exits and all the rest are killed.
+ * A handler thread keeps handling requests from its connection until the
+ * client closes it. On shutdown, the connections being handled are shut down,
+ * so that the handler threads can exit; connections that are still queued are
+ * simply closed.
  *
- * Another approach is pre-threading; we make a number of threads beforehand
- * and handle all client connections; I view this approach as limiting in
- * principle; probably that's foolish of me.
+ * Some connections stay open, but are idle most of the time (e.g. those of the
+ * workers waiting for runs). Waiting on them would tie up the handler threads,
+ * until there're none left for other clients. Instead, the connection handler
+ * can hand such a connection over to the first acceptor's event loop. Only the
+ * descriptor is watched there, once (using EPOLLONESHOT): when it becomes
+ * readable, the connection is put back into the queue. A handler thread then
+ * handles a single message from it, and hands it back to the event loop, which
+ * watches it again. This way, slow message handlers never run on the event
+ * loop thread, where they'd hold up accepting new connections.
  *
- * Finally, I cannot bring myself to do non-blocking I/O. I honestly fear the
- * amount of work it would require to maintain read buffers, etc.
+ * Messages can also be sent to a connection from other threads (see
+ * tcp_server_send). They're queued, and the event loop owning the connection
+ * is notified using an eventfd; it's the one that does the sending.
  *
- * So I came up with this convoluted scheme. The TCP server adds the listening
- * socket to the event loop, as before. Each client thread makes an eventfd
- * descriptor that it writes to when it's about to finish. The eventfd
- * descriptor is added to the event loop; once it's readable, we clean up the
- * client thread quickly from the main event loop thread. The TCP server itself
- * keeps track of client threads; on shutdown, it cleans up those still working.
+ * Alternatively, the server can be created without any handler threads. In
+ * that case, accepted connections are made non-blocking and added to the event
+ * loop. Each connection has a read buffer, where incoming messages are
+ * assembled incrementally from the length prefix, and a queue of outgoing
+ * messages. Once a message is complete, it's handled on the event loop thread.
+ * This way, a slow or stalled client doesn't tie up a thread.
  *
- * I'm _really_ not sure about this approach, it seems fishy as hell; I guess,
- * we'll see.
+ * Accepting connections might become a bottleneck itself if there're a lot of
+ * them. In that case, the server can be created with multiple acceptors. Each
+ * acceptor binds its own socket to the same port (using SO_REUSEPORT), so that
+ * the kernel spreads incoming connections between them. The first acceptor
+ * uses the event loop supplied by the caller; the others run their own event
+ * loops on separate threads. Without handler threads, each acceptor handles
+ * the connections it has accepted.
  */
 
-struct client {
-    struct tcp_server* server;
-    int conn_fd;
+/* The maximum number of accepted connections waiting for a handler thread. */
+#define TCP_SERVER_QUEUE_CAPACITY 1024
 
-    int cleanup_fd;
+struct conn_queue {
+    int fds[TCP_SERVER_QUEUE_CAPACITY];
+    size_t head;
+    size_t size;
+};
 
-    pid_t tid;
-    pthread_t thread;
+static void conn_queue_create(struct conn_queue* queue) {
+    queue->head = 0;
+    queue->size = 0;
+}
+
+static int conn_queue_is_empty(const struct conn_queue* queue) {
+    return !queue->size;
+}
+
+static int conn_queue_is_full(const struct conn_queue* queue) {
+    return queue->size == TCP_SERVER_QUEUE_CAPACITY;
+}
+
+static void conn_queue_add_last(struct conn_queue* queue, int fd) {
+    queue->fds[(queue->head + queue->size) % TCP_SERVER_QUEUE_CAPACITY] = fd;
+    ++queue->size;
+}
+
+static int conn_queue_remove_first(struct conn_queue* queue) {
+    const int fd = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % TCP_SERVER_QUEUE_CAPACITY;
+    --queue->size;
+    return fd;
+}
+
+struct tcp_msg {
+    uint32_t size;
+    struct buf* buf;
+    /* The number of bytes (including the length prefix) sent so far. */
+    size_t sent;
 
-    SIMPLEQ_ENTRY(client) entries;
+    SIMPLEQ_ENTRY(tcp_msg) entries;
 };
 
-SIMPLEQ_HEAD(client_queue, client);
+SIMPLEQ_HEAD(tcp_msg_queue, tcp_msg);
+
+/* Takes ownership of the buffer, even if it fails. */
+static int tcp_msg_create(struct tcp_msg** _msg, struct buf* buf) {
+    struct tcp_msg* msg = malloc(sizeof(struct tcp_msg));
+    if (!msg) {
+        log_errno("malloc");
+        free((void*)buf_get_data(buf));
+        buf_destroy(buf);
+        return -1;
+    }
+
+    msg->size = htonl(buf_get_size(buf));
+    msg->buf = buf;
+    msg->sent = 0;
+
+    *_msg = msg;
+    return 0;
+}
+
+static void tcp_msg_destroy(struct tcp_msg* msg) {
+    free((void*)buf_get_data(msg->buf));
+    buf_destroy(msg->buf);
+    free(msg);
+}
+
+static void tcp_msg_queue_move(struct tcp_msg_queue* dest, struct tcp_msg_queue* src) {
+    while (!SIMPLEQ_EMPTY(src)) {
+        struct tcp_msg* msg = SIMPLEQ_FIRST(src);
+        SIMPLEQ_REMOVE_HEAD(src, entries);
+        SIMPLEQ_INSERT_TAIL(dest, msg, entries);
+    }
+}
+
+static void tcp_msg_queue_destroy(struct tcp_msg_queue* queue) {
+    struct tcp_msg* msg1 = SIMPLEQ_FIRST(queue);
+    while (msg1) {
+        struct tcp_msg* msg2 = SIMPLEQ_NEXT(msg1, entries);
+        tcp_msg_destroy(msg1);
+        msg1 = msg2;
+    }
+    SIMPLEQ_INIT(queue);
+}
+
+struct tcp_conn;
+
+LIST_HEAD(tcp_conn_list, tcp_conn);
+TAILQ_HEAD(tcp_conn_queue, tcp_conn);
+
+struct tcp_server_thread {
+    struct tcp_server* server;
+    pthread_t thread;
+    /* The connection being handled, if any. */
+    int conn_fd;
+    /* Set if it's an idle connection with a message to be handled. */
+    struct tcp_conn* idle_conn;
+    /* Messages sent to the connection using tcp_server_send while it's being
+     * handled. They're sent once it's handed over to the event loop. */
+    struct tcp_msg_queue outbox;
+};
+
+struct tcp_acceptor {
+    struct tcp_server* server;
 
-struct tcp_server {
     struct event_loop* loop;
+    int accept_fd;
 
+    /* Connections owned by the event loop: either accepted by the acceptor (if
+     * there're no handler threads), or handed over by the handler threads. */
+    struct tcp_conn_list conns;
+    /* Connections that have messages to be sent, or have been handed back by
+     * the handler threads. The event loop is notified using the eventfd. */
+    struct tcp_conn_queue pending;
+    int wake_fd;
+
+    /* Only used by the acceptors that run their own event loops. */
+    pthread_t thread;
+    int stop_fd;
+    int stopping;
+};
+
+struct tcp_server {
     tcp_server_conn_handler conn_handler;
+    tcp_server_msg_handler msg_handler;
+    tcp_server_close_handler close_handler;
     void* conn_handler_arg;
 
-    struct client_queue client_queue;
+    /* Besides the fields below, this protects the acceptors' lists and queues
+     * of connections, the handler threads' outboxes and the connections'
+     * fields marked as such. */
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
 
-    int accept_fd;
+    int stopping;
+
+    struct conn_queue conn_queue;
+    struct tcp_server_stats stats;
+
+    /* Connections owned by the event loops, indexed by descriptor. */
+    struct tcp_conn** conns;
+    size_t conns_size;
+
+    struct tcp_server_thread* threads;
+    unsigned numof_threads;
+
+    struct tcp_acceptor* acceptors;
+    unsigned numof_acceptors;
 };
 
-static void client_destroy(struct client* client) {
-    log_debug("Cleaning up client thread %d\n", client->tid);
+struct tcp_conn {
+    struct tcp_server* server;
+    struct tcp_acceptor* acceptor;
+    int fd;
+
+    /* Handed over by a handler thread. Only the descriptor is watched by the
+     * event loop; messages are handled on the handler threads. */
+    int idle;
+    /* The descriptor is in the event loop. */
+    int armed;
+
+    /* The message being received (unless the connection is idle). */
+    uint32_t size;
+    size_t size_read;
+    unsigned char* data;
+    size_t data_read;
+
+    struct tcp_msg_queue write_queue;
+
+    /* Stop reading and close the connection once the write queue is empty. */
+    int closing;
+
+    /* The following fields are protected by the server's lock. */
 
-    SIMPLEQ_REMOVE(&client->server->client_queue, client, client, entries);
-    pthread_errno_if(pthread_join(client->thread, NULL), "pthread_join");
-    file_close(client->cleanup_fd);
-    net_close(client->conn_fd);
-    free(client);
+    /* Messages sent using tcp_server_send, to be moved to the write queue. */
+    struct tcp_msg_queue outbox;
+    /* A handler thread is handling a message from the connection. */
+    int busy;
+    /* The connection is in its acceptor's queue. */
+    int pending;
+
+    LIST_ENTRY(tcp_conn) entries;
+    TAILQ_ENTRY(tcp_conn) pending_entries;
+};
+
+static int tcp_server_lock(struct tcp_server* server) {
+    int ret = pthread_mutex_lock(&server->mtx);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_lock");
+        return ret;
+    }
+    return ret;
 }
 
-static int client_destroy_handler(
+static void tcp_server_unlock(struct tcp_server* server) {
+    pthread_errno_if(pthread_mutex_unlock(&server->mtx), "pthread_mutex_unlock");
+}
+
+/* The functions below that don't take the lock themselves must be called with
+ * the lock held. */
+
+static int tcp_server_reserve_conns(struct tcp_server* server, int fd) {
+    if ((size_t)fd < server->conns_size)
+        return 0;
+
+    size_t new_size = server->conns_size ? server->conns_size : 64;
+    while (new_size <= (size_t)fd)
+        new_size *= 2;
+
+    struct tcp_conn** new_conns = realloc(server->conns, new_size * sizeof(struct tcp_conn*));
+    if (!new_conns) {
+        log_errno("realloc");
+        return -1;
+    }
+    for (size_t i = server->conns_size; i < new_size; ++i)
+        new_conns[i] = NULL;
+
+    server->conns = new_conns;
+    server->conns_size = new_size;
+    return 0;
+}
+
+static struct tcp_conn* tcp_server_find_conn(const struct tcp_server* server, int fd) {
+    if (fd < 0 || (size_t)fd >= server->conns_size)
+        return NULL;
+    return server->conns[fd];
+}
+
+static int tcp_server_add_conn(struct tcp_server* server, struct tcp_conn* conn) {
+    int ret = 0;
+
+    ret = tcp_server_reserve_conns(server, conn->fd);
+    if (ret < 0)
+        return ret;
+
+    server->conns[conn->fd] = conn;
+    LIST_INSERT_HEAD(&conn->acceptor->conns, conn, entries);
+    return ret;
+}
+
+static void tcp_server_remove_conn(struct tcp_server* server, struct tcp_conn* conn) {
+    server->conns[conn->fd] = NULL;
+    LIST_REMOVE(conn, entries);
+    if (conn->pending)
+        TAILQ_REMOVE(&conn->acceptor->pending, conn, pending_entries);
+    tcp_msg_queue_destroy(&conn->outbox);
+}
+
+static struct tcp_server_thread* tcp_server_find_thread(struct tcp_server* server, int conn_fd) {
+    for (unsigned i = 0; i < server->numof_threads; ++i)
+        if (server->threads[i].conn_fd == conn_fd && !server->threads[i].idle_conn)
+            return &server->threads[i];
+    return NULL;
+}
+
+static void tcp_server_enqueue(struct tcp_server* server, int conn_fd) {
+    conn_queue_add_last(&server->conn_queue, conn_fd);
+    server->stats.queue_depth = server->conn_queue.size;
+    if (server->stats.queue_depth > server->stats.max_queue_depth)
+        server->stats.max_queue_depth = server->stats.queue_depth;
+
+    pthread_errno_if(pthread_cond_signal(&server->cv), "pthread_cond_signal");
+}
+
+/* Makes the event loop owning the connection look at it. */
+static void tcp_conn_wake(struct tcp_conn* conn) {
+    struct tcp_acceptor* acceptor = conn->acceptor;
+
+    if (conn->pending)
+        return;
+
+    TAILQ_INSERT_TAIL(&acceptor->pending, conn, pending_entries);
+    conn->pending = 1;
+    log_errno_if(eventfd_write(acceptor->wake_fd, 1), "eventfd_write");
+}
+
+static int tcp_conn_create(
+    struct tcp_conn** _conn,
+    struct tcp_server* server,
+    struct tcp_acceptor* acceptor,
+    int fd
+) {
+    struct tcp_conn* conn = calloc(1, sizeof(struct tcp_conn));
+    if (!conn) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    conn->server = server;
+    conn->acceptor = acceptor;
+    conn->fd = fd;
+
+    conn->idle = 0;
+    conn->armed = 0;
+
+    conn->size = 0;
+    conn->size_read = 0;
+    conn->data = NULL;
+    conn->data_read = 0;
+
+    SIMPLEQ_INIT(&conn->write_queue);
+    conn->closing = 0;
+
+    SIMPLEQ_INIT(&conn->outbox);
+    conn->busy = 0;
+    conn->pending = 0;
+
+    *_conn = conn;
+    return 0;
+}
+
+static void tcp_conn_destroy(struct tcp_conn* conn) {
+    struct tcp_server* server = conn->server;
+    server->close_handler(conn->fd, server->conn_handler_arg);
+
+    /* tcp_server_send mustn't find it anymore. If the lock can't be acquired,
+     * better to leak it. */
+    if (tcp_server_lock(server) < 0)
+        return;
+    tcp_server_remove_conn(server, conn);
+    tcp_server_unlock(server);
+
+    tcp_msg_queue_destroy(&conn->write_queue);
+    net_free_msg(conn->data);
+    net_close(conn->fd);
+    free(conn);
+}
+
+static void tcp_conn_close(struct tcp_conn* conn) {
+    log_debug("Closing connection %d\n", conn->fd);
+
+    if (conn->armed)
+        event_loop_remove(conn->acceptor->loop, conn->fd);
+    tcp_conn_destroy(conn);
+}
+
+static void tcp_conn_list_destroy(struct tcp_conn_list* list) {
+    struct tcp_conn* conn1 = LIST_FIRST(list);
+    while (conn1) {
+        struct tcp_conn* conn2 = LIST_NEXT(conn1, entries);
+        tcp_conn_close(conn1);
+        conn1 = conn2;
+    }
+}
+
+static int tcp_conn_handler(struct event_loop*, int fd, short revents, void* _conn);
+
+static int tcp_conn_update_events(struct tcp_conn* conn) {
+    struct event_loop* loop = conn->acceptor->loop;
+    int ret = 0;
+
+    short events = 0;
+    if (!conn->closing)
+        events |= POLLIN;
+    if (!SIMPLEQ_EMPTY(&conn->write_queue))
+        events |= POLLOUT;
+
+    if (conn->armed)
+        return event_loop_modify(loop, conn->fd, events);
+
+    /* Idle connections are watched until the descriptor becomes ready once. */
+    ret = event_loop_add_once(loop, conn->fd, events, tcp_conn_handler, conn);
+    if (ret < 0)
+        return ret;
+    conn->armed = 1;
+
+    return ret;
+}
+
+/* Closes the connection if there's nothing left to do, otherwise makes the
+ * event loop watch it. */
+static void tcp_conn_watch(struct tcp_conn* conn) {
+    if (conn->closing && SIMPLEQ_EMPTY(&conn->write_queue))
+        goto close;
+
+    if (tcp_conn_update_events(conn) < 0)
+        goto close;
+
+    return;
+
+close:
+    tcp_conn_close(conn);
+}
+
+/* Returns 1 if the write queue has been flushed, 0 if the socket is not
+ * writable anymore. */
+static int tcp_conn_flush(struct tcp_conn* conn) {
+    /* The descriptors of idle connections are blocking. */
+    static const int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+
+    while (!SIMPLEQ_EMPTY(&conn->write_queue)) {
+        struct tcp_msg* msg = SIMPLEQ_FIRST(&conn->write_queue);
+
+        struct iovec iov[2];
+        int iovcnt = 0;
+        size_t offset = msg->sent;
+
+        if (offset < sizeof(msg->size)) {
+            iov[iovcnt].iov_base = (unsigned char*)&msg->size + offset;
+            iov[iovcnt].iov_len = sizeof(msg->size) - offset;
+            ++iovcnt;
+            offset = 0;
+        } else {
+            offset -= sizeof(msg->size);
+        }
+        iov[iovcnt].iov_base = (unsigned char*)buf_get_data(msg->buf) + offset;
+        iov[iovcnt].iov_len = buf_get_size(msg->buf) - offset;
+        ++iovcnt;
+
+        struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = iovcnt};
+
+        ssize_t ret = sendmsg(conn->fd, &hdr, flags);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            log_errno("sendmsg");
+            return -1;
+        }
+        msg->sent += ret;
+
+        if (msg->sent < sizeof(msg->size) + buf_get_size(msg->buf))
+            continue;
+
+        SIMPLEQ_REMOVE_HEAD(&conn->write_queue, entries);
+        tcp_msg_destroy(msg);
+    }
+
+    return 1;
+}
+
+/* Takes ownership of the reply. */
+static int tcp_conn_send(struct tcp_conn* conn, struct buf* reply) {
+    struct tcp_msg* msg = NULL;
+    int ret = 0;
+
+    ret = tcp_msg_create(&msg, reply);
+    if (ret < 0)
+        return ret;
+
+    /* Try to send the reply right away, most of the time the socket is
+     * writable anyway. */
+    SIMPLEQ_INSERT_TAIL(&conn->write_queue, msg, entries);
+    ret = tcp_conn_flush(conn);
+    if (ret < 0)
+        return ret;
+
+    return 0;
+}
+
+/* Passes the message to the message handler, and sends the reply. */
+static int tcp_conn_dispatch(struct tcp_conn* conn, const struct buf* msg) {
+    struct tcp_server* server = conn->server;
+    struct buf* reply = NULL;
+
+    const int handler_ret = server->msg_handler(conn->fd, msg, &reply, server->conn_handler_arg);
+    if (handler_ret)
+        conn->closing = 1;
+
+    if (!reply)
+        return 0;
+    return tcp_conn_send(conn, reply);
+}
+
+static int tcp_conn_handle_msg(struct tcp_conn* conn) {
+    struct buf* msg = NULL;
+    int ret = 0;
+
+    ret = buf_create(&msg, conn->data, conn->size);
+    if (ret < 0)
+        return ret;
+
+    ret = tcp_conn_dispatch(conn, msg);
+    buf_destroy(msg);
+
+    net_free_msg(conn->data);
+    conn->data = NULL;
+    conn->size_read = 0;
+    conn->data_read = 0;
+
+    return ret;
+}
+
+/* Returns 1 if the peer has closed the connection. */
+static int tcp_conn_read(struct tcp_conn* conn) {
+    int ret = 0;
+
+    while (!conn->closing) {
+        void* dest = NULL;
+        size_t size = 0;
+
+        if (conn->size_read < sizeof(conn->size)) {
+            dest = (unsigned char*)&conn->size + conn->size_read;
+            size = sizeof(conn->size) - conn->size_read;
+        } else {
+            dest = conn->data + conn->data_read;
+            size = conn->size - conn->data_read;
+        }
+
+        ssize_t read_now = read(conn->fd, dest, size);
+        if (!read_now)
+            return 1;
+        if (read_now < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            log_errno("read");
+            return -1;
+        }
+
+        if (conn->size_read < sizeof(conn->size)) {
+            conn->size_read += read_now;
+            if (conn->size_read < sizeof(conn->size))
+                continue;
+
+            conn->size = ntohl(conn->size);
+            if (!conn->size) {
+                log_err("Received an empty message\n");
+                return -1;
+            }
+
+            ret = net_check_msg_size(conn->size);
+            if (ret < 0)
+                return ret;
+
+            conn->data = net_alloc_msg(conn->size);
+            if (!conn->data)
+                return -1;
+            continue;
+        }
+
+        conn->data_read += read_now;
+        if (conn->data_read < conn->size)
+            continue;
+
+        ret = tcp_conn_handle_msg(conn);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Same, but for idle connections: a single message is read on a handler
+ * thread, blocking until it's complete. */
+static int tcp_conn_read_idle(struct tcp_conn* conn) {
+    struct buf* msg = NULL;
+    int ret = 0;
+
+    ret = net_recv_eof(conn->fd);
+    if (ret)
+        return ret;
+
+    ret = net_recv_buf(conn->fd, &msg);
+    if (ret < 0)
+        return ret;
+
+    ret = tcp_conn_dispatch(conn, msg);
+    net_free_buf(msg);
+
+    return ret;
+}
+
+/* An idle connection has become readable, pass it to the handler threads. */
+static int tcp_conn_queue_idle(struct tcp_conn* conn) {
+    struct tcp_server* server = conn->server;
+    int ret = 0;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        return ret;
+
+    if (conn_queue_is_full(&server->conn_queue)) {
+        log_err("Connection queue is full, closing connection\n");
+        ret = -1;
+        goto unlock;
+    }
+
+    conn->busy = 1;
+    tcp_server_enqueue(server, conn->fd);
+
+unlock:
+    tcp_server_unlock(server);
+
+    return ret;
+}
+
+static int tcp_conn_handler(
     UNUSED struct event_loop* loop,
     UNUSED int fd,
-    UNUSED short revents,
-    void* _client
+    short revents,
+    void* _conn
 ) {
-    struct client* client = (struct client*)_client;
-    log_debug("Client thread %d indicated that it's done\n", client->tid);
+    struct tcp_conn* conn = (struct tcp_conn*)_conn;
+    int ret = 0;
+
+    /* One-shot descriptors have been removed from the event loop already. */
+    if (conn->idle)
+        conn->armed = 0;
+
+    if (revents & POLLOUT) {
+        ret = tcp_conn_flush(conn);
+        if (ret < 0)
+            goto close;
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (conn->idle) {
+            /* It wasn't watched for input, so the peer must be gone. */
+            if (conn->closing)
+                goto close;
 
-    client_destroy(client);
+            ret = tcp_conn_queue_idle(conn);
+            if (ret < 0)
+                goto close;
+            /* It's handed back once the message has been handled. */
+            return 0;
+        }
+
+        ret = tcp_conn_read(conn);
+        if (ret < 0)
+            goto close;
+        /* The peer is gone, there's no one to send the replies to. */
+        if (ret > 0)
+            goto close;
+    }
+
+    tcp_conn_watch(conn);
+    return 0;
+
+close:
+    tcp_conn_close(conn);
+
+    /* A broken connection is not an error as far as the event loop is
+     * concerned. */
     return 0;
 }
 
-static void* client_thread_func(void* _client) {
-    struct client* client = (struct client*)_client;
+static int tcp_acceptor_add_conn(struct tcp_acceptor* acceptor, int conn_fd) {
+    struct tcp_server* server = acceptor->server;
+    struct tcp_conn* conn = NULL;
     int ret = 0;
 
-    client->tid = gettid();
-    log_debug("New client thread thread %d has started\n", client->tid);
+    ret = tcp_conn_create(&conn, server, acceptor, conn_fd);
+    if (ret < 0)
+        return ret;
+
+    ret = event_loop_add(acceptor->loop, conn_fd, POLLIN, tcp_conn_handler, conn);
+    if (ret < 0)
+        goto free_conn;
+    conn->armed = 1;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        goto remove_conn;
+    ret = tcp_server_add_conn(server, conn);
+    tcp_server_unlock(server);
+    if (ret < 0)
+        goto remove_conn;
+
+    return ret;
 
-    /* Let the client thread handle its signals except those that should be
+remove_conn:
+    event_loop_remove(acceptor->loop, conn_fd);
+
+free_conn:
+    free(conn);
+
+    return ret;
+}
+
+/* Must be called with the lock held. */
+static struct tcp_conn* tcp_acceptor_next_pending(struct tcp_acceptor* acceptor) {
+    struct tcp_conn* conn = NULL;
+
+    while ((conn = TAILQ_FIRST(&acceptor->pending))) {
+        TAILQ_REMOVE(&acceptor->pending, conn, pending_entries);
+        conn->pending = 0;
+
+        /* It's woken up again once the handler thread is done with it. */
+        if (conn->busy)
+            continue;
+
+        tcp_msg_queue_move(&conn->write_queue, &conn->outbox);
+        return conn;
+    }
+
+    return NULL;
+}
+
+/* Sends the messages queued using tcp_server_send, and watches the connections
+ * handed over (or back) by the handler threads. */
+static int tcp_acceptor_wake_handler(
+    UNUSED struct event_loop* loop,
+    UNUSED int fd,
+    UNUSED short revents,
+    void* _acceptor
+) {
+    struct tcp_acceptor* acceptor = (struct tcp_acceptor*)_acceptor;
+    struct tcp_server* server = acceptor->server;
+    eventfd_t value = 0;
+    int ret = 0;
+
+    log_errno_if(eventfd_read(acceptor->wake_fd, &value), "eventfd_read");
+
+    while (1) {
+        ret = tcp_server_lock(server);
+        if (ret < 0)
+            return ret;
+
+        struct tcp_conn* conn = tcp_acceptor_next_pending(acceptor);
+
+        tcp_server_unlock(server);
+
+        if (!conn)
+            break;
+
+        /* The close handler might take its own locks, so the connection is
+         * closed without holding the server's lock. */
+        if (tcp_conn_flush(conn) < 0)
+            tcp_conn_close(conn);
+        else
+            tcp_conn_watch(conn);
+    }
+
+    return ret;
+}
+
+/* Returns 1 if a connection was dequeued, 0 if the server is stopping. */
+static int tcp_server_dequeue(struct tcp_server_thread* thread) {
+    struct tcp_server* server = thread->server;
+    int ret = 0;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        return ret;
+
+    while (!server->stopping && conn_queue_is_empty(&server->conn_queue)) {
+        ret = pthread_cond_wait(&server->cv, &server->mtx);
+        if (ret) {
+            pthread_errno(ret, "pthread_cond_wait");
+            goto unlock;
+        }
+    }
+
+    if (server->stopping)
+        goto unlock;
+
+    thread->conn_fd = conn_queue_remove_first(&server->conn_queue);
+    /* It might be an idle connection that has become readable. */
+    thread->idle_conn = tcp_server_find_conn(server, thread->conn_fd);
+    server->stats.queue_depth = server->conn_queue.size;
+    ret = 1;
+
+unlock:
+    tcp_server_unlock(server);
+
+    return ret;
+}
+
+static void tcp_server_release_conn(struct tcp_server_thread* thread) {
+    struct tcp_server* server = thread->server;
+
+    /* If the lock can't be acquired, tcp_server_stop_threads might shut down a
+     * descriptor that's been reused; better to leak it in that case. */
+    if (tcp_server_lock(server) < 0)
+        return;
+
+    net_close(thread->conn_fd);
+    thread->conn_fd = -1;
+    tcp_msg_queue_destroy(&thread->outbox);
+
+    tcp_server_unlock(server);
+}
+
+/* Returns 0 if the connection has been handed over to the event loop. */
+static int tcp_server_hand_over_conn(struct tcp_server_thread* thread) {
+    struct tcp_server* server = thread->server;
+    struct tcp_conn* conn = NULL;
+    int ret = 0;
+
+    ret = tcp_conn_create(&conn, server, &server->acceptors[0], thread->conn_fd);
+    if (ret < 0)
+        return ret;
+    conn->idle = 1;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        goto free_conn;
+
+    if (server->stopping) {
+        ret = -1;
+        goto unlock;
+    }
+
+    ret = tcp_server_add_conn(server, conn);
+    if (ret < 0)
+        goto unlock;
+
+    tcp_msg_queue_move(&conn->outbox, &thread->outbox);
+    tcp_conn_wake(conn);
+    /* tcp_server_stop_threads mustn't touch it anymore. */
+    thread->conn_fd = -1;
+
+    tcp_server_unlock(server);
+    return ret;
+
+unlock:
+    tcp_server_unlock(server);
+
+free_conn:
+    free(conn);
+
+    return ret;
+}
+
+/* Handles a single message from an idle connection, and hands the connection
+ * back to the event loop. */
+static void tcp_server_handle_idle_conn(struct tcp_server_thread* thread) {
+    struct tcp_server* server = thread->server;
+    struct tcp_conn* conn = thread->idle_conn;
+
+    /* If the peer has closed the connection, or it's broken, the event loop
+     * closes it. */
+    if (tcp_conn_read_idle(conn))
+        conn->closing = 1;
+
+    /* See tcp_server_release_conn. */
+    if (tcp_server_lock(server) < 0)
+        return;
+
+    conn->busy = 0;
+    tcp_conn_wake(conn);
+    thread->conn_fd = -1;
+    thread->idle_conn = NULL;
+
+    tcp_server_unlock(server);
+}
+
+static void* tcp_server_thread_func(void* _thread) {
+    struct tcp_server_thread* thread = (struct tcp_server_thread*)_thread;
+    struct tcp_server* server = thread->server;
+    int ret = 0;
+
+    log_debug("New handler thread %d has started\n", gettid());
+
+    /* Let the handler thread handle its signals except those that should be
      * handled in the main thread. */
     ret = signal_block_sigterms();
     if (ret < 0)
-        goto cleanup;
+        return NULL;
 
-    ret = client->server->conn_handler(client->conn_fd, client->server->conn_handler_arg);
-    if (ret < 0)
-        goto cleanup;
+    while (1) {
+        ret = tcp_server_dequeue(thread);
+        if (ret <= 0)
+            break;
+
+        if (thread->idle_conn) {
+            tcp_server_handle_idle_conn(thread);
+            continue;
+        }
 
-cleanup:
-    log_errno_if(eventfd_write(client->cleanup_fd, 1), "eventfd_write");
+        ret = server->conn_handler(thread->conn_fd, server->conn_handler_arg);
+        if (ret > 0 && !tcp_server_hand_over_conn(thread))
+            continue;
 
+        server->close_handler(thread->conn_fd, server->conn_handler_arg);
+        tcp_server_release_conn(thread);
+    }
+
+    log_debug("Handler thread %d is exiting\n", gettid());
     return NULL;
 }
 
-static int client_create_thread(struct client* client) {
+static void tcp_server_stop_threads(struct tcp_server* server, unsigned numof_threads) {
+    if (!tcp_server_lock(server)) {
+        server->stopping = 1;
+        pthread_errno_if(pthread_cond_broadcast(&server->cv), "pthread_cond_broadcast");
+
+        /* Wake up the handler threads waiting for more requests from their
+         * clients. */
+        for (unsigned i = 0; i < numof_threads; ++i)
+            if (server->threads[i].conn_fd >= 0)
+                net_shutdown(server->threads[i].conn_fd);
+
+        tcp_server_unlock(server);
+    }
+
+    for (unsigned i = 0; i < numof_threads; ++i)
+        pthread_errno_if(pthread_join(server->threads[i].thread, NULL), "pthread_join");
+}
+
+static int tcp_server_start_threads(struct tcp_server* server) {
     sigset_t old_mask;
+    unsigned numof_started = 0;
     int ret = 0;
 
-    /* Block all signals (we'll unblock them later); the client thread will
+    /* Block all signals (we'll unblock them later); the handler threads will
      * have all signals blocked initially. This allows the main thread to
      * handle SIGINT/SIGTERM/etc. */
     ret = signal_block_all(&old_mask);
     if (ret < 0)
         return ret;
 
-    ret = pthread_create(&client->thread, NULL, client_thread_func, client);
-    if (ret) {
-        pthread_errno(ret, "pthread_create");
-        goto restore_mask;
+    for (numof_started = 0; numof_started < server->numof_threads; ++numof_started) {
+        struct tcp_server_thread* thread = &server->threads[numof_started];
+
+        thread->server = server;
+        thread->conn_fd = -1;
+        thread->idle_conn = NULL;
+        SIMPLEQ_INIT(&thread->outbox);
+
+        ret = pthread_create(&thread->thread, NULL, tcp_server_thread_func, thread);
+        if (ret) {
+            pthread_errno(ret, "pthread_create");
+            goto stop_threads;
+        }
     }
 
+    goto restore_mask;
+
+stop_threads:
+    tcp_server_stop_threads(server, numof_started);
+
 restore_mask:
     /* Restore the previously-enabled signals for handling in the main thread. */
     signal_set_mask(&old_mask);
@@ -154,79 +1009,308 @@ restore_mask:
     return ret;
 }
 
-static int client_create(struct tcp_server* server, int conn_fd) {
-    int ret = 0;
+/* Connections that are still queued are simply closed; idle ones are destroyed
+ * along with their acceptor. */
+static void tcp_server_close_queued_conns(struct tcp_server* server) {
+    while (!conn_queue_is_empty(&server->conn_queue)) {
+        const int conn_fd = conn_queue_remove_first(&server->conn_queue);
+        if (!tcp_server_find_conn(server, conn_fd))
+            net_close(conn_fd);
+    }
+}
 
-    struct client* client = calloc(1, sizeof(struct client));
-    if (!client) {
-        log_errno("calloc");
-        return -1;
+static int tcp_acceptor_accept_nonblock(struct tcp_acceptor* acceptor) {
+    struct tcp_server* server = acceptor->server;
+    int conn_fd = -1, ret = 0;
+
+    ret = net_accept_nonblock(acceptor->accept_fd);
+    if (ret < 0)
+        return ret;
+    conn_fd = ret;
+
+    ret = tcp_acceptor_add_conn(acceptor, conn_fd);
+    if (ret < 0)
+        goto close_conn;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        return ret;
+    ++server->stats.numof_accepted;
+    tcp_server_unlock(server);
+
+    return ret;
+
+close_conn:
+    net_close(conn_fd);
+
+    return ret;
+}
+
+static int tcp_acceptor_accept(struct tcp_acceptor* acceptor) {
+    struct tcp_server* server = acceptor->server;
+    int conn_fd = -1, ret = 0;
+
+    if (!server->numof_threads)
+        return tcp_acceptor_accept_nonblock(acceptor);
+
+    ret = net_accept(acceptor->accept_fd);
+    if (ret < 0)
+        return ret;
+    conn_fd = ret;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        goto close_conn;
+
+    if (conn_queue_is_full(&server->conn_queue)) {
+        ++server->stats.numof_rejected;
+        tcp_server_unlock(server);
+
+        log_err("Connection queue is full, rejecting connection\n");
+        /* This is not an error as far as the event loop is concerned. */
+        ret = 0;
+        goto close_conn;
     }
 
-    client->server = server;
-    client->conn_fd = conn_fd;
+    tcp_server_enqueue(server, conn_fd);
+    ++server->stats.numof_accepted;
+    tcp_server_unlock(server);
+
+    return ret;
+
+close_conn:
+    net_close(conn_fd);
+
+    return ret;
+}
+
+static int tcp_acceptor_accept_handler(
+    UNUSED struct event_loop* loop,
+    UNUSED int fd,
+    UNUSED short revents,
+    void* _acceptor
+) {
+    struct tcp_acceptor* acceptor = (struct tcp_acceptor*)_acceptor;
+    return tcp_acceptor_accept(acceptor);
+}
+
+static int tcp_acceptor_set_stopping(
+    UNUSED struct event_loop* loop,
+    UNUSED int fd,
+    UNUSED short revents,
+    void* _acceptor
+) {
+    struct tcp_acceptor* acceptor = (struct tcp_acceptor*)_acceptor;
+    acceptor->stopping = 1;
+    return 0;
+}
+
+static int tcp_acceptor_has_own_loop(const struct tcp_acceptor* acceptor) {
+    return acceptor != &acceptor->server->acceptors[0];
+}
+
+/* Pass loop as NULL to make the acceptor create its own event loop. */
+static int tcp_acceptor_create(
+    struct tcp_acceptor* acceptor,
+    struct tcp_server* server,
+    struct event_loop* loop,
+    const char* port,
+    int reuseport
+) {
+    int ret = 0;
+
+    acceptor->server = server;
+    acceptor->loop = loop;
+    acceptor->stop_fd = -1;
+    acceptor->stopping = 0;
+    LIST_INIT(&acceptor->conns);
+    TAILQ_INIT(&acceptor->pending);
+
+    ret = reuseport ? net_bind_reuseport(port) : net_bind(port);
+    if (ret < 0)
+        return ret;
+    acceptor->accept_fd = ret;
+
+    if (!loop) {
+        ret = event_loop_create(&acceptor->loop);
+        if (ret < 0)
+            goto close;
+
+        ret = eventfd(0, EFD_CLOEXEC);
+        if (ret < 0) {
+            log_errno("eventfd");
+            goto destroy_loop;
+        }
+        acceptor->stop_fd = ret;
+
+        ret = event_loop_add(
+            acceptor->loop, acceptor->stop_fd, POLLIN, tcp_acceptor_set_stopping, acceptor
+        );
+        if (ret < 0)
+            goto close_stop_fd;
+    }
 
     ret = eventfd(0, EFD_CLOEXEC);
     if (ret < 0) {
         log_errno("eventfd");
-        goto free;
+        goto close_stop_fd;
     }
-    client->cleanup_fd = ret;
+    acceptor->wake_fd = ret;
 
-    ret = event_loop_add_once(
-        server->loop, client->cleanup_fd, POLLIN, client_destroy_handler, client
+    ret = event_loop_add(
+        acceptor->loop, acceptor->wake_fd, POLLIN, tcp_acceptor_wake_handler, acceptor
     );
     if (ret < 0)
-        goto close_cleanup_fd;
-
-    SIMPLEQ_INSERT_TAIL(&server->client_queue, client, entries);
+        goto close_wake_fd;
 
-    ret = client_create_thread(client);
+    ret = event_loop_add(
+        acceptor->loop, acceptor->accept_fd, POLLIN, tcp_acceptor_accept_handler, acceptor
+    );
     if (ret < 0)
-        goto remove_from_client_queue;
+        goto remove_wake_fd;
 
     return ret;
 
-remove_from_client_queue:
-    SIMPLEQ_REMOVE(&server->client_queue, client, client, entries);
+remove_wake_fd:
+    event_loop_remove(acceptor->loop, acceptor->wake_fd);
 
-close_cleanup_fd:
-    file_close(client->cleanup_fd);
+close_wake_fd:
+    net_close(acceptor->wake_fd);
 
-free:
-    free(client);
+close_stop_fd:
+    if (!loop)
+        net_close(acceptor->stop_fd);
+
+destroy_loop:
+    if (!loop)
+        event_loop_destroy(acceptor->loop);
+
+close:
+    net_unbind(acceptor->accept_fd);
 
     return ret;
 }
 
-static void client_queue_create(struct client_queue* client_queue) {
-    SIMPLEQ_INIT(client_queue);
+static void tcp_acceptor_destroy(struct tcp_acceptor* acceptor) {
+    /* The first acceptor's loop belongs to the caller, and outlives it. */
+    event_loop_remove(acceptor->loop, acceptor->accept_fd);
+    net_unbind(acceptor->accept_fd);
+    tcp_conn_list_destroy(&acceptor->conns);
+    event_loop_remove(acceptor->loop, acceptor->wake_fd);
+    net_close(acceptor->wake_fd);
+    if (tcp_acceptor_has_own_loop(acceptor)) {
+        event_loop_destroy(acceptor->loop);
+        net_close(acceptor->stop_fd);
+    }
 }
 
-static void client_queue_destroy(struct client_queue* client_queue) {
-    struct client* entry1 = SIMPLEQ_FIRST(client_queue);
-    while (entry1) {
-        struct client* entry2 = SIMPLEQ_NEXT(entry1, entries);
-        client_destroy(entry1);
-        entry1 = entry2;
+static void* tcp_acceptor_thread_func(void* _acceptor) {
+    struct tcp_acceptor* acceptor = (struct tcp_acceptor*)_acceptor;
+    int ret = 0;
+
+    log_debug("New acceptor thread %d has started\n", gettid());
+
+    /* Same as for the handler threads. */
+    ret = signal_block_sigterms();
+    if (ret < 0)
+        return NULL;
+
+    while (!acceptor->stopping) {
+        ret = event_loop_run(acceptor->loop);
+        if (ret < 0) {
+            log_err("Acceptor thread %d has failed\n", gettid());
+            break;
+        }
     }
+
+    log_debug("Acceptor thread %d is exiting\n", gettid());
+    return NULL;
 }
 
-static int tcp_server_accept_handler(
-    UNUSED struct event_loop* loop,
-    UNUSED int fd,
-    UNUSED short revents,
-    void* _server
+static void tcp_server_destroy_acceptors(struct tcp_server* server, unsigned numof_acceptors) {
+    for (unsigned i = 0; i < numof_acceptors; ++i)
+        tcp_acceptor_destroy(&server->acceptors[i]);
+}
+
+static int tcp_server_create_acceptors(
+    struct tcp_server* server,
+    struct event_loop* loop,
+    const char* port
 ) {
-    struct tcp_server* server = (struct tcp_server*)_server;
-    return tcp_server_accept(server);
+    unsigned numof_created = 0;
+    int ret = 0;
+
+    const int reuseport = server->numof_acceptors > 1;
+
+    for (numof_created = 0; numof_created < server->numof_acceptors; ++numof_created) {
+        ret = tcp_acceptor_create(
+            &server->acceptors[numof_created],
+            server,
+            numof_created ? NULL : loop,
+            port,
+            reuseport
+        );
+        if (ret < 0)
+            goto destroy_acceptors;
+    }
+
+    return ret;
+
+destroy_acceptors:
+    tcp_server_destroy_acceptors(server, numof_created);
+
+    return ret;
+}
+
+static void tcp_server_stop_acceptors(struct tcp_server* server, unsigned numof_acceptors) {
+    /* The first acceptor runs on the caller's event loop. */
+    for (unsigned i = 1; i < numof_acceptors; ++i)
+        log_errno_if(eventfd_write(server->acceptors[i].stop_fd, 1), "eventfd_write");
+
+    for (unsigned i = 1; i < numof_acceptors; ++i)
+        pthread_errno_if(pthread_join(server->acceptors[i].thread, NULL), "pthread_join");
+}
+
+static int tcp_server_start_acceptors(struct tcp_server* server) {
+    sigset_t old_mask;
+    unsigned numof_started = 1;
+    int ret = 0;
+
+    /* See tcp_server_start_threads. */
+    ret = signal_block_all(&old_mask);
+    if (ret < 0)
+        return ret;
+
+    for (numof_started = 1; numof_started < server->numof_acceptors; ++numof_started) {
+        struct tcp_acceptor* acceptor = &server->acceptors[numof_started];
+
+        ret = pthread_create(&acceptor->thread, NULL, tcp_acceptor_thread_func, acceptor);
+        if (ret) {
+            pthread_errno(ret, "pthread_create");
+            goto stop_acceptors;
+        }
+    }
+
+    goto restore_mask;
+
+stop_acceptors:
+    tcp_server_stop_acceptors(server, numof_started);
+
+restore_mask:
+    signal_set_mask(&old_mask);
+
+    return ret;
 }
 
 int tcp_server_create(
     struct tcp_server** _server,
     struct event_loop* loop,
     const char* port,
+    unsigned numof_acceptors,
+    unsigned numof_threads,
     tcp_server_conn_handler conn_handler,
+    tcp_server_msg_handler msg_handler,
+    tcp_server_close_handler close_handler,
     void* conn_handler_arg
 ) {
     int ret = 0;
@@ -237,27 +1321,87 @@ int tcp_server_create(
         return -1;
     }
 
-    server->loop = loop;
-
     server->conn_handler = conn_handler;
+    server->msg_handler = msg_handler;
+    server->close_handler = close_handler;
     server->conn_handler_arg = conn_handler_arg;
 
-    client_queue_create(&server->client_queue);
+    ret = pthread_mutex_init(&server->mtx, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_mutex_init");
+        goto free;
+    }
+
+    ret = pthread_cond_init(&server->cv, NULL);
+    if (ret) {
+        pthread_errno(ret, "pthread_cond_init");
+        goto destroy_mtx;
+    }
+
+    server->stopping = 0;
+    conn_queue_create(&server->conn_queue);
+    server->conns = NULL;
+    server->conns_size = 0;
+
+    server->threads = NULL;
+    if (numof_threads) {
+        server->threads = calloc(numof_threads, sizeof(struct tcp_server_thread));
+        if (!server->threads) {
+            log_errno("calloc");
+            ret = -1;
+            goto destroy_cv;
+        }
+    }
+    server->numof_threads = numof_threads;
 
-    ret = net_bind(port);
+    server->acceptors = calloc(numof_acceptors, sizeof(struct tcp_acceptor));
+    if (!server->acceptors) {
+        log_errno("calloc");
+        ret = -1;
+        goto free_threads;
+    }
+    server->numof_acceptors = numof_acceptors;
+
+    ret = tcp_server_create_acceptors(server, loop, port);
     if (ret < 0)
-        goto free;
-    server->accept_fd = ret;
+        goto free_acceptors;
 
-    ret = event_loop_add(loop, server->accept_fd, POLLIN, tcp_server_accept_handler, server);
+    ret = tcp_server_start_threads(server);
     if (ret < 0)
-        goto close;
+        goto destroy_acceptors;
+
+    ret = tcp_server_start_acceptors(server);
+    if (ret < 0)
+        goto stop_threads;
+
+    if (server->numof_threads)
+        log("Started %u handler thread(s)\n", server->numof_threads);
+    else
+        log("Handling connections on the event loop thread(s)\n");
+    if (server->numof_acceptors > 1)
+        log("Started %u acceptor thread(s)\n", server->numof_acceptors - 1);
 
     *_server = server;
     return ret;
 
-close:
-    net_close(server->accept_fd);
+stop_threads:
+    tcp_server_stop_threads(server, server->numof_threads);
+
+destroy_acceptors:
+    tcp_server_destroy_acceptors(server, server->numof_acceptors);
+
+free_acceptors:
+    free(server->acceptors);
+
+free_threads:
+    free(server->threads);
+
+destroy_cv:
+    pthread_errno_if(pthread_cond_destroy(&server->cv), "pthread_cond_destroy");
+
+destroy_mtx:
+    pthread_errno_if(pthread_mutex_destroy(&server->mtx), "pthread_mutex_destroy");
+
 free:
     free(server);
 
@@ -265,27 +1409,72 @@ free:
 }
 
 void tcp_server_destroy(struct tcp_server* server) {
-    net_close(server->accept_fd);
-    client_queue_destroy(&server->client_queue);
+    tcp_server_stop_acceptors(server, server->numof_acceptors);
+    tcp_server_stop_threads(server, server->numof_threads);
+
+    log("Accepted %llu connection(s), rejected %llu\n",
+        server->stats.numof_accepted,
+        server->stats.numof_rejected);
+
+    tcp_server_close_queued_conns(server);
+    tcp_server_destroy_acceptors(server, server->numof_acceptors);
+    free(server->conns);
+    free(server->acceptors);
+    free(server->threads);
+    pthread_errno_if(pthread_cond_destroy(&server->cv), "pthread_cond_destroy");
+    pthread_errno_if(pthread_mutex_destroy(&server->mtx), "pthread_mutex_destroy");
     free(server);
 }
 
-int tcp_server_accept(struct tcp_server* server) {
-    int conn_fd = -1, ret = 0;
+int tcp_server_send(struct tcp_server* server, int conn_fd, struct buf* buf) {
+    struct tcp_msg* msg = NULL;
+    int ret = 0;
 
-    ret = net_accept(server->accept_fd);
+    ret = tcp_msg_create(&msg, buf);
     if (ret < 0)
         return ret;
-    conn_fd = ret;
 
-    ret = client_create(server, conn_fd);
+    ret = tcp_server_lock(server);
     if (ret < 0)
-        goto close_conn;
+        goto destroy_msg;
+
+    struct tcp_conn* conn = tcp_server_find_conn(server, conn_fd);
+    struct tcp_server_thread* thread = conn ? NULL : tcp_server_find_thread(server, conn_fd);
+
+    if (conn) {
+        SIMPLEQ_INSERT_TAIL(&conn->outbox, msg, entries);
+        /* Otherwise, the handler thread wakes it up once it's done. */
+        if (!conn->busy)
+            tcp_conn_wake(conn);
+    } else if (thread) {
+        SIMPLEQ_INSERT_TAIL(&thread->outbox, msg, entries);
+    } else {
+        log_err("Connection %d is not open\n", conn_fd);
+        ret = -1;
+    }
+
+    tcp_server_unlock(server);
+
+    if (ret < 0)
+        goto destroy_msg;
 
     return ret;
 
-close_conn:
-    net_close(conn_fd);
+destroy_msg:
+    tcp_msg_destroy(msg);
+
+    return ret;
+}
+
+int tcp_server_get_stats(struct tcp_server* server, struct tcp_server_stats* stats) {
+    int ret = 0;
+
+    ret = tcp_server_lock(server);
+    if (ret < 0)
+        return ret;
+
+    *stats = server->stats;
 
+    tcp_server_unlock(server);
     return ret;
 }
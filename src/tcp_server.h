@@ -8,21 +8,66 @@
 #ifndef __TCP_SERVER_H__
 #define __TCP_SERVER_H__
 
+#include "buf.h"
 #include "event_loop.h"
 
+#include <stddef.h>
+
 struct tcp_server;
 
+/* Handles the entire connection on one of the handler threads. If it returns a
+ * positive value, the connection is kept open, and handed over to the event
+ * loop, which waits for more messages; from then on, each message is handled by
+ * the message handler, on one of the handler threads. */
 typedef int (*tcp_server_conn_handler)(int conn_fd, void* arg);
+/* Handles a single message, either on a handler thread (see above) or on the
+ * event loop thread (if there're no handler threads). The reply, if any, must
+ * own its data; it's freed by the TCP server after it's been sent. If the
+ * handler fails or returns a positive value, the connection is closed after
+ * the reply is sent. */
+typedef int (*tcp_server_msg_handler)(
+    int conn_fd,
+    const struct buf* msg,
+    struct buf** reply,
+    void* arg
+);
+
+/* Called right before the connection is closed, in either mode. */
+typedef void (*tcp_server_close_handler)(int conn_fd, void* arg);
 
+/* If numof_threads is 0, no handler threads are created; connections are made
+ * non-blocking and messages are handled on the event loop thread instead.
+ * If numof_acceptors is greater than 1, the extra acceptors run their own
+ * event loops on separate threads. */
 int tcp_server_create(
     struct tcp_server**,
     struct event_loop*,
     const char* port,
+    unsigned numof_acceptors,
+    unsigned numof_threads,
     tcp_server_conn_handler,
+    tcp_server_msg_handler,
+    tcp_server_close_handler,
     void* arg
 );
 void tcp_server_destroy(struct tcp_server*);
 
-int tcp_server_accept(struct tcp_server*);
+/* Queues a message to be sent to the connection by the event loop; this never
+ * blocks. The connection must be either handed over to the event loop, or being
+ * handled by a handler thread (the message is sent after it's handed over).
+ * The TCP server takes ownership of the buffer, which must own its data. */
+int tcp_server_send(struct tcp_server*, int conn_fd, struct buf*);
+
+struct tcp_server_stats {
+    /* The number of connections waiting for a handler thread. */
+    size_t queue_depth;
+    size_t max_queue_depth;
+
+    unsigned long long numof_accepted;
+    /* The number of connections closed right away because the queue was full. */
+    unsigned long long numof_rejected;
+};
+
+int tcp_server_get_stats(struct tcp_server*, struct tcp_server_stats*);
 
 #endif
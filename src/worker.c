@@ -8,14 +8,15 @@
 #include "worker.h"
 
 #include "ci.h"
+#include "codec.h"
 #include "command.h"
 #include "compiler.h"
 #include "const.h"
 #include "event_loop.h"
 #include "git.h"
+#include "json_rpc.h"
 #include "log.h"
 #include "net.h"
-#include "process.h"
 #include "protocol.h"
 #include "run_queue.h"
 #include "signal.h"
@@ -34,6 +35,9 @@ struct worker {
     struct event_loop* event_loop;
     int signalfd;
 
+    /* The connection to the server, kept open for as long as the worker runs. */
+    int fd;
+
     struct run* run;
 };
 
@@ -56,6 +60,8 @@ static struct settings* worker_settings_copy(const struct settings* src) {
         goto free_host;
     }
 
+    result->encoding = src->encoding;
+
     return result;
 
 free_host:
@@ -101,7 +107,7 @@ static int worker_handle_cmd_start_run(
 }
 
 static struct cmd_desc commands[] = {
-    {CMD_START_RUN, worker_handle_cmd_start_run},
+    {CMD_START_RUN, worker_handle_cmd_start_run, NULL},
 };
 
 static const size_t numof_commands = sizeof(commands) / sizeof(commands[0]);
@@ -121,7 +127,13 @@ int worker_create(struct worker** _worker, const struct settings* settings) {
         goto free;
     }
 
+    /* Requests to the server are sent using this encoding; the server
+     * responds, and sends new runs, in kind. */
+    jsonrpc_set_default_encoding(settings->encoding);
+
     worker->stopping = 0;
+    worker->fd = -1;
+    worker->run = NULL;
 
     ret = cmd_dispatcher_create(&worker->cmd_dispatcher, commands, numof_commands, worker);
     if (ret < 0)
@@ -176,52 +188,39 @@ void worker_destroy(struct worker* worker) {
     free(worker);
 }
 
-static int worker_do_run(struct worker* worker) {
+/* How often the worker lets the server know it's alive while waiting for a run. */
+#define WORKER_HEARTBEAT_INTERVAL_MS (30 * 1000)
+
+static int worker_send_heartbeat(UNUSED struct event_loop* loop, UNUSED int timer, void* _worker) {
+    struct worker* worker = (struct worker*)_worker;
     int ret = 0;
 
-    struct process_output* result = NULL;
-    ret = process_output_create(&result);
+    struct jsonrpc_request* heartbeat_request = NULL;
+    ret = request_create_heartbeat(&heartbeat_request);
     if (ret < 0)
         return ret;
 
-    ret = ci_run_git_repo(run_get_repo_url(worker->run), run_get_repo_rev(worker->run), result);
-    if (ret < 0) {
-        log_err("Run failed with an error\n");
-        goto free_output;
-    }
-
-    process_output_dump(result);
-
-    struct jsonrpc_request* finished_request = NULL;
-
-    ret = request_create_finished_run(&finished_request, run_get_id(worker->run), result);
-    if (ret < 0)
-        goto free_output;
+    ret = jsonrpc_request_send(heartbeat_request, worker->fd);
+    jsonrpc_request_destroy(heartbeat_request);
+    return ret;
+}
 
-    ret = net_connect(worker->settings->host, worker->settings->port);
-    if (ret < 0)
-        goto free_request;
-    int fd = ret;
+static int worker_handle_server_msg(struct event_loop* loop, int fd, short revents, void* _worker) {
+    struct worker* worker = (struct worker*)_worker;
+    int ret = 0;
 
-    ret = jsonrpc_request_send(finished_request, fd);
+    ret = net_recv_eof(fd);
     if (ret < 0)
-        goto close_conn;
-
-close_conn:
-    net_close(fd);
-
-free_request:
-    jsonrpc_request_destroy(finished_request);
-
-free_output:
-    process_output_destroy(result);
-
-    run_destroy(worker->run);
+        return ret;
+    if (ret) {
+        log_err("Server has closed the connection\n");
+        return -1;
+    }
 
-    return ret;
+    return cmd_dispatcher_handle_event(loop, fd, revents, worker->cmd_dispatcher);
 }
 
-static int worker_get_run(struct worker* worker) {
+static int worker_connect(struct worker* worker) {
     int ret = 0, fd = -1;
 
     ret = net_connect(worker->settings->host, worker->settings->port);
@@ -239,17 +238,24 @@ static int worker_get_run(struct worker* worker) {
     if (ret < 0)
         goto close;
 
-    ret = event_loop_add_once(
-        worker->event_loop, fd, POLLIN, cmd_dispatcher_handle_event, worker->cmd_dispatcher
-    );
+    ret = event_loop_add(worker->event_loop, fd, POLLIN, worker_handle_server_msg, worker);
     if (ret < 0)
         goto close;
 
-    log("Waiting for a new command\n");
+    worker->fd = fd;
 
-    ret = event_loop_run(worker->event_loop);
+    /* The timer is owned by the event loop. */
+    ret = event_loop_add_periodic_timer(
+        worker->event_loop, WORKER_HEARTBEAT_INTERVAL_MS, worker_send_heartbeat, worker
+    );
     if (ret < 0)
-        goto close;
+        goto remove_fd;
+
+    return 0;
+
+remove_fd:
+    event_loop_remove(worker->event_loop, fd);
+    worker->fd = -1;
 
 close:
     net_close(fd);
@@ -257,21 +263,164 @@ close:
     return ret;
 }
 
+static void worker_disconnect(struct worker* worker) {
+    event_loop_remove(worker->event_loop, worker->fd);
+    net_close(worker->fd);
+    worker->fd = -1;
+}
+
+struct worker_output_ctx {
+    struct worker* worker;
+    /* The number of bytes sent so far. */
+    size_t offset;
+
+    /* Reused for compressing every chunk. */
+    unsigned char* buf;
+    size_t buf_size;
+};
+
+/* Compress the chunk if it makes it smaller. */
+static int worker_compress_output(struct worker_output_ctx* ctx, struct run_output_chunk* chunk) {
+    int ret = 0;
+
+    if (ctx->buf_size < chunk->size) {
+        unsigned char* buf = realloc(ctx->buf, chunk->size);
+        if (!buf) {
+            log_errno("realloc");
+            return -1;
+        }
+        ctx->buf = buf;
+        ctx->buf_size = chunk->size;
+    }
+
+    /* Only accept the result if it's actually smaller. */
+    size_t compressed_size = chunk->size - 1;
+    ret = codec_compress(CODEC_ZLIB, chunk->data, chunk->size, ctx->buf, &compressed_size);
+    if (ret < 0)
+        return ret;
+    if (ret)
+        return 0;
+
+    chunk->codec = CODEC_ZLIB;
+    chunk->data = ctx->buf;
+    chunk->data_size = compressed_size;
+    return 0;
+}
+
+/* Send the output to the server right away, so that nothing accumulates on the worker. */
+static int worker_send_output(const void* data, size_t size, void* _ctx) {
+    struct worker_output_ctx* ctx = (struct worker_output_ctx*)_ctx;
+    struct worker* worker = ctx->worker;
+    int ret = 0;
+
+    struct run_output_chunk chunk = {
+        .offset = ctx->offset,
+        .size = size,
+        .codec = CODEC_NONE,
+        .data = data,
+        .data_size = size,
+    };
+
+    ret = worker_compress_output(ctx, &chunk);
+    if (ret < 0)
+        return ret;
+
+    struct jsonrpc_request* request = NULL;
+    ret = request_create_run_output(&request, run_get_id(worker->run), &chunk);
+    if (ret < 0)
+        return ret;
+
+    ret = jsonrpc_request_send(request, worker->fd);
+    jsonrpc_request_destroy(request);
+    if (ret < 0)
+        return ret;
+
+    ctx->offset += size;
+    return ret;
+}
+
+static int worker_do_run(struct worker* worker) {
+    int ret = 0;
+
+    struct worker_output_ctx output_ctx = {
+        .worker = worker,
+        .offset = 0,
+        .buf = NULL,
+        .buf_size = 0,
+    };
+    int ec = -1;
+
+    ret = ci_run_git_repo(
+        run_get_repo_url(worker->run),
+        run_get_repo_rev(worker->run),
+        worker_send_output,
+        &output_ctx,
+        &ec
+    );
+    free(output_ctx.buf);
+    if (ret < 0) {
+        log_err("Run failed with an error\n");
+        goto destroy_run;
+    }
+
+    log("Process exit code: %d\n", ec);
+    log("Process output: %zu bytes\n", output_ctx.offset);
+
+    struct jsonrpc_request* finished_request = NULL;
+
+    ret = request_create_finished_run(&finished_request, run_get_id(worker->run), ec);
+    if (ret < 0)
+        goto destroy_run;
+
+    /* This also lets the server know that the worker is ready for a new run. */
+    ret = jsonrpc_request_send(finished_request, worker->fd);
+    jsonrpc_request_destroy(finished_request);
+    if (ret < 0)
+        goto destroy_run;
+
+destroy_run:
+    run_destroy(worker->run);
+    worker->run = NULL;
+
+    return ret;
+}
+
+static int worker_get_run(struct worker* worker) {
+    int ret = 0;
+
+    log("Waiting for a new command\n");
+
+    while (!worker->run && !worker->stopping) {
+        ret = event_loop_run(worker->event_loop);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret;
+}
+
 int worker_main(struct worker* worker) {
     int ret = 0;
 
+    ret = worker_connect(worker);
+    if (ret < 0)
+        return ret;
+
     while (1) {
         ret = worker_get_run(worker);
         if (ret < 0)
-            return ret;
+            goto disconnect;
 
         if (worker->stopping)
             break;
 
         ret = worker_do_run(worker);
         if (ret < 0)
-            return ret;
+            goto disconnect;
     }
 
+disconnect:
+    worker_disconnect(worker);
+
     return ret;
 }
@@ -8,9 +8,12 @@
 #ifndef __WORKER_H__
 #define __WORKER_H__
 
+#include "json_rpc.h"
+
 struct settings {
     const char* host;
     const char* port;
+    enum jsonrpc_encoding encoding;
 };
 
 struct worker;
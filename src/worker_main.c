@@ -7,6 +7,7 @@
 
 #include "cmd_line.h"
 #include "const.h"
+#include "json_rpc.h"
 #include "log.h"
 #include "worker.h"
 
@@ -17,12 +18,22 @@ static struct settings default_settings(void) {
     struct settings settings = {
         .host = default_host,
         .port = default_port,
+        .encoding = JSONRPC_ENCODING_JSON,
     };
     return settings;
 }
 
 const char* get_usage_string(void) {
-    return "[-h|--help] [-V|--version] [-v|--verbose] [-H|--host HOST] [-p|--port PORT]";
+    return "[-h|--help] [-V|--version] [-v|--verbose] [-H|--host HOST] [-p|--port PORT] [-e|--encoding json|msgpack]";
+}
+
+static enum jsonrpc_encoding parse_encoding(const char* src) {
+    enum jsonrpc_encoding result = JSONRPC_ENCODING_JSON;
+
+    if (jsonrpc_encoding_from_string(src, &result) < 0)
+        exit_with_usage_err("encoding must be either json or msgpack");
+
+    return result;
 }
 
 static int parse_settings(struct settings* settings, int argc, char* argv[]) {
@@ -37,11 +48,12 @@ static int parse_settings(struct settings* settings, int argc, char* argv[]) {
 	    {"verbose", no_argument, 0, 'v'},
 	    {"host", required_argument, 0, 'H'},
 	    {"port", required_argument, 0, 'p'},
+	    {"encoding", required_argument, 0, 'e'},
 	    {0, 0, 0, 0},
 	};
     /* clang-format on */
 
-    while ((opt = getopt_long(argc, argv, "hVvH:p:", long_options, &longind)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hVvH:p:e:", long_options, &longind)) != -1) {
         switch (opt) {
             case 'h':
                 exit_with_usage(0);
@@ -58,6 +70,9 @@ static int parse_settings(struct settings* settings, int argc, char* argv[]) {
             case 'p':
                 settings->port = optarg;
                 break;
+            case 'e':
+                settings->encoding = parse_encoding(optarg);
+                break;
             default:
                 exit_with_usage(1);
                 break;
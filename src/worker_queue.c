@@ -7,18 +7,19 @@
 
 #include "worker_queue.h"
 
+#include "json_rpc.h"
 #include "log.h"
-#include "net.h"
 
 #include <stdlib.h>
 #include <sys/queue.h>
 
 struct worker {
     int fd;
+    enum jsonrpc_encoding encoding;
     SIMPLEQ_ENTRY(worker) entries;
 };
 
-int worker_create(struct worker** _entry, int fd) {
+int worker_create(struct worker** _entry, int fd, enum jsonrpc_encoding encoding) {
     struct worker* entry = malloc(sizeof(struct worker));
     if (!entry) {
         log_errno("malloc");
@@ -26,13 +27,13 @@ int worker_create(struct worker** _entry, int fd) {
     }
 
     entry->fd = fd;
+    entry->encoding = encoding;
 
     *_entry = entry;
     return 0;
 }
 
 void worker_destroy(struct worker* entry) {
-    net_close(entry->fd);
     free(entry);
 }
 
@@ -40,6 +41,10 @@ int worker_get_fd(const struct worker* entry) {
     return entry->fd;
 }
 
+enum jsonrpc_encoding worker_get_encoding(const struct worker* entry) {
+    return entry->encoding;
+}
+
 void worker_queue_create(struct worker_queue* queue) {
     SIMPLEQ_INIT(queue);
 }
@@ -71,3 +76,14 @@ struct worker* worker_queue_remove_first(struct worker_queue* queue) {
     SIMPLEQ_REMOVE_HEAD(queue, entries);
     return entry;
 }
+
+struct worker* worker_queue_remove_conn(struct worker_queue* queue, int conn_fd) {
+    struct worker* entry = NULL;
+    SIMPLEQ_FOREACH(entry, queue, entries) {
+        if (entry->fd == conn_fd) {
+            SIMPLEQ_REMOVE(queue, entry, worker, entries);
+            return entry;
+        }
+    }
+    return NULL;
+}
@@ -8,14 +8,19 @@
 #ifndef __WORKER_QUEUE_H__
 #define __WORKER_QUEUE_H__
 
+#include "json_rpc.h"
+
 #include <sys/queue.h>
 
 struct worker;
 
-int worker_create(struct worker**, int fd);
+/* fd is the connection the worker has registered on, it's owned by the TCP server. Requests are
+ * sent to the worker using the same encoding it has registered with. */
+int worker_create(struct worker**, int fd, enum jsonrpc_encoding);
 void worker_destroy(struct worker*);
 
 int worker_get_fd(const struct worker*);
+enum jsonrpc_encoding worker_get_encoding(const struct worker*);
 
 SIMPLEQ_HEAD(worker_queue, worker);
 
@@ -28,5 +33,7 @@ void worker_queue_add_first(struct worker_queue*, struct worker*);
 void worker_queue_add_last(struct worker_queue*, struct worker*);
 
 struct worker* worker_queue_remove_first(struct worker_queue*);
+/* Returns NULL if there's no worker registered on this connection. */
+struct worker* worker_queue_remove_conn(struct worker_queue*, int conn_fd);
 
 #endif
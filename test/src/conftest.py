@@ -96,7 +96,10 @@ def sqlite_path(tmp_path):
 
 
 @fixture
-def sqlite_db(server, sqlite_path):
+def sqlite_db(server, sqlite_path, server_storage):
+    # Nothing is written to disk with the in-memory storage.
+    if server_storage == "memory":
+        return None
     return Database(sqlite_path)
 
 
@@ -125,21 +128,102 @@ def client_exe(params):
     return CmdLine(params.client)
 
 
+# Tests can override this to run the server with a different number of
+# handler threads (0 means connections are handled on the event loop thread).
 @fixture
-def server_cmd(base_cmd_line, params, server_port, sqlite_path):
-    args = ["--port", server_port, "--sqlite", sqlite_path]
+def server_threads():
+    return None
+
+
+# Same, but for the number of acceptors (each binds its own socket).
+@fixture
+def server_acceptors():
+    return None
+
+
+# Tests can override this to make the server listen on a Unix domain socket
+# instead of a TCP port.
+@fixture
+def server_unix_socket():
+    return False
+
+
+# Tests can override this to make the workers and the client talk to the server
+# using a different message encoding.
+@fixture
+def encoding():
+    return None
+
+
+# Tests can override this to use a different storage backend (the --storage
+# option).
+@fixture
+def server_storage():
+    return None
+
+
+# Tests can override this to pass extra SQLite settings to the server (the
+# --sqlite-* options, without the prefix).
+@fixture
+def server_sqlite_options():
+    return None
+
+
+# Same, but for the retention policies (the --keep-* options, and
+# --maintenance-interval).
+@fixture
+def server_retention_options():
+    return None
+
+
+@fixture
+def server_addr(server_port, server_unix_socket, tmp_path):
+    if server_unix_socket:
+        return "unix:" + os.path.join(tmp_path, "cimple.sock")
+    return server_port
+
+
+@fixture
+def server_cmd(
+    base_cmd_line,
+    params,
+    server_addr,
+    sqlite_path,
+    server_threads,
+    server_acceptors,
+    server_storage,
+    server_sqlite_options,
+    server_retention_options,
+):
+    args = ["--port", server_addr, "--sqlite", sqlite_path]
+    if server_storage is not None:
+        args += ["--storage", server_storage]
+    if server_sqlite_options is not None:
+        for name, value in server_sqlite_options.items():
+            args += [f"--sqlite-{name}", str(value)]
+    if server_retention_options is not None:
+        for name, value in server_retention_options.items():
+            args += [f"--{name}", str(value)]
+    if server_threads is not None:
+        args += ["--threads", str(server_threads)]
+    if server_acceptors is not None:
+        args += ["--acceptors", str(server_acceptors)]
     return CmdLineServer.wrap(base_cmd_line, CmdLine(params.server, *args))
 
 
 @fixture
-def worker_cmd(base_cmd_line, params, server_port):
-    args = ["--host", "127.0.0.1", "--port", server_port]
+def worker_cmd(base_cmd_line, params, server_addr, encoding):
+    args = ["--host", "127.0.0.1", "--port", server_addr]
+    if encoding is not None:
+        args += ["--encoding", encoding]
     return CmdLineWorker.wrap(base_cmd_line, CmdLine(params.worker, *args))
 
 
 @fixture
-def client(base_cmd_line, params, server_port):
-    args = ["--host", "127.0.0.1", "--port", server_port]
+def client(base_cmd_line, params, server_addr, encoding):
+    args = ["--host", "127.0.0.1", "--port", server_addr]
+    if encoding is not None:
+        args += ["--encoding", encoding]
     return CmdLine.wrap(base_cmd_line, CmdLine(params.client, *args))
 
 
@@ -223,6 +307,11 @@ def flame_graph_repo(stress_test_repo):
     return stress_test_repo
 
 
+@fixture
+def long_output_repo(repo_path, params):
+    return _make_repo(repo_path, params, repo.TestRepoOutputLong)
+
+
 Env = namedtuple("Env", ["server", "workers", "client", "db"])
 
 
@@ -5,13 +5,17 @@
 
 from contextlib import closing, contextmanager
 import logging
+import os
 import sqlite3
+import zlib
 
 
 class Database:
-    def __init__(self, path):
+    def __init__(self, path, blob_dir=None):
         logging.info("Opening SQLite database: %s", path)
         self.conn = sqlite3.connect(f"file:{path}?mode=ro", uri=True)
+        # Run outputs are stored next to the database by default.
+        self.blob_dir = blob_dir if blob_dir is not None else f"{path}-blobs"
 
     def __enter__(self):
         return self
@@ -24,7 +28,66 @@ class Database:
         with closing(self.conn.cursor()) as cur:
             yield cur
 
+    def get_journal_mode(self):
+        with self.get_cursor() as cur:
+            cur.execute("PRAGMA journal_mode")
+            return cur.fetchone()[0]
+
     def get_all_runs(self):
         with self.get_cursor() as cur:
             cur.execute("SELECT * FROM cimple_runs_view")
+            runs = cur.fetchall()
+        result = []
+        for id, status, ec, output, *rest in runs:
+            # The output is NULL in the view if it's compressed or in the blob
+            # store.
+            if output is None:
+                output = self.get_run_output(id)
+            result.append((id, status, ec, output, *rest))
+        return result
+
+    DECOMPRESS = {
+        "none": lambda data: data,
+        "zlib": zlib.decompress,
+    }
+
+    def get_run_output(self, id):
+        with self.get_cursor() as cur:
+            cur.execute("SELECT output_hash FROM cimple_runs WHERE id = ?", (id,))
+            (hash,) = cur.fetchone()
+        if hash is not None:
+            return self.read_blob(hash)
+        with self.get_cursor() as cur:
+            cur.execute(
+                "SELECT codec, data FROM cimple_run_output_view "
+                "WHERE run_id = ? ORDER BY offset",
+                (id,),
+            )
+            chunks = cur.fetchall()
+        return b"".join(self.DECOMPRESS[codec](data) for codec, data in chunks)
+
+    def get_blob_path(self, hash):
+        return os.path.join(self.blob_dir, hash[:2], hash)
+
+    def read_blob(self, hash):
+        with open(self.get_blob_path(hash), "rb") as f:
+            return f.read()
+
+    def get_blobs(self):
+        with self.get_cursor() as cur:
+            cur.execute("SELECT hash, refcount FROM cimple_blobs")
+            return dict(cur.fetchall())
+
+    def get_blob_files(self):
+        # Temporary files are skipped.
+        return sorted(
+            name
+            for dir in os.listdir(self.blob_dir)
+            if not dir.startswith(".")
+            for name in os.listdir(os.path.join(self.blob_dir, dir))
+        )
+
+    def get_output_hashes(self):
+        with self.get_cursor() as cur:
+            cur.execute("SELECT output_hash, output_size FROM cimple_runs")
             return cur.fetchall()
@@ -3,7 +3,14 @@
 # For details, see https://github.com/egor-tensin/cimple.
 # Distributed under the MIT License.
 
+from contextlib import closing
+import json
 import re
+import socket
+import struct
+
+from lib.process import Process
+from lib.tests import my_parametrize
 
 
 def _test_cmd_line_version_internal(cmd_line, name, version):
@@ -67,3 +74,128 @@ def test_run_noop_server(server):
 
 def test_run_noop_server_and_workers(server, workers):
     pass
+
+
+def _get_stats(client):
+    return json.loads(client.run("get-stats"))["result"]
+
+
+@my_parametrize("server_threads", [None, 0])
+def test_oversized_message(server, client, server_port, server_threads):
+    rejected = _get_stats(client)["net"]["rejected_msgs"]
+    with closing(socket.create_connection(("127.0.0.1", int(server_port)))) as sock:
+        # The maximum possible size, the server mustn't even try to read it.
+        sock.sendall(b"\xff\xff\xff\xff")
+        assert sock.recv(1) == b"", "The server didn't close the connection"
+    stats = _get_stats(client)["net"]
+    assert stats["rejected_msgs"] == rejected + 1
+    assert stats["pool_hits"] + stats["pool_misses"] > 0
+
+
+def test_cmd_stats(server, client):
+    client.run("get-runs", "get-runs")
+    stats = _get_stats(client)["commands"]
+    assert stats["get-runs"]["calls"] == 2
+    assert stats["get-runs"]["errors"] == 0
+    assert sum(stats["get-runs"]["latency_us_log2"]) == 2
+    # The current call is recorded once it's done.
+    assert stats["get-stats"]["calls"] == 0
+
+
+def test_repo_cache_stats(server, client):
+    before = _get_stats(client)["storage"]
+    client.run("queue-run", "/a", "rev", "queue-run", "/a", "rev", "queue-run", "/b", "rev")
+    after = _get_stats(client)["storage"]
+    assert after["repo_cache_misses"] == before["repo_cache_misses"] + 2
+    assert after["repo_cache_hits"] == before["repo_cache_hits"] + 1
+
+
+def _send_msg(sock, msg):
+    data = json.dumps(msg).encode() + b"\0"
+    sock.sendall(struct.pack(">I", len(data)) + data)
+
+
+def _recv_exactly(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        assert chunk, "The server closed the connection"
+        data += chunk
+    return data
+
+
+def _recv_msg(sock):
+    (size,) = struct.unpack(">I", _recv_exactly(sock, 4))
+    return json.loads(_recv_exactly(sock, size).rstrip(b"\0"))
+
+
+@my_parametrize("server_threads", [None, 0])
+def test_batch(server, server_port, server_threads):
+    batch = [
+        {"jsonrpc": "2.0", "id": 1, "method": "get-stats"},
+        {"jsonrpc": "2.0", "id": 2, "method": "no-such-command"},
+        # Notifications don't get a response.
+        {"jsonrpc": "2.0", "method": "get-stats"},
+        {"jsonrpc": "2.0", "id": "last", "method": "get-stats"},
+    ]
+    with closing(socket.create_connection(("127.0.0.1", int(server_port)))) as sock:
+        _send_msg(sock, batch)
+        response = _recv_msg(sock)
+    assert [r["id"] for r in response] == [1, 2, "last"]
+    assert "net" in response[0]["result"]
+    assert "error" in response[1]
+    assert "net" in response[2]["result"]
+
+
+@my_parametrize("server_threads", [None, 0])
+def test_error_keeps_conn(server, server_port, server_threads):
+    params = {"run_id": 999}
+    requests = [
+        {"jsonrpc": "2.0", "id": 1, "method": "get-run-output", "params": params},
+        {"jsonrpc": "2.0", "id": 2, "method": "get-stats"},
+    ]
+    with closing(socket.create_connection(("127.0.0.1", int(server_port)))) as sock:
+        for request in requests:
+            _send_msg(sock, request)
+        # A failed command doesn't affect the requests after it.
+        assert "error" in _recv_msg(sock)
+        assert "net" in _recv_msg(sock)["result"]
+
+
+@my_parametrize("server_threads", [1])
+def test_idle_workers(server, workers, client, server_threads):
+    # Connected workers mustn't occupy the only handler thread.
+    Process.run(*client.argv, "get-runs", timeout=30)
+
+
+@my_parametrize("server_threads", [None, 0])
+def test_get_runs_out_of_range(server, client, server_port, server_threads):
+    # The client doesn't let these through, so they have to be sent directly.
+    params = [{"before_id": 4294967301}, {"after_id": -(2**32)}, {"exit_code": 2**32}]
+    batch = [
+        {"jsonrpc": "2.0", "id": i, "method": "get-runs", "params": param}
+        for i, param in enumerate(params)
+    ]
+    with closing(socket.create_connection(("127.0.0.1", int(server_port)))) as sock:
+        _send_msg(sock, batch)
+        response = _recv_msg(sock)
+    # These mustn't be truncated to fit into an int.
+    assert all("error" in r for r in response), f"Invalid response: {response}"
+
+    ec, output = client.try_run("get-runs", "before_id=4294967301")
+    assert ec != 0, f"Invalid exit code {ec}, output:\n{output}"
+
+
+@my_parametrize("server_unix_socket", [True])
+def test_unix_socket_in_use(server_cmd, server_addr, client, server_unix_socket):
+    path = server_addr.removeprefix("unix:")
+    # A socket file that nobody listens on is left behind, and is replaced.
+    with closing(socket.socket(socket.AF_UNIX)) as sock:
+        sock.bind(path)
+    with server_cmd.run_async():
+        client.run("get-stats")
+        # But a socket that's in use mustn't be taken over.
+        ec, output = Process.try_run(*server_cmd.argv, timeout=30)
+        assert ec != 0, f"Invalid exit code {ec}, output:\n{output}"
+        assert "in use" in output, f"Invalid output:\n{output}"
+        client.run("get-stats")
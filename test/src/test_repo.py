@@ -3,10 +3,14 @@
 # For details, see https://github.com/egor-tensin/cimple.
 # Distributed under the MIT License.
 
+from contextlib import closing
 import json
 import logging
 import multiprocessing as mp
+import os
 import re
+import sqlite3
+import time
 
 import pytest
 
@@ -38,14 +42,21 @@ class LoggingEventRunComplete(LoggingEvent):
             super().set()
 
 
-def client_runner_process(log_queue, client, runs_per_process, repo):
+def client_runner_process(
+    log_queue, client, runs_per_process, repo, runs_per_conn, batch
+):
     with configure_logging_in_child(log_queue):
         logging.info("Executing %s clients", runs_per_process)
-        for i in range(runs_per_process):
-            client.run("queue-run", repo.path, "HEAD")
+        for i in range(0, runs_per_process, runs_per_conn):
+            # Multiple actions are sent over the same connection.
+            numof_actions = min(runs_per_conn, runs_per_process - i)
+            args = ["--batch"] if batch else []
+            client.run(*args, *["queue-run", repo.path, "HEAD"] * numof_actions)
 
 
-def _test_repo_internal(env, repo, numof_processes, runs_per_process):
+def _run_repo(
+    env, repo, numof_processes, runs_per_process, runs_per_conn=1, batch=False
+):
     numof_runs = numof_processes * runs_per_process
 
     event = LoggingEventRunComplete(numof_runs)
@@ -54,7 +65,7 @@ def _test_repo_internal(env, repo, numof_processes, runs_per_process):
 
     with child_logging_thread() as log_queue:
         ctx = mp.get_context("spawn")
-        args = (log_queue, env.client, runs_per_process, repo)
+        args = (log_queue, env.client, runs_per_process, repo, runs_per_conn, batch)
         processes = [
             ctx.Process(target=client_runner_process, args=args)
             for i in range(numof_processes)
@@ -67,6 +78,15 @@ def _test_repo_internal(env, repo, numof_processes, runs_per_process):
         event.wait()
 
     repo.run_files_are_present(numof_runs)
+    return numof_runs
+
+
+def _test_repo_internal(
+    env, repo, numof_processes, runs_per_process, runs_per_conn=1, batch=False
+):
+    numof_runs = _run_repo(
+        env, repo, numof_processes, runs_per_process, runs_per_conn, batch
+    )
 
     runs = env.db.get_all_runs()
     assert numof_runs == len(runs)
@@ -76,8 +96,10 @@ def _test_repo_internal(env, repo, numof_processes, runs_per_process):
         assert repo.run_exit_code_matches(ec), f"Exit code doesn't match: {ec}"
         assert repo.run_output_matches(output), f"Output doesn't match: {output}"
 
-    runs = env.client.run("get-runs")
-    runs = json.loads(runs)["result"]
+    result = env.client.run("get-runs")
+    result = json.loads(result)["result"]
+    assert "next_before_id" not in result
+    runs = result["runs"]
     assert len(runs) == numof_runs
 
     for run in runs:
@@ -96,6 +118,265 @@ def test_repo(env, test_repo, numof_clients, runs_per_client):
     _test_repo_internal(env, test_repo, numof_clients, runs_per_client)
 
 
+@my_parametrize("server_threads", [0])
+def test_repo_nonblocking(env, test_repo, server_threads):
+    _test_repo_internal(env, test_repo, 5, 5)
+
+
+@my_parametrize("server_threads", [None, 0])
+def test_repo_keep_alive(env, test_repo, server_threads):
+    _test_repo_internal(env, test_repo, 2, 10, runs_per_conn=5)
+
+
+@my_parametrize("server_threads", [None, 0])
+def test_repo_batch(env, test_repo, server_threads):
+    _test_repo_internal(env, test_repo, 2, 10, runs_per_conn=5, batch=True)
+
+
+def _get_runs(env, *args):
+    result = env.client.run("get-runs", *args)
+    return json.loads(result)["result"]
+
+
+def _get_run_ids(env, *args):
+    return [run["id"] for run in _get_runs(env, *args)["runs"]]
+
+
+def test_repo_get_runs_pages(env, test_repo):
+    _test_repo_internal(env, test_repo, 1, 7)
+
+    all_ids = _get_run_ids(env)
+    assert len(all_ids) == 7
+    assert all_ids == sorted(all_ids, reverse=True)
+
+    # Walk the pages from the newest runs to the oldest.
+    ids, args = [], ["limit=3"]
+    while True:
+        result = _get_runs(env, *args)
+        page = [run["id"] for run in result["runs"]]
+        assert len(page) <= 3
+        ids += page
+        if "next_before_id" not in result:
+            break
+        assert result["next_before_id"] == page[-1]
+        args = ["limit=3", f"before_id={page[-1]}"]
+    assert ids == all_ids
+
+    # And back, from the oldest runs to the newest.
+    ids, args = [], ["limit=3", "after_id=0"]
+    while True:
+        result = _get_runs(env, *args)
+        page = [run["id"] for run in result["runs"]]
+        assert page == sorted(page, reverse=True)
+        ids = page + ids
+        if "next_after_id" not in result:
+            break
+        assert result["next_after_id"] == page[0]
+        args = ["limit=3", f"after_id={page[0]}"]
+    assert ids == all_ids
+
+    middle = _get_run_ids(env, f"before_id={all_ids[1]}", f"after_id={all_ids[5]}")
+    assert middle == all_ids[2:5]
+
+
+def test_repo_get_runs_filters(env, test_repo):
+    _test_repo_internal(env, test_repo, 1, 5)
+
+    all_ids = _get_run_ids(env)
+    assert len(all_ids) == 5
+    ec = _get_runs(env)["runs"][0]["exit_code"]
+
+    assert _get_run_ids(env, "status=finished") == all_ids
+    assert _get_run_ids(env, "status=created") == []
+    assert _get_run_ids(env, f"exit_code={ec}") == all_ids
+    assert _get_run_ids(env, f"exit_code={ec + 1}") == []
+    assert _get_run_ids(env, f"repo_url={test_repo.path}") == all_ids
+    assert _get_run_ids(env, "repo_url=/nonexistent") == []
+    assert _get_run_ids(env, "created_after=0", "created_before=4000000000") == all_ids
+    assert _get_run_ids(env, "created_before=0") == []
+    assert _get_run_ids(env, "status=finished", "limit=2") == all_ids[:2]
+
+
+def test_repo_blobs(env, test_repo):
+    _test_repo_internal(env, test_repo, 1, 5)
+
+    # The outputs are moved to the blob store in the background.
+    _wait_for(lambda: all(hash for hash, size in env.db.get_output_hashes()))
+    hashes = env.db.get_output_hashes()
+    assert len(hashes) == 5
+    blobs = env.db.get_blobs()
+    # Every run references exactly one blob.
+    assert sum(blobs.values()) == len(hashes)
+    for hash, size in hashes:
+        assert hash in blobs, f"Blob {hash} is not tracked"
+        assert len(env.db.read_blob(hash)) == size
+
+
+def _wait_for(condition, timeout=30):
+    deadline = time.monotonic() + timeout
+    while not condition():
+        assert time.monotonic() < deadline, "Timed out waiting for the condition"
+        time.sleep(0.1)
+
+
+def _blobs_are_collected(db):
+    # Every blob that's left is referenced, and has its file.
+    blobs = db.get_blobs()
+    return 0 not in blobs.values() and db.get_blob_files() == sorted(blobs)
+
+
+@my_parametrize(
+    "server_retention_options",
+    [{"keep-runs": 2, "maintenance-interval": 1}],
+    ids=["keep-runs=2"],
+)
+def test_repo_retention_runs(env, test_repo, server_retention_options):
+    _run_repo(env, test_repo, 1, 5)
+
+    _wait_for(lambda: len(env.db.get_all_runs()) == 2)
+    _wait_for(lambda: _blobs_are_collected(env.db))
+
+    # Only the newest runs are kept.
+    assert _get_run_ids(env) == [5, 4]
+    assert sum(env.db.get_blobs().values()) == 2
+    for id, status, ec, output, url, rev in env.db.get_all_runs():
+        assert test_repo.run_output_matches(output)
+    stats = json.loads(env.client.run("get-stats"))["result"]["storage"]
+    assert stats["pruned_runs"] == 3
+
+
+@my_parametrize(
+    "server_retention_options",
+    [{"keep-output-days": 1, "maintenance-interval": 1}],
+    ids=["keep-output-days=1"],
+)
+def test_repo_retention_outputs(env, test_repo, sqlite_path, server_retention_options):
+    _run_repo(env, test_repo, 1, 5)
+
+    # Pretend the runs are old.
+    with closing(sqlite3.connect(sqlite_path)) as conn:
+        conn.execute("UPDATE cimple_runs SET created_at = 0")
+        conn.commit()
+
+    _wait_for(lambda: all(hash is None for hash, size in env.db.get_output_hashes()))
+    _wait_for(lambda: not env.db.get_blobs() and not env.db.get_blob_files())
+
+    # The runs are kept, but their outputs are gone.
+    assert len(_get_run_ids(env)) == 5
+    for id in _get_run_ids(env):
+        assert _get_run_output(env, id) == b""
+
+
+def _get_run_output(env, id, *args):
+    return env.client.run("get-run-output", str(id), *args).encode()
+
+
+def _get_run_output_pages(env, id, page_size):
+    output = b""
+    while True:
+        page = _get_run_output(env, id, f"offset={len(output)}", f"size={page_size}")
+        output += page
+        if len(page) < page_size:
+            return output
+
+
+def test_repo_get_run_output(env, test_repo):
+    _test_repo_internal(env, test_repo, 1, 2)
+
+    for id, status, ec, output, url, rev in env.db.get_all_runs():
+        assert _get_run_output(env, id) == output
+        assert _get_run_output_pages(env, id, 4096) == output
+        assert _get_run_output(env, id, "offset=3", "size=5") == output[3:8]
+        assert _get_run_output(env, id, f"offset={len(output) + 1}") == b""
+
+
+@my_parametrize("batch", [False, True])
+@my_parametrize("encoding", ["msgpack"])
+@my_parametrize("server_threads", [None, 0])
+def test_repo_msgpack(env, test_repo, server_threads, encoding, batch):
+    _test_repo_internal(env, test_repo, 2, 10, runs_per_conn=5, batch=batch)
+
+
+@my_parametrize(
+    "server_sqlite_options",
+    [
+        {"synchronous": "full", "cache-size": -8000, "mmap-size": 64 * 1024 * 1024},
+        # Larger than what fits into an int.
+        {"synchronous": "off", "cache-size": 100, "mmap-size": 4 * 1024**3},
+    ],
+    ids=["synchronous=full", "synchronous=off"],
+)
+def test_repo_sqlite_options(env, test_repo, server_sqlite_options):
+    assert env.db.get_journal_mode() == "wal"
+    _test_repo_internal(env, test_repo, 5, 5)
+
+
+@my_parametrize("server_storage", ["memory"])
+@my_parametrize("server_threads", [None, 0])
+def test_repo_memory_storage(
+    env, test_repo, sqlite_path, server_threads, server_storage
+):
+    numof_runs = _run_repo(env, test_repo, 2, 5, runs_per_conn=5)
+
+    runs = _get_runs(env, "status=finished")["runs"]
+    assert len(runs) == numof_runs
+    assert [run["id"] for run in runs] == list(range(numof_runs, 0, -1))
+    for run in runs:
+        ec = run["exit_code"]
+        assert test_repo.run_exit_code_matches(ec), f"Exit code doesn't match: {ec}"
+        output = _get_run_output(env, run["id"])
+        assert test_repo.run_output_matches(output), f"Output doesn't match: {output}"
+        assert _get_run_output_pages(env, run["id"], 4096) == output
+
+    newest = _get_run_ids(env, "limit=3", f"after_id={numof_runs - 3}")
+    assert newest == [numof_runs, numof_runs - 1, numof_runs - 2]
+    assert _get_run_ids(env, "repo_url=/nonexistent") == []
+    assert _get_run_ids(env, "status=created") == []
+    # Cursors at the ends of the int range.
+    assert _get_run_ids(env, "after_id=2147483647") == []
+    assert _get_run_ids(env, "before_id=-2147483648") == []
+    assert _get_run_ids(env, "after_id=-2147483648") == _get_run_ids(env)
+    assert _get_run_ids(env, "before_id=2147483647") == _get_run_ids(env)
+    # Nothing is written to disk.
+    assert not os.path.exists(sqlite_path)
+
+
+@my_parametrize("server_acceptors", [4])
+@my_parametrize("server_threads", [None, 0])
+def test_repo_acceptors(env, test_repo, server_threads, server_acceptors):
+    _test_repo_internal(env, test_repo, 5, 5)
+
+
+@my_parametrize("server_threads", [2])
+def test_repo_stats_latency(env, long_output_repo, server_threads):
+    # The output streamed by the workers is handled on the handler threads, so
+    # it shouldn't hold up other clients.
+    numof_runs = 10
+    event = LoggingEventRunComplete(numof_runs)
+    env.server.logger.add_event(event)
+
+    env.client.run(*["queue-run", long_output_repo.path, "HEAD"] * numof_runs)
+
+    latencies = []
+    deadline = time.monotonic() + event.timeout
+    while True:
+        start = time.monotonic()
+        env.client.run("get-stats")
+        latencies.append(time.monotonic() - start)
+        if event.is_set():
+            break
+        assert start < deadline, "Timed out waiting for the runs to finish"
+
+    long_output_repo.run_files_are_present(numof_runs)
+    assert max(latencies) < 1, f"get-stats took too long: {max(latencies)}s"
+
+
+@my_parametrize("server_unix_socket", [True])
+@my_parametrize("server_threads", [None, 0])
+def test_repo_unix_socket(env, test_repo, server_threads, server_unix_socket):
+    _test_repo_internal(env, test_repo, 5, 5)
+
+
 @pytest.mark.stress
 @my_parametrize(
     "numof_clients,runs_per_client",